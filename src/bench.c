@@ -0,0 +1,405 @@
+#include "index.h"
+#define LOG_NAME "busk.bench"
+#include "log.h"
+#include "version.h"
+
+#include <argp.h>
+#include <dirent.h>
+#include <fcntl.h> // open, openat
+#include <stb/stb_ds.h> // arr* macros
+#include <sys/resource.h> // struct rusage
+#include <sys/stat.h>
+#include <sys/wait.h> // wait4
+#include <unistd.h> // fork, execv, dup2
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h> // NULL, size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // qsort, strtol
+#include <string.h> // strlen, strcmp
+#include <time.h> // clock_gettime
+
+
+// Queries matching the vocabulary of gen-corpus, from very common to absent.
+static const char *const default_queries[] = {
+	"return",
+	"static const",
+	"struct walker",
+	"size_t i = 0",
+	"request_id=",
+	"ERROR [",
+	"busk_needle_7",
+	"missing from every corpus",
+};
+
+typedef struct {
+	const char *corpus_path;
+	bool verbose;
+	const char *output_path;
+	const char *bindir;
+	const char *queries_path;
+	const char **mk_index_args;
+	long runs;
+} Config;
+
+static const char cli_doc[] =
+	"Measure indexing throughput, peak memory, index size, load time and query latencies "
+	"on a corpus, appending the results as a line of JSON.";
+
+static const char cli_args_doc[] = "<CORPUS DIR>";
+
+enum {
+	CLI_BINDIR = 0x100, // long-only options start after the ASCII range
+	CLI_MKINDEX_ARG,
+};
+
+static const struct argp_option cli_options[] = {
+	{
+		.name="verbose", .key='v',
+		.doc="Print more verbose output to stderr",
+	},
+	{
+		.name="output", .key='o', .arg="OUTPUT",
+		.doc="Append results to OUTPUT instead of writing them to stdout",
+	},
+	{
+		.name="runs", .key='n', .arg="N",
+		.doc="Repeat each measurement N times (default: 5)",
+	},
+	{
+		.name="queries", .key='q', .arg="FILE",
+		.doc="Run the queries in FILE (one per line) instead of a fixed set matching generated corpora",
+	},
+	{
+		.name="bindir", .key=CLI_BINDIR, .arg="DIR",
+		.doc="Where to find the mk-index and search binaries (default: ./build)",
+	},
+	{
+		.name="mk-index-arg", .key=CLI_MKINDEX_ARG, .arg="ARG",
+		.doc="Pass ARG to mk-index when indexing the corpus (may be given more than once)",
+	},
+	{0},
+};
+
+static error_t cli_parser(int key, char *arg, struct argp_state *state)
+{
+	Config *cfg = state->input;
+	switch (key) {
+		case 'v':
+			cfg->verbose = true;
+			break;
+
+		case 'o':
+			cfg->output_path = arg;
+			break;
+
+		case 'n': {
+			char *end = NULL;
+			cfg->runs = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || cfg->runs < 1 || cfg->runs > 1000) {
+				argp_error(state, "invalid number of runs '%s'", arg);
+			}
+			break;
+		}
+
+		case 'q':
+			cfg->queries_path = arg;
+			break;
+
+		case CLI_BINDIR:
+			cfg->bindir = arg;
+			break;
+
+		case CLI_MKINDEX_ARG:
+			stbds_arrpush(cfg->mk_index_args, arg);
+			break;
+
+		case ARGP_KEY_ARG:
+			if (cfg->corpus_path) argp_usage(state);
+			cfg->corpus_path = arg;
+			break;
+
+		case ARGP_KEY_END:
+			if (!cfg->corpus_path) argp_usage(state);
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static const struct argp cli = {
+	.doc = cli_doc,
+	.args_doc = cli_args_doc,
+	.options = cli_options,
+	.parser = cli_parser,
+};
+
+
+static double now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	const double lhs = *(const double *)a;
+	const double rhs = *(const double *)b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+// Nearest-rank percentile of some (already sorted) samples.
+static double percentile(const double *sorted, size_t n, double p)
+{
+	if (n == 0) return 0;
+	size_t rank = (size_t)(p / 100 * n + 0.999999);
+	if (rank < 1) rank = 1;
+	return sorted[(rank < n ? rank : n) - 1];
+}
+
+// Result of running a command once.
+typedef struct {
+	double ms; // wall clock
+	long peak_rss_kb;
+	int status; // exit code, or -1 if it didn't exit normally
+} Run;
+
+// Runs a command with its output discarded (unless verbose), waiting for it to finish.
+static Run run(char *const argv[], bool verbose)
+{
+	const double start = now_ms();
+	const pid_t pid = fork();
+	if (pid < 0) LOG_FATALF("Failed to fork (errno = %d)", errno);
+	if (pid == 0) {
+		const int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) {
+			dup2(null, STDOUT_FILENO);
+			if (!verbose) dup2(null, STDERR_FILENO);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	int status = 0;
+	struct rusage usage = {0};
+	while (wait4(pid, &status, 0, &usage) < 0) {
+		if (errno != EINTR) LOG_FATALF("Failed to wait for '%s' (errno = %d)", argv[0], errno);
+	}
+	return (Run){
+		.ms = now_ms() - start,
+		.peak_rss_kb = usage.ru_maxrss,
+		.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+	};
+}
+
+// Adds up the sizes of every regular file in a directory tree, without following symlinks.
+static bool count_files(int dirfd, const char *name, uint64_t *bytes, uint64_t *files)
+{
+	const int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+	if (!dir) {
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	bool ok = true;
+	for (struct dirent *entry; ok && (entry = readdir(dir)) != NULL;) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		struct stat filestat = {0};
+		if (fstatat(fd, entry->d_name, &filestat, AT_SYMLINK_NOFOLLOW) != 0) continue;
+		if (S_ISDIR(filestat.st_mode)) {
+			ok = count_files(fd, entry->d_name, bytes, files);
+		} else if (S_ISREG(filestat.st_mode)) {
+			*bytes += filestat.st_size;
+			*files += 1;
+		}
+	}
+	closedir(dir);
+	return ok;
+}
+
+// Writes a string as a JSON literal.
+static void json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; ++str) {
+		const unsigned char c = *str;
+		if (c == '"' || c == '\\') fprintf(file, "\\%c", c);
+		else if (c < 0x20) fprintf(file, "\\u%04x", c);
+		else fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+int main(int argc, char *argv[])
+{
+	Config cfg = { .bindir = "./build", .runs = 5 };
+	argp_program_version = VERSION_STRING;
+	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
+
+	if (cfg.verbose) logger.level = LOG_LEVEL_DEBUG;
+#ifndef NDEBUG
+	LOG_WARN("Not a release build (see RELEASE=1), so measurements include sanitizers and debug checks");
+#endif
+
+	const char **queries = NULL;
+	char *queries_text = NULL;
+	if (cfg.queries_path) {
+		FILE *file = fopen(cfg.queries_path, "r");
+		if (!file) LOG_FATALF("Failed to open queries at '%s' (errno = %d)", cfg.queries_path, errno);
+		char *line = NULL;
+		size_t capacity = 0;
+		size_t *offsets = NULL; // into the text, which may still move while it grows
+		for (ssize_t length; (length = getline(&line, &capacity, file)) >= 0;) {
+			if (length > 0 && line[length - 1] == '\n') line[--length] = '\0';
+			if (length == 0) continue;
+			stbds_arrpush(offsets, stbds_arrlenu(queries_text));
+			memcpy(stbds_arraddnptr(queries_text, length + 1), line, length + 1);
+		}
+		free(line);
+		fclose(file);
+		for (size_t i = 0; i < stbds_arrlenu(offsets); ++i) stbds_arrpush(queries, &queries_text[offsets[i]]);
+		stbds_arrfree(offsets);
+	} else {
+		for (size_t i = 0; i < sizeof(default_queries) / sizeof(default_queries[0]); ++i) {
+			stbds_arrpush(queries, default_queries[i]);
+		}
+	}
+	const size_t nqueries = stbds_arrlenu(queries);
+
+	uint64_t corpus_bytes = 0, corpus_files = 0;
+	if (!count_files(AT_FDCWD, cfg.corpus_path, &corpus_bytes, &corpus_files)) {
+		LOG_FATALF("Failed to walk corpus at '%s' (errno = %d)", cfg.corpus_path, errno);
+	}
+
+	// the index is written next to the binaries, rather than to a (possibly in-memory) /tmp
+	const size_t pathlen = strlen(cfg.bindir) + 32;
+	char *mk_index = malloc(pathlen);
+	char *search = malloc(pathlen);
+	char *index_path = malloc(pathlen);
+	if (!mk_index || !search || !index_path) LOG_FATAL("Failed to allocate memory");
+	snprintf(mk_index, pathlen, "%s/mk-index", cfg.bindir);
+	snprintf(search, pathlen, "%s/search", cfg.bindir);
+	snprintf(index_path, pathlen, "%s/bench-index.XXXXXX", cfg.bindir);
+	const int index_fd = mkstemp(index_path);
+	if (index_fd < 0) LOG_FATALF("Failed to create temporary index file (errno = %d)", errno);
+	close(index_fd);
+
+	// indexing: the median run is the one reported, but the peak is over all of them
+	char **mk_index_argv = NULL;
+	stbds_arrpush(mk_index_argv, mk_index);
+	stbds_arrpush(mk_index_argv, "-o");
+	stbds_arrpush(mk_index_argv, index_path);
+	for (size_t i = 0; i < stbds_arrlenu(cfg.mk_index_args); ++i) stbds_arrpush(mk_index_argv, (char *)cfg.mk_index_args[i]);
+	stbds_arrpush(mk_index_argv, (char *)cfg.corpus_path);
+	stbds_arrpush(mk_index_argv, NULL);
+	double *samples = NULL;
+	long peak_rss_kb = 0;
+	for (long r = 0; r < cfg.runs; ++r) {
+		const Run result = run(mk_index_argv, cfg.verbose);
+		if (result.status != 0) LOG_FATALF("Failed to index '%s' (exit status %d)", cfg.corpus_path, result.status);
+		stbds_arrpush(samples, result.ms);
+		if (result.peak_rss_kb > peak_rss_kb) peak_rss_kb = result.peak_rss_kb;
+		LOG_DEBUGF("Indexed %s in %.1f ms", cfg.corpus_path, result.ms);
+	}
+	qsort(samples, stbds_arrlenu(samples), sizeof(double), double_cmp);
+	const double index_ms = percentile(samples, stbds_arrlenu(samples), 50);
+	struct stat index_stat = {0};
+	if (stat(index_path, &index_stat) != 0) LOG_FATALF("Failed to stat index at '%s' (errno = %d)", index_path, errno);
+
+	// loading, in this same process, since that's what every search starts with
+	stbds_arrsetlen(samples, 0);
+	for (long r = 0; r < cfg.runs; ++r) {
+		FILE *file = fopen(index_path, "r");
+		if (!file) LOG_FATALF("Failed to open index at '%s' (errno = %d)", index_path, errno);
+		struct Index index = {0};
+		const double start = now_ms();
+		const int error = index_load(&index, file, (struct IndexLoadOptions){0});
+		stbds_arrpush(samples, now_ms() - start);
+		fclose(file);
+		index_cleanup(&index);
+		if (error) LOG_FATALF("Failed to load index from '%s' (errno = %d)", index_path, error);
+	}
+	qsort(samples, stbds_arrlenu(samples), sizeof(double), double_cmp);
+	const double load_ms = percentile(samples, stbds_arrlenu(samples), 50);
+
+	// queries, end to end: load, intersect, then grep candidates (but don't print matches)
+	double *all_samples = NULL;
+	double *query_p50 = NULL;
+	bool *query_found = NULL;
+	for (size_t q = 0; q < nqueries; ++q) {
+		char *search_argv[] = { search, "-i", index_path, (char *)queries[q], NULL };
+		stbds_arrsetlen(samples, 0);
+		bool found = false;
+		for (long r = 0; r < cfg.runs; ++r) {
+			const Run result = run(search_argv, cfg.verbose);
+			if (result.status != 0 && result.status != 1) {
+				LOG_FATALF("Failed to search for '%s' (exit status %d)", queries[q], result.status);
+			}
+			found = result.status == 0;
+			stbds_arrpush(samples, result.ms);
+			stbds_arrpush(all_samples, result.ms);
+		}
+		qsort(samples, stbds_arrlenu(samples), sizeof(double), double_cmp);
+		stbds_arrpush(query_p50, percentile(samples, stbds_arrlenu(samples), 50));
+		stbds_arrpush(query_found, found);
+		LOG_DEBUGF("Searched for '%s' in %.1f ms", queries[q], stbds_arrlast(query_p50));
+	}
+	const size_t nsamples = stbds_arrlenu(all_samples);
+	if (nsamples > 0) qsort(all_samples, nsamples, sizeof(double), double_cmp);
+
+	FILE *out = stdout;
+	if (cfg.output_path) {
+		out = fopen(cfg.output_path, "a");
+		if (!out) LOG_FATALF("Failed to open output file at '%s' (errno = %d)", cfg.output_path, errno);
+	}
+	fprintf(out, "{\"corpus\":");
+	json_string(out, cfg.corpus_path);
+#ifdef NDEBUG
+	const bool release = true;
+#else
+	const bool release = false;
+#endif
+	fprintf(out, ",\"version\":\"%s\",\"release\":%s,\"runs\":%ld", VERSION_STRING, release ? "true" : "false", cfg.runs);
+	fprintf(out, ",\"bytes\":%zu,\"files\":%zu", corpus_bytes, corpus_files);
+	fprintf(
+		out, ",\"index\":{\"ms\":%.3f,\"mb_per_s\":%.3f,\"peak_rss_kb\":%ld,\"size\":%zu}",
+		index_ms, index_ms > 0 ? corpus_bytes / (1024.0 * 1024.0) / (index_ms / 1e3) : 0,
+		peak_rss_kb, (uint64_t)index_stat.st_size
+	);
+	fprintf(out, ",\"load\":{\"ms\":%.3f}", load_ms);
+	fprintf(
+		out, ",\"query\":{\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f,\"queries\":[",
+		percentile(all_samples, nsamples, 50), percentile(all_samples, nsamples, 90),
+		percentile(all_samples, nsamples, 99), nsamples > 0 ? all_samples[nsamples - 1] : 0
+	);
+	for (size_t q = 0; q < nqueries; ++q) {
+		fprintf(out, "%s{\"query\":", q > 0 ? "," : "");
+		json_string(out, queries[q]);
+		fprintf(out, ",\"p50_ms\":%.3f,\"found\":%s}", query_p50[q], query_found[q] ? "true" : "false");
+	}
+	fprintf(out, "]}}\n");
+	if (out != stdout && fclose(out) != 0) LOG_FATALF("Failed to write results to '%s'", cfg.output_path);
+	LOG_INFOF(
+		"Indexed %zu files (%zu bytes) in %.1f ms, index of %zu bytes loads in %.1f ms, queries take %.1f ms (p50)",
+		corpus_files, corpus_bytes, index_ms, (uint64_t)index_stat.st_size, load_ms, percentile(all_samples, nsamples, 50)
+	);
+
+	unlink(index_path);
+	stbds_arrfree(query_found);
+	stbds_arrfree(query_p50);
+	stbds_arrfree(all_samples);
+	stbds_arrfree(samples);
+	stbds_arrfree(mk_index_argv);
+	free(index_path);
+	free(search);
+	free(mk_index);
+	stbds_arrfree(queries);
+	stbds_arrfree(queries_text);
+	stbds_arrfree(cfg.mk_index_args);
+	return 0;
+}
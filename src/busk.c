@@ -0,0 +1,195 @@
+#define _GNU_SOURCE // memmem
+
+#include "busk.h"
+
+#include "index.h"
+#include "manifest.h"
+#include "query.h"
+
+#include <stb/stb_ds.h> // arr* macros
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h> // open
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // calloc, free
+#include <string.h> // memmem
+#include <unistd.h> // close
+
+
+// ranges are handed out as they are, without copying them
+_Static_assert(sizeof(struct BuskRange) == sizeof(struct IndexRange), "BuskRange must match IndexRange");
+
+struct BuskIndex {
+	struct Index *shards; // stb array, in the order of the manifest
+	struct Manifest manifest; // when the index was opened through one
+	bool has_manifest;
+};
+
+unsigned busk_abi_version(void)
+{
+	return BUSK_ABI_VERSION;
+}
+
+static int load_shard(struct BuskIndex *index, FILE *file)
+{
+	struct Index shard = {0};
+	if (index_load(&shard, file, (struct IndexLoadOptions){0}) != 0) {
+		index_cleanup(&shard);
+		return -EINVAL;
+	}
+	stbds_arrpush(index->shards, shard);
+	return 0;
+}
+
+int busk_open(const char *path, struct BuskIndex **out)
+{
+	*out = NULL;
+	FILE *file = fopen(path, "r");
+	if (!file) return -errno;
+	struct BuskIndex *index = calloc(1, sizeof(struct BuskIndex));
+	if (!index) {
+		fclose(file);
+		return -ENOMEM;
+	}
+
+	int error = 0;
+	if (manifest_sniff(file)) {
+		index->has_manifest = true;
+		if (manifest_load(&index->manifest, file) != 0) error = -EINVAL;
+		fclose(file);
+		for (size_t i = 0; !error && i < stbds_arrlenu(index->manifest.shards); ++i) {
+			char *shard_path = manifest_shard_path(path, index->manifest.shards[i]);
+			if (!shard_path) {
+				error = -ENOMEM;
+				break;
+			}
+			FILE *shard_file = fopen(shard_path, "r");
+			if (!shard_file) error = -errno;
+			free(shard_path);
+			if (error) break;
+			error = load_shard(index, shard_file);
+			fclose(shard_file);
+		}
+	} else {
+		error = load_shard(index, file);
+		fclose(file);
+	}
+
+	if (error) {
+		busk_close(index);
+		return error;
+	}
+	*out = index;
+	return 0;
+}
+
+void busk_close(struct BuskIndex *index)
+{
+	if (!index) return;
+	for (size_t i = 0; i < stbds_arrlenu(index->shards); ++i) index_cleanup(&index->shards[i]);
+	stbds_arrfree(index->shards);
+	manifest_cleanup(&index->manifest);
+	free(index);
+}
+
+// Queries every shard, leaving their candidates in manifest order.
+static int gather(const struct BuskIndex *index, const char *query, size_t query_len, struct QueryCandidates *list)
+{
+	for (size_t i = 0; i < stbds_arrlenu(index->shards); ++i) {
+		if (query_len < index_ngram_size(index->shards[i])) return -EINVAL;
+	}
+	const struct Manifest *manifest = index->has_manifest ? &index->manifest : NULL;
+	for (size_t i = 0; i < stbds_arrlenu(index->shards); ++i) {
+		struct IndexPathHandle *candidates = query_index(index->shards[i], query, query_len, NULL);
+		query_gather(index->shards[i], candidates, query_len, manifest, i, list);
+		stbds_arrfree(candidates);
+	}
+	return 0;
+}
+
+int busk_candidates(
+	const struct BuskIndex *index, const char *query, size_t query_len, BuskCandidateFn callback, void *context
+) {
+	struct QueryCandidates list = {0};
+	int result = gather(index, query, query_len, &list);
+	for (size_t i = 0; !result && i < stbds_arrlenu(list.files); ++i) {
+		const struct QueryFile file = list.files[i];
+		const struct BuskRange *ranges = (const struct BuskRange *)&list.ranges[file.first_range];
+		const char *path = &list.pathbuf[file.path_offset];
+		for (size_t p = 0; !result && p < file.npaths; ++p) {
+			const size_t pathlen = list.pathlens[file.first_path + p];
+			result = callback(context, path, pathlen, ranges, file.nranges);
+			path += pathlen + 1;
+		}
+	}
+	query_candidates_cleanup(&list);
+	return result;
+}
+
+// Opens the first of the paths of a file which still exists, returning its descriptor (or -1).
+static int open_candidate(const struct QueryCandidates *list, struct QueryFile file, const char **path, size_t *pathlen)
+{
+	const char *candidate = &list->pathbuf[file.path_offset];
+	for (size_t p = 0; p < file.npaths; ++p) {
+		const size_t length = list->pathlens[file.first_path + p];
+		const int fd = open(candidate, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			*path = candidate;
+			*pathlen = length;
+			return fd;
+		}
+		candidate += length + 1;
+	}
+	return -1;
+}
+
+int busk_search(
+	const struct BuskIndex *index, const char *query, size_t query_len, BuskMatchFn callback, void *context
+) {
+	struct QueryCandidates list = {0};
+	int result = gather(index, query, query_len, &list);
+	for (size_t i = 0; !result && i < stbds_arrlenu(list.files); ++i) {
+		const struct QueryFile file = list.files[i];
+		const char *path = NULL;
+		size_t pathlen = 0;
+		const int fd = open_candidate(&list, file, &path, &pathlen);
+		if (fd < 0) continue; // deleted (or unreadable) since it was indexed
+
+		struct stat filestat = {0};
+		const char *contents = MAP_FAILED;
+		if (fstat(fd, &filestat) == 0 && filestat.st_size > 0) {
+			contents = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		}
+		close(fd);
+		if (contents == MAP_FAILED) continue;
+		const size_t length = filestat.st_size;
+
+		// a changed file is searched whole, since its blocks may have moved
+		const struct IndexRange *ranges = &list.ranges[file.first_range];
+		size_t nranges = file.nranges;
+		if (file.has_stat && query_stat_changed(&file.stat, &filestat)) {
+			static const struct IndexRange whole = { .begin = 0, .end = UINT64_MAX };
+			ranges = &whole;
+			nranges = 1;
+		}
+
+		for (size_t r = 0; !result && r < nranges; ++r) {
+			const size_t end = ranges[r].end < length ? ranges[r].end : length;
+			for (size_t offset = ranges[r].begin; !result && offset < end;) {
+				const char *match = memmem(&contents[offset], end - offset, query, query_len);
+				if (!match) break;
+				offset = match - contents;
+				result = callback(context, path, pathlen, offset, query_len);
+				offset += query_len;
+			}
+		}
+		munmap((void *)contents, length);
+	}
+	query_candidates_cleanup(&list);
+	return result;
+}
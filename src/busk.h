@@ -0,0 +1,69 @@
+#ifndef INCLUDE_BUSK_H
+#define INCLUDE_BUSK_H
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// Bumped whenever a declaration below changes incompatibly (along with the soname).
+#define BUSK_ABI_VERSION 1
+
+#define BUSK_API __attribute__((visibility("default")))
+
+// Loaded index (or every shard of a manifest). It is only read once open, so it may be
+// shared by any number of threads until closed.
+struct BuskIndex;
+
+// Range of byte offsets into a candidate file which a match could start in and end
+// before, where `end == UINT64_MAX` means EOF.
+struct BuskRange {
+	uint64_t begin;
+	uint64_t end;
+};
+
+// Called with every path (including aliases) of a candidate file, along with the ranges where
+// the query could match. Returning anything but zero stops the query, which then returns it.
+typedef int (*BuskCandidateFn)(
+	void *context, const char *path, size_t pathlen, const struct BuskRange *ranges, size_t nranges
+);
+
+// Called with every match of the query, at some byte offset into a file. Returning anything
+// but zero stops the search, which then returns it.
+typedef int (*BuskMatchFn)(void *context, const char *path, size_t pathlen, uint64_t offset, size_t length);
+
+
+// Returns the ABI version of the library, which callers should compare to `BUSK_ABI_VERSION`.
+BUSK_API unsigned busk_abi_version(void);
+
+// Loads an index (or a manifest and all of its shards) from a file, returning zero
+// or a negative errno (-EINVAL when it isn't a valid index).
+BUSK_API int busk_open(const char *path, struct BuskIndex **index);
+
+// Deallocates an index, which no other thread may still be using.
+BUSK_API void busk_close(struct BuskIndex *index);
+
+// Looks up the files which could contain a string (as of when they were indexed), without
+// reading them. Returns zero, a negative errno (-EINVAL when the query is shorter than the
+// ngrams of the index) or whatever nonzero value a callback returned.
+BUSK_API int busk_candidates(
+	const struct BuskIndex *index, const char *query, size_t query_len, BuskCandidateFn callback, void *context
+);
+
+// Searches the candidate files for a string, reading them as they are now (files which changed
+// since they were indexed are searched whole, deleted ones are skipped). Matches of files with
+// several paths are reported once, with the first path which could be opened. Returns zero,
+// a negative errno (as `busk_candidates()`) or whatever nonzero value a callback returned.
+BUSK_API int busk_search(
+	const struct BuskIndex *index, const char *query, size_t query_len, BuskMatchFn callback, void *context
+);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // INCLUDE_BUSK_H
@@ -0,0 +1,28 @@
+#include "cli.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h> // strtoull
+
+
+bool parse_size(const char *str, uint64_t *size)
+{
+	char *end = NULL;
+	errno = 0;
+	const unsigned long long value = strtoull(str, &end, 10);
+	if (errno || end == str) return false;
+
+	uint64_t multiplier = 1;
+	switch (*end) {
+		case '\0': break;
+		case 'k': case 'K': multiplier = UINT64_C(1) << 10; ++end; break;
+		case 'm': case 'M': multiplier = UINT64_C(1) << 20; ++end; break;
+		case 'g': case 'G': multiplier = UINT64_C(1) << 30; ++end; break;
+		default: return false;
+	}
+	if (*end != '\0' || value > UINT64_MAX / multiplier) return false;
+
+	*size = value * multiplier;
+	return true;
+}
@@ -0,0 +1,11 @@
+#ifndef INCLUDE_CLI_H
+#define INCLUDE_CLI_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+// Parses a size in bytes, with an optional K/M/G (binary) suffix, returning false if invalid.
+bool parse_size(const char *str, uint64_t *size);
+
+#endif // INCLUDE_CLI_H
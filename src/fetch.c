@@ -0,0 +1,488 @@
+#include "fetch.h"
+
+#include <errno.h>
+#include <fcntl.h> // openat
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdlib.h> // calloc, malloc, free
+#include <string.h> // memset, strlen, memcpy
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <sys/syscall.h> // SYS_io_uring_*
+#include <unistd.h> // close, pread, syscall
+
+
+enum FetchJobState {
+	FETCH_JOB_QUEUED,
+	FETCH_JOB_OPENING,
+	FETCH_JOB_READING,
+	FETCH_JOB_DONE,
+};
+
+typedef struct {
+	enum FetchJobState state;
+	int dirfd;
+	char *name;
+	void *tag;
+	int fd; // or negative errno
+	uint8_t *contents;
+	size_t length; // bytes read so far
+	size_t size; // bytes we expect to read
+} FetchJob;
+
+// Bare-bones io_uring, set up with raw syscalls so we don't depend on liburing.
+typedef struct {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned to_submit;
+	unsigned in_flight; // submitted, but not yet completed
+	bool draining; // when set, no more operations are queued
+} Uring;
+
+struct Fetch {
+	struct FetchOptions options;
+	FetchJob *jobs; // ring buffer with `depth` slots
+	size_t head; // oldest job, to be returned next
+	size_t tail; // where the next job will be submitted
+	Uring ring;
+	pthread_t *threads;
+	int nthreads;
+	pthread_mutex_t lock; // guards the fields below, plus the state of every job
+	pthread_cond_t queued; // signaled when a job is submitted, or threads must stop
+	pthread_cond_t done; // signaled when a job is done
+	size_t started; // next job to be picked up by some thread
+	bool stopping;
+};
+
+
+// Reads the whole file (when it isn't too big) into a new buffer, or returns NULL.
+static uint8_t *read_contents(int fd, size_t max_size, size_t *length)
+{
+	struct stat filestat = {0};
+	if (fstat(fd, &filestat) != 0 || !S_ISREG(filestat.st_mode)) return NULL;
+	if ((uint64_t)filestat.st_size > max_size) return NULL;
+
+	const size_t size = filestat.st_size;
+	uint8_t *contents = malloc(size > 0 ? size : 1);
+	if (!contents) return NULL;
+
+	// pread leaves the file offset alone, in case the caller has to read it after all
+	size_t done = 0;
+	while (done < size) {
+		const ssize_t read_bytes = pread(fd, &contents[done], size - done, done);
+		if (read_bytes < 0 && errno == EINTR) continue;
+		if (read_bytes < 0) {
+			free(contents);
+			return NULL;
+		}
+		if (read_bytes == 0) break; // file was truncated in the meantime
+		done += read_bytes;
+	}
+
+	*length = done;
+	return contents;
+}
+
+// Opens and reads a file with blocking I/O.
+static void fetch_job_run(struct Fetch *fetch, FetchJob *job)
+{
+	job->fd = openat(job->dirfd, job->name, O_RDONLY | O_CLOEXEC);
+	if (job->fd < 0) {
+		job->fd = -errno;
+	} else {
+		job->contents = read_contents(job->fd, fetch->options.max_size, &job->length);
+	}
+}
+
+static void *fetch_thread(void *arg)
+{
+	struct Fetch *fetch = arg;
+	for (;;) {
+		pthread_mutex_lock(&fetch->lock);
+		while (!fetch->stopping && fetch->started == fetch->tail) {
+			pthread_cond_wait(&fetch->queued, &fetch->lock);
+		}
+		if (fetch->stopping) {
+			pthread_mutex_unlock(&fetch->lock);
+			break;
+		}
+		FetchJob *job = &fetch->jobs[fetch->started++ % fetch->options.depth];
+		job->state = FETCH_JOB_OPENING;
+		pthread_mutex_unlock(&fetch->lock);
+
+		fetch_job_run(fetch, job);
+
+		pthread_mutex_lock(&fetch->lock);
+		job->state = FETCH_JOB_DONE;
+		pthread_cond_broadcast(&fetch->done);
+		pthread_mutex_unlock(&fetch->lock);
+	}
+	return NULL;
+}
+
+
+static void uring_cleanup(Uring *ring)
+{
+	if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0) close(ring->fd);
+	*ring = (Uring){ .fd = -1 };
+}
+
+// Sets up a ring with (at least) the given number of entries, returning zero on success.
+static int uring_setup(Uring *ring, unsigned entries)
+{
+	*ring = (Uring){ .fd = -1 };
+	struct io_uring_params params = {0};
+	ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return -errno;
+
+	// we need to open and read files asynchronously, which isn't supported everywhere
+	const size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, probe_size);
+	if (!probe) {
+		uring_cleanup(ring);
+		return -ENOMEM;
+	}
+	const bool supported = syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0
+		&& probe->last_op >= IORING_OP_READ
+		&& (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+		&& (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	if (!supported) {
+		uring_cleanup(ring);
+		return -ENOTSUP;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap) {
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	const int prot = PROT_READ | PROT_WRITE;
+	const int flags = MAP_SHARED | MAP_POPULATE;
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, prot, flags, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+	ring->cq_ring = single_mmap ? ring->sq_ring : mmap(NULL, ring->cq_ring_size, prot, flags, ring->fd, IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+	ring->sqes = mmap(NULL, ring->sqes_size, prot, flags, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+	if (!ring->sq_ring || !ring->cq_ring || !ring->sqes) {
+		const int error = errno;
+		uring_cleanup(ring);
+		return -error;
+	}
+
+	uint8_t *sq = ring->sq_ring;
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	uint8_t *cq = ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+}
+
+// Queues an operation, which is only actually submitted by `uring_enter()`.
+// Since each job has at most one operation in flight, the queue never overflows.
+static void uring_push(Uring *ring, const struct io_uring_sqe *sqe)
+{
+	const unsigned tail = *ring->sq_tail;
+	const unsigned index = tail & *ring->sq_mask;
+	ring->sqes[index] = *sqe;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+static int uring_enter(Uring *ring, unsigned min_complete)
+{
+	const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+	const unsigned to_submit = ring->draining ? 0 : ring->to_submit;
+	const int submitted = syscall(SYS_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+	if (submitted < 0) return -errno;
+	ring->to_submit -= submitted;
+	ring->in_flight += submitted;
+	return 0;
+}
+
+// Whether an error from `uring_enter()` only means that it should be tried again
+// (after handling completions, which is what frees up resources or the CQ ring).
+static inline bool uring_transient(int error)
+{
+	return error == -EINTR || error == -EAGAIN || error == -EBUSY;
+}
+
+// Queues the next read of a job, unless the ring is draining (then it's left READING).
+static void uring_read(struct Fetch *fetch, size_t slot)
+{
+	if (fetch->ring.draining) return;
+	FetchJob *job = &fetch->jobs[slot];
+	const struct io_uring_sqe sqe = {
+		.opcode = IORING_OP_READ,
+		.fd = job->fd,
+		.addr = (uintptr_t)&job->contents[job->length],
+		.len = job->size - job->length,
+		.off = job->length,
+		.user_data = slot,
+	};
+	uring_push(&fetch->ring, &sqe);
+}
+
+// Moves a job to its next state, given the result of its last operation.
+static void uring_advance(struct Fetch *fetch, size_t slot, int result)
+{
+	FetchJob *job = &fetch->jobs[slot];
+	if (job->state == FETCH_JOB_OPENING) {
+		job->fd = result;
+		job->state = FETCH_JOB_DONE;
+		if (result < 0) return;
+
+		struct stat filestat = {0};
+		if (fstat(job->fd, &filestat) != 0 || !S_ISREG(filestat.st_mode)) return;
+		if ((uint64_t)filestat.st_size > fetch->options.max_size) return;
+		job->size = filestat.st_size;
+		job->contents = malloc(job->size > 0 ? job->size : 1);
+		if (!job->contents || job->size == 0) return;
+
+		job->state = FETCH_JOB_READING;
+		uring_read(fetch, slot);
+
+	} else if (job->state == FETCH_JOB_READING) {
+		if (result == -EINTR || result == -EAGAIN) {
+			uring_read(fetch, slot);
+		} else if (result < 0) {
+			free(job->contents);
+			job->contents = NULL;
+			job->state = FETCH_JOB_DONE;
+		} else if (result == 0) {
+			job->state = FETCH_JOB_DONE; // file was truncated in the meantime
+		} else {
+			job->length += result;
+			if (job->length < job->size) uring_read(fetch, slot);
+			else job->state = FETCH_JOB_DONE;
+		}
+	}
+}
+
+// Waits for (at least) one operation to complete, then handles all completions.
+// Only returns an error when the ring can't be used anymore.
+static int uring_wait(struct Fetch *fetch)
+{
+	Uring *ring = &fetch->ring;
+	int error = uring_enter(ring, 1);
+	if (error && !uring_transient(error)) return error;
+
+	unsigned head = *ring->cq_head;
+	const unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		ring->in_flight--;
+		uring_advance(fetch, cqe->user_data, cqe->res);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	// follow-up reads are submitted right away
+	error = ring->to_submit > 0 && !ring->draining ? uring_enter(ring, 0) : 0;
+	return uring_transient(error) ? 0 : error;
+}
+
+
+// Switches to (or starts with) the thread engine, spawning as many threads as it can.
+static void fetch_start_threads(struct Fetch *fetch)
+{
+	fetch->options.engine = FETCH_THREADS;
+	fetch->started = fetch->tail;
+	pthread_mutex_init(&fetch->lock, NULL);
+	pthread_cond_init(&fetch->queued, NULL);
+	pthread_cond_init(&fetch->done, NULL);
+	fetch->threads = calloc(fetch->options.depth, sizeof(pthread_t));
+	for (int i = 0; fetch->threads && i < fetch->options.depth; ++i) {
+		if (pthread_create(&fetch->threads[i], NULL, fetch_thread, fetch) != 0) break;
+		fetch->nthreads = i + 1;
+	}
+}
+
+// Gives up on a ring which can't be used anymore. Operations which the kernel already
+// took are waited for first, since they point to our buffers (and may open files).
+// Then, pending jobs are finished with blocking I/O, and later ones go to threads.
+static void uring_fallback(struct Fetch *fetch)
+{
+	Uring *ring = &fetch->ring;
+	ring->draining = true;
+	bool drained = true;
+	while (ring->in_flight > 0) {
+		if (uring_wait(fetch) != 0) {
+			drained = false;
+			break;
+		}
+	}
+	uring_cleanup(ring);
+
+	for (size_t i = fetch->head; i != fetch->tail; ++i) {
+		FetchJob *job = &fetch->jobs[i % fetch->options.depth];
+		if (job->state == FETCH_JOB_OPENING) {
+			fetch_job_run(fetch, job);
+		} else if (job->state == FETCH_JOB_READING) {
+			// if the kernel may still write to it, leaking the buffer is the only safe option
+			if (drained) free(job->contents);
+			job->length = 0;
+			job->contents = read_contents(job->fd, fetch->options.max_size, &job->length);
+		}
+		job->state = FETCH_JOB_DONE;
+	}
+
+	fetch_start_threads(fetch);
+}
+
+struct Fetch *fetch_start(struct FetchOptions options)
+{
+	if (options.depth < 1) options.depth = 1;
+
+	struct Fetch *fetch = calloc(1, sizeof(struct Fetch));
+	if (!fetch) return NULL;
+	fetch->options = options;
+	fetch->ring.fd = -1;
+	fetch->jobs = calloc(options.depth, sizeof(FetchJob));
+	if (!fetch->jobs) {
+		free(fetch);
+		return NULL;
+	}
+
+	if (options.engine == FETCH_URING) {
+		if (uring_setup(&fetch->ring, options.depth) == 0) return fetch;
+	}
+
+	fetch_start_threads(fetch);
+	if (fetch->nthreads == 0) {
+		fetch_finish(fetch);
+		return NULL;
+	}
+
+	return fetch;
+}
+
+void fetch_finish(struct Fetch *fetch)
+{
+	if (!fetch) return;
+
+	// in-flight operations still point to our buffers, so we wait for them
+	struct FetchedFile file = {0};
+	while (fetch_next(fetch, &file)) {
+		if (file.fd >= 0) close(file.fd);
+		fetch_release(&file);
+	}
+
+	if (fetch->options.engine == FETCH_URING) {
+		uring_cleanup(&fetch->ring);
+	} else {
+		pthread_mutex_lock(&fetch->lock);
+		fetch->stopping = true;
+		pthread_cond_broadcast(&fetch->queued);
+		pthread_mutex_unlock(&fetch->lock);
+		for (int i = 0; i < fetch->nthreads; ++i) pthread_join(fetch->threads[i], NULL);
+		pthread_cond_destroy(&fetch->done);
+		pthread_cond_destroy(&fetch->queued);
+		pthread_mutex_destroy(&fetch->lock);
+		free(fetch->threads);
+	}
+
+	free(fetch->jobs);
+	free(fetch);
+}
+
+enum FetchEngine fetch_engine(const struct Fetch *fetch)
+{
+	return fetch->options.engine;
+}
+
+bool fetch_submit(struct Fetch *fetch, int dirfd, const char *name, void *tag)
+{
+	if (fetch->tail - fetch->head >= (size_t)fetch->options.depth) return false;
+
+	const size_t namelen = strlen(name);
+	char *namecopy = malloc(namelen + 1);
+	if (!namecopy) return false;
+	memcpy(namecopy, name, namelen + 1);
+
+	const size_t slot = fetch->tail % fetch->options.depth;
+	FetchJob *job = &fetch->jobs[slot];
+	*job = (FetchJob){ .state = FETCH_JOB_QUEUED, .dirfd = dirfd, .name = namecopy, .tag = tag, .fd = -1 };
+
+	if (fetch->options.engine == FETCH_URING) {
+		job->state = FETCH_JOB_OPENING;
+		const struct io_uring_sqe sqe = {
+			.opcode = IORING_OP_OPENAT,
+			.fd = dirfd,
+			.addr = (uintptr_t)job->name,
+			.open_flags = O_RDONLY | O_CLOEXEC,
+			.user_data = slot,
+		};
+		uring_push(&fetch->ring, &sqe);
+		fetch->tail++;
+		// when only transient, whatever wasn't submitted will be along with the next batch
+		const int error = uring_enter(&fetch->ring, 0);
+		if (error && !uring_transient(error)) uring_fallback(fetch);
+	} else if (fetch->nthreads == 0) {
+		// threads couldn't be spawned when falling back from io_uring
+		fetch_job_run(fetch, job);
+		job->state = FETCH_JOB_DONE;
+		fetch->tail++;
+	} else {
+		pthread_mutex_lock(&fetch->lock);
+		fetch->tail++;
+		pthread_cond_signal(&fetch->queued);
+		pthread_mutex_unlock(&fetch->lock);
+	}
+	return true;
+}
+
+bool fetch_next(struct Fetch *fetch, struct FetchedFile *file)
+{
+	if (fetch->head == fetch->tail) return false;
+
+	FetchJob *job = &fetch->jobs[fetch->head % fetch->options.depth];
+	if (fetch->options.engine == FETCH_URING) {
+		while (job->state != FETCH_JOB_DONE) {
+			// the ring is unusable, but we can still open & read files ourselves
+			if (uring_wait(fetch) != 0) uring_fallback(fetch);
+		}
+	} else {
+		pthread_mutex_lock(&fetch->lock);
+		while (job->state != FETCH_JOB_DONE) pthread_cond_wait(&fetch->done, &fetch->lock);
+		pthread_mutex_unlock(&fetch->lock);
+	}
+
+	*file = (struct FetchedFile){
+		.fd = job->fd,
+		.contents = job->contents,
+		.length = job->length,
+		.tag = job->tag,
+	};
+	free(job->name);
+	*job = (FetchJob){0};
+	fetch->head++;
+	return true;
+}
+
+void fetch_release(struct FetchedFile *file)
+{
+	free(file->contents);
+	file->contents = NULL;
+	file->length = 0;
+}
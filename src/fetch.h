@@ -0,0 +1,53 @@
+#ifndef INCLUDE_FETCH_H
+#define INCLUDE_FETCH_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+
+struct Fetch; // opaque
+
+// How files are read in the background.
+enum FetchEngine {
+	FETCH_THREADS, // a pool of threads doing blocking I/O
+	FETCH_URING, // asynchronous I/O with io_uring (Linux 5.6+)
+};
+
+// File fetching options.
+struct FetchOptions {
+	enum FetchEngine engine; // io_uring falls back to threads when not supported
+	int depth; // how many files may be in flight at once
+	size_t max_size; // bigger files are only opened, to be read by the caller
+};
+
+// A file which was opened (and possibly read) in the background.
+struct FetchedFile {
+	int fd; // open file, which the caller must close, or a negative errno
+	uint8_t *contents; // whole file, or NULL if it wasn't read (so read it from fd)
+	size_t length;
+	void *tag; // whatever was submitted along with it
+};
+
+
+// Starts fetching, returning NULL when out of resources.
+struct Fetch *fetch_start(struct FetchOptions options);
+
+// Waits for in-flight files (which are closed and discarded), then deallocates everything.
+void fetch_finish(struct Fetch *fetch);
+
+// Engine actually used, which may differ from the one requested.
+enum FetchEngine fetch_engine(const struct Fetch *fetch);
+
+// Queues a file (named `name` in `dirfd`, which must stay open until it's fetched)
+// to be opened and read, returning false (and doing nothing) when the queue is full.
+bool fetch_submit(struct Fetch *fetch, int dirfd, const char *name, void *tag);
+
+// Waits for the oldest submitted file, returning false when there are none.
+// Its contents (if any) must be released with `fetch_release()`.
+bool fetch_next(struct Fetch *fetch, struct FetchedFile *file);
+
+// Deallocates the contents of a fetched file, but doesn't close it.
+void fetch_release(struct FetchedFile *file);
+
+#endif // INCLUDE_FETCH_H
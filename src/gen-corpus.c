@@ -0,0 +1,350 @@
+#define LOG_NAME "busk.gen-corpus"
+#include "cli.h"
+#include "log.h"
+#include "version.h"
+
+#include <argp.h>
+#include <stb/stb_ds.h> // arr* macros
+#include <sys/stat.h> // mkdir
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h> // NULL, size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // strtoull
+#include <string.h> // strcmp, strlen
+#include <unistd.h> // unlink
+
+
+// files are written in chunks of at most this size
+#define GEN_BUFFER_SIZE (64 * 1024)
+
+// what's left of the requested size once it gets below this isn't worth another file
+#define GEN_MIN_FILE_SIZE 512
+
+// directories nested by the 'deep' shape, which must stay below mk-index's limit
+#ifndef GEN_DEEP_DEPTH
+#define GEN_DEEP_DEPTH 40
+#endif
+
+enum Shape {
+	SHAPE_SOURCE, // many small files of C-like code, in a few levels of directories
+	SHAPE_LOGS, // a few big files of timestamped log lines
+	SHAPE_HUGE, // a single file with all of the contents
+	SHAPE_DEEP, // small files spread along long chains of nested directories
+	SHAPE_DUPS, // like 'source', but most files are copies of some earlier one
+};
+
+static const char *const shape_names[] = {
+	[SHAPE_SOURCE] = "source",
+	[SHAPE_LOGS] = "logs",
+	[SHAPE_HUGE] = "huge",
+	[SHAPE_DEEP] = "deep",
+	[SHAPE_DUPS] = "dups",
+};
+
+typedef struct {
+	const char *output_dir;
+	bool verbose;
+	enum Shape shape;
+	uint64_t size;
+	uint64_t seed;
+} Config;
+
+static const char cli_doc[] =
+	"Generate a deterministic synthetic corpus (for benchmarks) in a new directory, "
+	"shaped like 'source' code, 'logs', a single 'huge' file, a 'deep' tree or a 'dups'-heavy set.";
+
+static const char cli_args_doc[] = "<DIR>";
+
+enum {
+	CLI_SHAPE = 0x100, // long-only options start after the ASCII range
+	CLI_SIZE,
+	CLI_SEED,
+};
+
+static const struct argp_option cli_options[] = {
+	{
+		.name="verbose", .key='v',
+		.doc="Print more verbose output to stderr",
+	},
+	{
+		.name="shape", .key=CLI_SHAPE, .arg="SHAPE",
+		.doc="Either 'source' (default), 'logs', 'huge', 'deep' or 'dups'",
+	},
+	{
+		.name="size", .key=CLI_SIZE, .arg="SIZE",
+		.doc="Total size of the generated files (default: 64M)",
+	},
+	{
+		.name="seed", .key=CLI_SEED, .arg="N",
+		.doc="Seed of the generated contents, which are otherwise always the same (default: 1)",
+	},
+	{0},
+};
+
+static error_t cli_parser(int key, char *arg, struct argp_state *state)
+{
+	Config *cfg = state->input;
+	switch (key) {
+		case 'v':
+			cfg->verbose = true;
+			break;
+
+		case CLI_SHAPE: {
+			size_t i = 0;
+			const size_t nshapes = sizeof(shape_names) / sizeof(shape_names[0]);
+			while (i < nshapes && strcmp(arg, shape_names[i]) != 0) ++i;
+			if (i == nshapes) argp_error(state, "invalid shape '%s'", arg);
+			cfg->shape = i;
+			break;
+		}
+
+		case CLI_SIZE:
+			if (!parse_size(arg, &cfg->size) || cfg->size == 0) argp_error(state, "invalid size '%s'", arg);
+			break;
+
+		case CLI_SEED: {
+			char *end = NULL;
+			errno = 0;
+			cfg->seed = strtoull(arg, &end, 10);
+			if (errno || end == arg || *end != '\0') argp_error(state, "invalid seed '%s'", arg);
+			break;
+		}
+
+		case ARGP_KEY_ARG:
+			if (cfg->output_dir) argp_usage(state);
+			cfg->output_dir = arg;
+			break;
+
+		case ARGP_KEY_END:
+			if (!cfg->output_dir) argp_usage(state);
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static const struct argp cli = {
+	.doc = cli_doc,
+	.args_doc = cli_args_doc,
+	.options = cli_options,
+	.parser = cli_parser,
+};
+
+
+// splitmix64, which is fast, good enough, and the same everywhere
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static uint32_t rng_below(uint64_t *state, uint32_t bound)
+{
+	return (uint32_t)((rng_next(state) >> 32) * bound >> 32);
+}
+
+// common words in code and logs alike, so queries for them have lots of candidates
+static const char *const words[] = {
+	"walker", "index", "posting", "path", "buffer", "length", "count", "entry",
+	"file", "block", "shard", "query", "result", "gram", "hash", "node",
+	"list", "map", "table", "size", "offset", "error", "state", "config",
+	"option", "reader", "writer", "token", "parse", "load", "save", "merge",
+	"cache", "page", "chunk", "stream", "queue", "lock", "thread", "task",
+	"event", "watch", "delta", "segment", "alias", "stat", "range", "match",
+	"line", "column", "name", "value", "key", "data", "flag", "mode",
+	"level", "depth", "limit", "total", "first", "last", "next", "prev",
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *const types[] = { "int", "size_t", "uint64_t", "bool", "char *", "const char *", "double" };
+#define NTYPES (sizeof(types) / sizeof(types[0]))
+
+// Writes an identifier made of 1 to 3 words into the buffer, returning its length.
+static int identifier(uint64_t *rng, char *buffer, size_t size)
+{
+	const uint32_t nparts = 1 + rng_below(rng, 3);
+	int length = 0;
+	for (uint32_t i = 0; i < nparts && (size_t)length < size; ++i) {
+		length += snprintf(&buffer[length], size - length, "%s%s", i > 0 ? "_" : "", words[rng_below(rng, NWORDS)]);
+	}
+	return length;
+}
+
+// Appends a line of C-like code to the buffer, returning its length (or zero if it didn't fit).
+static size_t source_line(uint64_t *rng, char *buffer, size_t size)
+{
+	char a[64], b[64], c[64];
+	identifier(rng, a, sizeof(a));
+	identifier(rng, b, sizeof(b));
+	identifier(rng, c, sizeof(c));
+	const char *word = words[rng_below(rng, NWORDS)];
+	const char *type = types[rng_below(rng, NTYPES)];
+
+	int length = 0;
+	switch (rng_below(rng, 10)) {
+		case 0: length = snprintf(buffer, size, "\nstatic %s %s(struct %s *%s, size_t %s)\n{\n", type, a, word, b, c); break;
+		case 1: length = snprintf(buffer, size, "\tif (%s->%s == NULL) return -%s;\n", a, b, c); break;
+		case 2: length = snprintf(buffer, size, "\tfor (size_t i = 0; i < %s; ++i) %s[i] = %s(%s);\n", a, b, c, word); break;
+		case 3: length = snprintf(buffer, size, "\tconst %s %s = %s(%s, %s);\n", type, a, b, c, word); break;
+		case 4: length = snprintf(buffer, size, "\t%s->%s += %s * %u;\n", a, b, c, rng_below(rng, 4096)); break;
+		case 5: length = snprintf(buffer, size, "\t// %s the %s of each %s, unless %s\n", word, a, b, c); break;
+		case 6: length = snprintf(buffer, size, "\tstatic const %s %s[] = { %u, %u, %u };\n", type, a, rng_below(rng, 100), rng_below(rng, 100), rng_below(rng, 100)); break;
+		case 7: length = snprintf(buffer, size, "\tLOG_DEBUGF(\"%s %s at '%%s'\", %s);\n", word, a, b); break;
+		default: length = snprintf(buffer, size, "\treturn %s;\n}\n", a); break;
+	}
+
+	// a few rare markers, so that some queries only have a handful of matches
+	if (length > 0 && (size_t)length < size && rng_below(rng, 4096) == 0) {
+		buffer[length - 1] = ' ';
+		length += snprintf(&buffer[length], size - length, "// busk_needle_%u\n", rng_below(rng, 16));
+	}
+	return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+// Appends a log line to the buffer, returning its length (or zero if it didn't fit).
+static size_t log_line(uint64_t *rng, uint64_t *clock_ms, char *buffer, size_t size)
+{
+	static const char *const levels[] = { "INFO ", "INFO ", "INFO ", "INFO ", "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR" };
+	*clock_ms += rng_below(rng, 50);
+	const uint64_t seconds = *clock_ms / 1000;
+	char a[64];
+	identifier(rng, a, sizeof(a));
+	const int length = snprintf(
+		buffer, size, "2026-01-%02u %02u:%02u:%02u.%03u %s [%s] request_id=%08x %s %s took %ums\n",
+		(unsigned)(1 + seconds / 86400 % 28), (unsigned)(seconds / 3600 % 24), (unsigned)(seconds / 60 % 60),
+		(unsigned)(seconds % 60), (unsigned)(*clock_ms % 1000),
+		levels[rng_below(rng, 10)], words[rng_below(rng, NWORDS)], (unsigned)rng_next(rng),
+		a, words[rng_below(rng, NWORDS)], rng_below(rng, 2000)
+	);
+	return length > 0 && (size_t)length < size ? (size_t)length : 0;
+}
+
+// Creates every missing directory in a file's path (which is modified in the process).
+static bool make_parents(char *path)
+{
+	for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		const bool made = mkdir(path, 0755) == 0 || errno == EEXIST;
+		*slash = '/';
+		if (!made) return false;
+	}
+	return true;
+}
+
+// Writes a file of (about) the given size, whose contents only depend on the seed and shape.
+static uint64_t write_file(const char *path, uint64_t seed, uint64_t size, bool logs)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) LOG_FATALF("Failed to create file at '%s' (errno = %d)", path, errno);
+
+	static char buffer[GEN_BUFFER_SIZE];
+	uint64_t rng = seed;
+	uint64_t clock_ms = seed % (86400 * 1000);
+	uint64_t written = 0;
+	while (written < size) {
+		size_t filled = 0;
+		for (;;) {
+			const size_t length = logs
+				? log_line(&rng, &clock_ms, &buffer[filled], sizeof(buffer) - filled)
+				: source_line(&rng, &buffer[filled], sizeof(buffer) - filled);
+			if (length == 0 || written + filled + length > size) break;
+			filled += length;
+		}
+		if (filled == 0) break; // not even a whole line fits anymore
+		if (fwrite(buffer, 1, filled, file) != filled) LOG_FATALF("Failed to write to '%s'", path);
+		written += filled;
+	}
+
+	if (fclose(file) != 0) LOG_FATALF("Failed to write to '%s'", path);
+	LOG_DEBUGF("Generated '%s' (%zu bytes)", path, written);
+	return written;
+}
+
+int main(int argc, char *argv[])
+{
+	Config cfg = { .shape = SHAPE_SOURCE, .size = 64 << 20, .seed = 1 };
+	argp_program_version = VERSION_STRING;
+	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
+
+	if (cfg.verbose) logger.level = LOG_LEVEL_DEBUG;
+
+	// a fresh directory, so that nothing else ends up in the corpus
+	if (mkdir(cfg.output_dir, 0755) != 0) {
+		LOG_FATALF("Failed to create directory at '%s' (errno = %d)", cfg.output_dir, errno);
+	}
+
+	uint64_t rng = cfg.seed ^ ((uint64_t)cfg.shape << 56);
+	uint64_t *seeds = NULL; // of every file so far, which duplicates reuse
+	uint64_t total = 0;
+	size_t nfiles = 0;
+	char path[4096];
+	while (total < cfg.size) {
+		const uint64_t remaining = cfg.size - total;
+		if (remaining < GEN_MIN_FILE_SIZE) break;
+		uint64_t seed = rng_next(&rng);
+		uint64_t size = 0;
+		bool logs = false;
+		int length = 0;
+
+		switch (cfg.shape) {
+			case SHAPE_SOURCE:
+			case SHAPE_DUPS:
+				length = snprintf(
+					path, sizeof(path), "%s/%s/%s/%s_%zu.c", cfg.output_dir,
+					words[rng_below(&rng, 8)], words[8 + rng_below(&rng, 16)], words[rng_below(&rng, NWORDS)], nfiles
+				);
+				if (cfg.shape == SHAPE_DUPS && stbds_arrlenu(seeds) > 0 && rng_below(&rng, 100) < 60) {
+					seed = seeds[rng_below(&rng, stbds_arrlenu(seeds))];
+				}
+				// mostly small files, with a long tail of bigger ones, sized by their seed so that copies match
+				size = (UINT64_C(512) << (seed % 6)) + seed / 8 % 4096;
+				break;
+			case SHAPE_LOGS:
+				size = UINT64_C(8) << 20;
+				logs = true;
+				length = snprintf(path, sizeof(path), "%s/logs/%s-%03zu.log", cfg.output_dir, words[nfiles % NWORDS], nfiles);
+				break;
+			case SHAPE_HUGE:
+				size = remaining;
+				length = snprintf(path, sizeof(path), "%s/huge.c", cfg.output_dir);
+				break;
+			case SHAPE_DEEP: {
+				// each branch is a chain of directories, with a few files at every level
+				const size_t branch = nfiles / (GEN_DEEP_DEPTH * 4);
+				const size_t level = nfiles / 4 % GEN_DEEP_DEPTH;
+				length = snprintf(path, sizeof(path), "%s/%s-%zu", cfg.output_dir, words[branch % NWORDS], branch);
+				for (size_t l = 0; l <= level && length > 0 && (size_t)length < sizeof(path); ++l) {
+					length += snprintf(&path[length], sizeof(path) - length, "/%s", words[(branch + l) % NWORDS]);
+				}
+				if (length > 0 && (size_t)length < sizeof(path)) {
+					length += snprintf(&path[length], sizeof(path) - length, "/%s_%zu.c", words[rng_below(&rng, NWORDS)], nfiles);
+				}
+				size = 1024 + rng_below(&rng, 3072);
+				break;
+			}
+		}
+		if (length <= 0 || (size_t)length >= sizeof(path)) LOG_FATAL("Generated path is too long");
+		if (size > remaining) size = remaining;
+		stbds_arrpush(seeds, seed);
+
+		if (!make_parents(path)) LOG_FATALF("Failed to create directories for '%s' (errno = %d)", path, errno);
+		const uint64_t written = write_file(path, seed, size, logs);
+		if (written == 0) {
+			unlink(path);
+			break;
+		}
+		total += written;
+		++nfiles;
+	}
+	stbds_arrfree(seeds);
+
+	LOG_INFOF("Generated %zu files (%zu bytes) of shape '%s' in %s", nfiles, total, shape_names[cfg.shape], cfg.output_dir);
+	return 0;
+}
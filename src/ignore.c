@@ -0,0 +1,230 @@
+#include "ignore.h"
+
+#include <stb/stb_ds.h> // arr* macros
+
+#include <errno.h>
+#include <fcntl.h> // openat
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdlib.h> // malloc, free
+#include <string.h> // memcmp, memcpy, memchr, strchr
+#include <unistd.h> // read, close
+
+
+// Most patterns are plain names or extensions, which don't need a glob matcher.
+enum IgnoreKind {
+	IGNORE_LITERAL, // exact match, e.g. "node_modules"
+	IGNORE_SUFFIX, // a star followed by a literal, e.g. "*.o"
+	IGNORE_GLOB, // anything else
+};
+
+struct IgnorePattern {
+	char *text; // without the '!' prefix, nor leading and trailing slashes
+	size_t length;
+	enum IgnoreKind kind;
+	bool negated;
+	bool dir_only; // only matches directories (had a trailing slash)
+	bool anchored; // matches the whole relative path, not just the last component
+};
+
+
+// Matches a glob against a string, where '*' and '?' stop at slashes but "**" doesn't.
+static bool glob_match(const char *pattern, size_t plen, const char *str, size_t slen)
+{
+	size_t p = 0, s = 0;
+	while (p < plen) {
+		const char c = pattern[p];
+
+		if (c == '*') {
+			if (p + 1 < plen && pattern[p + 1] == '*') {
+				p += 2;
+				// "**/" matches zero or more whole directories
+				if (p < plen && pattern[p] == '/') {
+					++p;
+					if (glob_match(&pattern[p], plen - p, &str[s], slen - s)) return true;
+					for (size_t i = s; i < slen; ++i) {
+						if (str[i] == '/' && glob_match(&pattern[p], plen - p, &str[i + 1], slen - i - 1)) return true;
+					}
+					return false;
+				}
+				// otherwise (e.g. a trailing "/**") it matches anything at all
+				for (size_t i = s; i <= slen; ++i) {
+					if (glob_match(&pattern[p], plen - p, &str[i], slen - i)) return true;
+				}
+				return false;
+			}
+			++p;
+			for (size_t i = s; i <= slen; ++i) {
+				if (glob_match(&pattern[p], plen - p, &str[i], slen - i)) return true;
+				if (i < slen && str[i] == '/') break;
+			}
+			return false;
+		}
+
+		if (s >= slen) return false;
+		const unsigned char sc = str[s];
+
+		if (c == '?') {
+			if (sc == '/') return false;
+			++p, ++s;
+			continue;
+		}
+
+		if (c == '[') {
+			size_t q = p + 1;
+			const bool negate = q < plen && (pattern[q] == '!' || pattern[q] == '^');
+			if (negate) ++q;
+			bool found = false;
+			for (bool first = true; q < plen && (first || pattern[q] != ']'); first = false) {
+				if (pattern[q] == '\\' && q + 1 < plen) ++q;
+				const unsigned char lo = pattern[q++];
+				unsigned char hi = lo;
+				if (q + 1 < plen && pattern[q] == '-' && pattern[q + 1] != ']') {
+					q += pattern[q + 1] == '\\' && q + 2 < plen ? 2 : 1;
+					hi = pattern[q++];
+				}
+				if (lo <= sc && sc <= hi) found = true;
+			}
+			// unterminated brackets are taken literally
+			if (q < plen) {
+				if (found == negate || sc == '/') return false;
+				p = q + 1, ++s;
+				continue;
+			}
+		}
+
+		if (c == '\\' && p + 1 < plen) ++p;
+		if ((unsigned char)pattern[p] != sc) return false;
+		++p, ++s;
+	}
+	return s == slen;
+}
+
+// Length of the prefix with none of the `special` chars, like strcspn (but not NUL-terminated).
+static size_t plain_span(const char *str, size_t length, const char *special)
+{
+	size_t i = 0;
+	while (i < length && !strchr(special, str[i])) ++i;
+	return i;
+}
+
+bool ignore_add(struct IgnoreRules *rules, const char *pattern, size_t length)
+{
+	// trailing spaces are ignored unless escaped, as are CRs left by Windows line endings
+	while (length > 0 && (pattern[length - 1] == '\r' || pattern[length - 1] == ' ')) {
+		if (pattern[length - 1] == ' ' && length > 1 && pattern[length - 2] == '\\') break;
+		--length;
+	}
+	if (length == 0 || pattern[0] == '#') return false;
+
+	struct IgnorePattern compiled = {0};
+	if (pattern[0] == '!') {
+		compiled.negated = true;
+		++pattern, --length;
+	}
+	if (length > 0 && pattern[length - 1] == '/') {
+		compiled.dir_only = true;
+		--length;
+	}
+	if (length > 0 && pattern[0] == '/') {
+		compiled.anchored = true;
+		++pattern, --length;
+	}
+	if (length == 0) return false;
+	if (memchr(pattern, '/', length)) compiled.anchored = true;
+
+	if (plain_span(pattern, length, "*?[\\") == length) {
+		compiled.kind = IGNORE_LITERAL;
+	} else if (
+		!compiled.anchored && pattern[0] == '*'
+		&& plain_span(&pattern[1], length - 1, "*?[\\") == length - 1
+	) {
+		compiled.kind = IGNORE_SUFFIX;
+		++pattern, --length;
+	} else {
+		compiled.kind = IGNORE_GLOB;
+	}
+
+	compiled.text = malloc(length + 1);
+	if (!compiled.text) return false;
+	memcpy(compiled.text, pattern, length);
+	compiled.text[length] = '\0';
+	compiled.length = length;
+	stbds_arrpush(rules->patterns, compiled);
+	return true;
+}
+
+int ignore_load(struct IgnoreRules *rules, int dirfd, const char *filename)
+{
+	const int fd = openat(dirfd, filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return errno == ENOENT ? 0 : -errno;
+
+	char *contents = NULL;
+	for (;;) {
+		const size_t offset = stbds_arrlenu(contents);
+		stbds_arrsetlen(contents, offset + 4096);
+		const ssize_t read_bytes = read(fd, &contents[offset], 4096);
+		if (read_bytes < 0 && errno == EINTR) {
+			stbds_arrsetlen(contents, offset);
+			continue;
+		} else if (read_bytes < 0) {
+			const int error = errno;
+			stbds_arrfree(contents);
+			close(fd);
+			return -error;
+		}
+		stbds_arrsetlen(contents, offset + read_bytes);
+		if (read_bytes == 0) break;
+	}
+	close(fd);
+
+	const size_t length = stbds_arrlenu(contents);
+	for (size_t begin = 0; begin < length;) {
+		const char *newline = memchr(&contents[begin], '\n', length - begin);
+		const size_t end = newline ? (size_t)(newline - contents) : length;
+		ignore_add(rules, &contents[begin], end - begin);
+		begin = end + 1;
+	}
+
+	stbds_arrfree(contents);
+	return 0;
+}
+
+enum IgnoreMatch ignore_match(const struct IgnoreRules *rules, const char *path, size_t pathlen, bool is_dir)
+{
+	size_t name_offset = pathlen;
+	while (name_offset > 0 && path[name_offset - 1] != '/') --name_offset;
+	const char *name = &path[name_offset];
+	const size_t namelen = pathlen - name_offset;
+
+	for (size_t i = stbds_arrlenu(rules->patterns); i > 0; --i) {
+		const struct IgnorePattern *pattern = &rules->patterns[i - 1];
+		if (pattern->dir_only && !is_dir) continue;
+
+		const char *subject = pattern->anchored ? path : name;
+		const size_t length = pattern->anchored ? pathlen : namelen;
+		bool matched = false;
+		switch (pattern->kind) {
+			case IGNORE_LITERAL:
+				matched = length == pattern->length && memcmp(subject, pattern->text, length) == 0;
+				break;
+			case IGNORE_SUFFIX:
+				matched = length >= pattern->length
+					&& memcmp(&subject[length - pattern->length], pattern->text, pattern->length) == 0;
+				break;
+			case IGNORE_GLOB:
+				matched = glob_match(pattern->text, pattern->length, subject, length);
+				break;
+		}
+		if (matched) return pattern->negated ? IGNORE_NEGATED : IGNORE_MATCHED;
+	}
+
+	return IGNORE_NONE;
+}
+
+void ignore_cleanup(struct IgnoreRules *rules)
+{
+	for (size_t i = 0; i < stbds_arrlenu(rules->patterns); ++i) free(rules->patterns[i].text);
+	stbds_arrfree(rules->patterns);
+}
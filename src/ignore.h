@@ -0,0 +1,36 @@
+#ifndef INCLUDE_IGNORE_H
+#define INCLUDE_IGNORE_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+
+
+struct IgnorePattern; // opaque
+
+// Compiled list of gitignore-style patterns, relative to some directory.
+struct IgnoreRules {
+	struct IgnorePattern *patterns; // stb array, in the order they were added
+};
+
+// Result of matching a path against some rules.
+enum IgnoreMatch {
+	IGNORE_NONE, // no pattern matched
+	IGNORE_MATCHED, // the last matching pattern was a regular one
+	IGNORE_NEGATED, // the last matching pattern was negated (i.e. started with '!')
+};
+
+
+// Compiles a pattern (e.g. a line of a .gitignore), returning false when it's blank or a comment.
+bool ignore_add(struct IgnoreRules *rules, const char *pattern, size_t length);
+
+// Compiles every pattern in the file named `filename` in `dirfd`, if any,
+// returning zero (even when there's no such file) or a negative errno.
+int ignore_load(struct IgnoreRules *rules, int dirfd, const char *filename);
+
+// Matches a path relative to the directory of the rules, where the last matching pattern wins.
+enum IgnoreMatch ignore_match(const struct IgnoreRules *rules, const char *path, size_t pathlen, bool is_dir);
+
+// Deallocates every compiled pattern.
+void ignore_cleanup(struct IgnoreRules *rules);
+
+#endif // INCLUDE_IGNORE_H
@@ -1,33 +1,155 @@
 #include "index.h"
 
+#include <pthread.h>
 #include <stb/stb_ds.h> // arrr* and hm* macros
 
 #include <assert.h>
+#include <errno.h> // EIO, EINVAL, ENOMEM, ESPIPE, EOVERFLOW
+#include <limits.h> // PATH_MAX
 #include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h> // size_t
 #include <stdint.h>
 #include <stdio.h>
-#include <stdlib.h> // qsort, bsearch
+#include <stdlib.h> // qsort, bsearch, calloc
 #include <string.h> // strlen, memcpy, strncmp
+#include <sys/stat.h> // fstat
 
 
+// the size of ngrams (N) is chosen when building an index, within these bounds,
+// and defaults to INDEX_NGRAM_SIZE
+#define INDEX_NGRAM_MIN 2
+#define INDEX_NGRAM_MAX 8 // so that an ngram can be packed into a u64
+
 #ifndef INDEX_NGRAM_SIZE
 #define INDEX_NGRAM_SIZE 3
-#elif INDEX_NGRAM_SIZE < 2
-#error "INDEX_NGRAM_SIZE must be at least 2"
+#elif INDEX_NGRAM_SIZE < INDEX_NGRAM_MIN || INDEX_NGRAM_SIZE > INDEX_NGRAM_MAX
+#error "INDEX_NGRAM_SIZE must be between 2 and 8"
+#endif
+
+#ifndef INDEX_SPARSE_MAX
+#define INDEX_SPARSE_MAX 16
+#elif INDEX_SPARSE_MAX <= INDEX_NGRAM_MAX
+#error "INDEX_SPARSE_MAX must be greater than any ngram size"
+#endif
+
+// postings are offsets into the paths array, shifted left to make room for a
+// block number: zero when the whole file is covered, otherwise starting at one
+#define INDEX_BLOCK_BITS 20
+#define INDEX_BLOCK_MAX ((UINT64_C(1) << INDEX_BLOCK_BITS) - 1)
+#define INDEX_PATHS_MAX (UINT64_C(1) << (64 - INDEX_BLOCK_BITS)) // bytes, see `check_new_path()`
+
+static inline uint64_t posting_make(uint64_t path_offset, uint64_t block)
+{
+	assert(path_offset < INDEX_PATHS_MAX);
+	assert(block <= INDEX_BLOCK_MAX);
+	return (path_offset << INDEX_BLOCK_BITS) | block;
+}
+
+static inline uint64_t posting_path(uint64_t posting)
+{
+	return posting >> INDEX_BLOCK_BITS;
+}
+
+static inline uint64_t posting_block(uint64_t posting)
+{
+	return posting & INDEX_BLOCK_MAX;
+}
+
+// posting lists with more than this percentage of all documents (i.e. postings
+// in the whole index) are stored as the complement, listing only the exceptions
+#ifndef INDEX_DENSE_PERCENT
+#define INDEX_DENSE_PERCENT 50
+#elif INDEX_DENSE_PERCENT < 0 || INDEX_DENSE_PERCENT > 100
+#error "INDEX_DENSE_PERCENT must be a percentage"
 #endif
 
+#define INDEX_COMPLEMENT_BIT (UINT32_C(1) << 31)
+
+// while building, posting lists are chains of links carved from big chunks of
+// memory (instead of an array each), which saves the headers and slack of
+// millions of tiny allocations, and the whole arena is freed at once
+#define INDEX_CHUNK_BITS 16 // slots (u64) per chunk, as a power of two
+#define INDEX_CHUNK_SLOTS (UINT32_C(1) << INDEX_CHUNK_BITS)
+#define INDEX_CHUNK_MAX (UINT32_C(1) << (32 - INDEX_CHUNK_BITS)) // so that refs fit in 32 bits
+#define INDEX_LINK_MIN 2 // postings in the first link of a chain, then doubling up to the max
+#define INDEX_LINK_MAX 256
+
+// Posting list of an index being built. Each link starts with a header slot
+// (a ref to the next link, then its count and capacity in 16 bits each), where
+// a ref is the number of a chunk, followed by a slot in it (zero means none).
 typedef struct {
-	uint8_t bytes[INDEX_NGRAM_SIZE];
-	uint8_t _padding[INDEX_NGRAM_SIZE % 2];
-} NGram;
+	uint32_t head;
+	uint32_t tail; // where postings are appended
+	uint32_t length;
+} PostingChain;
+
+// N bytes packed into an integer, first byte in the most significant position
+// (of those used), so that ngrams of the same size sort like their bytes do
+typedef uint64_t NGram;
+
+static inline NGram ngram_pack(const uint8_t *bytes, size_t n)
+{
+	NGram ngram = 0;
+	for (size_t i = 0; i < n; ++i) ngram = ngram << 8 | bytes[i];
+	return ngram;
+}
+
+static inline void ngram_unpack(NGram ngram, size_t n, uint8_t *bytes)
+{
+	for (size_t i = 0; i < n; ++i) bytes[i] = ngram >> (8 * (n - 1 - i));
+}
+
+// Returns how many bytes an ngram takes in a saved entry, i.e. padded to an even size.
+static inline size_t ngram_stride(size_t n)
+{
+	return n + n % 2;
+}
+
+static inline size_t ngram_size(const struct IndexOptions *options)
+{
+	return options->ngram_size ? options->ngram_size : INDEX_NGRAM_SIZE;
+}
 
 typedef struct IndexPostingMapping {
 	NGram key;
-	uint64_t *value; // offsets into paths array
+	uint64_t *value; // postings (see `posting_make()`) when loaded, or NULL
+	PostingChain chain; // postings while building, see `INDEX_CHUNK_BITS`
+	bool complement; // whether postings list the documents NOT in the set
 } IndexPostingMapping;
 
+typedef struct IndexSparseMapping {
+	uint64_t key; // hash of the sparse gram's bytes
+	uint64_t *value; // postings (see `posting_make()`) when loaded, or NULL
+	PostingChain chain; // postings while building
+	bool complement; // whether postings list the documents NOT in the set
+} IndexSparseMapping;
+
+typedef struct {
+	uint64_t size;
+	uint64_t hash;
+} ContentDigest;
+
+typedef struct IndexContentMapping {
+	ContentDigest key;
+	uint64_t value; // posting of the first file indexed with these contents
+} IndexContentMapping;
+
+typedef struct IndexSizeMapping {
+	uint64_t key; // file size
+	bool value; // unused
+} IndexSizeMapping;
+
+typedef struct {
+	uint64_t device;
+	uint64_t inode;
+} FileId;
+
+typedef struct IndexInodeMapping {
+	FileId key;
+	uint64_t value; // posting of the first path through which this file was indexed
+} IndexInodeMapping;
+
 typedef struct {
 	uint16_t allocation_size; // number of bytes used to allocate this
 	uint16_t offset_to_prefix; // relative backwards offset to prefix, or zero
@@ -45,7 +167,102 @@ void index_cleanup(struct Index *index)
 		stbds_arrfree(postings);
 	}
 	stbds_hmfree(index->_posting_hm);
+	for (size_t i = 0; i < stbds_hmlenu(index->_sparse_hm); ++i) {
+		uint64_t *postings = index->_sparse_hm[i].value;
+		stbds_arrfree(postings);
+	}
+	stbds_hmfree(index->_sparse_hm);
+	stbds_arrfree(index->_doc_arr);
+	stbds_arrfree(index->_alias_of);
+	stbds_arrfree(index->_alias_arr);
+	stbds_arrfree(index->_stat_of);
+	stbds_arrfree(index->_stat_arr);
+	stbds_hmfree(index->_content_hm);
+	stbds_hmfree(index->_size_hm);
+	stbds_hmfree(index->_inode_hm);
 	stbds_arrfree(index->_path_arr);
+	for (size_t i = 0; i < stbds_arrlenu(index->_arena_chunks); ++i) free(index->_arena_chunks[i]);
+	stbds_arrfree(index->_arena_chunks);
+}
+
+static inline uint64_t *arena_slot(const struct Index *index, uint32_t ref)
+{
+	return &index->_arena_chunks[ref >> INDEX_CHUNK_BITS][ref & (INDEX_CHUNK_SLOTS - 1)];
+}
+
+// Hands out a link with room for some postings (plus its header), returning a ref to it.
+static uint32_t arena_link(struct Index *index, uint32_t capacity)
+{
+	const size_t nchunks = stbds_arrlenu(index->_arena_chunks);
+	if (nchunks == 0 || index->_arena_used + 1 + capacity > INDEX_CHUNK_SLOTS) {
+		// like with stb_ds arrays, there's no way back from running out of memory here
+		uint64_t *chunk = nchunks < INDEX_CHUNK_MAX ? malloc(INDEX_CHUNK_SLOTS * sizeof(uint64_t)) : NULL;
+		if (!chunk) abort();
+		stbds_arrpush(index->_arena_chunks, chunk);
+		index->_arena_used = nchunks == 0 ? 1 : 0; // so that no link is ever at ref zero
+	}
+
+	const uint32_t chunk = stbds_arrlenu(index->_arena_chunks) - 1;
+	const uint32_t ref = chunk << INDEX_CHUNK_BITS | (uint32_t)index->_arena_used;
+	index->_arena_used += 1 + capacity;
+	*arena_slot(index, ref) = (uint64_t)capacity << 48;
+	return ref;
+}
+
+static inline uint32_t link_next(uint64_t header) { return header & UINT32_MAX; }
+static inline uint32_t link_count(uint64_t header) { return (header >> 32) & UINT16_MAX; }
+static inline uint32_t link_capacity(uint64_t header) { return header >> 48; }
+
+// Returns the last posting in a chain, or `UINT64_MAX` if empty.
+static uint64_t chain_last(const struct Index *index, PostingChain chain)
+{
+	if (chain.tail == 0) return UINT64_MAX;
+	const uint64_t *tail = arena_slot(index, chain.tail);
+	return tail[link_count(tail[0])];
+}
+
+static void chain_push(struct Index *index, PostingChain *chain, uint64_t posting)
+{
+	uint64_t *tail = chain->tail ? arena_slot(index, chain->tail) : NULL;
+	if (!tail || link_count(tail[0]) == link_capacity(tail[0])) {
+		// chunks never move, so the old tail stays where it was
+		const uint32_t capacity = !tail ? INDEX_LINK_MIN
+			: link_capacity(tail[0]) < INDEX_LINK_MAX ? 2 * link_capacity(tail[0])
+			: INDEX_LINK_MAX;
+		const uint32_t link = arena_link(index, capacity);
+		if (tail) tail[0] |= link;
+		else chain->head = link;
+		chain->tail = link;
+		tail = arena_slot(index, link);
+	}
+	tail[1 + link_count(tail[0])] = posting;
+	tail[0] += UINT64_C(1) << 32;
+	++chain->length;
+}
+
+// Returns the postings of a gram as an array: either those loaded, or its chain
+// copied into `scratch` (an stb array, which is reused).
+static const uint64_t *gather_postings(
+	const struct Index *index, const uint64_t *loaded, PostingChain chain, uint64_t **scratch
+) {
+	if (loaded) return loaded;
+	stbds_arrsetlen(*scratch, chain.length);
+	size_t n = 0;
+	for (uint32_t link = chain.head; link != 0;) {
+		const uint64_t *slots = arena_slot(index, link);
+		const uint32_t count = link_count(slots[0]);
+		memcpy(&(*scratch)[n], &slots[1], count * sizeof(uint64_t));
+		n += count;
+		link = link_next(slots[0]);
+	}
+	assert(n == chain.length);
+	return *scratch;
+}
+
+// Returns the number of postings of a gram, whether loaded or being built.
+static inline uint64_t postings_length(const uint64_t *loaded, PostingChain chain)
+{
+	return loaded ? stbds_arrlenu(loaded) : chain.length;
 }
 
 
@@ -59,107 +276,608 @@ static size_t round_to_alignment(size_t base_size, size_t alignment)
 }
 
 
+static inline uint16_t read_le16(const uint8_t *bytes) {
+	uint16_t value = 0;
+	for (int i = 0; i < 2; ++i) value |= ((uint16_t)bytes[i] & 0xff) << (i*8);
+	return value;
+}
+
+static inline uint32_t read_le32(const uint8_t *bytes) {
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i) value |= ((uint32_t)bytes[i] & 0xff) << (i*8);
+	return value;
+}
+
+static inline uint64_t read_le64(const uint8_t *bytes) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) value |= ((uint64_t)bytes[i] & 0xff) << (i*8);
+	return value;
+}
+
+static inline void write_le16(uint8_t *bytes, uint16_t value) {
+	for (int i = 0; i < 2; ++i) bytes[i] = (value >> (i*8)) & 0xff;
+}
+
+static inline void write_le32(uint8_t *bytes, uint32_t value) {
+	for (int i = 0; i < 4; ++i) bytes[i] = (value >> (i*8)) & 0xff;
+}
+
+static inline void write_le64(uint8_t *bytes, uint64_t value) {
+	for (int i = 0; i < 8; ++i) bytes[i] = (value >> (i*8)) & 0xff;
+}
+
+// Stores a sequence of values as LE u64, which is a plain copy on LE hosts.
+static void write_le64s(uint8_t *bytes, const uint64_t *values, size_t count)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (count > 0) memcpy(bytes, values, count * sizeof(uint64_t));
+#else
+	for (size_t i = 0; i < count; ++i) write_le64(&bytes[i*8], values[i]);
+#endif
+}
+
+// Incremental (non-cryptographic) 64-bit hash of a file's contents (or of a section
+// of an index file, see `index_save()`). Init with `{0}`.
+typedef struct {
+	uint64_t hash;
+	uint64_t size;
+	uint64_t tail; // bytes of the current word, when not aligned to 8
+} ContentHasher;
+
+static inline uint64_t content_mix(uint64_t hash, uint64_t word)
+{
+	hash ^= word * 0x9E3779B97F4A7C15ull;
+	hash = (hash << 31) | (hash >> 33);
+	return hash * 0xC2B2AE3D27D4EB4Full;
+}
+
+static void content_hash(ContentHasher *hasher, const uint8_t *bytes, size_t length)
+{
+	size_t i = 0;
+	while (i < length) {
+		// fast path: whole words, read as LE so the result doesn't depend on chunking
+		// (when previous chunks left a partial word, each one is split across two)
+		if (length - i >= 8) {
+			const uint64_t word = read_le64(&bytes[i]);
+			const unsigned shift = 8 * (hasher->size % 8);
+			if (shift == 0) {
+				hasher->hash = content_mix(hasher->hash, word);
+			} else {
+				hasher->hash = content_mix(hasher->hash, hasher->tail | word << shift);
+				hasher->tail = word >> (64 - shift);
+			}
+			hasher->size += 8;
+			i += 8;
+			continue;
+		}
+		hasher->tail |= (uint64_t)bytes[i] << (8 * (hasher->size % 8));
+		hasher->size += 1;
+		i += 1;
+		if (hasher->size % 8 == 0) {
+			hasher->hash = content_mix(hasher->hash, hasher->tail);
+			hasher->tail = 0;
+		}
+	}
+}
+
+static ContentDigest content_digest(const ContentHasher *hasher)
+{
+	uint64_t hash = content_mix(hasher->hash, hasher->tail ^ hasher->size);
+	hash ^= hash >> 33; // murmur3 finalizer
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
+	return (ContentDigest){ .size = hasher->size, .hash = hash };
+}
+
+
+// see `index_save()` for what each byte of the magic means
+#define INDEX_MAGIC "\xFF""BUSK08\x1A"
+#define INDEX_HEADER_SIZE (10 * 8)
+#define INDEX_CHECKSUMS 7 // header, paths, documents, aliases, stats, index, sparse index
+
 // binary file format:
 //
 // - header:
 //   - 8-byte byte sequence: file magic
-//   - 8-byte LE u64: size of ngram index, in number of entries
 //   - 8-byte little endian u64: size of path list, in bytes
+//   - 8-byte LE u64: size of ngram index, in number of entries
+//   - 8-byte LE u64: maximum length of sparse grams, or zero if not indexed
+//   - 8-byte LE u64: size of sparse gram index, in number of entries
+//   - 8-byte LE u64: size of blocks in split files, or zero if never split
+//   - 8-byte LE u64: size of document list, in number of entries
+//   - 8-byte LE u64: size of alias list, in number of entries
+//   - 8-byte LE u64: size of file stat list, in number of entries
+//   - 8-byte LE u64: size of ngrams (N), in bytes
 //
 // - paths:
 //   - variable-length C strings, concatenated, each terminated by a zero byte
 //
+// - documents:
+//   - sequence of LE u64: every distinct posting in the index, sorted
+//
+// - aliases:
+//   - sequence of entries, sorted, each with the following format:
+//     - 8-byte LE u64: posting (with block zero) of the original file
+//     - 8-byte LE u64: posting (with block zero) of its duplicate
+//
 // - index:
 //   - sequence of variable-length entries, each with the following format:
-//     - 4-byte LE u32: size of posting list, in number of items
-//     - N-byte ngram: first byte is ngram[0], second is ngram[1], etc
+//     - 4-byte LE u32: size of posting list, in number of items, where the
+//       highest bit indicates the list is complemented w.r.t. all documents
+//     - N-byte ngram: first byte is ngram[0], second is ngram[1], etc,
+//       followed by a zero byte when N is odd
 //     - sequence of LE u64: posting list, each item an offset into paths
+//       (shifted left by INDEX_BLOCK_BITS) ORed with a block number
+//
+// - sparse index:
+//   - sequence of variable-length entries, each with the following format:
+//     - 4-byte LE u32: size of posting list, in number of items
+//     - 8-byte LE u64: hash of the sparse gram
+//     - sequence of LE u64: posting list, same as above
+//
+// - checksums:
+//   - sequence of LE u64: hash (see `content_hash()`) of the bytes of each of the
+//     sections above, including the header, in order
+
+// Header of an index file, after its magic.
+typedef struct {
+	uint64_t pathslen;
+	uint64_t ngrams;
+	uint64_t sparse_max;
+	uint64_t sparse_grams;
+	uint64_t block_size;
+	uint64_t docs;
+	uint64_t aliases;
+	uint64_t stats;
+	uint64_t ngram_size;
+} IndexHeader;
+
+static void header_encode(IndexHeader header, uint8_t bytes[INDEX_HEADER_SIZE])
+{
+	const uint64_t fields[] = {
+		header.pathslen, header.ngrams, header.sparse_max, header.sparse_grams, header.block_size,
+		header.docs, header.aliases, header.stats, header.ngram_size,
+	};
+	static_assert(8 + sizeof(fields) == INDEX_HEADER_SIZE, "Header fields should fill the header");
+	memcpy(bytes, INDEX_MAGIC, 8);
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+		for (size_t j = 0; j < 8; ++j) bytes[8 + i*8 + j] = (fields[i] >> (j*8)) & 0xff;
+	}
+}
+
+static IndexHeader header_decode(const uint8_t bytes[INDEX_HEADER_SIZE])
+{
+	return (IndexHeader){
+		.pathslen = read_le64(&bytes[8]),
+		.ngrams = read_le64(&bytes[16]),
+		.sparse_max = read_le64(&bytes[24]),
+		.sparse_grams = read_le64(&bytes[32]),
+		.block_size = read_le64(&bytes[40]),
+		.docs = read_le64(&bytes[48]),
+		.aliases = read_le64(&bytes[56]),
+		.stats = read_le64(&bytes[64]),
+		.ngram_size = read_le64(&bytes[72]),
+	};
+}
 
 static int postingmap_cmp(const void *a, const void *b)
 {
 	const IndexPostingMapping *lhs = a;
 	const IndexPostingMapping *rhs = b;
-	int cmpresult = 0;
-	for (size_t i = 0; i < INDEX_NGRAM_SIZE; ++i) {
-		cmpresult = (int)lhs->key.bytes[i] - (int)rhs->key.bytes[i];
-		if (cmpresult != 0) break;
+	if (lhs->key < rhs->key) return -1;
+	else if (lhs->key > rhs->key) return 1;
+	else return 0;
+}
+
+static int sparsemap_cmp(const void *a, const void *b)
+{
+	const IndexSparseMapping *lhs = a;
+	const IndexSparseMapping *rhs = b;
+	if (lhs->key < rhs->key) return -1;
+	else if (lhs->key > rhs->key) return 1;
+	else return 0;
+}
+
+// bytes buffered by a writer before they're written out (and checksummed) at once
+#define INDEX_WRITE_BUFFER (1 << 20)
+
+// Output of an index file, which checksums each section as it's written.
+typedef struct {
+	FILE *file;
+	int64_t written; // bytes, counted when buffered (minus those which then failed)
+	uint8_t *buffer; // stb array, of bytes not yet written out
+	ContentHasher hasher; // of the current section
+	uint64_t checksums[INDEX_CHECKSUMS];
+	size_t sections; // which were ended so far
+} IndexWriter;
+
+static void writer_flush(IndexWriter *writer)
+{
+	const size_t length = stbds_arrlenu(writer->buffer);
+	content_hash(&writer->hasher, writer->buffer, length);
+	writer->written -= length - fwrite(writer->buffer, 1, length, writer->file);
+	stbds_arrsetlen(writer->buffer, 0);
+}
+
+// Returns where to encode some (less than a buffer of) bytes, flushing the buffer first if full.
+static uint8_t *writer_reserve(IndexWriter *writer, size_t length)
+{
+	assert(length <= INDEX_WRITE_BUFFER);
+	if (!writer->buffer) stbds_arrsetcap(writer->buffer, INDEX_WRITE_BUFFER);
+	if (stbds_arrlenu(writer->buffer) + length > INDEX_WRITE_BUFFER) writer_flush(writer);
+	writer->written += length;
+	return stbds_arraddnptr(writer->buffer, length);
+}
+
+static void writer_put(IndexWriter *writer, const void *bytes, size_t length)
+{
+	if (length <= INDEX_WRITE_BUFFER) {
+		if (length > 0) memcpy(writer_reserve(writer, length), bytes, length);
+		return;
+	}
+	// too big to be worth copying, so written out as is
+	writer_flush(writer);
+	content_hash(&writer->hasher, bytes, length);
+	writer->written += fwrite(bytes, 1, length, writer->file);
+}
+
+static void writer_le(IndexWriter *writer, uint64_t value, size_t size)
+{
+	uint8_t *bytes = writer_reserve(writer, size);
+	for (size_t i = 0; i < size; ++i) bytes[i] = (value >> (i*8)) & 0xff;
+}
+
+static void writer_le64s(IndexWriter *writer, const uint64_t *values, size_t count)
+{
+	const size_t per_buffer = INDEX_WRITE_BUFFER / sizeof(uint64_t);
+	for (size_t i = 0; i < count; i += per_buffer) {
+		const size_t n = count - i < per_buffer ? count - i : per_buffer;
+		write_le64s(writer_reserve(writer, n * sizeof(uint64_t)), &values[i], n);
+	}
+}
+
+static void writer_end_section(IndexWriter *writer)
+{
+	assert(writer->sections < INDEX_CHECKSUMS);
+	writer_flush(writer);
+	writer->checksums[writer->sections++] = content_digest(&writer->hasher).hash;
+	writer->hasher = (ContentHasher){0};
+}
+
+// Writes the checksums of every section, once they've all been ended, and frees the buffer.
+static void writer_finish(IndexWriter *writer)
+{
+	assert(writer->sections == INDEX_CHECKSUMS);
+	uint8_t trailer[INDEX_CHECKSUMS * 8];
+	write_le64s(trailer, writer->checksums, INDEX_CHECKSUMS);
+	writer->written += fwrite(trailer, 1, sizeof(trailer), writer->file);
+	stbds_arrfree(writer->buffer);
+}
+
+// Returns the items to be written for a posting list, complementing it w.r.t.
+// all documents when dense enough. Might use `scratch` as storage for that.
+static const uint64_t *encode_postings(
+	const uint64_t *postings, bool *complement,
+	const uint64_t *docs, uint64_t **scratch
+) {
+	const size_t length = stbds_arrlenu(postings);
+	const size_t ndocs = stbds_arrlenu(docs);
+	if (*complement || (uint64_t)length * 100 <= (uint64_t)ndocs * INDEX_DENSE_PERCENT) return postings;
+
+	// postings are a sorted subset of docs, so we can just walk both in order
+	stbds_arrsetlen(*scratch, 0);
+	size_t j = 0;
+	for (size_t i = 0; i < ndocs; ++i) {
+		if (j < length && postings[j] == docs[i]) {
+			++j;
+			continue;
+		}
+		stbds_arrpush(*scratch, docs[i]);
+	}
+	assert(j == length);
+
+	*complement = true;
+	return *scratch;
+}
+
+typedef struct {
+	uint64_t original;
+	uint64_t alias;
+} AliasPair;
+
+static int aliaspair_cmp(const void *a, const void *b)
+{
+	const AliasPair *lhs = a;
+	const AliasPair *rhs = b;
+	if (lhs->original != rhs->original) return lhs->original < rhs->original ? -1 : 1;
+	if (lhs->alias != rhs->alias) return lhs->alias < rhs->alias ? -1 : 1;
+	return 0;
+}
+
+// Compares alias pairs by their original paths alone, for lookups ignoring aliases.
+static int aliaspair_original_cmp(const void *a, const void *b)
+{
+	const AliasPair *lhs = a;
+	const AliasPair *rhs = b;
+	if (lhs->original < rhs->original) return -1;
+	else if (lhs->original > rhs->original) return 1;
+	else return 0;
+}
+
+// gram entries encoded by the same thread at once, into a buffer of their own
+#define INDEX_SAVE_BATCH 1024
+
+// Gram entries of an index being saved, split into batches (of ngrams, then sparse grams)
+// which any number of threads encode in turn, while the calling one writes them in order.
+// Only a window of batches is encoded ahead of the one being written, to bound memory.
+typedef struct {
+	const struct Index *index;
+	const IndexPostingMapping *ngrams; // sorted
+	size_t nngrams;
+	const IndexSparseMapping *sparse; // sorted
+	size_t nsparse;
+	size_t ngram_batches;
+	size_t batches;
+	uint8_t **encoded; // stb array of stb arrays, one per slot of the window
+	bool *ready; // stb array, whether each slot holds its batch
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	size_t next; // batch to be encoded next
+	size_t written; // batches written so far
+} SaveBatches;
+
+static void encode_batch(const SaveBatches *save, size_t batch, uint8_t **bytes, uint64_t **gathered, uint64_t **scratch)
+{
+	const size_t n = ngram_size(&save->index->options);
+	const bool sparse = batch >= save->ngram_batches;
+	const size_t count = sparse ? save->nsparse : save->nngrams;
+	const size_t first = (sparse ? batch - save->ngram_batches : batch) * INDEX_SAVE_BATCH;
+	const size_t end = count - first < INDEX_SAVE_BATCH ? count : first + INDEX_SAVE_BATCH;
+
+	stbds_arrsetlen(*bytes, 0);
+	for (size_t i = first; i < end; ++i) {
+		uint8_t key[8] = {0};
+		size_t key_size = 0;
+		const uint64_t *listed = NULL;
+		bool complement = false;
+		if (!sparse) {
+			const IndexPostingMapping *mapping = &save->ngrams[i];
+			ngram_unpack(mapping->key, n, key);
+			key_size = ngram_stride(n);
+			listed = gather_postings(save->index, mapping->value, mapping->chain, gathered);
+			complement = mapping->complement;
+		} else {
+			const IndexSparseMapping *mapping = &save->sparse[i];
+			write_le64(key, mapping->key);
+			key_size = sizeof(uint64_t);
+			listed = gather_postings(save->index, mapping->value, mapping->chain, gathered);
+			complement = mapping->complement;
+		}
+		const uint64_t *postings = encode_postings(listed, &complement, save->index->_doc_arr, scratch);
+
+		const uint32_t postinglen = stbds_arrlenu(postings);
+		assert(postinglen < INDEX_COMPLEMENT_BIT);
+		const uint32_t lenword = complement ? postinglen | INDEX_COMPLEMENT_BIT : postinglen;
+		uint8_t *entry = stbds_arraddnptr(*bytes, 4 + key_size + (size_t)postinglen * 8);
+		write_le32(entry, lenword);
+		memcpy(&entry[4], key, key_size);
+
+		// posting lists are already sorted, since path offsets are allocated
+		// monotonically, blocks within a file are indexed in order, and we
+		// only ever append to the end of posting lists
+		for (uint32_t j = 1; j < postinglen; ++j) assert(postings[j-1] < postings[j]);
+		write_le64s(&entry[4 + key_size], postings, postinglen);
+	}
+}
+
+// Encodes the next batch into its slot of the window, which the lock must be held for
+// (and the slot must be free). Releases the lock meanwhile.
+static void encode_next_batch(SaveBatches *save, uint64_t **gathered, uint64_t **scratch)
+{
+	const size_t batch = save->next++;
+	const size_t slot = batch % stbds_arrlenu(save->ready);
+	uint8_t *bytes = save->encoded[slot];
+	pthread_mutex_unlock(&save->lock);
+	encode_batch(save, batch, &bytes, gathered, scratch);
+	pthread_mutex_lock(&save->lock);
+	save->encoded[slot] = bytes;
+	save->ready[slot] = true;
+	pthread_cond_broadcast(&save->changed);
+}
+
+static void *save_thread(void *arg)
+{
+	SaveBatches *save = arg;
+	uint64_t *gathered = NULL;
+	uint64_t *scratch = NULL;
+	pthread_mutex_lock(&save->lock);
+	while (save->next < save->batches) {
+		if (save->next >= save->written + stbds_arrlenu(save->ready)) {
+			pthread_cond_wait(&save->changed, &save->lock);
+			continue;
+		}
+		encode_next_batch(save, &gathered, &scratch);
 	}
-	return cmpresult;
+	pthread_mutex_unlock(&save->lock);
+	stbds_arrfree(gathered);
+	stbds_arrfree(scratch);
+	return NULL;
 }
 
-static inline size_t write_le(FILE *file, uint64_t value, size_t size)
+// Writes every batch before `end`, encoding them too whenever no other thread has yet,
+// and returns their bytes.
+static size_t write_batches(SaveBatches *save, size_t end, IndexWriter *writer, uint64_t **gathered, uint64_t **scratch)
 {
-	uint8_t buffer[sizeof(uintmax_t)];
-	assert(size <= sizeof(buffer));
-	for (size_t i = 0; i < size; ++i) {
-		buffer[i] = (value >> (i*8)) & 0xff;
+	size_t bytes = 0;
+	pthread_mutex_lock(&save->lock);
+	while (save->written < end) {
+		const size_t slot = save->written % stbds_arrlenu(save->ready);
+		if (!save->ready[slot]) {
+			if (save->next == save->written) encode_next_batch(save, gathered, scratch);
+			else pthread_cond_wait(&save->changed, &save->lock);
+			continue;
+		}
+		const uint8_t *encoded = save->encoded[slot];
+		pthread_mutex_unlock(&save->lock);
+		writer_put(writer, encoded, stbds_arrlenu(encoded));
+		bytes += stbds_arrlenu(encoded);
+		pthread_mutex_lock(&save->lock);
+		save->ready[slot] = false;
+		save->written += 1;
+		pthread_cond_broadcast(&save->changed);
 	}
-	return fwrite(buffer, 1, size, file);
+	pthread_mutex_unlock(&save->lock);
+	return bytes;
 }
 
-int64_t index_save(struct Index index, FILE *outfile)
+int64_t index_save(struct Index index, FILE *outfile, struct IndexSaveOptions options)
 {
+	IndexWriter writer = { .file = outfile };
 	int64_t expected_bytes = 0;
-	int64_t written_bytes = 0;
 
 	const unsigned char magic[] = {
 		'\xFF', // non-ascii byte to avoid confusion with a text file
 		'B', 'U', 'S', 'K', // make it read nicely in a hex dump
-		'0', '1', // placeholder, may become version number in the future
+		'0', '8', // format version
 		'\x1A', // ascii "Ctrl-Z", treated as end of file in DOS
 	};
 	static_assert(sizeof(magic) == 8, "File magic should be 8 bytes");
-	const uint64_t ngrams = stbds_hmlenu(index._posting_hm);
-	const uint64_t pathslen = stbds_arrlenu(index._path_arr);
+	assert(memcmp(magic, INDEX_MAGIC, 8) == 0);
+	const IndexHeader header = {
+		.pathslen = stbds_arrlenu(index._path_arr),
+		.ngrams = stbds_hmlenu(index._posting_hm),
+		.sparse_max = index.options.sparse_grams ? INDEX_SPARSE_MAX : 0,
+		.sparse_grams = stbds_hmlenu(index._sparse_hm),
+		.block_size = index.options.block_size,
+		.docs = stbds_arrlenu(index._doc_arr),
+		.aliases = stbds_arrlenu(index._alias_arr),
+		.stats = stbds_arrlenu(index._stat_of),
+		.ngram_size = ngram_size(&index.options),
+	};
+	const uint64_t ngrams = header.ngrams;
+	const uint64_t pathslen = header.pathslen;
+	const uint64_t sparse_grams = header.sparse_grams;
+	const uint64_t docs = header.docs;
+	const uint64_t aliases = header.aliases;
+	const uint64_t stats = header.stats;
 
 	// header
-	written_bytes += fwrite(magic, 1, 8, outfile);
-	written_bytes += write_le(outfile, pathslen, sizeof(uint64_t));
-	written_bytes += write_le(outfile, ngrams, sizeof(uint64_t));
-	expected_bytes += 8 * 3;
+	uint8_t header_bytes[INDEX_HEADER_SIZE];
+	header_encode(header, header_bytes);
+	writer_put(&writer, header_bytes, sizeof(header_bytes));
+	writer_end_section(&writer);
+	expected_bytes += INDEX_HEADER_SIZE;
 
 	// paths
 	for (uint64_t offset = 0; offset < pathslen;) {
 		const IndexPathEntry *entry = (IndexPathEntry*)&index._path_arr[offset];
-		written_bytes += write_le(outfile, entry->allocation_size, sizeof(uint16_t));
-		written_bytes += write_le(outfile, entry->offset_to_prefix, sizeof(uint16_t));
-		written_bytes += write_le(outfile, entry->prefix_length, sizeof(uint16_t));
-		written_bytes += write_le(outfile, entry->suffix_length, sizeof(uint16_t));
+		uint8_t *bytes = writer_reserve(&writer, entry->allocation_size);
+		write_le16(&bytes[0], entry->allocation_size);
+		write_le16(&bytes[2], entry->offset_to_prefix);
+		write_le16(&bytes[4], entry->prefix_length);
+		write_le16(&bytes[6], entry->suffix_length);
 		const size_t fam_size = entry->allocation_size - sizeof(IndexPathEntry);
-		written_bytes += fwrite(entry->suffix_bytes, 1, fam_size, outfile);
+		memcpy(&bytes[sizeof(IndexPathEntry)], entry->suffix_bytes, fam_size);
 		offset += entry->allocation_size;
 	}
+	writer_end_section(&writer);
 	expected_bytes += pathslen;
 
-	// sort ngrams to get consistent serialization output
-	IndexPostingMapping *postingmap_sorted = NULL;
-	stbds_arrsetlen(postingmap_sorted, ngrams);
-	memcpy(postingmap_sorted, index._posting_hm, sizeof(IndexPostingMapping) * ngrams);
-	qsort(postingmap_sorted, ngrams, sizeof(IndexPostingMapping), postingmap_cmp);
-
-	for (uint64_t i = 0; i < ngrams; ++i) {
-		const NGram ngram = postingmap_sorted[i].key;
-		const uint64_t *postings = postingmap_sorted[i].value;
+	// documents
+	writer_le64s(&writer, index._doc_arr, docs);
+	writer_end_section(&writer);
+	expected_bytes += docs * 8;
 
-		const uint32_t postinglen = stbds_arrlenu(postings);
-		written_bytes += write_le(outfile, postinglen, sizeof(uint32_t));
-		written_bytes += fwrite((char*)&ngram, 1, sizeof(ngram), outfile);
+	// aliases, sorted by original so they can be looked up after loading
+	AliasPair *alias_pairs = NULL;
+	stbds_arrsetlen(alias_pairs, aliases);
+	for (uint64_t i = 0; i < aliases; ++i) {
+		alias_pairs[i] = (AliasPair){ .original = index._alias_of[i], .alias = index._alias_arr[i] };
+	}
+	if (aliases > 0) qsort(alias_pairs, aliases, sizeof(AliasPair), aliaspair_cmp);
+	static_assert(sizeof(AliasPair) == 2 * sizeof(uint64_t), "Alias pairs should be written as they are");
+	writer_le64s(&writer, (const uint64_t *)alias_pairs, aliases * 2);
+	writer_end_section(&writer);
+	expected_bytes += aliases * 16;
+	stbds_arrfree(alias_pairs);
+
+	// file stats, already sorted since paths are added in order
+	for (uint64_t i = 0; i < stats; ++i) {
+		uint8_t *bytes = writer_reserve(&writer, 24);
+		write_le64(&bytes[0], index._stat_of[i]);
+		write_le64(&bytes[8], index._stat_arr[i].size);
+		write_le64(&bytes[16], index._stat_arr[i].mtime);
+	}
+	writer_end_section(&writer);
+	expected_bytes += stats * 24;
 
-		// posting lists are already sorted, since path offsets are allocated
-		// monotonically, and we only ever append to the end of posting lists
-		for (uint32_t j = 0; j < postinglen; ++j) {
-			const uint64_t offset = postings[j];
-			assert(j == 0 || postings[j-1] < offset);
-			written_bytes += write_le(outfile, offset, sizeof(uint64_t));
-		}
+	// sort grams to get consistent serialization output (sparse grams by hash)
+	IndexPostingMapping *postingmap_sorted = NULL;
+	stbds_arrsetlen(postingmap_sorted, ngrams);
+	if (ngrams > 0) {
+		memcpy(postingmap_sorted, index._posting_hm, sizeof(IndexPostingMapping) * ngrams);
+		qsort(postingmap_sorted, ngrams, sizeof(IndexPostingMapping), postingmap_cmp);
+	}
+	IndexSparseMapping *sparsemap_sorted = NULL;
+	stbds_arrsetlen(sparsemap_sorted, sparse_grams);
+	if (sparse_grams > 0) {
+		memcpy(sparsemap_sorted, index._sparse_hm, sizeof(IndexSparseMapping) * sparse_grams);
+		qsort(sparsemap_sorted, sparse_grams, sizeof(IndexSparseMapping), sparsemap_cmp);
+	}
 
-		expected_bytes += 4 + sizeof(ngram) + postinglen*8;
+	// then encode their entries in parallel, writing each section in order
+	const size_t ngram_batches = (ngrams + INDEX_SAVE_BATCH - 1) / INDEX_SAVE_BATCH;
+	SaveBatches save = {
+		.index = &index,
+		.ngrams = postingmap_sorted,
+		.nngrams = ngrams,
+		.sparse = sparsemap_sorted,
+		.nsparse = sparse_grams,
+		.ngram_batches = ngram_batches,
+		.batches = ngram_batches + (sparse_grams + INDEX_SAVE_BATCH - 1) / INDEX_SAVE_BATCH,
+	};
+	pthread_mutex_init(&save.lock, NULL);
+	pthread_cond_init(&save.changed, NULL);
+	size_t workers = options.threads;
+	if (workers + 1 > save.batches) workers = save.batches > 0 ? save.batches - 1 : 0;
+	const size_t window = 2 * (workers + 1);
+	for (size_t i = 0; i < window; ++i) {
+		stbds_arrpush(save.encoded, NULL);
+		stbds_arrpush(save.ready, false);
+	}
+	pthread_t *threads = NULL;
+	for (size_t i = 0; i < workers; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, save_thread, &save) != 0) break;
+		stbds_arrpush(threads, thread);
 	}
 
+	uint64_t *gathered = NULL;
+	uint64_t *scratch = NULL;
+	expected_bytes += write_batches(&save, ngram_batches, &writer, &gathered, &scratch);
+	writer_end_section(&writer);
+	expected_bytes += write_batches(&save, save.batches, &writer, &gathered, &scratch);
+	writer_end_section(&writer);
+
+	for (size_t i = 0; i < stbds_arrlenu(threads); ++i) pthread_join(threads[i], NULL);
+	stbds_arrfree(threads);
+	for (size_t i = 0; i < window; ++i) stbds_arrfree(save.encoded[i]);
+	stbds_arrfree(save.encoded);
+	stbds_arrfree(save.ready);
+	pthread_cond_destroy(&save.changed);
+	pthread_mutex_destroy(&save.lock);
 	stbds_arrfree(postingmap_sorted);
+	stbds_arrfree(sparsemap_sorted);
+	stbds_arrfree(gathered);
+	stbds_arrfree(scratch);
+
+	writer_finish(&writer);
+	expected_bytes += INDEX_CHECKSUMS * 8;
 
-	const int64_t error = written_bytes - expected_bytes;
-	return error ? error : written_bytes;
+	const int64_t error = writer.written - expected_bytes;
+	return error ? error : writer.written;
 }
 
 static int offset_cmp(const void *a, const void *b)
@@ -171,25 +889,133 @@ static int offset_cmp(const void *a, const void *b)
 	else return 0;
 }
 
-static inline uint16_t read_le16(const uint8_t *bytes) {
-	uint16_t value = 0;
-	for (int i = 0; i < 2; ++i) value |= ((uint16_t)bytes[i] & 0xff) << (i*8);
-	return value;
+// Reads bytes of a section, adding them to its checksum.
+static bool read_hashed(FILE *file, void *bytes, size_t length, ContentHasher *hasher)
+{
+	if (length > 0 && !fread(bytes, length, 1, file)) return false;
+	content_hash(hasher, bytes, length);
+	return true;
 }
 
-static inline uint32_t read_le32(const uint8_t *bytes) {
-	uint32_t value = 0;
-	for (int i = 0; i < 4; ++i) value |= ((uint32_t)bytes[i] & 0xff) << (i*8);
-	return value;
+// Reads a posting list (checked later, see `LoadCheck`), returning zero on success or an error code.
+static int read_postings(FILE *file, uint32_t postinglen, ContentHasher *hasher, uint64_t **postingsp)
+{
+	uint64_t *postings = NULL;
+	stbds_arrsetlen(postings, postinglen);
+	if (stbds_arrlenu(postings) != postinglen) {
+		stbds_arrfree(postings);
+		return 5;
+	}
+
+	// read as a whole, then converted in place (which is a no-op on LE hosts)
+	if (!read_hashed(file, postings, (size_t)postinglen * sizeof(uint64_t), hasher)) {
+		stbds_arrfree(postings);
+		return -5;
+	}
+	for (uint32_t i = 0; i < postinglen; ++i) postings[i] = read_le64((const uint8_t *)&postings[i]);
+
+	*postingsp = postings;
+	return 0;
 }
 
-static inline uint64_t read_le64(const uint8_t *bytes) {
-	uint64_t value = 0;
-	for (int i = 0; i < 8; ++i) value |= ((uint64_t)bytes[i] & 0xff) << (i*8);
-	return value;
+// gram entries whose postings are checked by the same thread at once
+#define INDEX_CHECK_BATCH 1024
+
+// Structural checks of the postings of a loaded index, which every posting must pass
+// before it can be dereferenced. They're split into items, which any number of threads
+// take in turn: documents, aliases and stats first, then batches of gram entries.
+typedef struct {
+	const uint64_t *valid_paths; // bitset of the offsets where path entries start
+	uint64_t pathslen;
+	bool split_files;
+	const uint64_t *documents;
+	const uint64_t *alias_of;
+	const uint64_t *alias_arr;
+	const uint64_t *stat_of;
+	const IndexPostingMapping *postingsmap;
+	const IndexSparseMapping *sparsemap;
+	size_t ngram_batches;
+	size_t items;
+	size_t next; // item to be taken next, atomically
+	int error; // first one found, atomically
+} LoadCheck;
+
+static inline bool valid_path(const LoadCheck *check, uint64_t posting)
+{
+	const uint64_t offset = posting_path(posting);
+	return offset < check->pathslen && (check->valid_paths[offset / 64] >> (offset % 64) & 1);
+}
+
+// Postings must point to valid entries, be sorted and unique, and only split files have blocks.
+static bool valid_postings(const LoadCheck *check, const uint64_t *postings, size_t length)
+{
+	for (size_t i = 0; i < length; ++i) {
+		if (
+			!valid_path(check, postings[i])
+			|| (i > 0 && postings[i] <= postings[i-1])
+			|| (!check->split_files && posting_block(postings[i]) != 0)
+		) return false;
+	}
+	return true;
+}
+
+static int check_item(const LoadCheck *check, size_t item)
+{
+	if (item == 0) {
+		return valid_postings(check, check->documents, stbds_arrlenu(check->documents)) ? 0 : 5;
+	} else if (item == 1) {
+		// sorted, unique, and pointing to whole files
+		for (size_t i = 0; i < stbds_arrlenu(check->alias_of); ++i) {
+			const AliasPair pair = { .original = check->alias_of[i], .alias = check->alias_arr[i] };
+			const AliasPair previous = { .original = i > 0 ? check->alias_of[i-1] : 0, .alias = i > 0 ? check->alias_arr[i-1] : 0 };
+			if (
+				posting_block(pair.original) != 0 || posting_block(pair.alias) != 0
+				|| (i > 0 && aliaspair_cmp(&previous, &pair) >= 0)
+				|| !valid_path(check, pair.original) || !valid_path(check, pair.alias)
+			) return 8;
+		}
+		return 0;
+	} else if (item == 2) {
+		for (size_t i = 0; i < stbds_arrlenu(check->stat_of); ++i) {
+			const uint64_t posting = check->stat_of[i];
+			if (posting_block(posting) != 0 || (i > 0 && posting <= check->stat_of[i-1]) || !valid_path(check, posting)) return 9;
+		}
+		return 0;
+	} else if (item < 3 + check->ngram_batches) {
+		const size_t first = (item - 3) * INDEX_CHECK_BATCH;
+		const size_t last = first + INDEX_CHECK_BATCH < stbds_hmlenu(check->postingsmap) ? first + INDEX_CHECK_BATCH : stbds_hmlenu(check->postingsmap);
+		for (size_t i = first; i < last; ++i) {
+			const uint64_t *postings = check->postingsmap[i].value;
+			if (!valid_postings(check, postings, stbds_arrlenu(postings))) return 5;
+		}
+		return 0;
+	} else {
+		const size_t first = (item - 3 - check->ngram_batches) * INDEX_CHECK_BATCH;
+		const size_t last = first + INDEX_CHECK_BATCH < stbds_hmlenu(check->sparsemap) ? first + INDEX_CHECK_BATCH : stbds_hmlenu(check->sparsemap);
+		for (size_t i = first; i < last; ++i) {
+			const uint64_t *postings = check->sparsemap[i].value;
+			if (!valid_postings(check, postings, stbds_arrlenu(postings))) return 6;
+		}
+		return 0;
+	}
+}
+
+static void *check_items(void *arg)
+{
+	LoadCheck *check = arg;
+	while (__atomic_load_n(&check->error, __ATOMIC_RELAXED) == 0) {
+		const size_t item = __atomic_fetch_add(&check->next, 1, __ATOMIC_RELAXED);
+		if (item >= check->items) break;
+		int error = check_item(check, item);
+		if (error) {
+			int none = 0;
+			__atomic_compare_exchange_n(&check->error, &none, error, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+	return NULL;
 }
 
-int index_load(struct Index *index, FILE *file)
+int index_load(struct Index *index, FILE *file, struct IndexLoadOptions options)
 {
 	// return zero: OK
 	// return negative: not enough data aka unexpected EOF
@@ -197,17 +1023,51 @@ int index_load(struct Index *index, FILE *file)
 
 	// TODO: optimize for read-only index (mmap)
 
-	uint8_t file_header[8 * 3] = {0};
-	if (!fread(file_header, sizeof(file_header), 1, file)) return -3;
+	// every section is checksummed as it's read, so that a corrupt file is always
+	// rejected, while structural checks of its postings are done at the end
+	ContentHasher hashers[INDEX_CHECKSUMS] = {0};
+	ContentHasher *hasher = hashers;
+
+	uint8_t file_header[INDEX_HEADER_SIZE] = {0};
+	if (!read_hashed(file, file_header, sizeof(file_header), hasher)) return -3;
 
-	if (memcmp(&file_header[0], "\xFF""BUSK01\x1A", 8) != 0) return 1;
+	if (memcmp(&file_header[0], INDEX_MAGIC, 8) != 0) return 1;
 
-	const uint64_t pathslen = read_le64(&file_header[8]);
-	const uint64_t ngrams = read_le64(&file_header[16]);
+	const IndexHeader header = header_decode(file_header);
+	const uint64_t pathslen = header.pathslen;
+	const uint64_t ngrams = header.ngrams;
+	const uint64_t sparse_max = header.sparse_max;
+	const uint64_t sparse_grams = header.sparse_grams;
+	const uint64_t block_size = header.block_size;
+	const uint64_t docs = header.docs;
+	const uint64_t aliases = header.aliases;
+	const uint64_t stats = header.stats;
+	const uint64_t n = header.ngram_size;
+
+	// ngrams must fit in the packed keys we use
+	if (n < INDEX_NGRAM_MIN || n > INDEX_NGRAM_MAX) return 10;
+
+	// path offsets must fit in a posting, next to the block number
+	if (pathslen > INDEX_PATHS_MAX) return 2;
+
+	// sparse grams must have been generated with the same parameters we use
+	if (sparse_max != 0 && sparse_max != INDEX_SPARSE_MAX) return 6;
+	if (sparse_max == 0 && sparse_grams != 0) return 6;
+
+	// every posting list is a subset of documents, so their length must fit
+	if (docs >= INDEX_COMPLEMENT_BIT) return 7;
 
 	uint8_t *paths = NULL;
-	uint64_t *valid_offsets = NULL;
+	uint64_t *valid_paths = NULL;
+	uint64_t *documents = NULL;
+	uint64_t *alias_of = NULL;
+	uint64_t *alias_arr = NULL;
+	uint64_t *stat_of = NULL;
+	struct IndexFileStat *stat_arr = NULL;
 	IndexPostingMapping *postingsmap = NULL;
+	IndexSparseMapping *sparsemap = NULL;
+	uint8_t *entries = NULL; // raw aliases or stats
+	pthread_t *threads = NULL;
 
 	int error = 0;
 
@@ -217,9 +1077,18 @@ int index_load(struct Index *index, FILE *file)
 		error = 2;
 		goto cleanup;
 	}
+	if (!options.trusted) {
+		stbds_arrsetlen(valid_paths, (pathslen + 63) / 64);
+		if (pathslen > 0) memset(valid_paths, 0, stbds_arrlenu(valid_paths) * sizeof(uint64_t));
+	}
 
-	// parse paths
+	// read paths as a whole, then parse them in place
+	if (!read_hashed(file, paths, pathslen, ++hasher)) {
+		error = -4;
+		goto cleanup;
+	}
 	uint64_t last_path_added = 0;
+	uint64_t total_paths = 0;
 	for (uint64_t offset = 0; offset < pathslen;) {
 		// make sure we can fit an entry in the buffer before casting
 		if (offset + sizeof(IndexPathEntry) >= pathslen) {
@@ -228,12 +1097,8 @@ int index_load(struct Index *index, FILE *file)
 		}
 		IndexPathEntry *entry = (IndexPathEntry*)&paths[offset];
 
-		// then read the header
-		uint8_t entry_header[sizeof(IndexPathEntry)] = {0};
-		if (!fread(entry_header, sizeof(entry_header), 1, file)) {
-			error = -4;
-			goto cleanup;
-		}
+		// then convert its header, field by field
+		const uint8_t *entry_header = &paths[offset];
 		entry->allocation_size = read_le16(&entry_header[0]);
 		entry->offset_to_prefix = read_le16(&entry_header[2]);
 		entry->prefix_length = read_le16(&entry_header[4]);
@@ -258,130 +1123,784 @@ int index_load(struct Index *index, FILE *file)
 			goto cleanup;
 		}
 
-		const size_t fam_size = entry->allocation_size - sizeof(IndexPathEntry);
-		if (!fread(entry->suffix_bytes, fam_size, 1, file)) {
-			error = -4;
-			goto cleanup;
-		}
-
 		// validation: strlen on the suffix should match suffix_length
+		const size_t fam_size = entry->allocation_size - sizeof(IndexPathEntry);
 		const size_t len = strnlen(entry->suffix_bytes, fam_size);
 		if (entry->suffix_length != len) {
 			error = 4;
 			goto cleanup;
 		}
 
-		stbds_arrpush(valid_offsets, offset);
+		if (valid_paths) valid_paths[offset / 64] |= UINT64_C(1) << (offset % 64);
 		last_path_added = offset;
+		++total_paths;
 		offset += entry->allocation_size;
 	}
 
-	const size_t total_paths = stbds_arrlenu(valid_offsets);
+	// parse documents
+	error = read_postings(file, docs, ++hasher, &documents);
+	if (error) goto cleanup;
+
+	// parse aliases
+	if (aliases > total_paths) {
+		error = 8;
+		goto cleanup;
+	}
+	stbds_arrsetlen(entries, aliases * 16);
+	if (!read_hashed(file, entries, aliases * 16, ++hasher)) {
+		error = -8;
+		goto cleanup;
+	}
+	for (uint64_t i = 0; i < aliases; ++i) {
+		stbds_arrpush(alias_of, read_le64(&entries[i*16]));
+		stbds_arrpush(alias_arr, read_le64(&entries[i*16 + 8]));
+	}
+
+	// parse file stats
+	if (stats > total_paths) {
+		error = 9;
+		goto cleanup;
+	}
+	stbds_arrsetlen(entries, stats * 24);
+	if (!read_hashed(file, entries, stats * 24, ++hasher)) {
+		error = -9;
+		goto cleanup;
+	}
+	for (uint64_t i = 0; i < stats; ++i) {
+		const struct IndexFileStat stat = {
+			.size = read_le64(&entries[i*24 + 8]),
+			.mtime = (int64_t)read_le64(&entries[i*24 + 16]),
+		};
+		stbds_arrpush(stat_of, read_le64(&entries[i*24]));
+		stbds_arrpush(stat_arr, stat);
+	}
 
 	// parse ngrams
+	++hasher;
 	for (uint64_t i = 0; i < ngrams; ++i) {
-		uint8_t ngram_header[4 + sizeof(NGram)] = {0};
-		if (!fread(ngram_header, sizeof(ngram_header), 1, file)) {
+		uint8_t ngram_header[4 + INDEX_NGRAM_MAX] = {0};
+		if (!read_hashed(file, ngram_header, 4 + ngram_stride(n), hasher)) {
 			error = -3;
 			goto cleanup;
 		}
 
-		uint32_t postinglen = read_le32(ngram_header);
+		const uint32_t lenword = read_le32(ngram_header);
+		const uint32_t postinglen = lenword & ~INDEX_COMPLEMENT_BIT;
+		const bool complement = lenword & INDEX_COMPLEMENT_BIT;
 
-		NGram ngram = {0};
-		memcpy(ngram.bytes, &ngram_header[4], INDEX_NGRAM_SIZE);
+		const NGram ngram = ngram_pack(&ngram_header[4], n);
 
-		// validation: we shouldn't see an ngram twice
-		if (stbds_hmgetp_null(postingsmap, ngram)) {
+		// validation: we shouldn't see an ngram twice, and it can't have more postings than documents
+		if (stbds_hmgetp_null(postingsmap, ngram) || postinglen > docs) {
 			error = 5;
 			goto cleanup;
 		}
 
-		uint64_t *postings = NULL;
-		stbds_arrsetlen(postings, postinglen);
-		if (stbds_arrlenu(postings) != postinglen) {
-			stbds_arrfree(postings);
-			error = 5;
-			goto cleanup;
+		uint64_t *postings = NULL;
+		error = read_postings(file, postinglen, hasher, &postings);
+		if (error) goto cleanup;
+
+		stbds_hmputs(postingsmap, ((IndexPostingMapping){ .key = ngram, .value = postings, .complement = complement }));
+	}
+
+	// parse sparse grams
+	++hasher;
+	for (uint64_t i = 0; i < sparse_grams; ++i) {
+		uint8_t sparse_header[4 + 8] = {0};
+		if (!read_hashed(file, sparse_header, sizeof(sparse_header), hasher)) {
+			error = -6;
+			goto cleanup;
+		}
+
+		const uint32_t lenword = read_le32(sparse_header);
+		const uint32_t postinglen = lenword & ~INDEX_COMPLEMENT_BIT;
+		const bool complement = lenword & INDEX_COMPLEMENT_BIT;
+		const uint64_t hash = read_le64(&sparse_header[4]);
+
+		// validation: same as ngrams
+		if (stbds_hmgetp_null(sparsemap, hash) || postinglen > docs) {
+			error = 6;
+			goto cleanup;
+		}
+
+		uint64_t *postings = NULL;
+		error = read_postings(file, postinglen, hasher, &postings);
+		if (error) goto cleanup;
+
+		stbds_hmputs(sparsemap, ((IndexSparseMapping){ .key = hash, .value = postings, .complement = complement }));
+	}
+
+	// validation: every section must match its checksum
+	uint8_t checksums[INDEX_CHECKSUMS * 8] = {0};
+	if (!fread(checksums, sizeof(checksums), 1, file)) {
+		error = -11;
+		goto cleanup;
+	}
+	for (size_t i = 0; i < INDEX_CHECKSUMS; ++i) {
+		if (read_le64(&checksums[i*8]) != content_digest(&hashers[i]).hash) {
+			error = 11;
+			goto cleanup;
+		}
+	}
+
+	// validation: postings must point to valid path entries (which we have parsed above),
+	// unless the index is trusted, in which case the checksums are deemed enough
+	if (!options.trusted) {
+		const size_t ngram_batches = (stbds_hmlenu(postingsmap) + INDEX_CHECK_BATCH - 1) / INDEX_CHECK_BATCH;
+		const size_t sparse_batches = (stbds_hmlenu(sparsemap) + INDEX_CHECK_BATCH - 1) / INDEX_CHECK_BATCH;
+		LoadCheck check = {
+			.valid_paths = valid_paths,
+			.pathslen = pathslen,
+			.split_files = block_size > 0,
+			.documents = documents,
+			.alias_of = alias_of,
+			.alias_arr = alias_arr,
+			.stat_of = stat_of,
+			.postingsmap = postingsmap,
+			.sparsemap = sparsemap,
+			.ngram_batches = ngram_batches,
+			.items = 3 + ngram_batches + sparse_batches,
+		};
+		for (size_t i = 0; i < options.threads && i + 1 < check.items; ++i) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, check_items, &check) != 0) break;
+			stbds_arrpush(threads, thread);
+		}
+		check_items(&check);
+		for (size_t i = 0; i < stbds_arrlenu(threads); ++i) pthread_join(threads[i], NULL);
+		error = check.error;
+	}
+
+cleanup:
+	if (error) {
+		for (size_t i = 0; i < stbds_hmlenu(postingsmap); ++i) {
+			uint64_t *postings = postingsmap[i].value;
+			stbds_arrfree(postings);
+		}
+		stbds_hmfree(postingsmap);
+		for (size_t i = 0; i < stbds_hmlenu(sparsemap); ++i) {
+			uint64_t *postings = sparsemap[i].value;
+			stbds_arrfree(postings);
+		}
+		stbds_hmfree(sparsemap);
+		stbds_arrfree(documents);
+		stbds_arrfree(alias_of);
+		stbds_arrfree(alias_arr);
+		stbds_arrfree(stat_of);
+		stbds_arrfree(stat_arr);
+		stbds_arrfree(paths);
+	} else {
+		*index = (struct Index){
+			.options = { .sparse_grams = sparse_max != 0, .block_size = block_size, .ngram_size = n },
+			._path_arr = paths,
+			._posting_hm = postingsmap,
+			._sparse_hm = sparsemap,
+			._doc_arr = documents,
+			._alias_of = alias_of,
+			._alias_arr = alias_arr,
+			._stat_of = stat_of,
+			._stat_arr = stat_arr,
+			._last_path_added = last_path_added,
+		};
+	}
+
+	stbds_arrfree(valid_paths);
+	stbds_arrfree(entries);
+	stbds_arrfree(threads);
+
+	return error;
+}
+
+
+// Input of `index_merge()`, whose gram entries are read one at a time.
+typedef struct {
+	FILE *file;
+	uint64_t pathslen;
+	uint64_t ngrams;
+	uint64_t sparse_max;
+	uint64_t sparse_grams;
+	uint64_t block_size;
+	uint64_t docs;
+	uint64_t aliases;
+	uint64_t stats;
+	uint64_t ngram_size;
+	uint64_t base; // added to each of its postings, i.e. offset of its paths (shifted)
+	uint64_t *documents; // not rebased, to expand complemented posting lists
+	uint64_t *dropped; // sorted path offsets rejected by the filter, if any
+	AliasPair *renamed; // dropped paths (sorted) whose files are kept under an alias
+	uint64_t remaining; // entries after the current one, in the current section
+	bool has_entry; // whether the header of an entry was read, but not its postings
+	uint8_t key[8]; // ngram bytes, or LE hash of the sparse gram
+	uint32_t postinglen;
+	bool complement;
+} MergeInput;
+
+// Orders the keys of two entries, which are either ngram bytes (in lexicographic order)
+// or the LE hashes of sparse grams (in numeric order), even when both take 8 bytes.
+static int merge_key_cmp(const uint8_t *lhs, const uint8_t *rhs, size_t key_size, bool hashed)
+{
+	if (!hashed) return memcmp(lhs, rhs, key_size);
+	return (read_le64(lhs) > read_le64(rhs)) - (read_le64(lhs) < read_le64(rhs));
+}
+
+// Reads the header of the next gram entry in the current section, if any.
+static int merge_next_entry(MergeInput *input, size_t key_size, bool hashed)
+{
+	if (input->remaining == 0) {
+		input->has_entry = false;
+		return 0;
+	}
+	input->remaining--;
+
+	uint8_t header[4 + 8] = {0};
+	if (!fread(header, 4 + key_size, 1, input->file)) return -EIO;
+	const uint32_t lenword = read_le32(header);
+	uint8_t key[8] = {0};
+	memcpy(key, &header[4], key_size);
+
+	// keys must be strictly increasing, as written by `index_save()`
+	if (input->has_entry && merge_key_cmp(key, input->key, key_size, hashed) <= 0) return -EINVAL;
+
+	memcpy(input->key, key, sizeof(key));
+	input->postinglen = lenword & ~INDEX_COMPLEMENT_BIT;
+	input->complement = lenword & INDEX_COMPLEMENT_BIT;
+	input->has_entry = true;
+	if (input->postinglen > input->docs) return -EINVAL;
+	return 0;
+}
+
+static bool merge_dropped(const MergeInput *input, uint64_t posting)
+{
+	const uint64_t offset = posting_path(posting);
+	const size_t ndropped = stbds_arrlenu(input->dropped);
+	return ndropped > 0 && bsearch(&offset, input->dropped, ndropped, sizeof(offset), offset_cmp) != NULL;
+}
+
+// Moves a posting to the path taking the place of its own, if it was renamed.
+static uint64_t merge_rename(const MergeInput *input, uint64_t posting)
+{
+	const size_t nrenamed = stbds_arrlenu(input->renamed);
+	if (nrenamed == 0) return posting;
+	const AliasPair key = { .original = posting_make(posting_path(posting), 0) };
+	const AliasPair *found = bsearch(&key, input->renamed, nrenamed, sizeof(AliasPair), aliaspair_original_cmp);
+	if (!found) return posting;
+	return posting_make(posting_path(found->alias), posting_block(posting));
+}
+
+static void merge_posting(const MergeInput *input, uint64_t posting, uint64_t **merged)
+{
+	posting = merge_rename(input, posting);
+	if (!merge_dropped(input, posting)) stbds_arrpush(*merged, posting + input->base);
+}
+
+// Reads the postings of the current entry, then appends them (rebased) to `merged`.
+static int merge_postings(MergeInput *input, uint64_t **merged)
+{
+	const size_t first = stbds_arrlenu(*merged);
+	size_t next_doc = 0;
+	uint64_t previous = 0;
+	for (uint32_t i = 0; i < input->postinglen; ++i) {
+		uint8_t leu64[8] = {0};
+		if (!fread(leu64, sizeof(leu64), 1, input->file)) return -EIO;
+		const uint64_t posting = read_le64(leu64);
+		if (posting_path(posting) >= input->pathslen || (i > 0 && posting <= previous)) return -EINVAL;
+		previous = posting;
+
+		if (!input->complement) {
+			merge_posting(input, posting, merged);
+			continue;
+		}
+		// every document up to this exception is in the set
+		for (; next_doc < input->docs && input->documents[next_doc] < posting; ++next_doc) {
+			merge_posting(input, input->documents[next_doc], merged);
+		}
+		if (next_doc < input->docs && input->documents[next_doc] == posting) ++next_doc;
+	}
+	if (input->complement) {
+		for (; next_doc < input->docs; ++next_doc) merge_posting(input, input->documents[next_doc], merged);
+	}
+
+	// renamed files might need to move further down the list
+	if (stbds_arrlenu(input->renamed) > 0) {
+		qsort(&(*merged)[first], stbds_arrlenu(*merged) - first, sizeof(uint64_t), offset_cmp);
+	}
+	return 0;
+}
+
+// Merges the current section (ngrams or sparse grams) of every input, returning
+// the number of entries written, or a negative error code.
+static int64_t merge_section(
+	MergeInput *inputs, size_t ninputs, size_t key_size, bool hashed,
+	const uint64_t *docs, IndexWriter *writer
+) {
+	int64_t entries = 0;
+	uint64_t *merged = NULL;
+	uint64_t *scratch = NULL;
+	int error = 0;
+
+	for (size_t i = 0; i < ninputs && !error; ++i) error = merge_next_entry(&inputs[i], key_size, hashed);
+
+	while (!error) {
+		// the smallest key among all inputs goes next
+		const MergeInput *next = NULL;
+		for (size_t i = 0; i < ninputs; ++i) {
+			if (!inputs[i].has_entry) continue;
+			if (!next || merge_key_cmp(inputs[i].key, next->key, key_size, hashed) < 0) next = &inputs[i];
+		}
+		if (!next) break;
+		uint8_t key[8];
+		memcpy(key, next->key, sizeof(key));
+
+		// inputs are in order of their bases, so concatenating their lists keeps them sorted
+		stbds_arrsetlen(merged, 0);
+		for (size_t i = 0; i < ninputs && !error; ++i) {
+			if (!inputs[i].has_entry || memcmp(inputs[i].key, key, key_size) != 0) continue;
+			error = merge_postings(&inputs[i], &merged);
+			if (!error) error = merge_next_entry(&inputs[i], key_size, hashed);
+		}
+		if (error) break;
+		if (stbds_arrlenu(merged) == 0) continue; // every file with this gram was dropped
+
+		bool complement = false;
+		const uint64_t *postings = encode_postings(merged, &complement, docs, &scratch);
+		const uint32_t postinglen = stbds_arrlenu(postings);
+		const uint32_t lenword = complement ? postinglen | INDEX_COMPLEMENT_BIT : postinglen;
+		const int64_t written = writer->written;
+		writer_le(writer, lenword, sizeof(uint32_t));
+		writer_put(writer, key, key_size);
+		writer_le64s(writer, postings, postinglen);
+		if (writer->written - written != 4 + (int64_t)key_size + (int64_t)postinglen * 8) error = -EIO;
+		++entries;
+	}
+
+	stbds_arrfree(merged);
+	stbds_arrfree(scratch);
+	return error ? error : entries;
+}
+
+int64_t index_merge(FILE **infiles, size_t ninputs, IndexMergeFilter filter, void *context, FILE *outfile)
+{
+	MergeInput *inputs = calloc(ninputs, sizeof(MergeInput));
+	if (!inputs) return -ENOMEM;
+	uint64_t *docs = NULL;
+	AliasPair *alias_pairs = NULL;
+	char *path = NULL;
+	IndexWriter writer = { .file = outfile, .sections = 1 }; // header is checksummed at the end
+	int64_t error = 0;
+
+	// headers must be compatible, and the merged paths must still fit in postings
+	uint64_t pathslen = 0, ndocs = 0, block_size = 0, ngram_size = 0;
+	bool sparse_grams = true;
+	for (size_t i = 0; i < ninputs; ++i) {
+		MergeInput *input = &inputs[i];
+		input->file = infiles[i];
+		uint8_t file_header[INDEX_HEADER_SIZE] = {0};
+		if (!fread(file_header, sizeof(file_header), 1, input->file)) {
+			error = -EIO;
+			goto cleanup;
+		}
+		if (memcmp(&file_header[0], INDEX_MAGIC, 8) != 0) {
+			error = -EINVAL;
+			goto cleanup;
+		}
+		input->pathslen = read_le64(&file_header[8]);
+		input->ngrams = read_le64(&file_header[16]);
+		input->sparse_max = read_le64(&file_header[24]);
+		input->sparse_grams = read_le64(&file_header[32]);
+		input->block_size = read_le64(&file_header[40]);
+		input->docs = read_le64(&file_header[48]);
+		input->aliases = read_le64(&file_header[56]);
+		input->stats = read_le64(&file_header[64]);
+		input->ngram_size = read_le64(&file_header[72]);
+		input->base = pathslen << INDEX_BLOCK_BITS;
+
+		if (
+			(input->sparse_max != 0 && input->sparse_max != INDEX_SPARSE_MAX)
+			|| input->ngram_size < INDEX_NGRAM_MIN || input->ngram_size > INDEX_NGRAM_MAX
+			|| (i > 0 && input->ngram_size != ngram_size) // ngrams of different sizes can't be merged
+			|| (block_size != 0 && input->block_size != 0 && input->block_size != block_size)
+			|| input->pathslen > INDEX_PATHS_MAX - pathslen
+		) {
+			error = -EINVAL;
+			goto cleanup;
+		}
+		pathslen += input->pathslen;
+		ndocs += input->docs;
+		ngram_size = input->ngram_size;
+		if (input->block_size != 0) block_size = input->block_size;
+		// without sparse grams for every file, queries would miss some of them
+		if (input->sparse_max == 0) sparse_grams = false;
+	}
+	if (ndocs >= INDEX_COMPLEMENT_BIT) {
+		error = -EINVAL;
+		goto cleanup;
+	}
+
+	// header, where counts (and so its checksum) are only known at the end
+	const off_t header_offset = ftello(outfile);
+	IndexHeader header = {
+		.pathslen = pathslen,
+		.sparse_max = sparse_grams ? INDEX_SPARSE_MAX : 0,
+		.block_size = block_size,
+		.ngram_size = ngram_size,
+	};
+	uint8_t header_bytes[INDEX_HEADER_SIZE];
+	header_encode(header, header_bytes);
+	writer.written += fwrite(header_bytes, 1, sizeof(header_bytes), outfile);
+	int64_t expected_bytes = INDEX_HEADER_SIZE;
+
+	// paths are concatenated as is, since prefixes are relative to each entry,
+	// but we still decode them (each from the previous one) for the filter
+	for (size_t i = 0; i < ninputs; ++i) {
+		MergeInput *input = &inputs[i];
+		stbds_arrsetlen(path, 0);
+		for (uint64_t offset = 0; offset < input->pathslen;) {
+			uint8_t entry_header[sizeof(IndexPathEntry)] = {0};
+			if (!fread(entry_header, sizeof(entry_header), 1, input->file)) {
+				error = -EIO;
+				goto cleanup;
+			}
+			const uint16_t allocation_size = read_le16(&entry_header[0]);
+			const uint16_t prefix_length = read_le16(&entry_header[4]);
+			const uint16_t suffix_length = read_le16(&entry_header[6]);
+			if (
+				allocation_size < sizeof(IndexPathEntry) + suffix_length
+				|| allocation_size > input->pathslen - offset
+				|| prefix_length > stbds_arrlenu(path)
+			) {
+				error = -EINVAL;
+				goto cleanup;
+			}
+			const size_t fam_size = allocation_size - sizeof(IndexPathEntry);
+			stbds_arrsetlen(path, prefix_length + fam_size);
+			if (fam_size > 0 && !fread(&path[prefix_length], fam_size, 1, input->file)) {
+				error = -EIO;
+				goto cleanup;
+			}
+			writer_put(&writer, entry_header, sizeof(entry_header));
+			writer_put(&writer, &path[prefix_length], fam_size);
+			stbds_arrsetlen(path, prefix_length + suffix_length);
+
+			if (filter && !filter(context, i, path, stbds_arrlenu(path))) stbds_arrpush(input->dropped, offset);
+			offset += allocation_size;
 		}
+	}
+	writer_end_section(&writer);
+	expected_bytes += pathslen;
 
-		for (uint32_t i = 0; i < postinglen; ++i) {
+	// documents and aliases are rebased, which keeps them sorted
+	for (size_t i = 0; i < ninputs; ++i) {
+		MergeInput *input = &inputs[i];
+		for (uint64_t j = 0; j < input->docs; ++j) {
 			uint8_t leu64[8] = {0};
-			if (!fread(leu64, sizeof(leu64), 1, file)) {
-				error = -5;
-				break;
+			if (!fread(leu64, sizeof(leu64), 1, input->file)) {
+				error = -EIO;
+				goto cleanup;
 			}
+			const uint64_t posting = read_le64(leu64);
+			if (posting_path(posting) >= input->pathslen || (j > 0 && posting <= stbds_arrlast(input->documents))) {
+				error = -EINVAL;
+				goto cleanup;
+			}
+			stbds_arrpush(input->documents, posting);
+		}
+	}
+	for (size_t i = 0; i < ninputs; ++i) {
+		MergeInput *input = &inputs[i];
+		const size_t first_pair = stbds_arrlenu(alias_pairs);
+		for (uint64_t j = 0; j < input->aliases; ++j) {
+			uint8_t alias_entry[8 + 8] = {0};
+			if (!fread(alias_entry, sizeof(alias_entry), 1, input->file)) {
+				error = -EIO;
+				goto cleanup;
+			}
+			const AliasPair pair = { .original = read_le64(&alias_entry[0]), .alias = read_le64(&alias_entry[8]) };
+			if (j > 0 && aliaspair_cmp(&pair, &stbds_arrlast(alias_pairs)) <= 0) {
+				error = -EINVAL;
+				goto cleanup;
+			}
+			stbds_arrpush(alias_pairs, pair);
+		}
 
-			uint64_t offset = read_le64(leu64);
+		// when the path a file was indexed through is dropped, but not all of its
+		// aliases, the first remaining one takes its place (pairs are sorted by original)
+		for (size_t j = first_pair; j < stbds_arrlenu(alias_pairs); ++j) {
+			const AliasPair pair = alias_pairs[j];
+			if (!merge_dropped(input, pair.original) || merge_dropped(input, pair.alias)) continue;
+			if (stbds_arrlenu(input->renamed) > 0 && stbds_arrlast(input->renamed).original == pair.original) continue;
+			stbds_arrpush(input->renamed, pair);
+		}
+		size_t kept_pairs = first_pair;
+		for (size_t j = first_pair; j < stbds_arrlenu(alias_pairs); ++j) {
+			const AliasPair pair = { .original = merge_rename(input, alias_pairs[j].original), .alias = alias_pairs[j].alias };
+			if (merge_dropped(input, pair.alias) || pair.original == pair.alias) continue;
+			alias_pairs[kept_pairs++] = (AliasPair){ .original = pair.original + input->base, .alias = pair.alias + input->base };
+		}
+		stbds_arrsetlen(alias_pairs, kept_pairs);
+		if (stbds_arrlenu(input->renamed) > 0) {
+			qsort(&alias_pairs[first_pair], kept_pairs - first_pair, sizeof(AliasPair), aliaspair_cmp);
+		}
 
-			// validation
-			if (
-				offset >= pathslen // offset must be within paths memory block
-				|| (i > 0 && offset <= postings[i-1]) // must also be sorted and unique
-				|| bsearch(&offset, valid_offsets, total_paths, sizeof(offset), offset_cmp) == NULL
-				// ^ and must point to a valid entry (which we have parsed above)
-			) {
-				error = 5;
-				break;
+		const size_t first_doc = stbds_arrlenu(docs);
+		for (uint64_t j = 0; j < input->docs; ++j) {
+			const uint64_t document = merge_rename(input, input->documents[j]);
+			if (!merge_dropped(input, document)) stbds_arrpush(docs, document + input->base);
+		}
+		if (stbds_arrlenu(input->renamed) > 0) {
+			qsort(&docs[first_doc], stbds_arrlenu(docs) - first_doc, sizeof(uint64_t), offset_cmp);
+		}
+	}
+	const uint64_t ndocs_kept = stbds_arrlenu(docs);
+	writer_le64s(&writer, docs, ndocs_kept);
+	writer_end_section(&writer);
+	expected_bytes += ndocs_kept * 8;
+	const uint64_t aliases_kept = stbds_arrlenu(alias_pairs);
+	for (uint64_t j = 0; j < aliases_kept; ++j) {
+		writer_le(&writer, alias_pairs[j].original, sizeof(uint64_t));
+		writer_le(&writer, alias_pairs[j].alias, sizeof(uint64_t));
+	}
+	writer_end_section(&writer);
+	expected_bytes += aliases_kept * 16;
+
+	// file stats stay with their own path, even when it takes the place of a dropped one
+	uint64_t stats_kept = 0;
+	for (size_t i = 0; i < ninputs; ++i) {
+		MergeInput *input = &inputs[i];
+		uint64_t previous = 0;
+		for (uint64_t j = 0; j < input->stats; ++j) {
+			uint8_t stat_entry[8 + 8 + 8] = {0};
+			if (!fread(stat_entry, sizeof(stat_entry), 1, input->file)) {
+				error = -EIO;
+				goto cleanup;
+			}
+			const uint64_t posting = read_le64(&stat_entry[0]);
+			if (posting_path(posting) >= input->pathslen || (j > 0 && posting <= previous)) {
+				error = -EINVAL;
+				goto cleanup;
 			}
+			previous = posting;
+			if (merge_dropped(input, posting)) continue;
+			writer_le(&writer, posting + input->base, sizeof(uint64_t));
+			writer_put(&writer, &stat_entry[8], 16);
+			++stats_kept;
+		}
+	}
+	writer_end_section(&writer);
+	expected_bytes += stats_kept * 24;
+	if (writer.written != expected_bytes) {
+		error = -EIO;
+		goto cleanup;
+	}
 
-			postings[i] = offset;
+	// gram entries are sorted in every input, so we merge them in a single pass
+	for (size_t i = 0; i < ninputs; ++i) inputs[i].remaining = inputs[i].ngrams;
+	const int64_t ngrams = merge_section(inputs, ninputs, ngram_stride(ngram_size), false, docs, &writer);
+	if (ngrams < 0) {
+		error = ngrams;
+		goto cleanup;
+	}
+	writer_end_section(&writer);
+	int64_t sparse_entries = 0;
+	if (sparse_grams) {
+		for (size_t i = 0; i < ninputs; ++i) {
+			inputs[i].remaining = inputs[i].sparse_grams;
+			inputs[i].has_entry = false;
 		}
-		if (error) {
-			stbds_arrfree(postings);
+		sparse_entries = merge_section(inputs, ninputs, sizeof(uint64_t), true, docs, &writer);
+		if (sparse_entries < 0) {
+			error = sparse_entries;
 			goto cleanup;
 		}
-
-		stbds_hmput(postingsmap, ngram, postings);
 	}
+	writer_end_section(&writer);
+
+	// then checksum the complete header, and go back to fill in its counts
+	header.ngrams = ngrams;
+	header.sparse_grams = sparse_entries;
+	header.docs = ndocs_kept;
+	header.aliases = aliases_kept;
+	header.stats = stats_kept;
+	header_encode(header, header_bytes);
+	ContentHasher header_hasher = {0};
+	content_hash(&header_hasher, header_bytes, sizeof(header_bytes));
+	writer.checksums[0] = content_digest(&header_hasher).hash;
+	const int64_t trailer_bytes = writer.written;
+	writer_finish(&writer);
+	const off_t end_offset = ftello(outfile);
+	if (
+		writer.written - trailer_bytes != INDEX_CHECKSUMS * 8
+		|| header_offset < 0 || end_offset < 0
+		|| fseeko(outfile, header_offset, SEEK_SET) != 0
+		|| fwrite(header_bytes, 1, sizeof(header_bytes), outfile) != sizeof(header_bytes)
+		|| fseeko(outfile, end_offset, SEEK_SET) != 0
+	) {
+		error = -ESPIPE;
+		goto cleanup;
+	}
+	error = end_offset - header_offset;
 
 cleanup:
-	if (error) {
-		for (size_t i = 0; i < stbds_hmlenu(postingsmap); ++i) {
-			uint64_t *postings = postingsmap[i].value;
-			stbds_arrfree(postings);
-		}
-		stbds_hmfree(postingsmap);
-		stbds_arrfree(paths);
-	} else {
-		*index = (struct Index){
-			._path_arr = paths,
-			._posting_hm = postingsmap,
-			._last_path_added = last_path_added,
-		};
+	for (size_t i = 0; i < ninputs; ++i) {
+		stbds_arrfree(inputs[i].documents);
+		stbds_arrfree(inputs[i].dropped);
+		stbds_arrfree(inputs[i].renamed);
 	}
+	free(inputs);
+	stbds_arrfree(docs);
+	stbds_arrfree(alias_pairs);
+	stbds_arrfree(path);
+	stbds_arrfree(writer.buffer);
+	return error;
+}
+
+static void index_ngram(struct Index *index, NGram ngram, uint64_t posting)
+{
+	ptrdiff_t i = stbds_hmgeti(index->_posting_hm, ngram);
+	if (i < 0) {
+		stbds_hmputs(index->_posting_hm, ((IndexPostingMapping){ .key = ngram }));
+		i = stbds_hmgeti(index->_posting_hm, ngram);
+	}
+	PostingChain *chain = &index->_posting_hm[i].chain;
 
-	stbds_arrfree(valid_offsets);
+	// postings are monotonic, so if already in the list it must be the last one
+	if (chain_last(index, *chain) == posting) return;
 
-	return error;
+	// otherwise, append to posting list (which keeps it sorted)
+	chain_push(index, chain, posting);
+
+	// every posting is also a document; and since every file or block starts
+	// with an ngram, tracking them here is enough (sparse grams never add any)
+	const size_t ndocs = stbds_arrlenu(index->_doc_arr);
+	if (ndocs == 0 || index->_doc_arr[ndocs - 1] != posting) stbds_arrpush(index->_doc_arr, posting);
+}
+
+static void index_sparse(struct Index *index, uint64_t hash, uint64_t posting)
+{
+	ptrdiff_t i = stbds_hmgeti(index->_sparse_hm, hash);
+	if (i < 0) {
+		stbds_hmputs(index->_sparse_hm, ((IndexSparseMapping){ .key = hash }));
+		i = stbds_hmgeti(index->_sparse_hm, hash);
+	}
+	PostingChain *chain = &index->_sparse_hm[i].chain;
+	if (chain_last(index, *chain) == posting) return;
+	chain_push(index, chain, posting);
+}
+
+// Returns the posting for a gram starting at the given position of a file.
+static inline uint64_t posting_at(uint64_t path_offset, uint64_t block_size, uint64_t position)
+{
+	if (block_size == 0) return posting_make(path_offset, 0);
+	const uint64_t block = 1 + position / block_size;
+	return posting_make(path_offset, block < INDEX_BLOCK_MAX ? block : INDEX_BLOCK_MAX);
 }
 
 
-static int posting_cmp(const void *a, const void *b)
+// Sparse grams are variable-length substrings whose boundaries are chosen by
+// the content itself: each byte pair gets a (deterministic) weight, and a gram
+// spans from pair i to pair j whenever the weights at both of its ends are
+// strictly greater than those of every pair in between. Since this condition
+// only depends on bytes inside the gram, every sparse gram of a query string
+// is also a sparse gram of any text containing that string.
+
+static inline uint32_t bytepair_weight(uint8_t a, uint8_t b)
 {
-	const uint64_t lhs = *(const uint64_t *)a;
-	const uint64_t rhs = *(const uint64_t *)b;
-	if (lhs < rhs) return -1;
-	else if (lhs > rhs) return 1;
-	else return 0;
+	uint32_t x = ((uint32_t)a << 8) | b;
+	x *= 0x9E3779B1u; // a murmur-like mix of the 16-bit pair
+	x ^= x >> 15;
+	x *= 0x85EBCA77u;
+	x ^= x >> 13;
+	return x;
 }
 
-static void index_ngram(struct Index *index, NGram ngram, uint64_t path_offset)
+static inline uint64_t sparse_hash_step(uint64_t hash, uint8_t byte)
 {
-	IndexPostingMapping *index_mapping = stbds_hmgetp_null(index->_posting_hm, ngram);
-	uint64_t *postings = index_mapping ? index_mapping->value : NULL;
+	return (hash ^ byte) * 0x100000001B3ull; // FNV-1a
+}
+
+#define SPARSE_HASH_INIT 0xCBF29CE484222325ull
+
+// Incremental sparse gram extractor. Must be initialized with `{0}`.
+typedef struct {
+	uint64_t bytes_fed;
+	uint8_t last_byte;
+	size_t depth; // number of byte pairs in the stack
+	uint64_t pair_begin[INDEX_SPARSE_MAX]; // stack of pairs, by position of their first byte
+	uint32_t pair_weight[INDEX_SPARSE_MAX]; // with their weights, strictly decreasing
+} SparseScanner;
+
+// Feeds the next byte to the scanner, writing to `begins` the starting position
+// of every sparse gram which ends with this byte. Returns how many were found.
+// Only grams longer than an N-gram (and at most INDEX_SPARSE_MAX) are reported.
+static size_t sparse_scan(SparseScanner *scanner, size_t n, uint8_t byte, uint64_t begins[INDEX_SPARSE_MAX])
+{
+	const uint64_t position = scanner->bytes_fed++;
+	const uint8_t previous = scanner->last_byte;
+	scanner->last_byte = byte;
+	if (position == 0) return 0;
+
+	const uint32_t weight = bytepair_weight(previous, byte);
+
+	// forget pairs which could only start grams that are too long
+	size_t expired = 0;
+	while (expired < scanner->depth && position - scanner->pair_begin[expired] + 1 > INDEX_SPARSE_MAX) {
+		++expired;
+	}
+	if (expired > 0) {
+		scanner->depth -= expired;
+		memmove(scanner->pair_begin, &scanner->pair_begin[expired], scanner->depth * sizeof(uint64_t));
+		memmove(scanner->pair_weight, &scanner->pair_weight[expired], scanner->depth * sizeof(uint32_t));
+	}
+
+	// everything above a pair in the stack is lighter than it, so the new pair
+	// closes a gram with each lighter pair it pops, plus the first heavier one
+	size_t found = 0;
+	while (scanner->depth > 0 && scanner->pair_weight[scanner->depth - 1] < weight) {
+		begins[found++] = scanner->pair_begin[--scanner->depth];
+	}
+	if (scanner->depth > 0) {
+		begins[found++] = scanner->pair_begin[scanner->depth - 1];
+		// equal weights can't be inside of a gram, so this one won't start any other
+		if (scanner->pair_weight[scanner->depth - 1] == weight) --scanner->depth;
+	}
 
-	// if offset already in posting list, do nothing
-	if (postings) {
-		const size_t n = stbds_arrlenu(postings);
-		uint64_t *found = bsearch(&path_offset, postings, n, sizeof(path_offset), posting_cmp);
-		if (found) return;
+	assert(scanner->depth < INDEX_SPARSE_MAX);
+	scanner->pair_begin[scanner->depth] = position - 1;
+	scanner->pair_weight[scanner->depth] = weight;
+	++scanner->depth;
+
+	// grams of length N (or shorter) are already covered by the ngram index
+	size_t kept = 0;
+	for (size_t i = 0; i < found; ++i) {
+		if (position - begins[i] + 1 > n) begins[kept++] = begins[i];
 	}
+	return kept;
+}
 
-	// otherwise, append to posting list (offsets are monotonic so this is sorted)
-	uint64_t *old = postings;
-	stbds_arrpush(postings, path_offset);
-	if (postings != old) stbds_hmput(index->_posting_hm, ngram, postings);
+// Same as `sparse_scan()`, but keeps a window of recent bytes in order to index every gram found.
+typedef struct {
+	SparseScanner scanner;
+	uint8_t window[INDEX_SPARSE_MAX]; // circular buffer with the last bytes fed
+} SparseIndexer;
+
+static void index_sparse_bytes(
+	struct Index *index, SparseIndexer *indexer,
+	const uint8_t *bytes, size_t length,
+	uint64_t path_offset, uint64_t block_size
+) {
+	const size_t n = ngram_size(&index->options);
+	uint64_t begins[INDEX_SPARSE_MAX];
+	for (size_t i = 0; i < length; ++i) {
+		const uint64_t position = indexer->scanner.bytes_fed;
+		indexer->window[position % INDEX_SPARSE_MAX] = bytes[i];
+		const size_t found = sparse_scan(&indexer->scanner, n, bytes[i], begins);
+		for (size_t j = 0; j < found; ++j) {
+			uint64_t hash = SPARSE_HASH_INIT;
+			for (uint64_t k = begins[j]; k <= position; ++k) {
+				hash = sparse_hash_step(hash, indexer->window[k % INDEX_SPARSE_MAX]);
+			}
+			index_sparse(index, hash, posting_at(path_offset, block_size, begins[j]));
+		}
+	}
 }
 
 static size_t shared_length(const char *a, size_t alen, const char *b, size_t blen)
@@ -475,90 +1994,513 @@ static uint64_t add_path_compressed(struct Index *index, const char *filepath, u
 	return current_offset;
 }
 
-int64_t index_file(struct Index *index, FILE *file, const char *filepath, size_t pathlen)
+// Remembers the size and mtime of a file, which is how it can later be told apart from a newer version.
+static void record_stat(struct Index *index, uint64_t path_offset, const struct stat *filestat)
+{
+	const struct IndexFileStat stat = {
+		.size = filestat->st_size,
+		.mtime = (int64_t)filestat->st_mtim.tv_sec * 1000000000 + filestat->st_mtim.tv_nsec,
+	};
+	stbds_arrpush(index->_stat_of, posting_make(path_offset, 0));
+	stbds_arrpush(index->_stat_arr, stat);
+}
+
+// State of a file being indexed, which is fed its contents chunk by chunk.
+typedef struct FileIndexer {
+	uint64_t path_offset;
+	uint64_t block_size; // or zero when the file isn't split
+	int64_t ngram_count; // since the k-th ngram starts at byte k, also the current position
+	NGram ngram; // sliding window, with the last `filled` bytes seen so far (at most N)
+	size_t filled;
+	void (*feed_ngrams)(struct Index *, struct FileIndexer *, const uint8_t *, size_t); // see `feed_ngrams()`
+	SparseIndexer sparse;
+	ContentHasher hasher;
+} FileIndexer;
+
+// Slides the window of N bytes over a chunk, indexing every ngram in it. This is
+// always inlined, so each size gets its own copy with constant shifts and masks.
+static inline __attribute__((always_inline)) void feed_ngrams(
+	struct Index *index, FileIndexer *indexer,
+	const uint8_t *bytes, size_t length, size_t n
+) {
+	const NGram mask = n < 8 ? (UINT64_C(1) << (8 * n)) - 1 : UINT64_MAX;
+	const uint64_t path_offset = indexer->path_offset;
+	const uint64_t block_size = indexer->block_size;
+	NGram ngram = indexer->ngram;
+	size_t filled = indexer->filled;
+	int64_t count = indexer->ngram_count;
+
+	for (size_t i = 0; i < length; ++i) {
+		ngram = (ngram << 8 | bytes[i]) & mask;
+		if (filled < n && ++filled < n) continue;
+		index_ngram(index, ngram, posting_at(path_offset, block_size, count));
+		++count;
+	}
+
+	indexer->ngram = ngram;
+	indexer->filled = filled;
+	indexer->ngram_count = count;
+}
+
+#define FEED_NGRAMS_OF_SIZE(N) \
+	static void feed_ngrams_##N(struct Index *index, FileIndexer *indexer, const uint8_t *bytes, size_t length) \
+	{ \
+		feed_ngrams(index, indexer, bytes, length, N); \
+	}
+
+FEED_NGRAMS_OF_SIZE(2)
+FEED_NGRAMS_OF_SIZE(3)
+FEED_NGRAMS_OF_SIZE(4)
+FEED_NGRAMS_OF_SIZE(8)
+
+#undef FEED_NGRAMS_OF_SIZE
+
+// Fallback for sizes without a copy of their own.
+static void feed_ngrams_n(struct Index *index, FileIndexer *indexer, const uint8_t *bytes, size_t length)
 {
-	int64_t ngram_count = 0;
+	feed_ngrams(index, indexer, bytes, length, ngram_size(&index->options));
+}
 
+// Checks whether a path can be added, returning zero or a negative error code.
+// Postings only have room for so many bits of path offsets, which `posting_make()`
+// merely asserts, so an index outgrowing them has to stop taking in files instead.
+static int check_new_path(const struct Index *index, size_t pathlen)
+{
 	// avoid overflow when allocating in add_path_compressed
 	if (pathlen > UINT16_MAX - (sizeof(IndexPathEntry) + 1 + alignof(IndexPathEntry))) {
 		return -UINT16_MAX;
 	}
-	const uint64_t path_offset = add_path_compressed(index, filepath, pathlen);
+	if (stbds_arrlenu(index->_path_arr) >= INDEX_PATHS_MAX) return -EOVERFLOW;
+	return 0;
+}
+
+static int64_t file_indexer_begin(
+	struct Index *index, FileIndexer *indexer,
+	int fd, const char *filepath, size_t pathlen
+) {
+	const int error = check_new_path(index, pathlen);
+	if (error) return error;
+	*indexer = (FileIndexer){ .path_offset = add_path_compressed(index, filepath, pathlen) };
+	switch (ngram_size(&index->options)) {
+		case 2: indexer->feed_ngrams = feed_ngrams_2; break;
+		case 3: indexer->feed_ngrams = feed_ngrams_3; break;
+		case 4: indexer->feed_ngrams = feed_ngrams_4; break;
+		case 8: indexer->feed_ngrams = feed_ngrams_8; break;
+		default: indexer->feed_ngrams = feed_ngrams_n; break;
+	}
+
+	// the file was just opened, so this doesn't need to resolve its path again
+	struct stat filestat = {0};
+	const bool has_stat = fstat(fd, &filestat) == 0 && S_ISREG(filestat.st_mode);
+	if (has_stat) record_stat(index, indexer->path_offset, &filestat);
+
+	// other links to this same file can then be indexed as aliases
+	if (has_stat && index->options.dedup_links) {
+		const FileId id = { .device = filestat.st_dev, .inode = filestat.st_ino };
+		stbds_hmput(index->_inode_hm, id, posting_make(indexer->path_offset, 0));
+	}
+
+	// big files are split into blocks, so each posting only covers part of them
+	if (
+		index->options.block_size > 0 && has_stat
+		&& (uint64_t)filestat.st_size > index->options.split_threshold
+	) {
+		indexer->block_size = index->options.block_size;
+	}
+
+	return 0;
+}
+
+static void file_indexer_feed(struct Index *index, FileIndexer *indexer, const uint8_t *bytes, size_t length)
+{
+	if (index->options.sparse_grams) {
+		index_sparse_bytes(index, &indexer->sparse, bytes, length, indexer->path_offset, indexer->block_size);
+	}
+	if (index->options.dedup_contents) content_hash(&indexer->hasher, bytes, length);
+	indexer->feed_ngrams(index, indexer, bytes, length);
+}
+
+static int64_t file_indexer_end(struct Index *index, FileIndexer *indexer)
+{
+	// remember these contents, unless some other file already had them
+	if (index->options.dedup_contents) {
+		const ContentDigest digest = content_digest(&indexer->hasher);
+		if (stbds_hmgeti(index->_content_hm, digest) < 0) {
+			stbds_hmput(index->_content_hm, digest, posting_make(indexer->path_offset, 0));
+			stbds_hmput(index->_size_hm, digest.size, true);
+		}
+	}
+	return indexer->ngram_count;
+}
 
-	NGram ngram = {0};
-	char buffer[4096];
+int64_t index_file(struct Index *index, FILE *file, const char *filepath, size_t pathlen)
+{
+	return index_file_prefixed(index, NULL, 0, file, filepath, pathlen);
+}
 
-	// read first ngram
-	if (!fread(buffer, INDEX_NGRAM_SIZE, 1, file)) return ngram_count;
-	memcpy(ngram.bytes, buffer, INDEX_NGRAM_SIZE);
-	index_ngram(index, ngram, path_offset);
-	++ngram_count;
+int64_t index_file_prefixed(
+	struct Index *index, const void *head, size_t head_length,
+	FILE *file, const char *filepath, size_t pathlen
+) {
+	FileIndexer indexer;
+	const int64_t error = file_indexer_begin(index, &indexer, fileno(file), filepath, pathlen);
+	if (error) return error;
+	if (head_length > 0) file_indexer_feed(index, &indexer, head, head_length);
 
-	// read the following ngrams by sliding an N-byte window with 1-byte steps
+	uint8_t buffer[4096];
 	size_t chunk_length = 0;
 	while ((chunk_length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-		// edge case: chunk is too short
-		if (chunk_length <= INDEX_NGRAM_SIZE) {
-			for (size_t i = 0; i < chunk_length; ++i) {
-				memmove(ngram.bytes, ngram.bytes + 1, INDEX_NGRAM_SIZE - 1);
-				ngram.bytes[INDEX_NGRAM_SIZE - 1] = buffer[i];
-				index_ngram(index, ngram, path_offset);
-				++ngram_count;
-			}
-			continue;
+		file_indexer_feed(index, &indexer, buffer, chunk_length);
+	}
+
+	return file_indexer_end(index, &indexer);
+}
+
+int64_t index_contents(
+	struct Index *index, const void *contents, size_t length,
+	int fd, const char *filepath, size_t pathlen
+) {
+	FileIndexer indexer;
+	const int64_t error = file_indexer_begin(index, &indexer, fd, filepath, pathlen);
+	if (error) return error;
+	file_indexer_feed(index, &indexer, contents, length);
+	return file_indexer_end(index, &indexer);
+}
+
+// Compares the contents of a file (read from `file`, unless already in memory) with
+// those of the one originally indexed at the given posting, which is opened again.
+// This rules out hash collisions, and also files which changed since they were indexed.
+static bool same_contents(
+	struct Index *index, uint64_t original, FILE *file,
+	const uint8_t *contents, size_t length
+) {
+	char path[PATH_MAX];
+	const size_t pathlen = index_path(*index, (struct IndexPathHandle){ ._posting = original }, path, sizeof(path));
+	if (pathlen == 0 || pathlen >= sizeof(path)) return false;
+	FILE *other = fopen(path, "rb");
+	if (!other) return false;
+
+	bool same = true;
+	uint8_t buffer[4096], other_buffer[4096];
+	size_t offset = 0;
+	while (same) {
+		size_t chunk_length = 0;
+		if (file) {
+			chunk_length = fread(buffer, 1, sizeof(buffer), file);
+		} else {
+			chunk_length = length - offset < sizeof(buffer) ? length - offset : sizeof(buffer);
+			memcpy(buffer, &contents[offset], chunk_length);
+			offset += chunk_length;
 		}
-		// until the first ngram is totaly gone, we actually slide the bytes
-		for (size_t i = 0; i < INDEX_NGRAM_SIZE - 1; ++i) {
-			memmove(ngram.bytes, ngram.bytes + 1, INDEX_NGRAM_SIZE - 1);
-			ngram.bytes[INDEX_NGRAM_SIZE - 1] = buffer[i];
-			index_ngram(index, ngram, path_offset);
-			++ngram_count;
+		const size_t other_length = fread(other_buffer, 1, chunk_length > 0 ? chunk_length : 1, other);
+		if (chunk_length == 0) {
+			same = other_length == 0 && !ferror(other);
+			break;
 		}
-		// after that point, we make a non-overlapping copy each time
-		for (size_t i = 0; i <= chunk_length - INDEX_NGRAM_SIZE; ++i) {
-			memcpy(ngram.bytes, &buffer[i], INDEX_NGRAM_SIZE);
-			index_ngram(index, ngram, path_offset);
-			++ngram_count;
+		same = other_length == chunk_length && memcmp(buffer, other_buffer, chunk_length) == 0;
+	}
+
+	fclose(other);
+	return same;
+}
+
+static void add_alias(
+	struct Index *index, uint64_t original, const struct stat *filestat,
+	const char *filepath, size_t pathlen
+) {
+	const uint64_t path_offset = add_path_compressed(index, filepath, pathlen);
+	record_stat(index, path_offset, filestat);
+	stbds_arrpush(index->_alias_of, original);
+	stbds_arrpush(index->_alias_arr, posting_make(path_offset, 0));
+}
+
+// Shared by `index_duplicate()` and `index_duplicate_contents()`, where the
+// contents are only read from `file` when they're not already in memory.
+static int find_duplicate(
+	struct Index *index, int fd, FILE *file, const uint8_t *contents, size_t length,
+	const char *filepath, size_t pathlen
+) {
+	const bool dedup_links = index->options.dedup_links;
+	if (!index->options.dedup_contents && !dedup_links) return 0;
+	const int error = check_new_path(index, pathlen);
+	if (error) return error;
+
+	// we can only tell (and rewind) regular files
+	struct stat filestat = {0};
+	if (fstat(fd, &filestat) != 0 || !S_ISREG(filestat.st_mode)) return 0;
+
+	// the cheapest check is whether this very file was reached through another link
+	const FileId id = { .device = filestat.st_dev, .inode = filestat.st_ino };
+	if (dedup_links && index_duplicate_link(index, &filestat, filepath, pathlen) > 0) return 1;
+
+	// otherwise, only bother hashing when sizes match
+	if (!index->options.dedup_contents) return 0;
+	const uint64_t size = file ? (uint64_t)filestat.st_size : length;
+	if (stbds_hmgeti(index->_size_hm, size) < 0) return 0;
+
+	ContentHasher hasher = {0};
+	if (file) {
+		uint8_t buffer[4096];
+		size_t chunk_length = 0;
+		while ((chunk_length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+			content_hash(&hasher, buffer, chunk_length);
 		}
-		// at the end of the buffer, we go back to byte-by-byte
-		for (size_t i = chunk_length - INDEX_NGRAM_SIZE + 1; i < chunk_length; ++i) {
-			memmove(ngram.bytes, ngram.bytes + 1, INDEX_NGRAM_SIZE - 1);
-			ngram.bytes[INDEX_NGRAM_SIZE - 1] = buffer[i];
-			index_ngram(index, ngram, path_offset);
-			++ngram_count;
+		if (ferror(file)) {
+			rewind(file);
+			return -EIO;
 		}
+	} else {
+		content_hash(&hasher, contents, length);
 	}
 
-	return ngram_count;
+	// equal digests are only a hint, since the hash isn't collision-resistant
+	const ContentDigest digest = content_digest(&hasher);
+	const IndexContentMapping *found = stbds_hmgetp_null(index->_content_hm, digest);
+	if (file) rewind(file);
+	if (!found) return 0;
+	const bool same = same_contents(index, found->value, file, contents, length);
+	if (file) rewind(file);
+	if (!same) return 0;
+
+	// the duplicate won't get any postings: they're shared with the original
+	add_alias(index, found->value, &filestat, filepath, pathlen);
+	if (dedup_links) stbds_hmput(index->_inode_hm, id, found->value);
+	return 1;
+}
+
+int index_duplicate_link(struct Index *index, const struct stat *filestat, const char *filepath, size_t pathlen)
+{
+	if (!index->options.dedup_links || !S_ISREG(filestat->st_mode)) return 0;
+	const int error = check_new_path(index, pathlen);
+	if (error) return error;
+
+	const FileId id = { .device = filestat->st_dev, .inode = filestat->st_ino };
+	const IndexInodeMapping *found = stbds_hmgetp_null(index->_inode_hm, id);
+	if (!found) return 0;
+	add_alias(index, found->value, filestat, filepath, pathlen);
+	return 1;
+}
+
+int index_duplicate(struct Index *index, FILE *file, const char *filepath, size_t pathlen)
+{
+	return find_duplicate(index, fileno(file), file, NULL, 0, filepath, pathlen);
+}
+
+int index_duplicate_contents(
+	struct Index *index, const void *contents, size_t length,
+	int fd, const char *filepath, size_t pathlen
+) {
+	return find_duplicate(index, fd, NULL, contents, length, filepath, pathlen);
 }
 
 
-size_t index_ngram_size(void)
+size_t index_ngram_size(struct Index index)
 {
-	return INDEX_NGRAM_SIZE;
+	return ngram_size(&index.options);
 }
 
 struct IndexResult index_query(struct Index index, struct IndexQuery query)
 {
 	const struct IndexResult empty_result = {0};
-	if (query.text == NULL || query.strlen < INDEX_NGRAM_SIZE) return empty_result;
+	const size_t n = ngram_size(&index.options);
+	if (query.text == NULL || query.strlen < n) return empty_result;
 
-	NGram ngram = {0};
-	memcpy(ngram.bytes, query.text, INDEX_NGRAM_SIZE);
+	const NGram ngram = ngram_pack((const uint8_t *)query.text, n);
 
-	IndexPostingMapping *index_mapping = stbds_hmgetp_null(index._posting_hm, ngram);
-	if (!index_mapping) return empty_result;
+	// looking up an empty map would allocate one, which this copy of the index would leak,
+	// and the index may be shared by several threads, so lookups mustn't touch the map
+	// (unlike plain `hmgeti`, which keeps the index it finds in the map's header)
+	if (!index._posting_hm) return empty_result;
+	ptrdiff_t found = -1;
+	stbds_hmgeti_ts(index._posting_hm, ngram, found);
+	if (found < 0) return empty_result;
+	const IndexPostingMapping *index_mapping = &index._posting_hm[found];
+	assert(index_mapping->value || index_mapping->chain.length == 0); // still being built
 
 	const uint64_t *postings = index_mapping->value;
 	struct IndexResult result = {
 		.handles = (const struct IndexPathHandle *)postings,
 		.length = stbds_arrlenu(postings),
+		.complement = index_mapping->complement,
 	};
 	static_assert(sizeof(*postings) == sizeof(struct IndexPathHandle), "u64[] <=> IndexPathHandle[] cast check");
 
 	return result;
 }
 
+struct IndexGrams index_grams(struct Index index, struct IndexQuery query)
+{
+	struct IndexGrams result = {0};
+	const size_t n = ngram_size(&index.options);
+	if (query.text == NULL || query.strlen < n) return result;
+
+	struct IndexQuery *grams = NULL;
+	for (size_t i = 0; i <= query.strlen - n; ++i) {
+		const struct IndexQuery ngram = { .text = &query.text[i], .strlen = n };
+		stbds_arrpush(grams, ngram);
+	}
+
+	if (index.options.sparse_grams) {
+		SparseScanner scanner = {0};
+		uint64_t begins[INDEX_SPARSE_MAX];
+		for (size_t i = 0; i < query.strlen; ++i) {
+			const size_t found = sparse_scan(&scanner, n, query.text[i], begins);
+			for (size_t j = 0; j < found; ++j) {
+				const struct IndexQuery gram = { .text = &query.text[begins[j]], .strlen = i - begins[j] + 1 };
+				stbds_arrpush(grams, gram);
+			}
+		}
+	}
+
+	result.grams = grams;
+	result.length = stbds_arrlenu(grams);
+	return result;
+}
+
+void index_grams_cleanup(struct IndexGrams *grams)
+{
+	if (!grams) return;
+	stbds_arrfree(grams->grams);
+	*grams = (struct IndexGrams){0};
+}
+
+struct IndexResult index_query_gram(struct Index index, struct IndexQuery gram)
+{
+	const struct IndexResult empty_result = {0};
+	if (gram.text == NULL) return empty_result;
+	if (gram.strlen == ngram_size(&index.options)) return index_query(index, gram);
+	if (!index.options.sparse_grams || gram.strlen > INDEX_SPARSE_MAX) return empty_result;
+
+	uint64_t hash = SPARSE_HASH_INIT;
+	for (size_t i = 0; i < gram.strlen; ++i) hash = sparse_hash_step(hash, gram.text[i]);
+
+	if (!index._sparse_hm) return empty_result; // see `index_query()`
+	ptrdiff_t found = -1;
+	stbds_hmgeti_ts(index._sparse_hm, hash, found);
+	if (found < 0) return empty_result;
+	const IndexSparseMapping *index_mapping = &index._sparse_hm[found];
+	assert(index_mapping->value || index_mapping->chain.length == 0); // see `index_query()`
+
+	const uint64_t *postings = index_mapping->value;
+	struct IndexResult result = {
+		.handles = (const struct IndexPathHandle *)postings,
+		.length = stbds_arrlenu(postings),
+		.complement = index_mapping->complement,
+	};
+	return result;
+}
+
+struct IndexResult index_all(struct Index index)
+{
+	struct IndexResult result = {
+		.handles = (const struct IndexPathHandle *)index._doc_arr,
+		.length = stbds_arrlenu(index._doc_arr),
+	};
+	return result;
+}
+
+struct IndexCounts index_counts(struct Index index)
+{
+	struct IndexCounts counts = {
+		.docs = stbds_arrlenu(index._doc_arr),
+		.ngrams = stbds_hmlenu(index._posting_hm),
+		.sparse_grams = stbds_hmlenu(index._sparse_hm),
+		.path_bytes = stbds_arrlenu(index._path_arr),
+	};
+	for (size_t i = 0; i < counts.ngrams; ++i) {
+		counts.postings += postings_length(index._posting_hm[i].value, index._posting_hm[i].chain);
+	}
+	for (size_t i = 0; i < counts.sparse_grams; ++i) {
+		counts.postings += postings_length(index._sparse_hm[i].value, index._sparse_hm[i].chain);
+	}
+	return counts;
+}
+
+// Returns how many items a posting list takes when saved, see `encode_postings()`.
+static uint64_t encoded_length(uint64_t length, bool complement, uint64_t ndocs)
+{
+	if (complement || length * 100 <= ndocs * INDEX_DENSE_PERCENT) return length;
+	return ndocs - length;
+}
+
+struct IndexSections index_sections(struct Index index)
+{
+	const uint64_t ndocs = stbds_arrlenu(index._doc_arr);
+	struct IndexSections sections = {
+		.header = INDEX_HEADER_SIZE,
+		.checksums = INDEX_CHECKSUMS * 8,
+		.paths = stbds_arrlenu(index._path_arr),
+		.docs = ndocs * 8,
+		.aliases = stbds_arrlenu(index._alias_arr) * 16,
+		.stats = stbds_arrlenu(index._stat_of) * 24,
+	};
+	for (size_t i = 0; i < stbds_hmlenu(index._posting_hm); ++i) {
+		const IndexPostingMapping *mapping = &index._posting_hm[i];
+		const uint64_t length = postings_length(mapping->value, mapping->chain);
+		sections.ngrams += 4 + ngram_stride(ngram_size(&index.options)) + encoded_length(length, mapping->complement, ndocs) * 8;
+	}
+	for (size_t i = 0; i < stbds_hmlenu(index._sparse_hm); ++i) {
+		const IndexSparseMapping *mapping = &index._sparse_hm[i];
+		const uint64_t length = postings_length(mapping->value, mapping->chain);
+		sections.sparse_grams += 4 + 8 + encoded_length(length, mapping->complement, ndocs) * 8;
+	}
+	return sections;
+}
+
+struct IndexPathStats index_path_stats(struct Index index)
+{
+	// a compressed path always points to the entry right before it, so
+	// the length of its chain is just one more than that of the previous
+	struct IndexPathStats stats = { .stored_bytes = stbds_arrlenu(index._path_arr) };
+	const size_t nbuckets = sizeof(stats.depths) / sizeof(stats.depths[0]);
+	uint64_t depth = 0;
+	for (uint64_t offset = 0; offset < stats.stored_bytes;) {
+		const IndexPathEntry *entry = (IndexPathEntry*)&index._path_arr[offset];
+		depth = entry->prefix_length == 0 ? 0 : depth + 1;
+		size_t bucket = 0;
+		while (bucket + 1 < nbuckets && depth >= (UINT64_C(1) << bucket)) ++bucket;
+		++stats.depths[bucket];
+		if (depth > stats.max_depth) stats.max_depth = depth;
+		++stats.paths;
+		stats.raw_bytes += entry->prefix_length + entry->suffix_length + 1;
+		offset += entry->allocation_size;
+	}
+	return stats;
+}
+
+void index_each_gram(struct Index index, IndexGramVisitor visit, void *context)
+{
+	const size_t n = ngram_size(&index.options);
+	uint8_t ngram[INDEX_NGRAM_MAX];
+	uint64_t *gathered = NULL;
+	for (size_t i = 0; i < stbds_hmlenu(index._posting_hm); ++i) {
+		const IndexPostingMapping *mapping = &index._posting_hm[i];
+		ngram_unpack(mapping->key, n, ngram);
+		const struct IndexGramList list = {
+			.ngram = { .text = (const char *)ngram, .strlen = n },
+			.result = {
+				.handles = (const struct IndexPathHandle *)gather_postings(&index, mapping->value, mapping->chain, &gathered),
+				.length = postings_length(mapping->value, mapping->chain),
+				.complement = mapping->complement,
+			},
+		};
+		visit(context, list);
+	}
+	for (size_t i = 0; i < stbds_hmlenu(index._sparse_hm); ++i) {
+		const IndexSparseMapping *mapping = &index._sparse_hm[i];
+		const struct IndexGramList list = {
+			.sparse_hash = mapping->key,
+			.result = {
+				.handles = (const struct IndexPathHandle *)gather_postings(&index, mapping->value, mapping->chain, &gathered),
+				.length = postings_length(mapping->value, mapping->chain),
+				.complement = mapping->complement,
+			},
+		};
+		visit(context, list);
+	}
+	stbds_arrfree(gathered);
+}
+
 void index_result_cleanup(struct IndexResult *result)
 {
 	if (!result) return;
@@ -567,9 +2509,113 @@ void index_result_cleanup(struct IndexResult *result)
 }
 
 
+struct IndexResult index_aliases(struct Index index, struct IndexPathHandle handle)
+{
+	const uint64_t original = posting_make(posting_path(handle._posting), 0);
+	const size_t n = stbds_arrlenu(index._alias_of);
+
+	// binary search for the first alias of this file
+	size_t lo = 0;
+	size_t hi = n;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (index._alias_of[mid] < original) lo = mid + 1;
+		else hi = mid;
+	}
+	size_t end = lo;
+	while (end < n && index._alias_of[end] == original) ++end;
+
+	struct IndexResult result = {
+		.handles = (const struct IndexPathHandle *)&index._alias_arr[lo],
+		.length = end - lo,
+	};
+	return result;
+}
+
+bool index_stat(struct Index index, struct IndexPathHandle handle, struct IndexFileStat *stat)
+{
+	const uint64_t posting = posting_make(posting_path(handle._posting), 0);
+	const size_t n = stbds_arrlenu(index._stat_of);
+	const uint64_t *found = n > 0 ? bsearch(&posting, index._stat_of, n, sizeof(uint64_t), offset_cmp) : NULL;
+	if (!found) return false;
+	*stat = index._stat_arr[found - index._stat_of];
+	return true;
+}
+
+struct IndexRange index_range(struct Index index, struct IndexPathHandle handle)
+{
+	const uint64_t block = posting_block(handle._posting);
+	const uint64_t block_size = index.options.block_size;
+	if (block == 0 || block_size == 0) return (struct IndexRange){ .begin = 0, .end = UINT64_MAX };
+	const uint64_t begin = (block - 1) * block_size;
+	const uint64_t end = block < INDEX_BLOCK_MAX ? begin + block_size : UINT64_MAX;
+	return (struct IndexRange){ .begin = begin, .end = end };
+}
+
+size_t index_block_span(struct Index index, size_t offset)
+{
+	const uint64_t block_size = index.options.block_size;
+	if (block_size == 0) return 0;
+	return (offset + block_size - 1) / block_size;
+}
+
+int index_handle_cmp(const void *a, const void *b)
+{
+	const struct IndexPathHandle *lhs = a;
+	const struct IndexPathHandle *rhs = b;
+	if (lhs->_posting < rhs->_posting) return -1;
+	else if (lhs->_posting > rhs->_posting) return 1;
+	else return 0;
+}
+
+bool index_same_file(struct IndexPathHandle a, struct IndexPathHandle b)
+{
+	return posting_path(a._posting) == posting_path(b._posting);
+}
+
+bool index_handle_seek(struct IndexPathHandle *handle, int64_t blocks)
+{
+	const uint64_t block = posting_block(handle->_posting);
+	if (block == 0) return true;
+	const int64_t target = (int64_t)block + blocks;
+	if (target < 1 || target > (int64_t)INDEX_BLOCK_MAX) return false;
+	handle->_posting = posting_make(posting_path(handle->_posting), target);
+	return true;
+}
+
+// Checks whether a result contains the given handle, where `all` is the result of `index_all()`.
+static bool result_contains(struct IndexResult result, struct IndexResult all, struct IndexPathHandle handle)
+{
+	const size_t size = sizeof(struct IndexPathHandle);
+	const bool listed = result.length > 0 && bsearch(&handle, result.handles, result.length, size, index_handle_cmp) != NULL;
+	if (!result.complement) return listed;
+	return !listed && bsearch(&handle, all.handles, all.length, size, index_handle_cmp) != NULL;
+}
+
+size_t index_intersect(
+	struct Index index, struct IndexResult result, size_t span,
+	struct IndexPathHandle *candidates, size_t length
+) {
+	// a complement without exceptions is in every document
+	if (result.complement && result.length == 0) return length;
+
+	const struct IndexResult all = index_all(index);
+	size_t kept = 0;
+	for (size_t i = 0; i < length; ++i) {
+		bool found = false;
+		for (size_t d = 0; d <= span && !found; ++d) {
+			struct IndexPathHandle handle = candidates[i];
+			if (!index_handle_seek(&handle, d)) break;
+			found = result_contains(result, all, handle);
+		}
+		if (found) candidates[kept++] = candidates[i];
+	}
+	return kept;
+}
+
 size_t index_pathlen(struct Index index, struct IndexPathHandle handle)
 {
-	const uint64_t offset = handle._offset;
+	const uint64_t offset = posting_path(handle._posting);
 	if (offset >= stbds_arrlenu(index._path_arr)) return 0;
 	const IndexPathEntry *entry = (IndexPathEntry*)&index._path_arr[offset];
 	const size_t pathlen = entry->prefix_length + entry->suffix_length;
@@ -609,7 +2655,7 @@ static size_t uncompress_path(
 
 size_t index_path(struct Index index, struct IndexPathHandle handle, char *pathbuf, size_t buflen)
 {
-	const uint64_t offset = handle._offset;
+	const uint64_t offset = posting_path(handle._posting);
 	if (offset >= stbds_arrlenu(index._path_arr)) return 0;
 
 	const IndexPathEntry *entry = (IndexPathEntry*)&index._path_arr[offset];
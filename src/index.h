@@ -1,18 +1,93 @@
 #ifndef INCLUDE_INDEX_H
 #define INCLUDE_INDEX_H
 
+#include <stdbool.h>
 #include <stddef.h> // size_t
 #include <stdint.h>
 #include <stdio.h> // FILE
 
 
 struct IndexPostingMapping; // forward decl
+struct IndexSparseMapping; // forward decl
+struct IndexContentMapping; // forward decl
+struct IndexSizeMapping; // forward decl
+struct IndexInodeMapping; // forward decl
+struct stat; // forward decl
+
+// Index build options, which are persisted along with the index.
+struct IndexOptions {
+	bool sparse_grams; // also index variable-length grams, see `index_grams()`
+	uint64_t block_size; // size of the blocks which big files are split into, or zero
+	uint64_t split_threshold; // only files bigger than this are split into blocks
+	bool dedup_contents; // keep track of file contents, see `index_duplicate()`
+	bool dedup_links; // keep track of (device, inode) pairs, see `index_duplicate()`
+	size_t ngram_size; // N, from 2 to 8, or zero for the default (see `index_ngram_size()`)
+};
+
+// Size and modification time of an indexed file, as seen when it was indexed.
+struct IndexFileStat {
+	uint64_t size;
+	int64_t mtime; // in nanoseconds since the epoch
+};
 
 // Text search (aka inverted) index. Must be initialized with `{0}`.
 struct Index {
+	struct IndexOptions options; // set these before indexing the first file
 	uint8_t *_path_arr; // big array with all paths, encoded with compression
 	struct IndexPostingMapping *_posting_hm; // map of NGram -> Set(Posting).
+	struct IndexSparseMapping *_sparse_hm; // map of Hash(SparseGram) -> Set(Posting).
+	uint64_t *_doc_arr; // every distinct posting, i.e. all indexed files (or blocks)
+	uint64_t *_alias_of; // original file of each alias, sorted when loaded
+	uint64_t *_alias_arr; // files indexed as duplicates of some other (aka aliases)
+	uint64_t *_stat_of; // sorted postings of the files (or aliases) in the array below
+	struct IndexFileStat *_stat_arr; // of every regular file, when indexed
+	struct IndexContentMapping *_content_hm; // map of Digest -> Posting, only when building
+	struct IndexSizeMapping *_size_hm; // set of file sizes in the map above
+	struct IndexInodeMapping *_inode_hm; // map of (Device, Inode) -> Posting, only when building
 	uint64_t _last_path_added; // used for prefix compression
+	uint64_t **_arena_chunks; // where posting lists are stored while building
+	uint64_t _arena_used; // slots of the last chunk which were handed out
+};
+
+// How an index is saved, see `index_save()`.
+struct IndexSaveOptions {
+	size_t threads; // besides the calling one, to encode posting lists in parallel
+};
+
+// How an index is loaded, see `index_load()`.
+struct IndexLoadOptions {
+	bool trusted; // skip structural checks of postings, only verifying section checksums
+	size_t threads; // besides the calling one, to check postings in parallel
+};
+
+// Sizes of the main structures of an index.
+struct IndexCounts {
+	uint64_t docs; // indexed files (or blocks)
+	uint64_t ngrams; // distinct
+	uint64_t sparse_grams; // distinct
+	uint64_t postings; // items in every posting list (only exceptions, when complemented)
+	uint64_t path_bytes; // with compression
+};
+
+// Bytes taken by each section of an index once saved, see `index_save()`.
+struct IndexSections {
+	uint64_t header;
+	uint64_t paths;
+	uint64_t docs;
+	uint64_t aliases;
+	uint64_t stats;
+	uint64_t ngrams; // including their entry headers
+	uint64_t sparse_grams; // including their entry headers
+	uint64_t checksums;
+};
+
+// How the paths of an index are stored, with prefix compression.
+struct IndexPathStats {
+	uint64_t paths; // entries, including aliases
+	uint64_t raw_bytes; // of every path, uncompressed and NUL-terminated
+	uint64_t stored_bytes; // of every entry, including headers and padding
+	uint64_t max_depth; // longest chain of prefixes followed to decode a path
+	uint64_t depths[16]; // paths whose chain has 0, 1, 2-3, 4-7, etc prefixes (the last one counts longer chains too)
 };
 
 // Index query, with a pointer to some text and corresponding strlen.
@@ -21,16 +96,33 @@ struct IndexQuery {
 	size_t strlen;
 };
 
+// Handle to an indexed file or, when the file was split, to one of its blocks.
 struct IndexPathHandle {
-	uint64_t _offset;
+	uint64_t _posting;
+};
+
+// Range of byte offsets into an indexed file, where `end == UINT64_MAX` means EOF.
+struct IndexRange {
+	uint64_t begin;
+	uint64_t end;
 };
 
-// Index query result, with an array of path handles.
+// List of grams (substrings of a query text) which can be looked up in the index.
+// Must be cleaned up with `index_grams_cleanup()`.
+struct IndexGrams {
+	struct IndexQuery *grams;
+	size_t length;
+};
+
+// Index query result, with a sorted array of path handles.
+// When `complement` is set, the result actually contains every indexed file
+// (or block, see `index_all()`) EXCEPT for those in the array.
 // A missing result is indicated by a NULL array + zero length.
 // If not a missing result, must be cleaned up with `index_result_cleanup()`.
 struct IndexResult {
 	const struct IndexPathHandle *handles;
 	size_t length;
+	bool complement;
 };
 
 
@@ -38,23 +130,138 @@ struct IndexResult {
 void index_cleanup(struct Index *index);
 
 // Serialize index to file, returning number of bytes written, or a negative error code.
-int64_t index_save(struct Index index, FILE *file);
+// Posting lists are encoded by several threads, but written in order by the calling one.
+int64_t index_save(struct Index index, FILE *file, struct IndexSaveOptions options);
+
+// Load index from file, returning zero on success or an error code. Every section must
+// match its checksum, and unless trusted, every posting must point to a valid path entry.
+int index_load(struct Index *index, FILE *file, struct IndexLoadOptions options);
+
+// Decides whether files indexed through `path` in the given input are kept when merging.
+typedef bool (*IndexMergeFilter)(void *context, size_t input, const char *path, size_t pathlen);
 
-// Load index from file, returning zero on success or an error code.
-int index_load(struct Index *index, FILE *file);
+// Merge serialized indexes into a single one, as if their files had been indexed together
+// (but without deduplication across them), streaming their sorted gram entries so that
+// only the current posting lists are kept in memory. The output must be seekable.
+// Files rejected by the optional filter (and not aliased by a kept path) are left out.
+// Returns number of bytes written, or a negative errno.
+int64_t index_merge(FILE **inputs, size_t ninputs, IndexMergeFilter filter, void *context, FILE *output);
 
-// Index file contents, returning the number of ngrams processed, or a negative error code.
+// Index file contents, returning the number of ngrams processed, or a negative error code
+// (e.g. -EOVERFLOW once the index has too many paths for its postings to address).
 int64_t index_file(struct Index *index, FILE *file, const char *filepath, size_t pathlen);
 
-// Return the size of an N-gram in bytes (i.e. the value of N).
-size_t index_ngram_size(void);
+// Same as `index_file()`, for a file (or pipe) whose first `head_length` bytes were already read into `head`.
+int64_t index_file_prefixed(
+	struct Index *index, const void *head, size_t head_length,
+	FILE *file, const char *filepath, size_t pathlen
+);
+
+// Same as `index_file()`, for contents already read from `fd` (which is only fstat'ed).
+int64_t index_contents(
+	struct Index *index, const void *contents, size_t length,
+	int fd, const char *filepath, size_t pathlen
+);
+
+// When the index was built with `dedup_links` (or `dedup_contents`), checks whether
+// the same file (or some file with the exact same contents) was already indexed,
+// in which case the path is added as its alias and 1 is returned. Otherwise,
+// returns 0 (or a negative error code) after rewinding the file, if it had to be
+// read at all. Files with the same digest are compared byte for byte by opening the
+// original again, so when that fails (e.g. its path is too long, or it's no longer
+// readable) they're not duplicates.
+int index_duplicate(struct Index *index, FILE *file, const char *filepath, size_t pathlen);
+
+// Same as `index_duplicate()`, for contents already read from `fd` (which is only fstat'ed).
+int index_duplicate_contents(
+	struct Index *index, const void *contents, size_t length,
+	int fd, const char *filepath, size_t pathlen
+);
+
+// Same as `index_duplicate()`, but only checks for another link to the same file,
+// which then doesn't need to be opened at all (`filestat` is as given by `stat()`).
+int index_duplicate_link(struct Index *index, const struct stat *filestat, const char *filepath, size_t pathlen);
+
+// Returns handles to the aliases of the file referred to by the given handle,
+// i.e. paths which were indexed as duplicates of it. Only works on loaded indexes.
+struct IndexResult index_aliases(struct Index index, struct IndexPathHandle handle);
+
+// Return the size of an N-gram in bytes (i.e. the value of N) in the index.
+size_t index_ngram_size(struct Index index);
 
 // Query the index for exactly `index_ngram_size()` bytes read from the query text.
+// Only works on loaded indexes, since results point into their posting lists as they are
+// (while building, those are scattered in chunks, see `index_each_gram()` instead).
 struct IndexResult index_query(struct Index index, struct IndexQuery query);
 
+// List all grams in the query text which are indexed: every N-gram and, when the
+// index was built with `sparse_grams`, every sparse gram as well.
+// Any file containing the query text will be in the results of each of these grams.
+struct IndexGrams index_grams(struct Index index, struct IndexQuery query);
+
+// Deallocate a list of grams returned by `index_grams()`.
+void index_grams_cleanup(struct IndexGrams *grams);
+
+// Query the index for a single gram, exactly as listed by `index_grams()`.
+// Only works on loaded indexes, like `index_query()`.
+struct IndexResult index_query_gram(struct Index index, struct IndexQuery gram);
+
+// Returns the (never complemented) result with every indexed file or block.
+struct IndexResult index_all(struct Index index);
+
+// Counts what's in the index, whether it's being built or was loaded.
+struct IndexCounts index_counts(struct Index index);
+
+// Returns how many bytes each section would take if the index was saved as it is.
+struct IndexSections index_sections(struct Index index);
+
+// Measures how well the paths of the index are compressed.
+struct IndexPathStats index_path_stats(struct Index index);
+
+// Posting list of a gram in the index, see `index_each_gram()`.
+struct IndexGramList {
+	struct IndexQuery ngram; // only valid during the visit, and NULL for sparse grams (only kept as a hash)
+	uint64_t sparse_hash;
+	struct IndexResult result; // same as `index_query_gram()` would return, once loaded
+};
+
+typedef void (*IndexGramVisitor)(void *context, struct IndexGramList list);
+
+// Calls `visit` with the posting list of every gram in the index, in no particular order.
+void index_each_gram(struct Index index, IndexGramVisitor visit, void *context);
+
 // Deallocate any resources used by the result of an index query.
 void index_result_cleanup(struct IndexResult *result);
 
+// Gets the size and modification time recorded for the file of the given handle,
+// returning false if there are none (e.g. it was read from a pipe).
+bool index_stat(struct Index index, struct IndexPathHandle handle, struct IndexFileStat *stat);
+
+// Returns the range of positions where a match covered by the given handle may start.
+struct IndexRange index_range(struct Index index, struct IndexPathHandle handle);
+
+// Returns how many blocks a gram found at `offset` bytes into the query may be
+// away from the block where the match actually starts. Zero if files aren't split.
+size_t index_block_span(struct Index index, size_t offset);
+
+// Compares two handles, ordered like they are in results. Usable with qsort/bsearch.
+int index_handle_cmp(const void *a, const void *b);
+
+// Returns whether both handles refer to the same indexed file (possibly different blocks).
+bool index_same_file(struct IndexPathHandle a, struct IndexPathHandle b);
+
+// Moves a handle by some number of blocks within the same file, returning false
+// if that would fall outside of it. Handles to unsplit files are not affected.
+bool index_handle_seek(struct IndexPathHandle *handle, int64_t blocks);
+
+// Keeps only the candidates (sorted handles) in the given result, or whose match may start in a
+// block which is at most `span` blocks before one in it (see `index_block_span()`), moving them
+// to the front of the array (in the same order) and returning how many there are.
+size_t index_intersect(
+	struct Index index, struct IndexResult result, size_t span,
+	struct IndexPathHandle *candidates, size_t length
+);
+
 // Returns the number of non-null bytes in the path corresponding to the given offset.
 size_t index_pathlen(struct Index index, struct IndexPathHandle handle);
 
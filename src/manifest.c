@@ -0,0 +1,394 @@
+#include "manifest.h"
+
+#include "index.h"
+
+#include <stb/stb_ds.h> // arr* macros
+#include <sys/file.h> // flock
+#include <sys/stat.h> // fstat
+
+#include <errno.h>
+#include <fcntl.h> // open, O_* flags
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdio.h>
+#include <stdlib.h> // malloc, free, strtoul
+#include <string.h> // strlen, strrchr, memcpy, memcmp
+#include <unistd.h> // access, close
+
+
+// text file format:
+//
+// - header line: "busk-manifest 1" (the format version)
+// - optionally, a "next-shard <n>" line with the number of the next shard to be named
+// - then one line per shard: "shard <path>", in the order they're queried
+// - each shard line may be followed by "tombstone <path>" lines, for the paths
+//   (files or directories) which it deletes or replaces in the shards before it
+// - then one line per retired shard: "retired <path>", which isn't queried anymore
+// - empty lines and lines starting with '#' are ignored
+
+#define MANIFEST_MAGIC "busk-manifest 1"
+
+bool manifest_sniff(FILE *file)
+{
+	// index files start with a non-ascii byte, so a single char is enough
+	const int c = getc(file);
+	if (c == EOF) return false;
+	ungetc(c, file);
+	return c == MANIFEST_MAGIC[0];
+}
+
+bool manifest_add(struct Manifest *manifest, const char *shard_path)
+{
+	const size_t length = strlen(shard_path);
+	char *copy = malloc(length + 1);
+	if (!copy) return false;
+	memcpy(copy, shard_path, length + 1);
+	stbds_arrpush(manifest->shards, copy);
+	return true;
+}
+
+bool manifest_add_retired(struct Manifest *manifest, const char *shard_path)
+{
+	const size_t length = strlen(shard_path);
+	char *copy = malloc(length + 1);
+	if (!copy) return false;
+	memcpy(copy, shard_path, length + 1);
+	stbds_arrpush(manifest->retired, copy);
+	return true;
+}
+
+// Finds the next component of a path, starting from `*offset` (which is moved to it) and
+// skipping empty and "." ones, so that e.g. "./a//b/" and "a/b" are spelled the same.
+// Returns the length of the component, or zero past the end of the path.
+static size_t path_component(const char *path, size_t pathlen, size_t *offset)
+{
+	for (size_t start = *offset;;) {
+		while (start < pathlen && path[start] == '/') ++start;
+		size_t end = start;
+		while (end < pathlen && path[end] != '/') ++end;
+		if (end - start == 1 && path[start] == '.') {
+			start = end;
+			continue;
+		}
+		*offset = start;
+		return end - start;
+	}
+}
+
+// Checks whether a path is `ancestor` itself, or somewhere under it, however they're spelled.
+static bool path_within(const char *path, size_t pathlen, const char *ancestor, size_t length)
+{
+	const bool absolute = pathlen > 0 && path[0] == '/';
+	if (absolute != (length > 0 && ancestor[0] == '/')) return false;
+	size_t i = 0, j = 0;
+	for (size_t n; (n = path_component(ancestor, length, &j)) > 0; j += n) {
+		const size_t m = path_component(path, pathlen, &i);
+		if (m != n || memcmp(&path[i], &ancestor[j], n) != 0) return false;
+		i += m;
+	}
+	return true;
+}
+
+bool manifest_add_tombstone(struct Manifest *manifest, const char *path)
+{
+	if (stbds_arrlenu(manifest->shards) == 0) return false;
+
+	// normalized, so that "./a//b/" is stored as "a/b" (and "./" as ".", which deletes every relative path)
+	const size_t pathlen = strlen(path);
+	char *copy = malloc(pathlen + 2);
+	if (!copy) return false;
+	size_t length = 0;
+	if (path[0] == '/') copy[length++] = '/';
+	for (size_t offset = 0, n; (n = path_component(path, pathlen, &offset)) > 0; offset += n) {
+		if (length > 0 && copy[length - 1] != '/') copy[length++] = '/';
+		memcpy(&copy[length], &path[offset], n);
+		length += n;
+	}
+	if (length == 0) copy[length++] = '.';
+	copy[length] = '\0';
+	const struct ManifestTombstone tombstone = { .shard = stbds_arrlenu(manifest->shards) - 1, .path = copy };
+	stbds_arrpush(manifest->tombstones, tombstone);
+	return true;
+}
+
+bool manifest_deleted(const struct Manifest *manifest, size_t shard, const char *path, size_t pathlen)
+{
+	// tombstones are sorted by shard, and only the later ones matter
+	for (size_t i = stbds_arrlenu(manifest->tombstones); i > 0 && manifest->tombstones[i - 1].shard > shard; --i) {
+		const char *deleted = manifest->tombstones[i - 1].path;
+		if (path_within(path, pathlen, deleted, strlen(deleted))) return true;
+	}
+	return false;
+}
+
+char *manifest_new_shard(struct Manifest *manifest, const char *manifest_path)
+{
+	const char *slash = strrchr(manifest_path, '/');
+	const char *name = slash ? slash + 1 : manifest_path;
+	const size_t length = strlen(name);
+	char *shard = malloc(length + 32);
+	if (!shard) return NULL;
+
+	for (unsigned long n = manifest->next_shard;; ++n) {
+		snprintf(shard, length + 32, "%s.%lu", name, n);
+		bool used = false;
+		for (size_t i = 0; i < stbds_arrlenu(manifest->shards) && !used; ++i) {
+			used = strcmp(manifest->shards[i], shard) == 0;
+		}
+		for (size_t i = 0; i < stbds_arrlenu(manifest->retired) && !used; ++i) {
+			used = strcmp(manifest->retired[i], shard) == 0;
+		}
+		if (used) continue;
+
+		char *path = manifest_shard_path(manifest_path, shard);
+		if (!path) break;
+		const bool exists = access(path, F_OK) == 0;
+		free(path);
+		if (!exists) {
+			manifest->next_shard = n + 1;
+			return shard;
+		}
+	}
+	free(shard);
+	return NULL;
+}
+
+int manifest_save(const struct Manifest *manifest, FILE *file)
+{
+	if (fprintf(file, MANIFEST_MAGIC "\n") < 0) return -EIO;
+	if (manifest->next_shard > 0 && fprintf(file, "next-shard %lu\n", manifest->next_shard) < 0) return -EIO;
+	for (size_t i = 0; i < stbds_arrlenu(manifest->shards); ++i) {
+		if (fprintf(file, "shard %s\n", manifest->shards[i]) < 0) return -EIO;
+		for (size_t j = 0; j < stbds_arrlenu(manifest->tombstones); ++j) {
+			if (manifest->tombstones[j].shard != i) continue;
+			if (fprintf(file, "tombstone %s\n", manifest->tombstones[j].path) < 0) return -EIO;
+		}
+	}
+	for (size_t i = 0; i < stbds_arrlenu(manifest->retired); ++i) {
+		if (fprintf(file, "retired %s\n", manifest->retired[i]) < 0) return -EIO;
+	}
+	return fflush(file) == 0 ? 0 : -EIO;
+}
+
+int manifest_load(struct Manifest *manifest, FILE *file)
+{
+	// return zero: OK
+	// return negative: not enough data aka unexpected EOF
+	// return positive: something wrong with read data
+
+	char *line = NULL;
+	size_t capacity = 0;
+	int error = -3;
+	for (size_t lineno = 0; getline(&line, &capacity, file) >= 0; ++lineno) {
+		size_t length = strlen(line);
+		if (length > 0 && line[length - 1] == '\n') line[--length] = '\0';
+
+		if (lineno == 0) {
+			if (strcmp(line, MANIFEST_MAGIC) != 0) {
+				error = 1;
+				break;
+			}
+			error = 0;
+		} else if (length == 0 || line[0] == '#') {
+			continue;
+		} else if (strncmp(line, "next-shard ", 11) == 0 && length > 11) {
+			char *end = NULL;
+			errno = 0;
+			manifest->next_shard = strtoul(&line[11], &end, 10);
+			if (errno || *end != '\0') {
+				error = 2;
+				break;
+			}
+		} else if (strncmp(line, "shard ", 6) == 0 && length > 6) {
+			if (!manifest_add(manifest, &line[6])) {
+				error = -ENOMEM;
+				break;
+			}
+		} else if (strncmp(line, "tombstone ", 10) == 0 && length > 10) {
+			if (stbds_arrlenu(manifest->shards) == 0) {
+				error = 3; // tombstones must follow their shard
+				break;
+			} else if (!manifest_add_tombstone(manifest, &line[10])) {
+				error = -ENOMEM;
+				break;
+			}
+		} else if (strncmp(line, "retired ", 8) == 0 && length > 8) {
+			if (!manifest_add_retired(manifest, &line[8])) {
+				error = -ENOMEM;
+				break;
+			}
+		} else {
+			error = 2;
+			break;
+		}
+	}
+	free(line);
+
+	if (error) manifest_cleanup(manifest);
+	return error;
+}
+
+char *manifest_shard_path(const char *manifest_path, const char *shard_path)
+{
+	const char *slash = manifest_path ? strrchr(manifest_path, '/') : NULL;
+	const size_t dirlen = shard_path[0] == '/' || !slash ? 0 : (size_t)(slash - manifest_path) + 1;
+	const size_t length = strlen(shard_path);
+	char *path = malloc(dirlen + length + 1);
+	if (!path) return NULL;
+	if (dirlen > 0) memcpy(path, manifest_path, dirlen);
+	memcpy(&path[dirlen], shard_path, length + 1);
+	return path;
+}
+
+int manifest_lock(const char *manifest_path)
+{
+	// the manifest itself gets replaced, so the lock is taken on a file of its own
+	const size_t length = strlen(manifest_path);
+	char *lock_path = malloc(length + sizeof(".lock"));
+	if (!lock_path) return -ENOMEM;
+	memcpy(lock_path, manifest_path, length);
+	memcpy(&lock_path[length], ".lock", sizeof(".lock"));
+	const int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	const int error = fd < 0 ? -errno : 0;
+	free(lock_path);
+	if (error) return error;
+
+	while (flock(fd, LOCK_EX) != 0) {
+		if (errno == EINTR) continue;
+		const int lock_error = -errno;
+		close(fd);
+		return lock_error;
+	}
+	return fd;
+}
+
+void manifest_unlock(int lock)
+{
+	close(lock); // which releases the lock
+}
+
+static bool segment_keeps(void *context, size_t segment, const char *path, size_t pathlen)
+{
+	return !manifest_deleted(context, segment, path, pathlen);
+}
+
+int64_t manifest_compact(const char *manifest_path, struct ManifestCompactOptions options, size_t *segments)
+{
+	*segments = 0;
+
+	// deltas added while merging would be lost, so they have to wait until it's done
+	const int lock = manifest_lock(manifest_path);
+	if (lock < 0) return lock;
+
+	int64_t result = 0;
+	struct Manifest manifest = {0};
+	struct Manifest compacted = {0};
+	FILE **inputs = NULL;
+	char *shard = NULL;
+	char *shard_path = NULL;
+	char *tmp_path = NULL;
+
+	FILE *file = fopen(manifest_path, "r");
+	if (!file) {
+		result = -errno;
+		goto cleanup;
+	}
+	const int load_error = manifest_load(&manifest, file);
+	fclose(file);
+	if (load_error) {
+		result = load_error < 0 ? load_error : -EINVAL;
+		goto cleanup;
+	}
+
+	const size_t nshards = stbds_arrlenu(manifest.shards);
+	*segments = nshards;
+	uint64_t base_size = 0, delta_size = 0;
+	for (size_t i = 0; i < nshards; ++i) {
+		char *path = manifest_shard_path(manifest_path, manifest.shards[i]);
+		FILE *input = path ? fopen(path, "r") : NULL;
+		if (!input) result = path ? -errno : -ENOMEM;
+		free(path);
+		if (!input) goto cleanup;
+		stbds_arrpush(inputs, input);
+
+		struct stat filestat = {0};
+		if (fstat(fileno(input), &filestat) != 0) continue;
+		if (i == 0) base_size = filestat.st_size;
+		else delta_size += filestat.st_size;
+	}
+
+	// without thresholds, any delta is merged
+	bool needed = nshards > 1;
+	if (options.max_segments || options.max_delta) {
+		needed = (options.max_segments && nshards > (size_t)options.max_segments)
+			|| (options.max_delta && delta_size * 100 > base_size * (uint64_t)options.max_delta);
+	}
+	if (!needed) goto cleanup;
+
+	// the new segment gets a fresh name, so searches keep seeing the old ones until the swap
+	shard = manifest_new_shard(&manifest, manifest_path);
+	shard_path = shard ? manifest_shard_path(manifest_path, shard) : NULL;
+	if (!shard_path) {
+		result = -ENOMEM;
+		goto cleanup;
+	}
+	FILE *output = fopen(shard_path, "w+");
+	if (!output) {
+		result = -errno;
+		goto cleanup;
+	}
+	result = index_merge(inputs, nshards, segment_keeps, &manifest, output);
+	if (fclose(output) != 0 && result >= 0) result = -EIO;
+	if (result < 0) goto cleanup;
+
+	compacted.next_shard = manifest.next_shard;
+	bool added = manifest_add(&compacted, shard);
+	for (size_t i = 0; i < nshards && added; ++i) added = manifest_add_retired(&compacted, manifest.shards[i]);
+	const size_t tmp_pathlen = strlen(manifest_path) + sizeof(".tmp");
+	tmp_path = added ? malloc(tmp_pathlen) : NULL;
+	if (!tmp_path) {
+		result = -ENOMEM;
+		goto cleanup;
+	}
+	snprintf(tmp_path, tmp_pathlen, "%s.tmp", manifest_path);
+	file = fopen(tmp_path, "w");
+	if (!file) {
+		result = -errno;
+		goto cleanup;
+	}
+	const int save_error = manifest_save(&compacted, file);
+	if (fclose(file) != 0 || save_error || rename(tmp_path, manifest_path) != 0) {
+		result = save_error ? save_error : -errno;
+		remove(tmp_path);
+		goto cleanup;
+	}
+
+	// only segments retired by the previous compaction are old enough to go
+	for (size_t i = 0; i < stbds_arrlenu(manifest.retired); ++i) {
+		char *path = manifest_shard_path(manifest_path, manifest.retired[i]);
+		if (path) remove(path); // otherwise, it's just left behind
+		free(path);
+	}
+
+cleanup:
+	manifest_unlock(lock);
+	if (shard_path && result < 0) remove(shard_path);
+	for (size_t i = 0; i < stbds_arrlenu(inputs); ++i) fclose(inputs[i]);
+	stbds_arrfree(inputs);
+	free(tmp_path);
+	free(shard_path);
+	free(shard);
+	manifest_cleanup(&compacted);
+	manifest_cleanup(&manifest);
+	return result;
+}
+
+void manifest_cleanup(struct Manifest *manifest)
+{
+	for (size_t i = 0; i < stbds_arrlenu(manifest->shards); ++i) free(manifest->shards[i]);
+	stbds_arrfree(manifest->shards);
+	for (size_t i = 0; i < stbds_arrlenu(manifest->tombstones); ++i) free(manifest->tombstones[i].path);
+	stbds_arrfree(manifest->tombstones);
+	for (size_t i = 0; i < stbds_arrlenu(manifest->retired); ++i) free(manifest->retired[i]);
+	stbds_arrfree(manifest->retired);
+}
@@ -0,0 +1,82 @@
+#ifndef INCLUDE_MANIFEST_H
+#define INCLUDE_MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h> // int64_t
+#include <stdio.h> // FILE
+
+
+// Path deleted (along with everything under it) from the shards before some other.
+struct ManifestTombstone {
+	size_t shard; // index of the shard which introduced it
+	char *path;
+};
+
+// List of index shards making up a bigger index. Must be initialized with `{0}`.
+// Later shards are delta segments, whose tombstones hide files of earlier ones.
+struct Manifest {
+	char **shards; // stb array of paths, relative to the manifest's own directory
+	struct ManifestTombstone *tombstones; // stb array, in order of their shards
+	char **retired; // stb array of shards replaced by a compaction, which searches may still be opening
+	unsigned long next_shard; // number of the next shard to be named, so that names are never reused
+};
+
+// Thresholds past which `manifest_compact()` merges segments. When both are unset, any delta is.
+struct ManifestCompactOptions {
+	long max_segments; // or zero when unset
+	long max_delta; // percentage of the base segment, or zero when unset
+};
+
+
+// Checks (without consuming anything) whether a file starts like a manifest, instead of an index.
+bool manifest_sniff(FILE *file);
+
+// Adds a shard to the manifest, returning false when out of memory.
+bool manifest_add(struct Manifest *manifest, const char *shard_path);
+
+// Adds a shard which is no longer listed, but whose file is kept until the next compaction.
+bool manifest_add_retired(struct Manifest *manifest, const char *shard_path);
+
+// Adds a tombstone to the last shard of the manifest, returning false when out of memory.
+bool manifest_add_tombstone(struct Manifest *manifest, const char *path);
+
+// Checks whether a path indexed in some shard was deleted (or reindexed) by a later one.
+// Paths are compared component by component, so "./a//b" is under a tombstone of "a/".
+bool manifest_deleted(const struct Manifest *manifest, size_t shard, const char *path, size_t pathlen);
+
+// Picks a name for a new shard, next to the manifest and unused by any other file (nor by any
+// shard it ever had, since searches reading an older manifest may still open those), returning
+// a newly allocated string (relative to the manifest) or NULL when out of memory.
+char *manifest_new_shard(struct Manifest *manifest, const char *manifest_path);
+
+// Serialize manifest to file, returning zero on success or a negative error code.
+int manifest_save(const struct Manifest *manifest, FILE *file);
+
+// Load manifest from file, returning zero on success or an error code.
+int manifest_load(struct Manifest *manifest, FILE *file);
+
+// Resolves the path of a shard relative to the path of its manifest (or the current
+// directory, when NULL), returning a newly allocated string or NULL when out of memory.
+char *manifest_shard_path(const char *manifest_path, const char *shard_path);
+
+// Takes an exclusive lock on the manifest at the given path, waiting for whoever else has it.
+// Updates hold it from loading the manifest until replacing it, so they don't lose each other's
+// segments (searches never take it). Returns a file descriptor to be given to `manifest_unlock()`,
+// or a negative error code.
+int manifest_lock(const char *manifest_path);
+
+// Releases a lock taken with `manifest_lock()`.
+void manifest_unlock(int lock);
+
+// Replaces the segments of the manifest at the given path with a single one, dropping deleted
+// files, when past the given thresholds. Replaced segments are only removed by the next compaction,
+// since searches reading the old manifest may still be about to open them. Returns the size of the
+// new segment, zero if there was no need for it, or a negative error code (-EINVAL when segments
+// are invalid or incompatible). Either way, `*segments` is set to how many the manifest had.
+int64_t manifest_compact(const char *manifest_path, struct ManifestCompactOptions options, size_t *segments);
+
+// Deallocates every shard path and tombstone.
+void manifest_cleanup(struct Manifest *manifest);
+
+#endif // INCLUDE_MANIFEST_H
@@ -0,0 +1,277 @@
+#include "index.h"
+#define LOG_NAME "busk.merge"
+#include "log.h"
+#include "manifest.h"
+#include "version.h"
+
+#include <argp.h>
+#include <stb/stb_ds.h> // arr* macros
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h> // NULL
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // free, strtol
+#include <string.h> // strlen
+
+
+typedef struct {
+	const char **index_paths;
+	bool verbose;
+	const char *index_output_path;
+	bool compact;
+	long max_segments; // or zero when unset
+	long max_delta; // percentage of the base segment, or zero when unset
+} Config;
+
+static const char cli_doc[] = "Merge index files (or manifests of shards) into a single index.";
+
+static const char cli_args_doc[] = "<INDEX>...";
+
+enum {
+	CLI_MAX_SEGMENTS = 0x100, // long-only options start after the ASCII range
+	CLI_MAX_DELTA,
+};
+
+static const struct argp_option cli_options[] = {
+	{
+		.name="verbose", .key='v',
+		.doc="Print more verbose output to stderr",
+	},
+	{
+		.name="output", .key='o', .arg="OUTPUT",
+		.doc="Output merged index to OUTPUT instead of stdout",
+	},
+	{
+		.name="compact", .key='c',
+		.doc="Merge the segments of each manifest given into a single one, in place, dropping deleted files",
+	},
+	{
+		.name="max-segments", .key=CLI_MAX_SEGMENTS, .arg="N",
+		.doc="Only compact manifests with more than N segments (or too big deltas)",
+	},
+	{
+		.name="max-delta", .key=CLI_MAX_DELTA, .arg="PERCENT",
+		.doc="Only compact manifests whose delta segments add up to more than PERCENT of the first one (or too many segments)",
+	},
+	{0},
+};
+
+// Parses a positive integer argument, exiting with an error if invalid.
+static long parse_count(struct argp_state *state, const char *arg)
+{
+	char *end = NULL;
+	const long value = strtol(arg, &end, 10);
+	if (end == arg || *end != '\0' || value < 1) argp_error(state, "invalid number '%s'", arg);
+	return value;
+}
+
+static error_t cli_parser(int key, char *arg, struct argp_state *state)
+{
+	Config *cfg = state->input;
+	switch (key) {
+		case 'v':
+			cfg->verbose = true;
+			break;
+
+		case 'o':
+			cfg->index_output_path = arg;
+			break;
+
+		case 'c':
+			cfg->compact = true;
+			break;
+
+		case CLI_MAX_SEGMENTS:
+			cfg->max_segments = parse_count(state, arg);
+			break;
+
+		case CLI_MAX_DELTA:
+			cfg->max_delta = parse_count(state, arg);
+			break;
+
+		case ARGP_KEY_ARG:
+			stbds_arrpush(cfg->index_paths, arg);
+			break;
+
+		case ARGP_KEY_END:
+			if (state->arg_num < 1) argp_usage(state);
+			if (cfg->compact && cfg->index_output_path) argp_error(state, "manifests are compacted in place, without an OUTPUT");
+			if (!cfg->compact && (cfg->max_segments || cfg->max_delta)) argp_error(state, "thresholds only apply with --compact");
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static const struct argp cli = {
+	.doc = cli_doc,
+	.args_doc = cli_args_doc,
+	.options = cli_options,
+	.parser = cli_parser,
+};
+
+
+// Index to be merged, possibly a segment of a manifest whose tombstones apply to it.
+typedef struct {
+	FILE *file;
+	char *path;
+	const struct Manifest *manifest; // unless NULL
+	size_t shard;
+} Input;
+
+static bool input_keeps(void *context, size_t input, const char *path, size_t pathlen)
+{
+	const Input *inputs = context;
+	const struct Manifest *manifest = inputs[input].manifest;
+	return !manifest || !manifest_deleted(manifest, inputs[input].shard, path, pathlen);
+}
+
+// Opens every shard of a manifest, in order.
+static void open_shards(const char *path, const struct Manifest *manifest, Input **inputs)
+{
+	for (size_t i = 0; i < stbds_arrlenu(manifest->shards); ++i) {
+		char *shard_path = manifest_shard_path(path, manifest->shards[i]);
+		if (!shard_path) LOG_FATAL("Failed to allocate shard path");
+		FILE *shard = fopen(shard_path, "r");
+		if (!shard) LOG_FATALF("Failed to open index file at '%s' (errno = %d)", shard_path, errno);
+		const Input input = { .file = shard, .path = shard_path, .manifest = manifest, .shard = i };
+		stbds_arrpush(*inputs, input);
+	}
+}
+
+// Opens an index, or every shard of a manifest (which is then loaded into `manifests`).
+static void open_inputs(const char *path, Input **inputs, struct Manifest ***manifests)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) LOG_FATALF("Failed to open index file at '%s' (errno = %d)", path, errno);
+
+	if (!manifest_sniff(file)) {
+		char *copy = manifest_shard_path(NULL, path);
+		if (!copy) LOG_FATAL("Failed to allocate index path");
+		const Input input = { .file = file, .path = copy };
+		stbds_arrpush(*inputs, input);
+		return;
+	}
+
+	struct Manifest *manifest = calloc(1, sizeof(struct Manifest));
+	if (!manifest) LOG_FATAL("Failed to allocate manifest");
+	const int load_error = manifest_load(manifest, file);
+	if (load_error) LOG_FATALF("Failed to parse manifest from '%s' (errno = %d)", path, load_error);
+	fclose(file);
+	LOG_DEBUGF("Manifest with %zu shards loaded from %s", stbds_arrlenu(manifest->shards), path);
+	stbds_arrpush(*manifests, manifest);
+	open_shards(path, manifest, inputs);
+}
+
+static void inputs_cleanup(Input *inputs)
+{
+	for (size_t i = 0; i < stbds_arrlenu(inputs); ++i) {
+		fclose(inputs[i].file);
+		free(inputs[i].path);
+	}
+	stbds_arrfree(inputs);
+}
+
+// Merges every input into a (seekable) output, returning the number of bytes written.
+static int64_t merge_inputs(Input *inputs, FILE *outfile)
+{
+	const size_t ninputs = stbds_arrlenu(inputs);
+	FILE **files = NULL;
+	for (size_t i = 0; i < ninputs; ++i) {
+		LOG_DEBUGF("Merging index %zu from %s", i, inputs[i].path);
+		stbds_arrpush(files, inputs[i].file);
+	}
+
+	const int64_t written = index_merge(files, ninputs, input_keeps, inputs, outfile);
+	if (written == -EINVAL) {
+		LOG_FATAL("Failed to merge indexes, some of them are invalid or incompatible");
+	} else if (written < 0) {
+		LOG_FATALF("Failed to read or write indexes while merging (errno = %zd)", -written);
+	}
+	stbds_arrfree(files);
+	return written;
+}
+
+// Replaces the segments of a manifest with a single one, when past the given thresholds.
+static void compact(const Config *cfg, const char *path)
+{
+	const struct ManifestCompactOptions options = { .max_segments = cfg->max_segments, .max_delta = cfg->max_delta };
+	size_t nshards = 0;
+	const int64_t written = manifest_compact(path, options, &nshards);
+	if (written == -EINVAL) {
+		LOG_FATALF("Failed to compact manifest at '%s', it or some of its segments are invalid", path);
+	} else if (written < 0) {
+		LOG_FATALF("Failed to compact manifest at '%s' (errno = %zd)", path, -written);
+	} else if (written == 0) {
+		LOG_INFOF("Manifest at %s has %zu segments, no need to compact it", path, nshards);
+	} else {
+		LOG_INFOF("Compacted %zu segments of %s (%zd bytes)", nshards, path, written);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	Config cfg = {0};
+	argp_program_version = VERSION_STRING;
+	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
+
+	if (cfg.verbose) logger.level = LOG_LEVEL_DEBUG;
+
+	if (cfg.compact) {
+		for (size_t i = 0; i < stbds_arrlenu(cfg.index_paths); ++i) compact(&cfg, cfg.index_paths[i]);
+		stbds_arrfree(cfg.index_paths);
+		return 0;
+	}
+
+	Input *inputs = NULL;
+	struct Manifest **manifests = NULL;
+	for (size_t i = 0; i < stbds_arrlenu(cfg.index_paths); ++i) {
+		open_inputs(cfg.index_paths[i], &inputs, &manifests);
+	}
+
+	// gram counts are patched into the header at the end, so pipes get a temporary file
+	const char *outpath = cfg.index_output_path;
+	FILE *outfile = NULL;
+	FILE *spool = NULL;
+	if (!outpath) {
+		outfile = stdout;
+		outpath = "*stdout*";
+		if (ftello(outfile) < 0) {
+			spool = tmpfile();
+			if (!spool) LOG_FATALF("Failed to create temporary file (errno = %d)", errno);
+		}
+	} else {
+		outfile = fopen(outpath, "w+");
+		if (!outfile)
+			LOG_FATALF("Failed to open output file at '%s' (errno = %d)", outpath, errno);
+	}
+
+	const int64_t written = merge_inputs(inputs, spool ? spool : outfile);
+
+	if (spool) {
+		rewind(spool);
+		char buffer[4096];
+		for (size_t length; (length = fread(buffer, 1, sizeof(buffer), spool)) > 0;) {
+			if (fwrite(buffer, 1, length, outfile) != length) {
+				LOG_FATALF("Failed to write merged index to output (errno = %d)", errno);
+			}
+		}
+		if (ferror(spool)) LOG_FATALF("Failed to read back merged index (errno = %d)", errno);
+		fclose(spool);
+	}
+	LOG_INFOF("Merged %zu indexes into %s (%zd bytes)", stbds_arrlenu(inputs), outpath, written);
+
+	inputs_cleanup(inputs);
+	for (size_t i = 0; i < stbds_arrlenu(manifests); ++i) {
+		manifest_cleanup(manifests[i]);
+		free(manifests[i]);
+	}
+	stbds_arrfree(manifests);
+	fclose(outfile);
+	stbds_arrfree(cfg.index_paths);
+	return 0;
+}
@@ -0,0 +1,448 @@
+#include "index.h"
+#define LOG_NAME "busk.microbench"
+#include "log.h"
+#include "version.h"
+
+#include <argp.h>
+#include <stb/stb_ds.h> // arr* macros
+
+#include <errno.h>
+#include <math.h> // sqrt
+#include <stdbool.h>
+#include <stddef.h> // NULL, size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // qsort, strtol, strtoull
+#include <string.h> // strlen, strncmp, memcpy
+#include <time.h> // clock_gettime
+
+
+// contents are indexed as files of (at most) this size, like mk-index reads them
+#define MICROBENCH_FILE_SIZE 4096
+
+// default number of paths indexed (and decoded) by the path kernels, also used as names for the files above
+#ifndef MICROBENCH_PATHS
+#define MICROBENCH_PATHS 10000
+#endif
+
+typedef struct {
+	bool verbose;
+	long runs;
+	uint64_t size;
+	long paths;
+	uint64_t seed;
+	const char **kernels; // stb array of name prefixes, or NULL for all
+} Config;
+
+static const char cli_doc[] =
+	"Time the kernels of the index in isolation, on synthetic inputs, "
+	"reporting the cost per byte (or per operation) over several runs.";
+
+enum {
+	CLI_SEED = 0x100, // long-only options start after the ASCII range
+	CLI_SIZE,
+	CLI_PATHS,
+};
+
+static const struct argp_option cli_options[] = {
+	{
+		.name="verbose", .key='v',
+		.doc="Print more verbose output to stderr",
+	},
+	{
+		.name="kernel", .key='k', .arg="NAME",
+		.doc="Only run kernels whose name starts with NAME (may be given more than once)",
+	},
+	{
+		.name="runs", .key='n', .arg="N",
+		.doc="Repeat each kernel N times (default: 10)",
+	},
+	{
+		.name="size", .key=CLI_SIZE, .arg="SIZE",
+		.doc="Bytes of contents indexed by each run of the indexing kernels (default: 4M)",
+	},
+	{
+		.name="paths", .key=CLI_PATHS, .arg="N",
+		.doc="Number of paths (and documents) in the path and intersection kernels (default: 10000)",
+	},
+	{
+		.name="seed", .key=CLI_SEED, .arg="N",
+		.doc="Seed of the generated inputs (default: 1)",
+	},
+	{0},
+};
+
+// Parses a byte count with an optional K, M or G suffix.
+static bool parse_size(const char *str, uint64_t *size)
+{
+	char *end = NULL;
+	errno = 0;
+	const unsigned long long value = strtoull(str, &end, 10);
+	if (errno || end == str) return false;
+
+	uint64_t multiplier = 1;
+	switch (*end) {
+		case '\0': break;
+		case 'k': case 'K': multiplier = UINT64_C(1) << 10; ++end; break;
+		case 'm': case 'M': multiplier = UINT64_C(1) << 20; ++end; break;
+		case 'g': case 'G': multiplier = UINT64_C(1) << 30; ++end; break;
+		default: return false;
+	}
+	if (*end != '\0' || value > UINT64_MAX / multiplier) return false;
+
+	*size = value * multiplier;
+	return true;
+}
+
+static error_t cli_parser(int key, char *arg, struct argp_state *state)
+{
+	Config *cfg = state->input;
+	switch (key) {
+		case 'v':
+			cfg->verbose = true;
+			break;
+
+		case 'k':
+			stbds_arrpush(cfg->kernels, arg);
+			break;
+
+		case 'n': {
+			char *end = NULL;
+			cfg->runs = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || cfg->runs < 1 || cfg->runs > 100000) {
+				argp_error(state, "invalid number of runs '%s'", arg);
+			}
+			break;
+		}
+
+		case CLI_SIZE:
+			if (!parse_size(arg, &cfg->size) || cfg->size == 0) argp_error(state, "invalid size '%s'", arg);
+			break;
+
+		case CLI_PATHS: {
+			char *end = NULL;
+			cfg->paths = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || cfg->paths < 1 || cfg->paths > 10000000) {
+				argp_error(state, "invalid number of paths '%s'", arg);
+			}
+			break;
+		}
+
+		case CLI_SEED: {
+			char *end = NULL;
+			errno = 0;
+			cfg->seed = strtoull(arg, &end, 10);
+			if (errno || end == arg || *end != '\0') argp_error(state, "invalid seed '%s'", arg);
+			break;
+		}
+
+		case ARGP_KEY_ARG:
+			argp_usage(state);
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static const struct argp cli = {
+	.doc = cli_doc,
+	.options = cli_options,
+	.parser = cli_parser,
+};
+
+
+static double now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// splitmix64, same as gen-corpus
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+static const char *const words[] = {
+	"walker", "index", "posting", "path", "buffer", "length", "count", "entry",
+	"file", "block", "shard", "query", "result", "gram", "hash", "node",
+	"list", "map", "table", "size", "offset", "error", "state", "config",
+	"option", "reader", "writer", "token", "parse", "load", "save", "merge",
+};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+// Inputs shared by every kernel, generated once.
+typedef struct {
+	uint8_t *text; // words, punctuation and indentation, like source code
+	uint8_t *binary; // uniformly random bytes, so nearly every ngram is new
+	size_t size; // of each of the above
+	char **paths; // stb array, in the order a directory walk would list them
+	struct Index queried; // loaded index whose documents are `paths`, with the grams below
+	struct IndexResult halves, tenths, all_but_hundredths; // of grams in every 2nd, 10th, and not 100th document
+} Inputs;
+
+static void inputs_make(Inputs *inputs, uint64_t size, size_t npaths, uint64_t seed)
+{
+	uint64_t rng = seed;
+	inputs->size = size;
+	inputs->text = malloc(size);
+	inputs->binary = malloc(size);
+	if (!inputs->text || !inputs->binary) LOG_FATAL("Failed to allocate inputs");
+
+	for (size_t filled = 0; filled < size;) {
+		const uint64_t random = rng_next(&rng);
+		const char *word = words[random % NWORDS];
+		static const char separators[] = " (),;.->\n\t*[]";
+		const size_t length = strlen(word);
+		for (size_t i = 0; i < length && filled < size; ++i) inputs->text[filled++] = word[i];
+		if (filled < size) inputs->text[filled++] = separators[(random >> 32) % (sizeof(separators) - 1)];
+	}
+	for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+		const uint64_t random = rng_next(&rng);
+		memcpy(&inputs->binary[i], &random, size - i < sizeof(random) ? size - i : sizeof(random));
+	}
+
+	// three levels of directories, with their files next to each other
+	char path[256];
+	for (size_t i = 0; i < npaths; ++i) {
+		const int length = snprintf(
+			path, sizeof(path), "src/%s/%s/%s_%zu.c",
+			words[i / 4096 % NWORDS], words[i / 128 % NWORDS], words[rng_next(&rng) % NWORDS], i
+		);
+		char *copy = malloc(length + 1);
+		if (!copy) LOG_FATAL("Failed to allocate inputs");
+		memcpy(copy, path, length + 1);
+		stbds_arrpush(inputs->paths, copy);
+	}
+
+	// every file has a gram in common, plus others in some of them (saved and loaded
+	// again, which is how search sees posting lists, complemented when they're dense)
+	struct Index index = {0};
+	for (size_t i = 0; i < npaths; ++i) {
+		char contents[16];
+		const int length = snprintf(
+			contents, sizeof(contents), "xyz%s%s%s",
+			i % 2 == 0 ? " aa" : "", i % 10 == 0 ? " bb" : "", i % 100 != 0 ? " cc" : ""
+		);
+		const char *filepath = inputs->paths[i];
+		if (index_contents(&index, contents, length, -1, filepath, strlen(filepath)) < 0) {
+			LOG_FATALF("Failed to index '%s'", filepath);
+		}
+	}
+	FILE *file = tmpfile();
+	if (!file) LOG_FATALF("Failed to create a temporary file (errno = %d)", errno);
+	if (index_save(index, file, (struct IndexSaveOptions){0}) < 0) LOG_FATAL("Failed to save the queried index");
+	index_cleanup(&index);
+	rewind(file);
+	const int error = index_load(&inputs->queried, file, (struct IndexLoadOptions){0});
+	if (error) LOG_FATALF("Failed to load the queried index (error = %d)", error);
+	fclose(file);
+
+	inputs->halves = index_query(inputs->queried, (struct IndexQuery){ .text = " aa", .strlen = 3 });
+	inputs->tenths = index_query(inputs->queried, (struct IndexQuery){ .text = " bb", .strlen = 3 });
+	inputs->all_but_hundredths = index_query(inputs->queried, (struct IndexQuery){ .text = " cc", .strlen = 3 });
+}
+
+static void inputs_cleanup(Inputs *inputs)
+{
+	free(inputs->text);
+	free(inputs->binary);
+	for (size_t i = 0; i < stbds_arrlenu(inputs->paths); ++i) free(inputs->paths[i]);
+	stbds_arrfree(inputs->paths);
+	index_result_cleanup(&inputs->halves);
+	index_result_cleanup(&inputs->tenths);
+	index_result_cleanup(&inputs->all_but_hundredths);
+	index_cleanup(&inputs->queried);
+}
+
+
+// Runs a kernel once, returning how long it took (in ns) and setting how many bytes (or ops) it processed.
+typedef double (*KernelFn)(const Inputs *inputs, uint64_t *ops);
+
+// Indexes contents as a sequence of files, i.e. `index_ngram()` (and maybe `index_sparse()`) per byte.
+static double index_files(const Inputs *inputs, const uint8_t *contents, bool sparse_grams, uint64_t *ops)
+{
+	struct Index index = { .options = { .sparse_grams = sparse_grams } };
+	const size_t npaths = stbds_arrlenu(inputs->paths);
+	const double start = now_ns();
+	for (size_t offset = 0, i = 0; offset < inputs->size; offset += MICROBENCH_FILE_SIZE, ++i) {
+		const size_t remaining = inputs->size - offset;
+		const size_t length = remaining < MICROBENCH_FILE_SIZE ? remaining : MICROBENCH_FILE_SIZE;
+		const char *filepath = inputs->paths[i % npaths];
+		index_contents(&index, &contents[offset], length, -1, filepath, strlen(filepath));
+	}
+	const double elapsed = now_ns() - start;
+	index_cleanup(&index);
+	*ops = inputs->size;
+	return elapsed;
+}
+
+static double kernel_index_text(const Inputs *inputs, uint64_t *ops)
+{
+	return index_files(inputs, inputs->text, false, ops);
+}
+
+static double kernel_index_binary(const Inputs *inputs, uint64_t *ops)
+{
+	return index_files(inputs, inputs->binary, false, ops);
+}
+
+static double kernel_index_sparse(const Inputs *inputs, uint64_t *ops)
+{
+	return index_files(inputs, inputs->text, true, ops);
+}
+
+// Adds empty files, i.e. `add_path_compressed()` (plus an fstat which fails right away).
+static double kernel_add_path(const Inputs *inputs, uint64_t *ops)
+{
+	struct Index index = {0};
+	const size_t npaths = stbds_arrlenu(inputs->paths);
+	size_t *lengths = malloc(npaths * sizeof(size_t));
+	if (!lengths) LOG_FATAL("Failed to allocate inputs");
+	for (size_t i = 0; i < npaths; ++i) lengths[i] = strlen(inputs->paths[i]);
+
+	const double start = now_ns();
+	for (size_t i = 0; i < npaths; ++i) index_contents(&index, NULL, 0, -1, inputs->paths[i], lengths[i]);
+	const double elapsed = now_ns() - start;
+
+	free(lengths);
+	index_cleanup(&index);
+	*ops = npaths;
+	return elapsed;
+}
+
+// Decodes every path of the queried index, i.e. `uncompress_path()`.
+static double kernel_index_path(const Inputs *inputs, uint64_t *ops)
+{
+	const struct IndexResult all = index_all(inputs->queried);
+	char pathbuf[4096];
+	size_t checksum = 0; // so that nothing is optimized away
+	const double start = now_ns();
+	for (size_t i = 0; i < all.length; ++i) {
+		checksum += index_path(inputs->queried, all.handles[i], pathbuf, sizeof(pathbuf));
+	}
+	const double elapsed = now_ns() - start;
+	if (checksum == 0) LOG_WARN("No paths were decoded");
+	*ops = all.length;
+	return elapsed;
+}
+
+// Intersects every document with a result, i.e. a step of the query loop in search, per candidate.
+static double intersect(const Inputs *inputs, struct IndexResult result, uint64_t *ops)
+{
+	const struct IndexResult all = index_all(inputs->queried);
+	struct IndexPathHandle *candidates = malloc(all.length * sizeof(struct IndexPathHandle));
+	if (!candidates) LOG_FATAL("Failed to allocate inputs");
+	memcpy(candidates, all.handles, all.length * sizeof(struct IndexPathHandle));
+
+	const double start = now_ns();
+	const size_t kept = index_intersect(inputs->queried, result, 0, candidates, all.length);
+	const double elapsed = now_ns() - start;
+	LOG_DEBUGF("Kept %zu of %zu candidates", kept, all.length);
+
+	free(candidates);
+	*ops = all.length;
+	return elapsed;
+}
+
+static double kernel_intersect_half(const Inputs *inputs, uint64_t *ops)
+{
+	return intersect(inputs, inputs->halves, ops);
+}
+
+static double kernel_intersect_tenth(const Inputs *inputs, uint64_t *ops)
+{
+	return intersect(inputs, inputs->tenths, ops);
+}
+
+static double kernel_intersect_complement(const Inputs *inputs, uint64_t *ops)
+{
+	return intersect(inputs, inputs->all_but_hundredths, ops);
+}
+
+static const struct {
+	const char *name;
+	const char *unit;
+	KernelFn run;
+} kernels[] = {
+	{ "index/text", "ns/byte", kernel_index_text },
+	{ "index/binary", "ns/byte", kernel_index_binary },
+	{ "index/sparse", "ns/byte", kernel_index_sparse },
+	{ "path/add", "ns/op", kernel_add_path },
+	{ "path/decode", "ns/op", kernel_index_path },
+	{ "intersect/half", "ns/op", kernel_intersect_half },
+	{ "intersect/tenth", "ns/op", kernel_intersect_tenth },
+	{ "intersect/complement", "ns/op", kernel_intersect_complement },
+};
+#define NKERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static bool kernel_selected(const Config *cfg, const char *name)
+{
+	if (!cfg->kernels) return true;
+	for (size_t i = 0; i < stbds_arrlenu(cfg->kernels); ++i) {
+		if (strncmp(name, cfg->kernels[i], strlen(cfg->kernels[i])) == 0) return true;
+	}
+	return false;
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	const double lhs = *(const double *)a;
+	const double rhs = *(const double *)b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+int main(int argc, char *argv[])
+{
+	Config cfg = { .runs = 10, .size = 4 << 20, .paths = MICROBENCH_PATHS, .seed = 1 };
+	argp_program_version = VERSION_STRING;
+	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
+
+	if (cfg.verbose) logger.level = LOG_LEVEL_DEBUG;
+#ifndef NDEBUG
+	LOG_WARN("Not a release build (see RELEASE=1), so measurements include sanitizers and debug checks");
+#endif
+
+	Inputs inputs = {0};
+	inputs_make(&inputs, cfg.size, cfg.paths, cfg.seed);
+
+	printf("%-22s %-8s %10s %10s %8s %10s %10s\n", "kernel", "unit", "median", "mean", "stddev", "min", "max");
+	double *samples = malloc(cfg.runs * sizeof(double));
+	if (!samples) LOG_FATAL("Failed to allocate samples");
+	for (size_t k = 0; k < NKERNELS; ++k) {
+		if (!kernel_selected(&cfg, kernels[k].name)) continue;
+
+		// one untimed run first, to warm up caches and the allocator
+		uint64_t ops = 0;
+		kernels[k].run(&inputs, &ops);
+		double mean = 0;
+		for (long r = 0; r < cfg.runs; ++r) {
+			const double elapsed = kernels[k].run(&inputs, &ops);
+			samples[r] = ops > 0 ? elapsed / ops : 0;
+			mean += samples[r] / cfg.runs;
+		}
+		double variance = 0;
+		for (long r = 0; r < cfg.runs; ++r) variance += (samples[r] - mean) * (samples[r] - mean) / cfg.runs;
+		qsort(samples, cfg.runs, sizeof(double), double_cmp);
+
+		// stddev is relative to the mean, which makes kernels easier to compare
+		const double median = cfg.runs % 2 ? samples[cfg.runs / 2] : (samples[cfg.runs / 2 - 1] + samples[cfg.runs / 2]) / 2;
+		printf(
+			"%-22s %-8s %10.3f %10.3f %7.1f%% %10.3f %10.3f\n",
+			kernels[k].name, kernels[k].unit, median, mean, mean > 0 ? 100 * sqrt(variance) / mean : 0,
+			samples[0], samples[cfg.runs - 1]
+		);
+		fflush(stdout);
+	}
+
+	free(samples);
+	inputs_cleanup(&inputs);
+	stbds_arrfree(cfg.kernels);
+	return EXIT_SUCCESS;
+}
@@ -1,12 +1,22 @@
 #include "index.h"
 #define LOG_NAME "busk.mk-index"
+#include "cli.h"
+#include "fetch.h"
+#include "ignore.h"
 #include "log.h"
+#include "manifest.h"
+#include "stats.h"
+#include "trace.h"
 #include "version.h"
+#include "walk.h"
+#include "watch.h"
 
 #include <argp.h>
 #include <dirent.h>
+#include <fcntl.h> // openat
 #include <stb/stb_ds.h> // arr* macros
 #include <sys/stat.h>
+#include <unistd.h> // close, sysconf
 
 #include <errno.h>
 #include <stdbool.h>
@@ -16,27 +26,110 @@
 #include <stdlib.h> // qsort
 #include <string.h> // strcmp, strlen, memcpy
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 #ifndef MKINDEX_MAX_FOLDER_DEPTH
 #define MKINDEX_MAX_FOLDER_DEPTH 64
 #endif
 
+#ifndef MKINDEX_WALK_AHEAD
+#define MKINDEX_WALK_AHEAD (64 * 1024)
+#endif
+
+#ifndef MKINDEX_IO_DEPTH
+#define MKINDEX_IO_DEPTH 32
+#endif
+
+#ifndef MKINDEX_IO_MAX_SIZE
+#define MKINDEX_IO_MAX_SIZE (1024 * 1024)
+#endif
+
+#ifndef MKINDEX_SNIFF_SIZE
+#define MKINDEX_SNIFF_SIZE 4096
+#endif
+
+#ifndef MKINDEX_WATCH_DEBOUNCE
+#define MKINDEX_WATCH_DEBOUNCE 1000
+#endif
+
+// how many segments a watched manifest may have before it's compacted
+#ifndef MKINDEX_WATCH_MAX_SEGMENTS
+#define MKINDEX_WATCH_MAX_SEGMENTS 16
+#endif
+
+#ifndef MKINDEX_DEFAULT_BLOCK_SIZE
+#define MKINDEX_DEFAULT_BLOCK_SIZE (64 * 1024)
+#endif
+
+#ifndef INDEX_NGRAM_SIZE
+#define INDEX_NGRAM_SIZE 3 // same default as the index, only for the help
+#endif
+
 
 typedef struct {
 	const char **corpus_paths;
 	bool verbose;
 	const char *index_output_path;
+	bool sparse_grams;
+	size_t ngram_size; // or zero for the default
+	bool dedup_contents;
+	bool dedup_links;
+	bool split_files;
+	uint64_t split_threshold;
+	uint64_t block_size;
+	int jobs;
+	bool sync_io;
+	enum FetchEngine io_engine;
+	uint64_t sniff_size; // zero to index binary files as well
+	struct IgnoreRules excludes;
+	struct IgnoreRules includes;
+	const char **ignore_files;
+	bool sharded;
+	uint64_t shard_size; // or zero for one shard per command line path
+	const char *delta_manifest_path;
+	bool watch;
+	long debounce_ms;
+	bool stats;
+	enum StatsFormat stats_format;
+	const char *trace_path;
 } Config;
 
 static void config_cleanup(Config *cfg)
 {
 	stbds_arrfree(cfg->corpus_paths);
+	ignore_cleanup(&cfg->excludes);
+	ignore_cleanup(&cfg->includes);
+	stbds_arrfree(cfg->ignore_files);
+}
+
+// Returns how many threads to use in the background, as configured with `--jobs`.
+static int config_jobs(const Config *cfg)
+{
+	return cfg->jobs >= 0 ? cfg->jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
 }
 
 static const char cli_doc[] = "Generate a text search index from the given files and/or directories.";
 
 static const char cli_args_doc[] = "<FILE/DIR>...";
 
+enum {
+	CLI_SPLIT_ABOVE = 0x100, // long-only options start after the ASCII range
+	CLI_BLOCK_SIZE,
+	CLI_IO,
+	CLI_BINARY,
+	CLI_INCLUDE,
+	CLI_IGNORE_FILE,
+	CLI_SHARDS,
+	CLI_DELTA,
+	CLI_WATCH,
+	CLI_STATS,
+	CLI_TRACE,
+	CLI_NGRAM_SIZE,
+};
+
 static const struct argp_option cli_options[] = {
 	{
 		.name="verbose", .key='v',
@@ -46,6 +139,74 @@ static const struct argp_option cli_options[] = {
 		.name="output", .key='o', .arg="OUTPUT",
 		.doc="Output index to OUTPUT instead of stdout",
 	},
+	{
+		.name="sparse", .key='s',
+		.doc="Also index variable-length sparse grams, for more selective queries",
+	},
+	{
+		.name="ngram-size", .key=CLI_NGRAM_SIZE, .arg="N",
+		.doc="Index ngrams of N bytes, from 2 to 8 (default: " STRINGIFY(INDEX_NGRAM_SIZE) "), where bigger ones make queries more selective but the index bigger",
+	},
+	{
+		.name="dedup", .key='d',
+		.doc="Index files with identical contents only once, as aliases of the first",
+	},
+	{
+		.name="exclude", .key='x', .arg="GLOB",
+		.doc="Skip files and directories matching GLOB (as in a .gitignore), so they're never opened",
+	},
+	{
+		.name="include", .key=CLI_INCLUDE, .arg="GLOB",
+		.doc="Only index files matching GLOB (or any other given one), while still walking every directory",
+	},
+	{
+		.name="ignore-file", .key=CLI_IGNORE_FILE, .arg="NAME",
+		.doc="Skip what's matched by the patterns of files named NAME (e.g. .gitignore) in the directory they're in",
+	},
+	{
+		.name="io", .key=CLI_IO, .arg="ENGINE",
+		.doc="Read files in the background with 'threads' (default) or 'uring', or just 'sync'",
+	},
+	{
+		.name="jobs", .key='j', .arg="N",
+		.doc="Walk directories (and encode the index once done) with N threads in the background (default: one per CPU)",
+	},
+	{
+		.name="link-aliases", .key='l',
+		.doc="Record files reached through several links (or symlinked directories) as aliases, instead of skipping them",
+	},
+	{
+		.name="shards", .key=CLI_SHARDS, .arg="POLICY",
+		.doc="Write a separate index per 'root' (i.e. each path given) or per SIZE of contents, named after OUTPUT, which is then a manifest listing them",
+	},
+	{
+		.name="delta", .key=CLI_DELTA, .arg="MANIFEST",
+		.doc="Add a segment to MANIFEST (creating it if needed) which replaces whatever was indexed under the given paths, even if they no longer exist",
+	},
+	{
+		.name="watch", .key=CLI_WATCH, .arg="MS", .flags=OPTION_ARG_OPTIONAL,
+		.doc="After indexing, keep adding a delta with whatever changed, once changes settle for MS milliseconds (default: 1000)",
+	},
+	{
+		.name="split-above", .key=CLI_SPLIT_ABOVE, .arg="SIZE",
+		.doc="Split files bigger than SIZE into blocks, so searches only read matching regions",
+	},
+	{
+		.name="block-size", .key=CLI_BLOCK_SIZE, .arg="SIZE",
+		.doc="Size of the blocks which split files are divided into (default: 64K)",
+	},
+	{
+		.name="binary", .key=CLI_BINARY, .arg="POLICY",
+		.doc="Either 'skip' files which look binary in their first 4K (default), only check their first N bytes with 'sniff-N', or 'index' them as well",
+	},
+	{
+		.name="stats", .key=CLI_STATS, .arg="FORMAT", .flags=OPTION_ARG_OPTIONAL,
+		.doc="Report time spent in each phase and other counters to stderr, as a 'table' (default) or 'json'",
+	},
+	{
+		.name="trace", .key=CLI_TRACE, .arg="FILE",
+		.doc="Write spans for each directory, file and phase to FILE as Chrome trace-event JSON (e.g. for Perfetto)",
+	},
 	{0},
 };
 
@@ -61,12 +222,131 @@ static error_t cli_parser(int key, char *arg, struct argp_state *state)
 			cfg->index_output_path = arg;
 			break;
 
+		case 's':
+			cfg->sparse_grams = true;
+			break;
+
+		case 'd':
+			cfg->dedup_contents = true;
+			break;
+
+		case 'j': {
+			char *end = NULL;
+			const long jobs = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || jobs < 0 || jobs > 1024) {
+				argp_error(state, "invalid number of jobs '%s'", arg);
+			}
+			cfg->jobs = jobs;
+			break;
+		}
+
+		case 'l':
+			cfg->dedup_links = true;
+			break;
+
+		case CLI_SPLIT_ABOVE:
+			if (!parse_size(arg, &cfg->split_threshold)) argp_error(state, "invalid size '%s'", arg);
+			cfg->split_files = true;
+			break;
+
+		case CLI_IO:
+			if (strcmp(arg, "threads") == 0) {
+				cfg->io_engine = FETCH_THREADS;
+			} else if (strcmp(arg, "uring") == 0) {
+				cfg->io_engine = FETCH_URING;
+			} else if (strcmp(arg, "sync") == 0) {
+				cfg->sync_io = true;
+			} else {
+				argp_error(state, "invalid I/O engine '%s'", arg);
+			}
+			break;
+
+		case 'x':
+			if (!ignore_add(&cfg->excludes, arg, strlen(arg))) argp_error(state, "invalid glob '%s'", arg);
+			break;
+
+		case CLI_INCLUDE:
+			if (!ignore_add(&cfg->includes, arg, strlen(arg))) argp_error(state, "invalid glob '%s'", arg);
+			break;
+
+		case CLI_IGNORE_FILE:
+			stbds_arrpush(cfg->ignore_files, arg);
+			break;
+
+		case CLI_BINARY:
+			if (strcmp(arg, "skip") == 0) {
+				cfg->sniff_size = MKINDEX_SNIFF_SIZE;
+			} else if (strcmp(arg, "index") == 0) {
+				cfg->sniff_size = 0;
+			} else if (strncmp(arg, "sniff-", 6) != 0 || !parse_size(arg + 6, &cfg->sniff_size)) {
+				argp_error(state, "invalid binary file policy '%s'", arg);
+			}
+			break;
+
+		case CLI_BLOCK_SIZE:
+			if (!parse_size(arg, &cfg->block_size) || cfg->block_size == 0) {
+				argp_error(state, "invalid block size '%s'", arg);
+			}
+			break;
+
 		case ARGP_KEY_ARG:
 			stbds_arrpush(cfg->corpus_paths, arg);
 			break;
 
+		case CLI_SHARDS:
+			if (strcmp(arg, "root") == 0) {
+				cfg->shard_size = 0;
+			} else if (!parse_size(arg, &cfg->shard_size) || cfg->shard_size == 0) {
+				argp_error(state, "invalid sharding policy '%s'", arg);
+			}
+			cfg->sharded = true;
+			break;
+
+		case CLI_DELTA:
+			cfg->delta_manifest_path = arg;
+			break;
+
+		case CLI_WATCH:
+			cfg->watch = true;
+			if (arg) {
+				char *end = NULL;
+				cfg->debounce_ms = strtol(arg, &end, 10);
+				if (end == arg || *end != '\0' || cfg->debounce_ms < 0 || cfg->debounce_ms > 3600 * 1000) {
+					argp_error(state, "invalid debounce period '%s'", arg);
+				}
+			}
+			break;
+
+		case CLI_STATS:
+			cfg->stats = true;
+			if (!arg || strcmp(arg, "table") == 0) {
+				cfg->stats_format = STATS_TABLE;
+			} else if (strcmp(arg, "json") == 0) {
+				cfg->stats_format = STATS_JSON;
+			} else {
+				argp_error(state, "invalid stats format '%s'", arg);
+			}
+			break;
+
+		case CLI_TRACE:
+			cfg->trace_path = arg;
+			break;
+
+		case CLI_NGRAM_SIZE: {
+			char *end = NULL;
+			const long size = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || size < 2 || size > 8) argp_error(state, "invalid ngram size '%s'", arg);
+			cfg->ngram_size = size;
+			break;
+		}
+
 		case ARGP_KEY_END:
 			if (state->arg_num < 1) argp_usage(state);
+			if (cfg->sharded && !cfg->index_output_path) argp_error(state, "shards need an OUTPUT to be named after");
+			if (cfg->delta_manifest_path && (cfg->sharded || cfg->index_output_path)) {
+				argp_error(state, "delta segments are written next to their MANIFEST, without an OUTPUT");
+			}
+			if (cfg->watch && !cfg->delta_manifest_path) argp_error(state, "watching needs a --delta MANIFEST to add changes to");
 			break;
 
 		default:
@@ -83,12 +363,94 @@ static const struct argp cli = {
 };
 
 
-int64_t index_file_filtered(struct Index *index, FILE *file, const char *filepath, size_t pathlen)
+// Phase timings and counters, reported with `--stats`.
+enum {
+	STAT_WALK,
+	STAT_READ,
+	STAT_CLASSIFY,
+	STAT_DEDUP,
+	STAT_INDEX,
+	STAT_SAVE,
+	STAT_DIRS,
+	STAT_FILES,
+	STAT_SKIPPED,
+	STAT_DUPLICATES,
+	STAT_FAILED,
+	STAT_BYTES,
+	STAT_NGRAMS,
+	STAT_SPARSE_GRAMS,
+	STAT_POSTING_BYTES,
+	STAT_OUTPUT_BYTES,
+	NSTATS
+};
+
+static struct StatsEntry stats[NSTATS] = {
+	[STAT_WALK] = { "walk", "Walking directories (waiting for listings)", STATS_TIME },
+	[STAT_READ] = { "read", "Opening and reading files", STATS_TIME },
+	[STAT_CLASSIFY] = { "classify", "Telling text from binary files", STATS_TIME },
+	[STAT_DEDUP] = { "dedup", "Checking for duplicates", STATS_TIME },
+	[STAT_INDEX] = { "index", "Indexing (tokenize and insert ngrams)", STATS_TIME },
+	[STAT_SAVE] = { "save", "Saving", STATS_TIME },
+	[STAT_DIRS] = { "dirs", "Directories listed", STATS_COUNT },
+	[STAT_FILES] = { "files", "Files indexed", STATS_COUNT },
+	[STAT_SKIPPED] = { "skipped", "Files skipped (binary or revisited)", STATS_COUNT },
+	[STAT_DUPLICATES] = { "duplicates", "Files indexed as aliases", STATS_COUNT },
+	[STAT_FAILED] = { "failed", "Files which failed to open or read", STATS_COUNT },
+	[STAT_BYTES] = { "bytes_read", "Bytes read", STATS_BYTES },
+	[STAT_NGRAMS] = { "ngrams", "Distinct ngrams", STATS_COUNT },
+	[STAT_SPARSE_GRAMS] = { "sparse_grams", "Distinct sparse grams", STATS_COUNT },
+	[STAT_POSTING_BYTES] = { "posting_bytes", "Posting list bytes (before complements)", STATS_BYTES },
+	[STAT_OUTPUT_BYTES] = { "output_bytes", "Index bytes written", STATS_BYTES },
+};
+
+// Saves an index (or shard), counting what's in it.
+static int64_t save_index(struct Index index, FILE *file, struct IndexSaveOptions options)
+{
+	const uint64_t start = stats_clock();
+	const uint64_t span = trace_begin();
+	const struct IndexCounts counts = index_counts(index);
+	stats_add(&stats[STAT_NGRAMS], counts.ngrams);
+	stats_add(&stats[STAT_SPARSE_GRAMS], counts.sparse_grams);
+	stats_add(&stats[STAT_POSTING_BYTES], counts.postings * sizeof(uint64_t));
+	const int64_t written = index_save(index, file, options);
+	if (written > 0) stats_add(&stats[STAT_OUTPUT_BYTES], written);
+	stats_since(&stats[STAT_SAVE], start);
+	trace_end("index_save", NULL, span);
+	return written;
+}
+
+// Writes the spans recorded with `--trace`, which then stops.
+static void save_trace(const char *path)
+{
+	const int error = trace_save(path);
+	if (error) LOG_ERRORF("Failed to write trace to '%s' (errno = %d)", path, -error);
+	else LOG_INFOF("Trace saved to %s", path);
+}
+
+
+// Checks whether a buffer looks like text, i.e. it has no control characters
+// other than whitespace (non-ASCII bytes could be UTF8 or ISO-8859-1).
+static bool looks_like_text(const uint8_t *buffer, size_t length)
 {
-	// read first 4k to determine whether this is a likely text file
-	uint8_t buffer[4096];
-	const size_t read_bytes = fread(buffer, 1, sizeof(buffer), file);
-	for (size_t i = 0; i < read_bytes; ++i) {
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	// 16 bytes at a time: compared as signed bytes, non-ASCII ones are negative
+	const __m128i minus_one = _mm_set1_epi8(-1);
+	const __m128i backspace = _mm_set1_epi8(8);
+	const __m128i shift_out = _mm_set1_epi8(14);
+	const __m128i space = _mm_set1_epi8(32);
+	const __m128i delete = _mm_set1_epi8(127);
+	for (; i + 16 <= length; i += 16) {
+		const __m128i bytes = _mm_loadu_si128((const __m128i *)&buffer[i]);
+		const __m128i below_space = _mm_and_si128(_mm_cmpgt_epi8(bytes, minus_one), _mm_cmplt_epi8(bytes, space));
+		const __m128i whitespace = _mm_and_si128(_mm_cmpgt_epi8(bytes, backspace), _mm_cmplt_epi8(bytes, shift_out));
+		const __m128i control = _mm_or_si128(_mm_andnot_si128(whitespace, below_space), _mm_cmpeq_epi8(bytes, delete));
+		if (_mm_movemask_epi8(control) != 0) return false;
+	}
+#endif
+
+	for (; i < length; ++i) {
 		const uint8_t c = buffer[i];
 		// ascii text ranges
 		if (9 <= c && c <= 13) continue;
@@ -96,33 +458,419 @@ int64_t index_file_filtered(struct Index *index, FILE *file, const char *filepat
 		// non-ascii, but could be UTF8 or ISO-8859-1
 		if (128 <= c) continue;
 		// otherwise, likely not text
-		// TODO: disable this via CLI flag to read binaries as well
-		// TODO: use regexes to filter by filename
 		// TODO: parsing binary formats such as PDFs might be useful
-		return 0;
+		return false;
+	}
+	return true;
+}
+
+// Indexes a file unless its first `sniff_size` bytes don't look like text.
+// These bytes are indexed right away instead of being read again, so every
+// file is read only once (and pipes work just as well).
+static int64_t index_file_filtered(
+	struct Index *index, FILE *file, const char *filepath, size_t pathlen, size_t sniff_size
+) {
+	uint8_t small_buffer[MKINDEX_SNIFF_SIZE];
+	uint8_t *head = sniff_size <= sizeof(small_buffer) ? small_buffer : malloc(sniff_size);
+	if (!head) return -ENOMEM;
+
+	uint64_t start = stats_clock();
+	const size_t head_length = fread(head, 1, sniff_size, file);
+	start = stats_since(&stats[STAT_READ], start);
+	int64_t result = 0;
+	if (ferror(file)) {
+		result = -EIO;
+	} else {
+		const bool text = looks_like_text(head, head_length);
+		start = stats_since(&stats[STAT_CLASSIFY], start);
+		if (text) {
+			// in between, the rest of the file is read as well
+			result = index_file_prefixed(index, head, head_length, file, filepath, pathlen);
+			stats_since(&stats[STAT_INDEX], start);
+		}
 	}
 
-	// remember to rewind the file before doing the actual indexing
-	rewind(file);
-	const int64_t result = index_file(index, file, filepath, pathlen);
+	if (head != small_buffer) free(head);
 	return result;
 }
 
-static int64_t index_dir_rec(struct Index *index, char **pathbufp, int depth)
+// Indexes a file (unless it's a duplicate or not text), returning whether it was indexed.
+// Its contents are read from `fd` (which is closed afterwards) unless they're already in memory.
+static bool index_regular_file(
+	struct Index *index, int fd, const uint8_t *contents, size_t length,
+	const char *filepath, size_t pathlen, size_t sniff_size
+) {
+	FILE *file = NULL;
+	if (!contents && !(file = fdopen(fd, "r"))) {
+		stats_add(&stats[STAT_FAILED], 1);
+		LOG_ERRORF("Failed to open file at '%s' (errno = %d)", filepath, errno);
+		close(fd);
+		return false;
+	}
+
+	bool indexed = false;
+	const uint64_t span = trace_begin();
+	uint64_t start = stats_clock();
+	const int duplicate = file
+		? index_duplicate(index, file, filepath, pathlen)
+		: index_duplicate_contents(index, contents, length, fd, filepath, pathlen);
+	start = stats_since(&stats[STAT_DEDUP], start);
+	if (duplicate > 0) {
+		indexed = true;
+		stats_add(&stats[STAT_DUPLICATES], 1);
+		LOG_DEBUGF("Indexed file '%s' (duplicate contents)", filepath);
+	} else if (duplicate < 0) {
+		stats_add(&stats[STAT_FAILED], 1);
+		LOG_ERRORF("Failed to read file at '%s' (errno = %d)", filepath, -duplicate);
+	} else {
+		int64_t ngrams = 0;
+		if (file) {
+			ngrams = index_file_filtered(index, file, filepath, pathlen, sniff_size);
+		} else {
+			const bool text = looks_like_text(contents, length < sniff_size ? length : sniff_size);
+			start = stats_since(&stats[STAT_CLASSIFY], start);
+			if (text) {
+				ngrams = index_contents(index, contents, length, fd, filepath, pathlen);
+				stats_since(&stats[STAT_INDEX], start);
+			}
+		}
+		if (ngrams < 0) {
+			stats_add(&stats[STAT_FAILED], 1);
+			LOG_ERRORF("Failed to index file at '%s' (errno = %zd)", filepath, -ngrams);
+		} else if (ngrams > 0) {
+			indexed = true;
+			stats_add(&stats[STAT_FILES], 1);
+			LOG_DEBUGF("Indexed file '%s' (%zu ngrams processed)", filepath, ngrams);
+		} else {
+			stats_add(&stats[STAT_SKIPPED], 1);
+			LOG_DEBUGF("Skipped non-text file '%s'", filepath);
+		}
+	}
+
+	// pipes can't tell how far they were read, but then they're never duplicates or binary
+	const off_t read_bytes = file ? ftello(file) : (off_t)length;
+	stats_add(&stats[STAT_BYTES], read_bytes > 0 ? (uint64_t)read_bytes : 0);
+
+	if (file) fclose(file);
+	else close(fd);
+	trace_endn("index_file", filepath, pathlen, span);
+	return indexed;
+}
+
+// Identifies a file, regardless of the path it was reached through.
+typedef struct {
+	uint64_t device;
+	uint64_t inode;
+} FileId;
+
+typedef struct {
+	FileId key;
+	uint64_t value; // files submitted to be fetched up to (and including) this one
+} FileIdSet;
+
+// Open directory, which is closed once nothing refers to it anymore.
+typedef struct {
+	int fd;
+	int refs;
+} DirRef;
+
+// File which was submitted to be fetched in the background.
+typedef struct {
+	char *path;
+	size_t pathlen;
+	DirRef *dir;
+} PendingFile;
+
+// Directory walker state, shared by every path given in the command line.
+typedef struct {
+	struct Index *index;
+	struct Walk *walk; // lists directories in the background
+	struct Fetch *fetch; // opens and reads files in the background, unless NULL
+	FileIdSet *visited; // files reached so far, so other links to them are caught early
+	uint64_t files_submitted; // to be fetched, so far
+	uint64_t files_fetched; // and indexed (in the same order), so far
+	size_t sniff_size; // how many bytes are checked to tell binary files apart
+	uint64_t files_indexed;
+	struct Manifest *manifest; // shards saved so far, unless NULL when not sharding
+	const char *output_path; // which shards are named after
+	uint64_t shard_size; // bytes of contents per shard, or zero when shards are per root
+	uint64_t shard_bytes; // indexed in the current shard so far
+	uint64_t shard_files;
+	struct Watch *watch; // where directories are added as they're walked, unless NULL
+	struct IndexSaveOptions save_options; // of each shard
+	const char **changed; // when not NULL, only paths leading to (or under) these are indexed
+} Walker;
+
+// Starts listing directories and fetching files in the background, as configured.
+static Walker walker_start(const Config *cfg, struct Index *index, struct WalkOptions walk_options)
+{
+	Walker walker = {
+		.index = index,
+		.walk = walk_start(walk_options),
+		.sniff_size = cfg->sniff_size,
+		.save_options = { .threads = config_jobs(cfg) },
+	};
+	if (!walker.walk) LOG_FATAL("Failed to start directory walker");
+	if (!cfg->sync_io) {
+		const struct FetchOptions fetch_options = {
+			.engine = cfg->io_engine,
+			.depth = MKINDEX_IO_DEPTH,
+			.max_size = MKINDEX_IO_MAX_SIZE,
+		};
+		walker.fetch = fetch_start(fetch_options);
+		if (!walker.fetch) LOG_FATAL("Failed to start reading files in the background");
+		if (fetch_engine(walker.fetch) != cfg->io_engine) LOG_WARN("io_uring is not supported, reading files with threads instead");
+	}
+	return walker;
+}
+
+static void walker_cleanup(Walker *walker)
+{
+	walk_finish(walker->walk);
+	fetch_finish(walker->fetch);
+	stbds_hmfree(walker->visited);
+}
+
+// Saves the current shard next to the manifest (unless it's empty), then starts a new one.
+static void walker_save_shard(Walker *walker)
+{
+	if (walker->shard_files == 0) return;
+
+	const size_t n = stbds_arrlenu(walker->manifest->shards);
+	const size_t pathlen = strlen(walker->output_path) + 1 + 20;
+	char *path = malloc(pathlen + 1);
+	if (!path) LOG_FATAL("Failed to allocate shard path");
+	snprintf(path, pathlen + 1, "%s.%zu", walker->output_path, n);
+	FILE *file = fopen(path, "w");
+	if (!file) LOG_FATALF("Failed to open shard file at '%s' (errno = %d)", path, errno);
+	const int64_t written = save_index(*walker->index, file, walker->save_options);
+	if (written < 0) LOG_FATALF("Failed to write shard to '%s' (errno = %zd)", path, written);
+	fclose(file);
+	LOG_DEBUGF("Saved shard with %zu files to %s", walker->shard_files, path);
+
+	// shards are listed relative to the manifest, which is in the same directory
+	const char *slash = strrchr(path, '/');
+	if (!manifest_add(walker->manifest, slash ? slash + 1 : path)) LOG_FATAL("Failed to add shard to manifest");
+	free(path);
+
+	const struct IndexOptions options = walker->index->options;
+	index_cleanup(walker->index);
+	*walker->index = (struct Index){ .options = options };
+	walker->shard_bytes = 0;
+	walker->shard_files = 0;
+}
+
+static void dir_unref(DirRef *dir)
+{
+	if (--dir->refs > 0) return;
+	close(dir->fd);
+	free(dir);
+}
+
+// Marks a file as visited, returning whether it already was.
+static bool walker_revisit(Walker *walker, FileId id)
+{
+	if (stbds_hmgeti(walker->visited, id) >= 0) return true;
+	stbds_hmput(walker->visited, id, walker->files_submitted + 1);
+	return false;
+}
+
+// Indexes an open file, unless it was already reached through another
+// link (in which case it is either skipped or, with `dedup_links`, aliased).
+// When `checked`, the walker already knows this is the first link it reached.
+static void walker_index_opened(
+	Walker *walker, int fd, const uint8_t *contents, size_t length,
+	const char *filepath, size_t pathlen, bool checked
+) {
+	// fstat on an open file doesn't need to resolve the path all over again
+	struct stat filestat = {0};
+	if (!walker->index->options.dedup_links && !checked) {
+		if (fstat(fd, &filestat) != 0) {
+			LOG_ERRORF("Failed to stat file at '%s' (errno = %d)", filepath, errno);
+			close(fd);
+			return;
+		} else if (walker_revisit(walker, (FileId){ .device = filestat.st_dev, .inode = filestat.st_ino })) {
+			stats_add(&stats[STAT_SKIPPED], 1);
+			LOG_DEBUGF("Skipped file '%s' (already indexed through another link)", filepath);
+			close(fd);
+			return;
+		}
+	}
+
+	// shards bounded by size are only cut between files
+	uint64_t size = length;
+	if (walker->manifest && walker->shard_size > 0) {
+		if (!contents && fstat(fd, &filestat) == 0) size = filestat.st_size;
+		if (walker->shard_bytes >= walker->shard_size) walker_save_shard(walker);
+	}
+
+	if (index_regular_file(walker->index, fd, contents, length, filepath, pathlen, walker->sniff_size)) {
+		++walker->files_indexed;
+		++walker->shard_files;
+		walker->shard_bytes += size;
+	}
+}
+
+// Indexes the oldest file being fetched, returning false if there were none.
+static bool walker_index_fetched(Walker *walker)
+{
+	struct FetchedFile fetched = {0};
+	const uint64_t start = stats_clock();
+	const uint64_t span = trace_begin();
+	if (!walker->fetch || !fetch_next(walker->fetch, &fetched)) return false;
+	++walker->files_fetched;
+	stats_since(&stats[STAT_READ], start);
+	PendingFile *pending = fetched.tag;
+	trace_endn("fetch_wait", pending->path, pending->pathlen, span);
+
+	if (fetched.fd < 0) {
+		stats_add(&stats[STAT_FAILED], 1);
+		LOG_ERRORF("Failed to open file at '%s' (errno = %d)", pending->path, -fetched.fd);
+	} else {
+		walker_index_opened(walker, fetched.fd, fetched.contents, fetched.length, pending->path, pending->pathlen, true);
+	}
+
+	fetch_release(&fetched);
+	dir_unref(pending->dir);
+	free(pending->path);
+	free(pending);
+	return true;
+}
+
+// Aliases a link to a file which was already indexed (without opening it), returning
+// whether it was. Otherwise, e.g. if the file wasn't text, it has to be fetched after all.
+static bool walker_index_link(
+	Walker *walker, DirRef *dir, const char *name, const char *filepath, size_t pathlen,
+	FileId id
+) {
+	struct stat filestat = {0};
+	if (fstatat(dir->fd, name, &filestat, 0) != 0) return false;
+	int result = index_duplicate_link(walker->index, &filestat, filepath, pathlen);
+
+	// the index only knows about the original after it's done being fetched, but
+	// files are indexed in order, so only those submitted up to it need to be
+	const uint64_t submitted = stbds_hmget(walker->visited, id);
+	if (result == 0 && walker->files_fetched < submitted) {
+		while (walker->files_fetched < submitted && walker_index_fetched(walker)) continue;
+		result = index_duplicate_link(walker->index, &filestat, filepath, pathlen);
+	}
+	if (result <= 0) return false;
+
+	stats_add(&stats[STAT_DUPLICATES], 1);
+	LOG_DEBUGF("Indexed file '%s' (duplicate contents)", filepath);
+	++walker->files_indexed;
+	++walker->shard_files;
+	return true;
+}
+
+// Indexes the regular file named `name` in directory `dir`, which may happen later
+// when it's fetched in the background. The full path is only used for the index and logs.
+// Files identified by `id` (unless NULL) are checked for revisits before they're opened.
+static void walker_index_file(
+	Walker *walker, DirRef *dir, const char *name, const char *filepath, size_t pathlen,
+	const FileId *id
+) {
+	// so that other links to a file aren't read all over again, just to be skipped or aliased
+	if (id && walker_revisit(walker, *id)) {
+		if (!walker->index->options.dedup_links) {
+			stats_add(&stats[STAT_SKIPPED], 1);
+			LOG_DEBUGF("Skipped file '%s' (already indexed through another link)", filepath);
+			return;
+		}
+		if (walker_index_link(walker, dir, name, filepath, pathlen, *id)) return;
+	}
+
+	if (!walker->fetch) {
+		const uint64_t start = stats_clock();
+		const int fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+		stats_since(&stats[STAT_READ], start);
+		if (fd < 0) {
+			stats_add(&stats[STAT_FAILED], 1);
+			LOG_ERRORF("Failed to open file at '%s' (errno = %d)", filepath, errno);
+		} else {
+			walker_index_opened(walker, fd, NULL, 0, filepath, pathlen, id != NULL);
+		}
+		return;
+	}
+
+	PendingFile *pending = malloc(sizeof(PendingFile));
+	char *path = malloc(pathlen + 1);
+	if (!pending || !path) LOG_FATAL("Failed to allocate memory for pending file");
+	memcpy(path, filepath, pathlen + 1);
+	*pending = (PendingFile){ .path = path, .pathlen = pathlen, .dir = dir };
+	dir->refs++;
+
+	// files are indexed in the same order they're submitted, so this stays reproducible
+	while (!fetch_submit(walker->fetch, dir->fd, name, pending)) {
+		if (!walker_index_fetched(walker)) LOG_FATAL("Failed to submit file to be fetched");
+	}
+	++walker->files_submitted;
+}
+
+// Checks whether a path is `ancestor` itself, or somewhere under it.
+static bool path_within(const char *path, size_t pathlen, const char *ancestor, size_t length)
+{
+	while (length > 1 && ancestor[length - 1] == '/') --length;
+	if (pathlen < length || memcmp(path, ancestor, length) != 0) return false;
+	return pathlen == length || path[length] == '/' || ancestor[length - 1] == '/';
+}
+
+// Checks whether a path was changed, or leads to something which was (see `Walker.changed`).
+static bool walker_wants(const Walker *walker, const char *path, size_t pathlen, bool is_dir)
+{
+	for (size_t i = 0; i < stbds_arrlenu(walker->changed); ++i) {
+		const char *changed = walker->changed[i];
+		const size_t length = strlen(changed);
+		if (path_within(path, pathlen, changed, length)) return true;
+		if (is_dir && path_within(changed, length, path, pathlen)) return true;
+	}
+	return false;
+}
+
+// Indexes a directory (named `name` in `dirfd`) as listed by the walk, then releases it.
+static int64_t index_dir_rec(Walker *walker, char **pathbufp, int dirfd, const char *name, struct WalkDir *dir)
 {
 	char *pathbuf = *pathbufp;
 
-	if (depth >= MKINDEX_MAX_FOLDER_DEPTH) {
-		LOG_ERRORF("Skipped directory at '%s' due to recursion depth limit (%d)", pathbuf, depth);
+	// watched before being listed, so that changes in between aren't missed
+	if (walker->watch) {
+		const int error = watch_add(walker->watch, pathbuf);
+		if (error) LOG_WARNF("Failed to watch directory at '%s' (errno = %d)", pathbuf, -error);
+	}
+
+	const uint64_t start = stats_clock();
+	const uint64_t span = trace_begin();
+	const struct WalkListing listing = walk_list(walker->walk, dir);
+	stats_since(&stats[STAT_WALK], start);
+	trace_end("walk_list", pathbuf, span);
+	if (listing.error == WALK_TOO_DEEP) {
+		LOG_ERRORF("Skipped directory at '%s' due to recursion depth limit (%d)", pathbuf, MKINDEX_MAX_FOLDER_DEPTH);
+		walk_release(walker->walk, dir);
+		return 0;
+	} else if (listing.error == WALK_LOOP) {
+		LOG_WARNF("Skipped directory at '%s' since it loops back to one of its parents", pathbuf);
+		walk_release(walker->walk, dir);
+		return 0;
+	} else if (listing.error == WALK_REVISITED) {
+		LOG_DEBUGF("Skipped directory '%s' (already indexed through another link)", pathbuf);
+		walk_release(walker->walk, dir);
 		return 0;
 	}
 
-	DIR *dir = opendir(pathbuf);
-	if (!dir) {
-		const int error = errno;
+	stats_add(&stats[STAT_DIRS], 1);
+
+	// files are opened relative to the directory, so we still need its fd
+	const int fd = listing.error < 0 && listing.length == 0 ? -1
+		: openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	DirRef *ref = fd >= 0 ? malloc(sizeof(DirRef)) : NULL;
+	if (!ref) {
+		const int error = listing.error < 0 ? -listing.error : errno;
 		LOG_ERRORF("Failed to open directory at '%s' (errno = %d)", pathbuf, error);
+		if (fd >= 0) close(fd);
+		walk_release(walker->walk, dir);
 		return -error;
 	}
+	*ref = (DirRef){ .fd = fd, .refs = 1 };
 
 	uint64_t file_count = 0;
 
@@ -131,13 +879,11 @@ static int64_t index_dir_rec(struct Index *index, char **pathbufp, int depth)
 		LOG_DEBUGF("Indexing directory '%s' ...", pathbuf);
 		++logger.indent;
 	}
-	errno = 0;
 
-	// TODO: read files in fully reproducible order
-	for (struct dirent *entry = NULL; (entry = readdir(dir)); errno = 0) {
-		const char *basename = entry->d_name;
-		if (strcmp(basename, ".") == 0) continue;
-		if (strcmp(basename, "..") == 0) continue;
+	// entries come sorted by name, so files are indexed in a reproducible order
+	for (size_t i = 0; i < listing.length; ++i) {
+		const struct WalkEntry entry = listing.entries[i];
+		const char *basename = entry.name;
 
 		// assemble null-terminated path
 		const size_t oldlen = stbds_arrlen(pathbuf);
@@ -147,27 +893,20 @@ static int64_t index_dir_rec(struct Index *index, char **pathbufp, int depth)
 		memcpy(&pathbuf[basename_offset], basename, basename_length);
 		stbds_arrpush(pathbuf, '\0'); // <- OK, back to null-terminated
 
-		struct stat fstat = {0};
-		if (stat(pathbuf, &fstat) != 0) {
-			LOG_ERRORF("Failed to stat file/dir at '%s' (errno = %d)", pathbuf, errno);
-		} else if (S_ISDIR(fstat.st_mode)) {
-			const int64_t result = index_dir_rec(index, &pathbuf, depth + 1);
+		if (walker->changed && !walker_wants(walker, pathbuf, stbds_arrlenu(pathbuf) - 1, entry.dir != NULL)) {
+			if (entry.dir) walk_release(walker->walk, entry.dir);
+		} else if (entry.error) {
+			LOG_ERRORF("Failed to stat file/dir at '%s' (errno = %d)", pathbuf, -entry.error);
+		} else if (entry.dir) {
+			const uint64_t span = trace_begin();
+			const int64_t result = index_dir_rec(walker, &pathbuf, fd, basename, entry.dir);
+			trace_end("index_dir_rec", pathbuf, span);
 			if (result >= 0) file_count += result;
-		} else if (S_ISREG(fstat.st_mode) || S_ISLNK(fstat.st_mode)) {
-			FILE *file = fopen(pathbuf, "r");
-			if (!file) {
-				LOG_ERRORF("Failed to open file at '%s' (errno = %d)", pathbuf, errno);
-			} else {
-				const size_t pathlen = stbds_arrlenu(pathbuf) - 1;
-				const int64_t ngrams = index_file_filtered(index, file, pathbuf, pathlen);
-				if (ngrams > 0) {
-					++file_count;
-					LOG_DEBUGF("Indexed file '%s' (%zu ngrams processed)", pathbuf, ngrams);
-				} else {
-					LOG_DEBUGF("Skipped non-text file '%s'", pathbuf);
-				}
-				fclose(file);
-			}
+		} else {
+			const size_t pathlen = stbds_arrlenu(pathbuf) - 1;
+			const FileId id = { .device = entry.device, .inode = entry.inode };
+			walker_index_file(walker, ref, basename, pathbuf, pathlen, &id);
+			++file_count;
 		}
 
 		// restore old dir path
@@ -175,18 +914,19 @@ static int64_t index_dir_rec(struct Index *index, char **pathbufp, int depth)
 		pathbuf[oldlen - 1] = '\0';
 	}
 
-	if (errno) LOG_ERRORF("Error while reading directory '%s' (errno = %d)", pathbuf, errno);
+	if (listing.error < 0) LOG_ERRORF("Error while reading directory '%s' (errno = %d)", pathbuf, -listing.error);
 	if (level <= LOG_LEVEL_DEBUG) {
 		--logger.indent;
 		LOG_DEBUGF("Indexed directory '%s' (%zu files processed)", pathbuf, file_count);
 	}
 
-	closedir(dir);
+	dir_unref(ref);
+	walk_release(walker->walk, dir);
 	*pathbufp = pathbuf;
 	return file_count;
 }
 
-static int64_t index_dir(struct Index *index, const char *dirpath)
+static int64_t index_dir(Walker *walker, const char *dirpath)
 {
 	// we'll use a single buffer to build full paths, pushing and popping
 	// suffixes like in a stack, and starting with the root directory
@@ -202,27 +942,175 @@ static int64_t index_dir(struct Index *index, const char *dirpath)
 	}
 	stbds_arrpush(pathbuf, '\0');
 
-	// TODO: detect folder structure loops
-	const int64_t fcount = index_dir_rec(index, &pathbuf, 0);
+	int64_t fcount = -ENOMEM;
+	const uint64_t start = stats_clock();
+	struct WalkDir *root = walk_root(walker->walk, pathbuf);
+	stats_since(&stats[STAT_WALK], start);
+	if (root) {
+		const uint64_t span = trace_begin();
+		fcount = index_dir_rec(walker, &pathbuf, AT_FDCWD, pathbuf, root);
+		trace_end("index_dir_rec", pathbuf, span);
+	}
 
 	stbds_arrfree(pathbuf);
 	return fcount;
 }
 
+// Saves the index as a new segment of a manifest, which replaces what its roots had in older ones.
+static void save_delta(struct Index index, const char *manifest_path, const char **roots, struct IndexSaveOptions options)
+{
+	// others updating the manifest in the meantime would have their segments dropped
+	const int lock = manifest_lock(manifest_path);
+	if (lock < 0) LOG_FATALF("Failed to lock manifest at '%s' (errno = %d)", manifest_path, -lock);
+	struct Manifest manifest = {0};
+	FILE *file = fopen(manifest_path, "r");
+	if (file) {
+		const int load_error = manifest_load(&manifest, file);
+		if (load_error) LOG_FATALF("Failed to parse manifest from '%s' (errno = %d)", manifest_path, load_error);
+		fclose(file);
+	} else if (errno != ENOENT) {
+		LOG_FATALF("Failed to open manifest at '%s' (errno = %d)", manifest_path, errno);
+	}
+	const bool has_base = stbds_arrlenu(manifest.shards) > 0;
+
+	char *shard = manifest_new_shard(&manifest, manifest_path);
+	char *shard_path = shard ? manifest_shard_path(manifest_path, shard) : NULL;
+	if (!shard_path) LOG_FATAL("Failed to allocate shard path");
+	file = fopen(shard_path, "w");
+	if (!file) LOG_FATALF("Failed to open shard file at '%s' (errno = %d)", shard_path, errno);
+	const int64_t written = save_index(index, file, options);
+	if (written < 0 || fclose(file) != 0) LOG_FATALF("Failed to write shard to '%s' (errno = %zd)", shard_path, written);
+
+	if (!manifest_add(&manifest, shard)) LOG_FATAL("Failed to add shard to manifest");
+	for (size_t i = 0; has_base && i < stbds_arrlenu(roots); ++i) {
+		if (!manifest_add_tombstone(&manifest, roots[i])) LOG_FATAL("Failed to add tombstone to manifest");
+	}
+
+	// the manifest is replaced atomically, so searches see either all of the new segment or none
+	const size_t tmp_pathlen = strlen(manifest_path) + sizeof(".tmp");
+	char *tmp_path = malloc(tmp_pathlen);
+	if (!tmp_path) LOG_FATAL("Failed to allocate manifest path");
+	snprintf(tmp_path, tmp_pathlen, "%s.tmp", manifest_path);
+	file = fopen(tmp_path, "w");
+	if (!file) LOG_FATALF("Failed to open manifest at '%s' (errno = %d)", tmp_path, errno);
+	const int save_error = manifest_save(&manifest, file);
+	if (save_error || fclose(file) != 0) LOG_FATALF("Failed to write manifest to '%s'", tmp_path);
+	if (rename(tmp_path, manifest_path) != 0) LOG_FATALF("Failed to replace manifest at '%s' (errno = %d)", manifest_path, errno);
+	manifest_unlock(lock);
+	LOG_INFOF("Segment %zu of %s saved to %s", stbds_arrlenu(manifest.shards) - 1, manifest_path, shard_path);
+
+	free(tmp_path);
+	free(shard_path);
+	free(shard);
+	manifest_cleanup(&manifest);
+}
+
+// Watches a file given in the command line, which isn't found by walking any directory.
+static void watch_root_file(struct Watch *watch, const char *path)
+{
+	const int error = watch_add(watch, path);
+	if (error) LOG_WARNF("Failed to watch file at '%s' (errno = %d)", path, -error);
+}
+
+// Keeps indexing whatever changes under the command line paths, adding a delta segment
+// to the manifest for every batch of changes. Only returns if watching fails.
+static void watch_updates(const Config *cfg, struct Watch *watch, struct IndexOptions options, struct WalkOptions walk_options)
+{
+	const size_t nroots = stbds_arrlenu(cfg->corpus_paths);
+	for (;;) {
+		char **changes = NULL;
+		const int result = watch_wait(watch, (int)cfg->debounce_ms, &changes);
+		if (result < 0) {
+			LOG_ERRORF("Failed to wait for changes (errno = %d)", -result);
+			watch_changes_free(changes);
+			break;
+		}
+
+		// events can still be reported for paths given with a different spelling, or after
+		// their root was deleted, but only those under some root are worth indexing again
+		const char **changed = NULL;
+		if (result == WATCH_OVERFLOW) {
+			LOG_WARN("Some changes were lost, so everything is indexed again");
+			for (size_t i = 0; i < nroots; ++i) stbds_arrpush(changed, cfg->corpus_paths[i]);
+		} else {
+			for (size_t i = 0; i < stbds_arrlenu(changes); ++i) {
+				// changes are sorted, so those in a deleted or new directory usually follow it
+				const size_t n = stbds_arrlenu(changed);
+				if (n > 0 && path_within(changes[i], strlen(changes[i]), changed[n - 1], strlen(changed[n - 1]))) continue;
+				for (size_t j = 0; j < nroots; ++j) {
+					const char *root = cfg->corpus_paths[j];
+					if (path_within(changes[i], strlen(changes[i]), root, strlen(root))) {
+						stbds_arrpush(changed, changes[i]);
+						break;
+					}
+				}
+			}
+		}
+		if (stbds_arrlenu(changed) == 0) {
+			stbds_arrfree(changed);
+			watch_changes_free(changes);
+			continue;
+		}
+		LOG_DEBUGF("Indexing %zu changed paths ...", stbds_arrlenu(changed));
+
+		struct Index index = { .options = options };
+		Walker walker = walker_start(cfg, &index, walk_options);
+		walker.watch = watch;
+		walker.changed = changed;
+		DirRef cwd = { .fd = AT_FDCWD, .refs = 1 };
+		for (size_t i = 0; i < nroots; ++i) {
+			const char *path = cfg->corpus_paths[i];
+			const size_t pathlen = strlen(path);
+			struct stat fstat = {0};
+			if (stat(path, &fstat) != 0) continue; // tombstones alone take care of deletions
+			if (S_ISDIR(fstat.st_mode)) {
+				if (walker_wants(&walker, path, pathlen, true)) index_dir(&walker, path);
+			} else if (S_ISREG(fstat.st_mode) && walker_wants(&walker, path, pathlen, false)) {
+				// files replaced by renaming over them need to be watched again
+				watch_root_file(watch, path);
+				const FileId id = { .device = fstat.st_dev, .inode = fstat.st_ino };
+				walker_index_file(&walker, &cwd, path, path, pathlen, &id);
+			}
+		}
+		while (walker_index_fetched(&walker)) continue;
+		LOG_INFOF("Successfully indexed the contents of %zu changed files", walker.files_indexed);
+		walker_cleanup(&walker);
+
+		save_delta(index, cfg->delta_manifest_path, changed, (struct IndexSaveOptions){ .threads = config_jobs(cfg) });
+		index_cleanup(&index);
+		stbds_arrfree(changed);
+		watch_changes_free(changes);
+
+		// otherwise, every batch of changes would make searches open yet another segment
+		const struct ManifestCompactOptions compact_options = { .max_segments = MKINDEX_WATCH_MAX_SEGMENTS };
+		size_t nsegments = 0;
+		const int64_t compacted = manifest_compact(cfg->delta_manifest_path, compact_options, &nsegments);
+		if (compacted < 0) {
+			LOG_ERRORF("Failed to compact manifest at '%s' (errno = %zd)", cfg->delta_manifest_path, -compacted);
+		} else if (compacted > 0) {
+			LOG_INFOF("Compacted %zu segments of %s (%zd bytes)", nsegments, cfg->delta_manifest_path, compacted);
+		}
+	}
+	watch_finish(watch);
+}
 
 int main(int argc, char *argv[])
 {
 	int retcode = 0;
+	const uint64_t start = stats_clock();
 
-	Config cfg = {0};
+	Config cfg = { .jobs = -1, .sniff_size = MKINDEX_SNIFF_SIZE };
 	argp_program_version = VERSION_STRING;
 	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
 
 	if (cfg.verbose) logger.level = LOG_LEVEL_DEBUG;
+	if (cfg.trace_path) trace_start();
 	const char *outpath = cfg.index_output_path;
 
 	FILE *outfile = NULL;
-	if (!outpath) {
+	if (cfg.delta_manifest_path) {
+		outpath = cfg.delta_manifest_path;
+	} else if (!outpath) {
 		outfile = stdout;
 		outpath = "*stdout*";
 	} else {
@@ -236,42 +1124,106 @@ int main(int argc, char *argv[])
 	qsort(cfg.corpus_paths, arglen, sizeof(char *), (int (*)(const void *, const void *))strcmp);
 
 	struct Index index = {0};
-	uint64_t files_indexed = 0;
+	index.options.sparse_grams = cfg.sparse_grams;
+	index.options.ngram_size = cfg.ngram_size;
+	index.options.dedup_contents = cfg.dedup_contents;
+	index.options.dedup_links = cfg.dedup_links;
+	if (cfg.split_files) {
+		index.options.block_size = cfg.block_size ? cfg.block_size : MKINDEX_DEFAULT_BLOCK_SIZE;
+		index.options.split_threshold = cfg.split_threshold;
+	}
+	struct WalkOptions walk_options = {
+		.threads = config_jobs(&cfg),
+		.max_ahead = MKINDEX_WALK_AHEAD,
+		.max_depth = MKINDEX_MAX_FOLDER_DEPTH,
+		.skip_revisits = !cfg.dedup_links,
+		.excludes = stbds_arrlenu(cfg.excludes.patterns) > 0 ? &cfg.excludes : NULL,
+		.includes = stbds_arrlenu(cfg.includes.patterns) > 0 ? &cfg.includes : NULL,
+		.ignore_files = cfg.ignore_files,
+	};
+	Walker walker = walker_start(&cfg, &index, walk_options);
+	if (cfg.watch) {
+		walker.watch = watch_start();
+		if (!walker.watch) LOG_FATALF("Failed to start watching for changes (errno = %d)", errno);
+	}
+
+	struct Manifest manifest = {0};
+	if (cfg.sharded) {
+		walker.manifest = &manifest;
+		walker.output_path = cfg.index_output_path;
+		walker.shard_size = cfg.shard_size;
+	}
+
+	// relative paths in the command line are opened from the current directory
+	DirRef cwd = { .fd = AT_FDCWD, .refs = 1 };
 	for (size_t i = 0; i < arglen; ++i) {
 		const char *path = cfg.corpus_paths[i];
+		if (cfg.sharded && cfg.shard_size == 0) {
+			while (walker_index_fetched(&walker)) continue;
+			walker_save_shard(&walker);
+		}
 		struct stat fstat = {0};
-		if (stat(path, &fstat) != 0) {
-			LOG_ERRORF("Failed to stat file/dir at '%s' (errno = %d)", path, errno);
+		const int stat_error = stat(path, &fstat) != 0 ? errno : 0;
+		if (stat_error == ENOENT && cfg.delta_manifest_path) {
+			LOG_DEBUGF("Nothing at '%s', so it's only deleted from older segments", path);
+		} else if (stat_error) {
+			LOG_ERRORF("Failed to stat file/dir at '%s' (errno = %d)", path, stat_error);
 		} else if (S_ISDIR(fstat.st_mode)) {
-			const int64_t result = index_dir(&index, path);
-			if (result >= 0) files_indexed += result;
-		} else if (S_ISREG(fstat.st_mode) || S_ISLNK(fstat.st_mode)) {
-			FILE *file = fopen(path, "r");
-			if (!file) {
+			index_dir(&walker, path);
+		} else if (S_ISREG(fstat.st_mode)) {
+			if (walker.watch) watch_root_file(walker.watch, path);
+			const FileId id = { .device = fstat.st_dev, .inode = fstat.st_ino };
+			walker_index_file(&walker, &cwd, path, path, strlen(path), &id);
+		} else if (S_ISFIFO(fstat.st_mode) || S_ISCHR(fstat.st_mode)) {
+			// pipes can't be read ahead, but files before them must be indexed first
+			while (walker_index_fetched(&walker)) continue;
+			const uint64_t opening = stats_clock();
+			const int fd = open(path, O_RDONLY | O_CLOEXEC);
+			stats_since(&stats[STAT_READ], opening);
+			if (fd < 0) {
+				stats_add(&stats[STAT_FAILED], 1);
 				LOG_ERRORF("Failed to open file at '%s' (errno = %d)", path, errno);
 			} else {
-				const size_t pathlen = strlen(path);
-				const int64_t ngrams = index_file_filtered(&index, file, path, pathlen);
-				if (ngrams > 0) {
-					++files_indexed;
-					LOG_DEBUGF("Indexed file '%s' (%zu ngrams processed)", path, ngrams);
-				} else {
-					LOG_DEBUGF("Skipped non-text file '%s'", path);
-				}
-				fclose(file);
+				walker_index_opened(&walker, fd, NULL, 0, path, strlen(path), false);
 			}
 		} else {
 			LOG_ERRORF("Invalid file type at '%s'", path);
 		}
 	}
+	while (walker_index_fetched(&walker)) continue;
+	if (cfg.sharded) walker_save_shard(&walker);
+	const uint64_t files_indexed = walker.files_indexed;
+	struct Watch *watch = walker.watch;
+	walker_cleanup(&walker);
 	LOG_INFOF("Successfully indexed the contents of %zu files", files_indexed);
 
-	const int64_t written = index_save(index, outfile);
-	if (written < 0) LOG_FATALF("Failed to write index to output (errno = %zd)", written);
-	LOG_INFOF("Search index saved to %s", outpath);
+	if (cfg.delta_manifest_path) {
+		save_delta(index, cfg.delta_manifest_path, cfg.corpus_paths, (struct IndexSaveOptions){ .threads = config_jobs(&cfg) });
+		if (cfg.stats) stats_print(stderr, cfg.stats_format, stats, NSTATS, start);
+		if (cfg.trace_path) save_trace(cfg.trace_path);
+		if (watch) {
+			// watching never ends, so the full index shouldn't stay around while it does
+			const struct IndexOptions options = index.options;
+			index_cleanup(&index);
+			index = (struct Index){ .options = options };
+			walk_options.threads = 0; // changes are usually few, so directories are only listed as needed
+			watch_updates(&cfg, watch, options, walk_options);
+		}
+	} else if (cfg.sharded) {
+		const int error = manifest_save(&manifest, outfile);
+		if (error) LOG_FATALF("Failed to write manifest to output (errno = %d)", -error);
+		LOG_INFOF("Manifest of %zu shards saved to %s", stbds_arrlenu(manifest.shards), outpath);
+		manifest_cleanup(&manifest);
+	} else {
+		const int64_t written = save_index(index, outfile, (struct IndexSaveOptions){ .threads = config_jobs(&cfg) });
+		if (written < 0) LOG_FATALF("Failed to write index to output (errno = %zd)", written);
+		LOG_INFOF("Search index saved to %s", outpath);
+	}
+	if (cfg.stats && !cfg.delta_manifest_path) stats_print(stderr, cfg.stats_format, stats, NSTATS, start);
+	if (cfg.trace_path && !cfg.delta_manifest_path) save_trace(cfg.trace_path);
 
 	index_cleanup(&index);
-	fclose(outfile);
+	if (outfile) fclose(outfile);
 	config_cleanup(&cfg);
 	return retcode;
 }
@@ -0,0 +1,246 @@
+#include "query.h"
+
+#include <stb/stb_ds.h> // arr* macros
+
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdlib.h> // qsort, bsearch
+#include <string.h> // strlen, memcpy, memset
+
+
+typedef struct {
+	struct IndexQuery gram;
+	struct IndexResult result;
+	size_t count; // number of files (or blocks) in the result, even when complemented
+} PlannedGram;
+
+static int planned_gram_cmp(const void *a, const void *b)
+{
+	const PlannedGram *lhs = a;
+	const PlannedGram *rhs = b;
+	// rarest grams first, breaking ties with the longest ones, then query order
+	if (lhs->count != rhs->count) return lhs->count < rhs->count ? -1 : 1;
+	if (lhs->gram.strlen != rhs->gram.strlen) return lhs->gram.strlen > rhs->gram.strlen ? -1 : 1;
+	if (lhs->gram.text != rhs->gram.text) return lhs->gram.text < rhs->gram.text ? -1 : 1;
+	return 0;
+}
+
+struct IndexPathHandle *query_index(struct Index index, const char *query, size_t query_len, const struct QueryHooks *hooks)
+{
+	// plan: look up every indexed gram of the query, then pick the rarest ones
+	// until they cover the whole query string (this always works, since the
+	// ngrams alone already do), and intersect them starting from the smallest
+	static const struct QueryHooks no_hooks = {0};
+	if (!hooks) hooks = &no_hooks;
+	struct IndexGrams grams = index_grams(index, (struct IndexQuery){ .text = query, .strlen = query_len });
+	const struct IndexResult all = index_all(index);
+	PlannedGram *plan = NULL;
+	stbds_arrsetlen(plan, grams.length);
+	for (size_t i = 0; i < grams.length; ++i) {
+		plan[i].gram = grams.grams[i];
+		const uint64_t span = hooks->begin ? hooks->begin() : 0;
+		plan[i].result = index_query_gram(index, grams.grams[i]);
+		if (hooks->end) hooks->end("index_query_gram", grams.grams[i].text, grams.grams[i].strlen, span);
+		const struct IndexResult result = plan[i].result;
+		plan[i].count = result.complement ? all.length - result.length : result.length;
+	}
+	qsort(plan, stbds_arrlenu(plan), sizeof(PlannedGram), planned_gram_cmp);
+
+	bool *covered = NULL;
+	stbds_arrsetlen(covered, query_len);
+	memset(covered, 0, query_len * sizeof(bool));
+	size_t uncovered = query_len;
+
+	struct IndexPathHandle *candidates = NULL; // sorted by offset, like posting lists
+	bool first = true;
+	for (size_t i = 0; i < stbds_arrlenu(plan) && uncovered > 0; ++i) {
+		const struct IndexQuery gram = plan[i].gram;
+		struct IndexResult result = plan[i].result;
+		const size_t gram_offset = gram.text - query;
+
+		// skip grams which wouldn't cover anything new
+		size_t newly_covered = 0;
+		for (size_t j = gram_offset; j < gram_offset + gram.strlen; ++j) {
+			if (!covered[j]) ++newly_covered;
+			covered[j] = true;
+		}
+		if (newly_covered == 0) continue;
+		uncovered -= newly_covered;
+
+		// when files are split, this gram might be a few blocks after the one
+		// where the match starts, so we need to look a bit further ahead
+		const size_t span = index_block_span(index, gram_offset);
+
+		if (first) { // populate initial set of results
+			// for a complemented result, that's every document except those listed
+			const struct IndexResult listed = result.complement ? all : result;
+			for (size_t j = 0; j < listed.length; ++j) {
+				if (result.complement && result.length > 0 && bsearch(
+					&listed.handles[j], result.handles, result.length,
+					sizeof(struct IndexPathHandle), index_handle_cmp
+				)) continue;
+				for (size_t d = 0; d <= span; ++d) {
+					struct IndexPathHandle handle = listed.handles[j];
+					if (!index_handle_seek(&handle, -(int64_t)d)) break;
+					stbds_arrpush(candidates, handle);
+				}
+			}
+			if (span > 0) { // sort and remove duplicates
+				const size_t n = stbds_arrlenu(candidates);
+				qsort(candidates, n, sizeof(struct IndexPathHandle), index_handle_cmp);
+				size_t kept = 0;
+				for (size_t j = 0; j < n; ++j) {
+					if (kept > 0 && index_handle_cmp(&candidates[kept - 1], &candidates[j]) == 0) continue;
+					candidates[kept++] = candidates[j];
+				}
+				stbds_arrsetlen(candidates, kept);
+			}
+			first = false;
+		} else { // keep only those also in this result
+			const uint64_t intersecting = hooks->begin ? hooks->begin() : 0;
+			const size_t kept = index_intersect(index, result, span, candidates, stbds_arrlenu(candidates));
+			stbds_arrsetlen(candidates, kept);
+			if (hooks->end) hooks->end("index_intersect", gram.text, gram.strlen, intersecting);
+		}
+
+		if (hooks->step) hooks->step(hooks->context, gram, plan[i].count, result.complement, stbds_arrlenu(candidates));
+
+		// no point in looking further once the intersection is empty
+		if (stbds_arrlenu(candidates) == 0) break;
+	}
+
+	for (size_t i = 0; i < stbds_arrlenu(plan); ++i) index_result_cleanup(&plan[i].result);
+	stbds_arrfree(plan);
+	stbds_arrfree(covered);
+	index_grams_cleanup(&grams);
+
+	return candidates;
+}
+
+void query_gather(
+	struct Index index, const struct IndexPathHandle *candidates, size_t query_len,
+	const struct Manifest *manifest, size_t shard, struct QueryCandidates *list
+) {
+	for (size_t j = 0; j < stbds_arrlenu(candidates);) {
+		// extract path from index, followed by those of files with the same contents
+		const struct IndexPathHandle handle = candidates[j];
+		const struct IndexResult aliases = index_aliases(index, handle);
+		struct QueryFile file = {
+			.path_offset = stbds_arrlenu(list->pathbuf),
+			.first_path = stbds_arrlenu(list->pathlens),
+			.first_range = stbds_arrlenu(list->ranges),
+		};
+		file.has_stat = index_stat(index, handle, &file.stat);
+		for (size_t a = 0; a <= aliases.length; ++a) {
+			const struct IndexPathHandle path = a == 0 ? handle : aliases.handles[a - 1];
+			const size_t pathlen = index_pathlen(index, path);
+			const size_t offset = stbds_arrlenu(list->pathbuf);
+			stbds_arrsetlen(list->pathbuf, offset + pathlen + 1);
+			index_path(index, path, &list->pathbuf[offset], pathlen + 1);
+			if (manifest && manifest_deleted(manifest, shard, &list->pathbuf[offset], pathlen)) {
+				stbds_arrsetlen(list->pathbuf, offset);
+				continue;
+			}
+			stbds_arrpush(list->pathlens, pathlen);
+			++file.npaths;
+		}
+		if (file.npaths == 0) {
+			for (; j < stbds_arrlenu(candidates) && index_same_file(handle, candidates[j]); ++j) continue;
+			continue;
+		}
+
+		// candidates in the same file are next to each other, so we merge
+		// their ranges (extended to fit matches starting at their end)
+		for (; j < stbds_arrlenu(candidates) && index_same_file(handle, candidates[j]); ++j) {
+			struct IndexRange range = index_range(index, candidates[j]);
+			range.end = range.end < UINT64_MAX - query_len ? range.end + query_len - 1 : UINT64_MAX;
+			const size_t n = stbds_arrlenu(list->ranges);
+			if (n > file.first_range && range.begin <= list->ranges[n - 1].end) {
+				list->ranges[n - 1].end = range.end;
+			} else {
+				stbds_arrpush(list->ranges, range);
+			}
+		}
+		stbds_arrpush(list->files, file);
+		stbds_arrlast(list->files).nranges = stbds_arrlenu(list->ranges) - file.first_range;
+	}
+}
+
+void query_list_files(struct Index index, const struct Manifest *manifest, size_t shard, struct QueryCandidates *list)
+{
+	const struct IndexResult all = index_all(index);
+	for (size_t j = 0; j < all.length; ++j) {
+		const struct IndexPathHandle handle = all.handles[j];
+		if (j > 0 && index_same_file(all.handles[j - 1], handle)) continue; // other blocks
+		const struct IndexResult aliases = index_aliases(index, handle);
+		for (size_t a = 0; a <= aliases.length; ++a) {
+			const struct IndexPathHandle path = a == 0 ? handle : aliases.handles[a - 1];
+			const size_t pathlen = index_pathlen(index, path);
+			const size_t offset = stbds_arrlenu(list->pathbuf);
+			stbds_arrsetlen(list->pathbuf, offset + pathlen + 1);
+			index_path(index, path, &list->pathbuf[offset], pathlen + 1);
+			if (manifest && manifest_deleted(manifest, shard, &list->pathbuf[offset], pathlen)) {
+				stbds_arrsetlen(list->pathbuf, offset);
+				continue;
+			}
+			struct QueryFile file = { .path_offset = offset, .first_path = stbds_arrlenu(list->pathlens), .npaths = 1 };
+			file.has_stat = index_stat(index, path, &file.stat);
+			stbds_arrpush(list->pathlens, pathlen);
+			stbds_arrpush(list->files, file);
+		}
+	}
+}
+
+void query_candidates_push_whole(struct QueryCandidates *list, const char *path)
+{
+	const size_t pathlen = strlen(path);
+	const struct QueryFile file = {
+		.path_offset = stbds_arrlenu(list->pathbuf),
+		.first_path = stbds_arrlenu(list->pathlens),
+		.npaths = 1,
+		.first_range = stbds_arrlenu(list->ranges),
+		.nranges = 1,
+	};
+	memcpy(stbds_arraddnptr(list->pathbuf, pathlen + 1), path, pathlen + 1);
+	stbds_arrpush(list->pathlens, pathlen);
+	stbds_arrpush(list->ranges, ((struct IndexRange){ .begin = 0, .end = UINT64_MAX }));
+	stbds_arrpush(list->files, file);
+}
+
+void query_candidates_append(struct QueryCandidates *list, struct QueryCandidates *other)
+{
+	const size_t path_offset = stbds_arrlenu(list->pathbuf);
+	const size_t first_path = stbds_arrlenu(list->pathlens);
+	const size_t first_range = stbds_arrlenu(list->ranges);
+	for (size_t i = 0; i < stbds_arrlenu(other->files); ++i) {
+		struct QueryFile file = other->files[i];
+		file.path_offset += path_offset;
+		file.first_path += first_path;
+		file.first_range += first_range;
+		stbds_arrpush(list->files, file);
+	}
+	const size_t pathbuf_length = stbds_arrlenu(other->pathbuf);
+	if (pathbuf_length > 0) memcpy(stbds_arraddnptr(list->pathbuf, pathbuf_length), other->pathbuf, pathbuf_length);
+	for (size_t i = 0; i < stbds_arrlenu(other->pathlens); ++i) stbds_arrpush(list->pathlens, other->pathlens[i]);
+	for (size_t i = 0; i < stbds_arrlenu(other->ranges); ++i) stbds_arrpush(list->ranges, other->ranges[i]);
+	query_candidates_cleanup(other);
+}
+
+void query_candidates_cleanup(struct QueryCandidates *list)
+{
+	stbds_arrfree(list->files);
+	stbds_arrfree(list->ranges);
+	stbds_arrfree(list->pathlens);
+	stbds_arrfree(list->pathbuf);
+}
+
+int64_t query_stat_mtime(const struct stat *filestat)
+{
+	return (int64_t)filestat->st_mtim.tv_sec * 1000000000 + filestat->st_mtim.tv_nsec;
+}
+
+bool query_stat_changed(const struct IndexFileStat *indexed, const struct stat *filestat)
+{
+	return indexed->size != (uint64_t)filestat->st_size || indexed->mtime != query_stat_mtime(filestat);
+}
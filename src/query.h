@@ -0,0 +1,73 @@
+#ifndef INCLUDE_QUERY_H
+#define INCLUDE_QUERY_H
+
+#include "index.h"
+#include "manifest.h"
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+
+// Candidate file to be grepped, pointing into arrays shared by all of them.
+struct QueryFile {
+	size_t path_offset; // of its NUL-separated paths, including aliases
+	size_t first_path; // index of its first path length
+	size_t npaths;
+	size_t first_range; // index of its first range to be searched
+	size_t nranges;
+	struct IndexFileStat stat; // when it was indexed, unless `has_stat` is false
+	bool has_stat;
+};
+
+// Candidate files of an index, pointing into the other arrays. Must be initialized with `{0}`.
+struct QueryCandidates {
+	char *pathbuf; // stb array
+	size_t *pathlens; // stb array
+	struct IndexRange *ranges; // stb array
+	struct QueryFile *files; // stb array
+};
+
+// Optional callbacks (any of which may be NULL) through which a query reports its progress.
+struct QueryHooks {
+	uint64_t (*begin)(void); // returns when a span begins, to be passed to `end`
+	void (*end)(const char *name, const char *detail, size_t length, uint64_t start);
+	void (*step)(void *context, struct IndexQuery gram, size_t files, bool complement, size_t candidates);
+	void *context;
+};
+
+
+// Plans and runs a query, returning the (sorted) handles of every candidate file or block
+// as an stb array. Only reads from the index, so it may be shared by several threads.
+// Hooks may be NULL.
+struct IndexPathHandle *query_index(struct Index index, const char *query, size_t query_len, const struct QueryHooks *hooks);
+
+// Gathers the paths (including aliases) and ranges to be searched in each candidate file,
+// except for paths deleted from this shard by later ones in the manifest, if any.
+void query_gather(
+	struct Index index, const struct IndexPathHandle *candidates, size_t query_len,
+	const struct Manifest *manifest, size_t shard, struct QueryCandidates *list
+);
+
+// Lists every indexed file (including aliases) along with its recorded stats, except for
+// paths deleted from this shard by later ones in the manifest, if any.
+void query_list_files(struct Index index, const struct Manifest *manifest, size_t shard, struct QueryCandidates *list);
+
+// Appends a file to be searched whole, since the index doesn't know where matches could be.
+void query_candidates_push_whole(struct QueryCandidates *list, const char *path);
+
+// Moves every candidate from another list to the end of this one.
+void query_candidates_append(struct QueryCandidates *list, struct QueryCandidates *other);
+
+// Deallocates every candidate.
+void query_candidates_cleanup(struct QueryCandidates *list);
+
+// Returns the modification time of a file, in nanoseconds.
+int64_t query_stat_mtime(const struct stat *filestat);
+
+// Checks whether a file no longer looks like it did when it was indexed.
+bool query_stat_changed(const struct IndexFileStat *indexed, const struct stat *filestat);
+
+#endif // INCLUDE_QUERY_H
@@ -1,21 +1,32 @@
 #include "index.h"
 #define LOG_NAME "busk.search"
+#include "fetch.h"
 #include "log.h"
+#include "manifest.h"
+#include "query.h"
+#include "stats.h"
+#include "trace.h"
 #include "version.h"
 
 #include <argp.h>
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
+#include <pthread.h>
 #include <stb/stb_ds.h> // hm* and arr* macros
 
 #include <assert.h>
 #include <errno.h>
+#include <dirent.h>
+#include <fcntl.h> // open, AT_FDCWD
 #include <stdbool.h>
 #include <stddef.h> // NULL
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h> // strlen
+#include <stdlib.h> // qsort
+#include <string.h> // strlen, memset
 #include <limits.h> // LINE_MAX
+#include <sys/stat.h>
+#include <unistd.h> // close, sysconf
 
 
 // TODO: read from cmdline option instead
@@ -23,14 +34,38 @@
 #define SEARCH_LINE_MAX LINE_MAX
 #endif
 
+#ifndef SEARCH_IO_DEPTH
+#define SEARCH_IO_DEPTH 32
+#endif
+
+#ifndef SEARCH_IO_MAX_SIZE
+#define SEARCH_IO_MAX_SIZE (1024 * 1024)
+#endif
+
 
 typedef struct {
 	const char *query;
 	bool verbose;
 	const char *index_input_path;
 	bool color;
+	bool sync_io;
+	enum FetchEngine io_engine;
+	int jobs;
+	bool rescan_stale;
+	bool trust_index;
+	bool stats;
+	enum StatsFormat stats_format;
+	const char *trace_path;
 } Config;
 
+enum {
+	CLI_IO = 0x100, // long-only options start after the ASCII range
+	CLI_RESCAN_STALE,
+	CLI_TRUST_INDEX,
+	CLI_STATS,
+	CLI_TRACE,
+};
+
 static const char cli_doc[] = "Query an index and search its backing files for a given string.";
 
 static const char cli_args_doc[] = "\"<SEARCH STRING>\"";
@@ -42,12 +77,36 @@ static const struct argp_option cli_options[] = {
 	},
 	{
 		.name="index", .key='i', .arg="INPUT",
-		.doc="Read index file from INPUT instead of stdin",
+		.doc="Read index file (or manifest of shards) from INPUT instead of stdin",
 	},
 	{
 		.name="color", .key='c',
 		.doc="Add terminal colors to search results",
 	},
+	{
+		.name="jobs", .key='j', .arg="N",
+		.doc="Query up to N shards of a manifest at once, checking each with the threads left (default: one per CPU)",
+	},
+	{
+		.name="io", .key=CLI_IO, .arg="ENGINE",
+		.doc="Read candidate files in the background with 'threads' (default) or 'uring', or just 'sync'",
+	},
+	{
+		.name="rescan-stale", .key=CLI_RESCAN_STALE,
+		.doc="Also search indexed files which changed since then (and new files next to them), even if the index doesn't list them as candidates",
+	},
+	{
+		.name="trust-index", .key=CLI_TRUST_INDEX,
+		.doc="Only verify the checksums of the index, skipping the structural checks of its postings (e.g. for indexes built on this machine)",
+	},
+	{
+		.name="stats", .key=CLI_STATS, .arg="FORMAT", .flags=OPTION_ARG_OPTIONAL,
+		.doc="Report time spent in each phase and other counters to stderr, as a 'table' (default) or 'json'",
+	},
+	{
+		.name="trace", .key=CLI_TRACE, .arg="FILE",
+		.doc="Write spans for each phase, posting list lookup and grepped file to FILE as Chrome trace-event JSON (e.g. for Perfetto)",
+	},
 	{0},
 };
 
@@ -67,6 +126,51 @@ static error_t cli_parser(int key, char *arg, struct argp_state *state)
 			cfg->color = true;
 			break;
 
+		case 'j': {
+			char *end = NULL;
+			const long jobs = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || jobs < 0 || jobs > 1024) {
+				argp_error(state, "invalid number of jobs '%s'", arg);
+			}
+			cfg->jobs = jobs;
+			break;
+		}
+
+		case CLI_IO:
+			if (strcmp(arg, "threads") == 0) {
+				cfg->io_engine = FETCH_THREADS;
+			} else if (strcmp(arg, "uring") == 0) {
+				cfg->io_engine = FETCH_URING;
+			} else if (strcmp(arg, "sync") == 0) {
+				cfg->sync_io = true;
+			} else {
+				argp_error(state, "invalid I/O engine '%s'", arg);
+			}
+			break;
+
+		case CLI_RESCAN_STALE:
+			cfg->rescan_stale = true;
+			break;
+
+		case CLI_TRUST_INDEX:
+			cfg->trust_index = true;
+			break;
+
+		case CLI_STATS:
+			cfg->stats = true;
+			if (!arg || strcmp(arg, "table") == 0) {
+				cfg->stats_format = STATS_TABLE;
+			} else if (strcmp(arg, "json") == 0) {
+				cfg->stats_format = STATS_JSON;
+			} else {
+				argp_error(state, "invalid stats format '%s'", arg);
+			}
+			break;
+
+		case CLI_TRACE:
+			cfg->trace_path = arg;
+			break;
+
 		case ARGP_KEY_ARG:
 			cfg->query = arg;
 			break;
@@ -89,6 +193,51 @@ static const struct argp cli = {
 };
 
 
+// Phase timings and counters, reported with `--stats`.
+enum {
+	STAT_LOAD,
+	STAT_INTERSECT,
+	STAT_GATHER,
+	STAT_RESCAN,
+	STAT_READ,
+	STAT_MATCH,
+	STAT_PRINT,
+	STAT_SHARDS,
+	STAT_NGRAMS,
+	STAT_POSTING_BYTES,
+	STAT_CANDIDATES,
+	STAT_FILES,
+	STAT_HITS,
+	STAT_FALSE_POSITIVES,
+	STAT_BYTES,
+	STAT_MATCHES,
+	STAT_STALE,
+	STAT_DELETED,
+	NSTATS
+};
+
+static struct StatsEntry stats[NSTATS] = {
+	[STAT_LOAD] = { "load", "Loading indexes", STATS_TIME },
+	[STAT_INTERSECT] = { "intersect", "Intersecting posting lists", STATS_TIME },
+	[STAT_GATHER] = { "gather", "Decoding candidate paths", STATS_TIME },
+	[STAT_RESCAN] = { "rescan", "Looking for stale files", STATS_TIME },
+	[STAT_READ] = { "read", "Opening and reading candidates", STATS_TIME },
+	[STAT_MATCH] = { "match", "Matching", STATS_TIME },
+	[STAT_PRINT] = { "print", "Printing matches", STATS_TIME },
+	[STAT_SHARDS] = { "shards", "Indexes (or shards) queried", STATS_COUNT },
+	[STAT_NGRAMS] = { "ngrams", "Distinct ngrams loaded", STATS_COUNT },
+	[STAT_POSTING_BYTES] = { "posting_bytes", "Posting list bytes loaded", STATS_BYTES },
+	[STAT_CANDIDATES] = { "candidates", "Candidate files (or blocks) in the index", STATS_COUNT },
+	[STAT_FILES] = { "files", "Files searched", STATS_COUNT },
+	[STAT_HITS] = { "hits", "Files with hits", STATS_COUNT },
+	[STAT_FALSE_POSITIVES] = { "false_positives", "False positives (searched without hits)", STATS_PERCENT },
+	[STAT_BYTES] = { "bytes_searched", "Bytes searched", STATS_BYTES },
+	[STAT_MATCHES] = { "matches", "Matches", STATS_COUNT },
+	[STAT_STALE] = { "stale", "Candidates which changed since indexed", STATS_COUNT },
+	[STAT_DELETED] = { "deleted", "Files deleted since indexed", STATS_COUNT },
+};
+
+
 static void print_char_escaped(char c)
 {
 	if (c == '\\') fprintf(stdout, "\\\\");                                 // \ is escape char
@@ -170,9 +319,69 @@ static void print_match(
 	fprintf(stdout, "\n");
 }
 
-static int grep(pcre2_code *re, FILE *file, const char *filepath, size_t pathlen, bool color)
-{
+// Greps a chunk of file contents (which starts at `file_offset`), reporting each
+// match once for every one of its `npaths` NUL-separated paths (aliases).
+static int grep_chunk(
+	pcre2_code *re, pcre2_match_data *match,
+	const char *buffer, size_t read_bytes, uint64_t file_offset,
+	const char *filepaths, const size_t *pathlens, size_t npaths, bool color
+) {
+	int hitcount = 0;
+	PCRE2_SIZE match_offset = 0;
+
+next_match:
+	LOG_TRACEF("Grepping %.*s at offset %zu", (int)pathlens[0], filepaths, file_offset + match_offset);
+	uint64_t start = stats_clock();
+	int rc = pcre2_match(
+		re,
+		(unsigned char *)buffer, read_bytes,
+		match_offset,
+		PCRE2_NOTEMPTY,
+		match,
+		NULL
+	);
+	start = stats_since(&stats[STAT_MATCH], start);
+
+	// TODO: what about a partial match at the end of the buffer?
+	if (rc < 0) { // no match
+		return hitcount;
+	} else if (rc == 0) {
+		LOG_FATAL("Failed to allocate sufficient offsets in match data");
+	} else {
+		assert(rc > 0);
+		++hitcount;
+		PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match);
+		const PCRE2_SIZE match_begin = ovector[0];
+		const PCRE2_SIZE match_end = ovector[1];
+		const char *alias = filepaths;
+		for (size_t p = 0; p < npaths; alias += pathlens[p] + 1, ++p) {
+			print_match(
+				buffer, read_bytes,
+				match_begin, match_end,
+				alias, pathlens[p], file_offset,
+				color
+			);
+		}
+		stats_since(&stats[STAT_PRINT], start);
+		assert(match_end > match_offset);
+		match_offset = match_end;
+		if (match_offset < read_bytes) goto next_match;
+	}
+
+	return hitcount;
+}
+
+// Greps the file within the given range (whose end may be past EOF), reporting
+// each match once for every one of its `npaths` NUL-separated paths (aliases).
+// When `contents` isn't NULL, they're used instead of reading from the file.
+static int grep(
+	pcre2_code *re, FILE *file, const char *contents, size_t length, struct IndexRange range,
+	const char *filepaths, const size_t *pathlens, size_t npaths, bool color
+) {
+	const char *filepath = filepaths;
+	const size_t pathlen = pathlens[0];
 	int hitcount = 0;
+	const uint64_t span = trace_begin();
 
 	char buffer[SEARCH_LINE_MAX];
 	const size_t buflen = sizeof(buffer);
@@ -180,69 +389,320 @@ static int grep(pcre2_code *re, FILE *file, const char *filepath, size_t pathlen
 	pcre2_match_data *match = pcre2_match_data_create_from_pattern(re, NULL);
 	if (!match) LOG_FATAL("Failed to allocate match data for this query");
 
-	size_t file_offset = 0;
-	for (size_t read_bytes = 0; (read_bytes = fread(buffer, 1, buflen, file)) > 0; file_offset += read_bytes) {
-		PCRE2_SIZE match_offset = 0;
-
-	next_match:
-		LOG_TRACEF("Grepping %.*s at offset %zu", (int)pathlen, filepath, file_offset + match_offset);
-		int rc = pcre2_match(
-			re,
-			(unsigned char *)buffer, read_bytes,
-			match_offset,
-			PCRE2_NOTEMPTY,
-			match,
-			NULL
-		);
-
-		// TODO: what about a partial match at the end of the buffer?
-		if (rc < 0) { // no match
-			continue;
-		} else if (rc == 0) {
-			LOG_FATAL("Failed to allocate sufficient offsets in match data");
+	if (!contents && fseeko(file, range.begin, SEEK_SET) != 0) {
+		LOG_ERRORF("Failed to seek to offset %zu of '%.*s' (errno = %d)", range.begin, (int)pathlen, filepath, errno);
+		pcre2_match_data_free(match);
+		return 0;
+	}
+
+	// contents in memory are grepped in the same chunks as the file would be read
+	size_t file_offset = range.begin;
+	for (size_t read_bytes = 0; file_offset < range.end; file_offset += read_bytes) {
+		const uint64_t remaining = range.end - file_offset;
+		const size_t chunk_length = remaining < buflen ? remaining : buflen;
+		const char *chunk = buffer;
+		if (contents) {
+			if (file_offset >= length) break;
+			read_bytes = length - file_offset < chunk_length ? length - file_offset : chunk_length;
+			chunk = &contents[file_offset];
 		} else {
-			assert(rc > 0);
-			++hitcount;
-			PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match);
-			const PCRE2_SIZE match_begin = ovector[0];
-			const PCRE2_SIZE match_end = ovector[1];
-			print_match(
-				buffer, read_bytes,
-				match_begin, match_end,
-				filepath, pathlen, file_offset,
-				color
-			);
-			assert(match_end > match_offset);
-			match_offset = match_end;
-			if (match_offset < read_bytes) goto next_match;
+			const uint64_t start = stats_clock();
+			read_bytes = fread(buffer, 1, chunk_length, file);
+			stats_since(&stats[STAT_READ], start);
+			if (read_bytes == 0) break;
 		}
+		stats_add(&stats[STAT_BYTES], read_bytes);
+		hitcount += grep_chunk(re, match, chunk, read_bytes, file_offset, filepaths, pathlens, npaths, color);
 	}
 
 	pcre2_match_data_free(match);
 
+	stats_add(&stats[STAT_MATCHES], hitcount);
+	trace_endn("grep", filepath, pathlen, span);
 	return hitcount;
 }
 
 
+// Greps the given ranges of a file (which is then closed), whose contents may
+// have already been read into memory, returning whether there were any hits.
+static bool search_file(
+	pcre2_code *re, int fd, const char *contents, size_t length,
+	const char *filepaths, const size_t *pathlens, size_t npaths,
+	const struct IndexRange *ranges, size_t nranges,
+	bool color
+) {
+	FILE *file = NULL;
+	if (!contents) {
+		file = fdopen(fd, "r");
+		if (!file) {
+			LOG_ERRORF("Failed to open indexed file at '%s' (errno = %d)", filepaths, errno);
+			close(fd);
+			return false;
+		}
+	}
+
+	bool has_hits = false;
+	for (size_t k = 0; k < nranges; ++k) {
+		const struct IndexRange range = ranges[k];
+		if (range.begin == 0 && range.end == UINT64_MAX) {
+			LOG_DEBUGF("Searching '%s' ...", filepaths);
+		} else {
+			LOG_DEBUGF("Searching '%s' from byte %zu to %zu ...", filepaths, range.begin, range.end);
+		}
+		int hits = grep(re, file, contents, length, range, filepaths, pathlens, npaths, color);
+		if (hits > 0) has_hits = true;
+	}
+
+	if (file) fclose(file);
+	else close(fd);
+	return has_hits;
+}
+
+// Index (or shard of a bigger one) to be loaded and queried, possibly in another thread.
+typedef struct {
+	char *path;
+	FILE *file; // already open, unless NULL
+	const char *query;
+	size_t query_len;
+	int open_error; // errno
+	int load_error; // see `index_load()`
+	size_t ngram_size; // of the index, when the query is too short to be looked up in it (or zero)
+	const struct Manifest *manifest; // which this is the n-th shard of, unless NULL
+	size_t n;
+	struct IndexLoadOptions load_options;
+	struct QueryCandidates candidates;
+	bool list_files; // whether every (live) indexed file is listed as well
+	struct QueryCandidates files; // with a single path and no ranges each
+	int64_t mtime; // of the index file, in nanoseconds since the epoch
+} Shard;
+
+// Logs how a gram of the query narrowed down the candidates.
+static void log_query_step(void *context, struct IndexQuery gram, size_t files, bool complement, size_t candidates)
+{
+	(void)context;
+	if (logger.level > LOG_LEVEL_TRACE) return;
+	char tracebuf[4096];
+	size_t tracelen = 0;
+	tracebuf[sizeof(tracebuf) - 1] = '\0';
+
+	#define PARTIAL_TRACEF(...) do { \
+		if (tracelen < sizeof(tracebuf) - 1) { \
+			const size_t remaining = sizeof(tracebuf) - 1 - tracelen; \
+			const size_t written = snprintf(&tracebuf[tracelen], remaining, __VA_ARGS__); \
+			tracelen += written; \
+		} \
+	} while (0)
+
+	PARTIAL_TRACEF("Processing gram='");
+	for (size_t i = 0; i < gram.strlen; ++i) {
+		const char c = gram.text[i];
+		if (c == '\\' || c == '\'') PARTIAL_TRACEF("\\%c", c);
+		else if (c >= ' ' && c <= '~') PARTIAL_TRACEF("%c", c);
+		else PARTIAL_TRACEF("\\x%02X", c);
+	}
+	PARTIAL_TRACEF("' files=%zu%s intersection=%zu", files, complement ? " (complement)" : "", candidates);
+	LOG_TRACEF("%s", tracebuf);
+
+	#undef PARTIAL_TRACEF
+}
+
+static const struct QueryHooks query_hooks = { .begin = trace_begin, .end = trace_endn, .step = log_query_step };
+
+static void query_shard(Shard *shard)
+{
+	FILE *file = shard->file ? shard->file : fopen(shard->path, "r");
+	if (!file) {
+		shard->open_error = errno;
+		return;
+	}
+
+	struct stat filestat = {0};
+	if (fstat(fileno(file), &filestat) == 0) shard->mtime = query_stat_mtime(&filestat);
+
+	uint64_t start = stats_clock();
+	const uint64_t span = trace_begin();
+	struct Index index = {0};
+	shard->load_error = index_load(&index, file, shard->load_options);
+	fclose(file);
+	trace_end("index_load", shard->path, span);
+	if (shard->load_error) {
+		index_cleanup(&index);
+		return;
+	}
+	start = stats_since(&stats[STAT_LOAD], start);
+	LOG_DEBUGF("Index loaded from %s", shard->path);
+	if (shard->query_len < index_ngram_size(index)) {
+		shard->ngram_size = index_ngram_size(index);
+		index_cleanup(&index);
+		return;
+	}
+	const struct IndexCounts counts = index_counts(index);
+	stats_add(&stats[STAT_SHARDS], 1);
+	stats_add(&stats[STAT_NGRAMS], counts.ngrams);
+	stats_add(&stats[STAT_POSTING_BYTES], counts.postings * sizeof(uint64_t));
+
+	LOG_DEBUGF("Querying index for string \"%s\"", shard->query);
+	const uint64_t querying = trace_begin();
+	struct IndexPathHandle *candidates = query_index(index, shard->query, shard->query_len, &query_hooks);
+	trace_end("query_index", shard->path, querying);
+	start = stats_since(&stats[STAT_INTERSECT], start);
+	LOG_DEBUGF("Got %zu candidate files (or blocks) from ngram index", stbds_arrlenu(candidates));
+	stats_add(&stats[STAT_CANDIDATES], stbds_arrlenu(candidates));
+	const uint64_t gathering = trace_begin();
+	query_gather(index, candidates, shard->query_len, shard->manifest, shard->n, &shard->candidates);
+	stbds_arrfree(candidates);
+	if (shard->list_files) query_list_files(index, shard->manifest, shard->n, &shard->files);
+	trace_end("gather_candidates", shard->path, gathering);
+	stats_since(&stats[STAT_GATHER], start);
+	index_cleanup(&index);
+}
+
+// Shards waiting to be queried by a pool of threads.
+typedef struct {
+	Shard *shards;
+	size_t length;
+	size_t next; // guarded by the lock
+	pthread_mutex_t lock;
+	struct LogConfig logger; // copied into each thread, since it's thread-local
+} ShardQueue;
+
+static void *shard_thread(void *arg)
+{
+	ShardQueue *queue = arg;
+	logger = queue->logger;
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		const size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= queue->length) break;
+		query_shard(&queue->shards[i]);
+	}
+	return NULL;
+}
+
+typedef struct {
+	char *key;
+	bool value; // unused
+} PathSet;
+
+static int strcmp_indirect(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Adds to the candidates every indexed file which changed since then (according to its
+// stats, or its mtime when it has none), and any newer file in the directories of indexed
+// ones. Only directories modified after the oldest index are listed, which is what adding
+// files does, while changed files are stat'ed one by one. Returns how many were added.
+static size_t rescan_stale(const Shard *shards, size_t nshards, struct QueryCandidates *list, size_t *deleted)
+{
+	PathSet *candidates = NULL;
+	PathSet *known = NULL;
+	PathSet *dirs = NULL;
+	stbds_sh_new_arena(candidates);
+	stbds_sh_new_arena(known);
+	stbds_sh_new_arena(dirs);
+	const char *path = list->pathbuf;
+	for (size_t i = 0; i < stbds_arrlenu(list->pathlens); path += list->pathlens[i++] + 1) {
+		stbds_shput(candidates, path, true);
+	}
+
+	char **stale = NULL;
+	char *dir = NULL;
+	int64_t index_mtime = INT64_MAX;
+	for (size_t i = 0; i < nshards; ++i) {
+		const Shard *shard = &shards[i];
+		if (shard->mtime < index_mtime) index_mtime = shard->mtime;
+		for (size_t j = 0; j < stbds_arrlenu(shard->files.files); ++j) {
+			const struct QueryFile *file = &shard->files.files[j];
+			const char *filepath = &shard->files.pathbuf[file->path_offset];
+			stbds_shput(known, filepath, true);
+			const char *slash = strrchr(filepath, '/');
+			const size_t dirlen = slash ? (size_t)(slash - filepath) + (slash == filepath) : 1;
+			stbds_arrsetlen(dir, dirlen + 1);
+			memcpy(dir, slash ? filepath : ".", dirlen);
+			dir[dirlen] = '\0';
+			stbds_shput(dirs, dir, true);
+			if (stbds_shgeti(candidates, filepath) >= 0) continue;
+
+			struct stat filestat = {0};
+			if (stat(filepath, &filestat) != 0) {
+				if (errno == ENOENT) ++*deleted;
+				continue;
+			}
+			const bool changed = file->has_stat
+				? query_stat_changed(&file->stat, &filestat)
+				: query_stat_mtime(&filestat) > shard->mtime;
+			if (S_ISREG(filestat.st_mode) && changed) {
+				LOG_DEBUGF("Rescanning '%s', which changed since it was indexed", filepath);
+				char *copy = strdup(filepath);
+				if (!copy) LOG_FATAL("Failed to allocate path of a stale file");
+				stbds_arrpush(stale, copy);
+			}
+		}
+	}
+
+	// new files are only found next to indexed ones, since subdirectories may have been excluded
+	char *newpath = NULL;
+	for (size_t i = 0; i < stbds_shlenu(dirs); ++i) {
+		const char *dirpath = dirs[i].key;
+		struct stat dirstat = {0};
+		if (stat(dirpath, &dirstat) != 0 || query_stat_mtime(&dirstat) <= index_mtime) continue;
+		DIR *stream = opendir(dirpath);
+		if (!stream) continue;
+		for (struct dirent *entry; (entry = readdir(stream)) != NULL;) {
+			if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+			const size_t dirlen = strcmp(dirpath, ".") == 0 ? 0 : strlen(dirpath);
+			const size_t namelen = strlen(entry->d_name);
+			const bool separator = dirlen > 0 && dirpath[dirlen - 1] != '/';
+			stbds_arrsetlen(newpath, dirlen + separator + namelen + 1);
+			memcpy(newpath, dirpath, dirlen);
+			if (separator) newpath[dirlen] = '/';
+			memcpy(&newpath[dirlen + separator], entry->d_name, namelen + 1);
+			if (stbds_shgeti(known, newpath) >= 0 || stbds_shgeti(candidates, newpath) >= 0) continue;
+
+			struct stat filestat = {0};
+			if (fstatat(dirfd(stream), entry->d_name, &filestat, 0) != 0) continue;
+			if (S_ISREG(filestat.st_mode) && query_stat_mtime(&filestat) > index_mtime) {
+				LOG_DEBUGF("Rescanning '%s', which is newer than the index", newpath);
+				char *copy = strdup(newpath);
+				if (!copy) LOG_FATAL("Failed to allocate path of a new file");
+				stbds_arrpush(stale, copy);
+			}
+		}
+		closedir(stream);
+	}
+
+	// searched in order, like the rest
+	const size_t nstale = stbds_arrlenu(stale);
+	if (nstale > 0) qsort(stale, nstale, sizeof(char *), strcmp_indirect);
+	for (size_t i = 0; i < nstale; ++i) {
+		query_candidates_push_whole(list, stale[i]);
+		free(stale[i]);
+	}
+
+	stbds_arrfree(stale);
+	stbds_arrfree(newpath);
+	stbds_arrfree(dir);
+	stbds_shfree(dirs);
+	stbds_shfree(known);
+	stbds_shfree(candidates);
+	return nstale;
+}
+
 int main(int argc, char *argv[])
 {
-	Config cfg = {0};
+	const uint64_t start = stats_clock();
+	Config cfg = { .jobs = -1 };
 	argp_program_version = VERSION_STRING;
 	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
 
 	if (cfg.verbose) logger.level = LOG_LEVEL_TRACE;
+	if (cfg.trace_path) trace_start();
 
 	const char *query = cfg.query;
 	const size_t query_len = strlen(query);
 
-	const size_t ngram_size = index_ngram_size();
-	if (query_len < ngram_size) {
-		LOG_FATALF(
-			"Query string '%s' is too short, need at least %zu characters",
-			query, ngram_size
-		);
-	}
-
 	// TODO: set context parameters for security
 	int errorcode = 0;
 	PCRE2_SIZE error_offset = 0;
@@ -258,7 +718,9 @@ int main(int argc, char *argv[])
 		LOG_FATALF("Invalid query string '%s': %s", query, buffer);
 	}
 
-	struct Index index = {0};
+	// the input is either an index, or a manifest listing the shards of a bigger one
+	Shard *shards = NULL;
+	struct Manifest manifest = {0};
 	{
 		const char* inpath = cfg.index_input_path;
 		FILE *infile = NULL;
@@ -270,114 +732,186 @@ int main(int argc, char *argv[])
 			if (!infile) LOG_FATALF("Failed to open index file at '%s' (errno = %d)", inpath, errno);
 		}
 
-		const int load_error = index_load(&index, infile);
-		if (load_error) LOG_FATALF("Failed to parse index from input (errno = %d)", load_error);
-		LOG_DEBUGF("Index loaded from %s", inpath);
-
-		fclose(infile);
-	}
-
-	typedef struct {
-		struct IndexPathHandle key; // handle from query result
-		bool value; // whether handle is actually in the intersection
-	} IntersectionResult;
-	IntersectionResult *intersection_hm = NULL;
-	size_t intersection_len = 0;
-	bool first = true;
-
-	LOG_DEBUGF("Querying index for string \"%s\"", query);
-	assert(query_len >= ngram_size);
-	for (size_t i = 0; i <= query_len - ngram_size; ++i) {
-		const char *ngram_base = &query[i];
-		const size_t remaining_len = query_len - i;
-		const struct IndexQuery query = { .text = ngram_base, .strlen = remaining_len };
-		struct IndexResult result = index_query(index, query);
-
-		IntersectionResult *result_set = NULL;
-		for (size_t j = 0; j < result.length; ++j) {
-			struct IndexPathHandle handle = result.handles[j];
-			stbds_hmput(result_set, handle, true);
-		}
-		index_result_cleanup(&result);
-
-		if (first) { // populate initial set of results
-			intersection_hm = result_set;
-			intersection_len = stbds_hmlenu(result_set);
-			first = false;
-		} else { // soft-remove elements not in intersection
-			for (size_t j = 0; j < stbds_hmlenu(intersection_hm); ++j) {
-				const IntersectionResult entry = intersection_hm[j];
-				if (!entry.value) continue;
-				const IntersectionResult *found = stbds_hmgetp_null(result_set, entry.key);
-				if (!found) {
-					stbds_hmput(intersection_hm, entry.key, false);
-					--intersection_len;
-				}
+		if (manifest_sniff(infile)) {
+			const int load_error = manifest_load(&manifest, infile);
+			if (load_error) LOG_FATALF("Failed to parse manifest from input (errno = %d)", load_error);
+			LOG_DEBUGF("Manifest with %zu shards loaded from %s", stbds_arrlenu(manifest.shards), inpath);
+			fclose(infile);
+			for (size_t i = 0; i < stbds_arrlenu(manifest.shards); ++i) {
+				char *path = manifest_shard_path(cfg.index_input_path, manifest.shards[i]);
+				if (!path) LOG_FATAL("Failed to allocate shard path");
+				const Shard shard = { .path = path, .manifest = &manifest, .n = i };
+				stbds_arrpush(shards, shard);
 			}
-			stbds_hmfree(result_set);
+		} else {
+			char *path = manifest_shard_path(NULL, inpath);
+			if (!path) LOG_FATAL("Failed to allocate index path");
+			const Shard shard = { .path = path, .file = infile };
+			stbds_arrpush(shards, shard);
 		}
+	}
 
-		if (logger.level <= LOG_LEVEL_TRACE) {
-			char tracebuf[4096];
-			size_t tracelen = 0;
-			tracebuf[sizeof(tracebuf) - 1] = '\0';
-
-			#define PARTIAL_TRACEF(...) do { \
-				if (tracelen < sizeof(tracebuf) - 1) { \
-					const size_t remaining = sizeof(tracebuf) - 1 - tracelen; \
-					const size_t written = snprintf(&tracebuf[tracelen], remaining, __VA_ARGS__); \
-					tracelen += written; \
-				} \
-			} while (0)
-
-			PARTIAL_TRACEF("Processing ngram='");
-			for (size_t i = 0; i < ngram_size; ++i) {
-				const char c = ngram_base[i];
-				if (c == '\\' || c == '\'') PARTIAL_TRACEF("\\%c", c);
-				else if (c >= ' ' && c <= '~') PARTIAL_TRACEF("%c", c);
-				else PARTIAL_TRACEF("\\x%02X", c);
-			}
-			PARTIAL_TRACEF("' files=%zu intersection=%zu", result.length, intersection_len);
-			LOG_TRACEF("%s", tracebuf);
-
-			#undef PARTIAL_TRACEF
+	// shards are queried in parallel, then their candidates are merged in order
+	const size_t nshards = stbds_arrlenu(shards);
+	const long jobs = cfg.jobs >= 0 ? cfg.jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	for (size_t i = 0; i < nshards; ++i) {
+		shards[i].query = query;
+		shards[i].query_len = query_len;
+		shards[i].list_files = cfg.rescan_stale;
+		shards[i].load_options.trusted = cfg.trust_index;
+		// jobs left once every shard has its own thread help checking their postings
+		shards[i].load_options.threads = jobs > (long)nshards ? (jobs - nshards) / nshards : 0;
+	}
+	{
+		const size_t nthreads = jobs < 1 ? 0 : (size_t)jobs < nshards ? (size_t)jobs - 1 : nshards - 1;
+		ShardQueue queue = { .shards = shards, .length = nshards, .logger = logger };
+		pthread_mutex_init(&queue.lock, NULL);
+		pthread_t *threads = NULL;
+		for (size_t i = 0; i < nthreads; ++i) {
+			pthread_t thread;
+			if (pthread_create(&thread, NULL, shard_thread, &queue) != 0) break;
+			stbds_arrpush(threads, thread);
 		}
+		shard_thread(&queue); // the main thread lends a hand as well
+		for (size_t i = 0; i < stbds_arrlenu(threads); ++i) pthread_join(threads[i], NULL);
+		stbds_arrfree(threads);
+		pthread_mutex_destroy(&queue.lock);
+	}
 
-		// TODO: hard remove elements, then check zero length for early stop
-		// TODO: optimize n-way intersection by starting with the smallest set
+	struct QueryCandidates list = {0};
+	for (size_t i = 0; i < nshards; ++i) {
+		Shard *shard = &shards[i];
+		if (shard->open_error) {
+			LOG_FATALF("Failed to open index file at '%s' (errno = %d)", shard->path, shard->open_error);
+		} else if (shard->load_error) {
+			LOG_FATALF("Failed to parse index from '%s' (errno = %d)", shard->path, shard->load_error);
+		} else if (shard->ngram_size) {
+			LOG_FATALF(
+				"Query string '%s' is too short for '%s', need at least %zu characters",
+				query, shard->path, shard->ngram_size
+			);
+		}
+		query_candidates_append(&list, &shard->candidates);
+		free(shard->path);
 	}
+	size_t deleted = 0;
+	const uint64_t rescan_start = stats_clock();
+	const uint64_t rescanning = trace_begin();
+	const size_t rescanned = cfg.rescan_stale ? rescan_stale(shards, nshards, &list, &deleted) : 0;
+	if (cfg.rescan_stale) {
+		stats_since(&stats[STAT_RESCAN], rescan_start);
+		trace_end("rescan_stale", NULL, rescanning);
+	}
+	for (size_t i = 0; i < nshards; ++i) query_candidates_cleanup(&shards[i].files);
+	stbds_arrfree(shards);
+	manifest_cleanup(&manifest);
 
 	bool has_hits = false;
-
-	LOG_DEBUGF("Got %zu candidate files from ngram index", intersection_len);
 	{
-		char *pathbuf = NULL;
-		for (size_t j = 0; j < stbds_hmlenu(intersection_hm); ++j) {
-			// extract path from index
-			IntersectionResult entry = intersection_hm[j];
-			if (!entry.value) continue;
-			const struct IndexPathHandle handle = entry.key;
-			const size_t pathlen = index_pathlen(index, handle);
-			stbds_arrsetlen(pathbuf, pathlen + 1);
-			index_path(index, handle, pathbuf, pathlen + 1);
-
-			// open & grep each file
-			FILE *grepfile = fopen(pathbuf, "r");
-			if (!grepfile) {
-				LOG_ERRORF("Failed to open indexed file at '%s' (errno = %d)", pathbuf, errno);
+		char *pathbuf = list.pathbuf;
+		size_t *pathlens = list.pathlens;
+		struct IndexRange *ranges = list.ranges;
+		struct QueryFile *files = list.files;
+
+		// open & grep each file in order, while the next ones are read in the background
+		struct Fetch *fetch = NULL;
+		if (!cfg.sync_io) {
+			const struct FetchOptions fetch_options = {
+				.engine = cfg.io_engine,
+				.depth = SEARCH_IO_DEPTH,
+				.max_size = SEARCH_IO_MAX_SIZE,
+			};
+			fetch = fetch_start(fetch_options);
+			if (!fetch) LOG_FATAL("Failed to start reading files in the background");
+			if (fetch_engine(fetch) != cfg.io_engine) LOG_WARN("io_uring is not supported, reading files with threads instead");
+		}
+		const size_t nfiles = stbds_arrlenu(files);
+		const size_t nindexed = nfiles - rescanned;
+		size_t stale = 0;
+		size_t submitted = 0;
+		for (size_t i = 0; i < nfiles; ++i) {
+			const struct QueryFile *file = &files[i];
+			const char *filepath = &pathbuf[file->path_offset];
+			struct FetchedFile fetched = { .fd = -1 };
+			const uint64_t opening = stats_clock();
+			const uint64_t span = trace_begin();
+			if (fetch) {
+				for (; submitted < nfiles; ++submitted) {
+					const char *path = &pathbuf[files[submitted].path_offset];
+					if (!fetch_submit(fetch, AT_FDCWD, path, NULL)) break;
+				}
+				const bool got = fetch_next(fetch, &fetched);
+				assert(got);
+				(void)got;
+			} else {
+				fetched.fd = open(filepath, O_RDONLY | O_CLOEXEC);
+				if (fetched.fd < 0) fetched.fd = -errno;
+			}
+			stats_since(&stats[STAT_READ], opening);
+			trace_end(fetch ? "fetch_wait" : "open", filepath, span);
+			if (fetched.fd == -ENOENT) {
+				LOG_DEBUGF("Skipped '%s', which was deleted since it was indexed", filepath);
+				++deleted;
+				continue;
+			} else if (fetched.fd < 0) {
+				LOG_ERRORF("Failed to open indexed file at '%s' (errno = %d)", filepath, -fetched.fd);
 				continue;
 			}
-			LOG_DEBUGF("Searching '%s' ...", pathbuf);
-			int hits = grep(re, grepfile, pathbuf, pathlen, cfg.color);
-			if (hits > 0) has_hits = true;
-			fclose(grepfile);
+
+			// a changed file is searched whole, since its blocks may have moved
+			const struct IndexRange *file_ranges = &ranges[file->first_range];
+			size_t nranges = file->nranges;
+			struct stat filestat = {0};
+			if (file->has_stat && fstat(fetched.fd, &filestat) == 0 && query_stat_changed(&file->stat, &filestat)) {
+				LOG_DEBUGF("Candidate '%s' changed since it was indexed", filepath);
+				++stale;
+				static const struct IndexRange whole = { .begin = 0, .end = UINT64_MAX };
+				file_ranges = &whole;
+				nranges = 1;
+			}
+
+			const bool hits = search_file(
+				re, fetched.fd, (const char *)fetched.contents, fetched.length,
+				filepath, &pathlens[file->first_path], file->npaths,
+				file_ranges, nranges,
+				cfg.color
+			);
+			if (hits) has_hits = true;
+			stats_add(&stats[STAT_FILES], 1);
+			stats_add(&stats[STAT_HITS], hits);
+			fetch_release(&fetched);
+		}
+		if (fetch) fetch_finish(fetch);
+		stats_add(&stats[STAT_STALE], stale);
+		stats_add(&stats[STAT_DELETED], deleted);
+
+		// other files may have changed as well, and they might match now
+		if (cfg.rescan_stale) {
+			LOG_INFOF("Rescanned %zu files which changed since indexed (or are new), %zu deleted", rescanned, deleted);
+		} else if (stale > 0) {
+			LOG_WARNF(
+				"%zu of %zu candidate files changed since indexed (and %zu were deleted), so others may have as well"
+				" and results may be incomplete (see --rescan-stale)",
+				stale, nindexed, deleted
+			);
+		} else if (deleted > 0) {
+			LOG_DEBUGF("%zu of %zu candidate files were deleted since indexed", deleted, nindexed);
 		}
-		stbds_arrfree(pathbuf);
 	}
 
-	stbds_hmfree(intersection_hm);
-	index_cleanup(&index);
+	query_candidates_cleanup(&list);
 	pcre2_code_free(re);
 
+	if (cfg.stats) {
+		const uint64_t files = stats[STAT_FILES].value;
+		const uint64_t misses = files - stats[STAT_HITS].value;
+		stats[STAT_FALSE_POSITIVES].value = files > 0 ? misses * 10000 / files : 0;
+		stats_print(stderr, cfg.stats_format, stats, NSTATS, start);
+	}
+	if (cfg.trace_path) {
+		const int error = trace_save(cfg.trace_path);
+		if (error) LOG_ERRORF("Failed to write trace to '%s' (errno = %d)", cfg.trace_path, -error);
+	}
+
 	return has_hits ? 0 : 1;
 }
@@ -0,0 +1,383 @@
+#include "index.h"
+#define LOG_NAME "busk.stat"
+#include "log.h"
+#include "manifest.h"
+#include "version.h"
+
+#include <argp.h>
+#include <stb/stb_ds.h> // arr* macros
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h> // NULL
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // free, qsort, bsearch, strtol
+#include <string.h> // memcmp, memcpy
+
+
+typedef struct {
+	const char **index_paths;
+	bool verbose;
+	long top; // densest ngrams listed
+} Config;
+
+static const char cli_doc[] = "Report what takes space in index files (or the shards of manifests), and how selective their grams are.";
+
+static const char cli_args_doc[] = "<INDEX>...";
+
+static const struct argp_option cli_options[] = {
+	{
+		.name="verbose", .key='v',
+		.doc="Print more verbose output to stderr",
+	},
+	{
+		.name="top", .key='k', .arg="K",
+		.doc="List the K ngrams found in the most files (default: 20)",
+	},
+	{0},
+};
+
+static error_t cli_parser(int key, char *arg, struct argp_state *state)
+{
+	Config *cfg = state->input;
+	switch (key) {
+		case 'v':
+			cfg->verbose = true;
+			break;
+
+		case 'k': {
+			char *end = NULL;
+			cfg->top = strtol(arg, &end, 10);
+			if (end == arg || *end != '\0' || cfg->top < 0) argp_error(state, "invalid number '%s'", arg);
+			break;
+		}
+
+		case ARGP_KEY_ARG:
+			stbds_arrpush(cfg->index_paths, arg);
+			break;
+
+		case ARGP_KEY_END:
+			if (state->arg_num < 1) argp_usage(state);
+			break;
+
+		default:
+			return ARGP_ERR_UNKNOWN;
+	}
+	return 0;
+}
+
+static const struct argp cli = {
+	.doc = cli_doc,
+	.args_doc = cli_args_doc,
+	.options = cli_options,
+	.parser = cli_parser,
+};
+
+
+// histograms have a bucket for zero, then one for each power of two (i.e. 1, 2-3, 4-7, etc)
+#define STAT_BUCKETS 64
+
+static size_t bucket_of(uint64_t value)
+{
+	size_t bucket = 0;
+	while (bucket + 1 < STAT_BUCKETS && value >= (UINT64_C(1) << bucket)) ++bucket;
+	return bucket;
+}
+
+static void print_bucket(size_t bucket)
+{
+	char range[48];
+	if (bucket <= 1) {
+		snprintf(range, sizeof(range), "%zu", bucket);
+	} else {
+		snprintf(range, sizeof(range), "%zu-%zu", (uint64_t)1 << (bucket - 1), ((uint64_t)1 << bucket) - 1);
+	}
+	printf("  %-24s", range);
+}
+
+static void print_bytes(uint64_t bytes)
+{
+	if (bytes < 1024) {
+		printf("%zu B", bytes);
+		return;
+	}
+	const char *units = "KMGTPE";
+	double scaled = bytes / 1024.0;
+	while (scaled >= 1024 && units[1]) {
+		scaled /= 1024;
+		++units;
+	}
+	printf("%.1f %ciB", scaled, *units);
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+	return whole > 0 ? 100.0 * part / whole : 0;
+}
+
+// Bytes taken by an unsigned LEB128 varint.
+static uint64_t varint_size(uint64_t value)
+{
+	uint64_t size = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		++size;
+	}
+	return size;
+}
+
+// Alternative encodings of posting lists, where documents are numbered by their position in the index.
+typedef struct {
+	uint64_t current; // u64 postings
+	uint64_t u32; // u32 document numbers
+	uint64_t varint; // gaps between document numbers, as varints
+	uint64_t bitmap; // a bit per document
+	uint64_t best; // smallest of varint gaps and a bitmap, picked for each list
+} Encodings;
+
+// Ngram entry, for the densest ones.
+typedef struct {
+	char text[8]; // copied, since ngrams listed by the index don't outlive their visit
+	size_t length;
+	uint64_t files; // in which it was found, complement included
+	uint64_t bytes; // of its posting list
+} DenseGram;
+
+// Everything gathered while visiting the posting list of every gram.
+typedef struct {
+	struct IndexResult all;
+	uint64_t ngram_lists[STAT_BUCKETS]; // by documents found in
+	uint64_t ngram_bytes[STAT_BUCKETS]; // and their postings
+	uint64_t sparse_lists[STAT_BUCKETS];
+	uint64_t sparse_bytes[STAT_BUCKETS];
+	uint64_t complemented;
+	uint64_t everywhere; // grams found in every document, useless in queries
+	Encodings encodings;
+	DenseGram *dense;
+} GramStats;
+
+static void visit_gram(void *context, struct IndexGramList list)
+{
+	GramStats *stats = context;
+	const uint64_t ndocs = stats->all.length;
+	const struct IndexResult result = list.result;
+	const uint64_t files = result.complement ? ndocs - result.length : result.length;
+	const uint64_t bytes = result.length * 8;
+	const size_t bucket = bucket_of(files);
+	if (list.ngram.text) {
+		++stats->ngram_lists[bucket];
+		stats->ngram_bytes[bucket] += bytes;
+		DenseGram dense = { .files = files, .bytes = bytes };
+		dense.length = list.ngram.strlen < sizeof(dense.text) ? list.ngram.strlen : sizeof(dense.text);
+		memcpy(dense.text, list.ngram.text, dense.length);
+		stbds_arrpush(stats->dense, dense);
+	} else {
+		++stats->sparse_lists[bucket];
+		stats->sparse_bytes[bucket] += bytes;
+	}
+	if (result.complement) ++stats->complemented;
+	if (files == ndocs) ++stats->everywhere;
+
+	// items are numbered by their position in the list of every document, so gaps are small
+	uint64_t varint = 0;
+	uint64_t previous = 0;
+	for (size_t i = 0; i < result.length; ++i) {
+		const struct IndexPathHandle *found = bsearch(
+			&result.handles[i], stats->all.handles, ndocs,
+			sizeof(struct IndexPathHandle), index_handle_cmp
+		);
+		const uint64_t number = found ? (uint64_t)(found - stats->all.handles) : previous;
+		varint += varint_size(i == 0 ? number : number - previous);
+		previous = number;
+	}
+	const uint64_t bitmap = (ndocs + 7) / 8;
+	stats->encodings.current += bytes;
+	stats->encodings.u32 += result.length * 4;
+	stats->encodings.varint += varint;
+	stats->encodings.bitmap += bitmap;
+	stats->encodings.best += varint < bitmap ? varint : bitmap;
+}
+
+static int dense_gram_cmp(const void *a, const void *b)
+{
+	const DenseGram *lhs = a;
+	const DenseGram *rhs = b;
+	if (lhs->files != rhs->files) return lhs->files > rhs->files ? -1 : 1;
+	return memcmp(lhs->text, rhs->text, lhs->length);
+}
+
+static void print_gram(struct IndexQuery gram)
+{
+	char buffer[64];
+	size_t length = 0;
+	buffer[length++] = '\'';
+	for (size_t i = 0; i < gram.strlen && length + 6 < sizeof(buffer); ++i) {
+		const unsigned char c = gram.text[i];
+		if (c == '\\' || c == '\'') length += snprintf(&buffer[length], sizeof(buffer) - length, "\\%c", c);
+		else if (c >= ' ' && c <= '~') buffer[length++] = c;
+		else length += snprintf(&buffer[length], sizeof(buffer) - length, "\\x%02X", c);
+	}
+	buffer[length++] = '\'';
+	buffer[length] = '\0';
+	printf("  %-24s", buffer);
+}
+
+static void print_histogram(const char *title, const uint64_t *lists, const uint64_t *bytes)
+{
+	uint64_t total_lists = 0, total_bytes = 0;
+	for (size_t i = 0; i < STAT_BUCKETS; ++i) {
+		total_lists += lists[i];
+		total_bytes += bytes[i];
+	}
+	if (total_lists == 0) return;
+
+	printf("\n%-26s%12s%10s%14s%10s\n", title, "grams", "share", "bytes", "share");
+	for (size_t i = 0; i < STAT_BUCKETS; ++i) {
+		if (lists[i] == 0) continue;
+		print_bucket(i);
+		printf("%12zu%9.1f%%%14zu%9.1f%%\n", lists[i], percent(lists[i], total_lists), bytes[i], percent(bytes[i], total_bytes));
+	}
+}
+
+static void print_encoding(const char *label, uint64_t bytes, uint64_t current)
+{
+	printf("  %-40s", label);
+	print_bytes(bytes);
+	printf(" (%+.1f%%)\n", current > 0 ? 100.0 * ((double)bytes - current) / current : 0);
+}
+
+// Loads an index and reports its stats to stdout, returning whether it could be loaded.
+static bool report(const Config *cfg, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		LOG_ERRORF("Failed to open index file at '%s' (errno = %d)", path, errno);
+		return false;
+	}
+	struct stat filestat = {0};
+	const uint64_t file_size = fstat(fileno(file), &filestat) == 0 ? (uint64_t)filestat.st_size : 0;
+	struct Index index = {0};
+	const int load_error = index_load(&index, file, (struct IndexLoadOptions){0});
+	fclose(file);
+	if (load_error) {
+		LOG_ERRORF("Failed to parse index from '%s' (errno = %d)", path, load_error);
+		index_cleanup(&index);
+		return false;
+	}
+	LOG_DEBUGF("Index loaded from %s", path);
+
+	const struct IndexCounts counts = index_counts(index);
+	printf("%s: ", path);
+	print_bytes(file_size);
+	printf(", %zu files (or blocks), %zu ngrams (N = %zu)", counts.docs, counts.ngrams, index_ngram_size(index));
+	if (index.options.sparse_grams) printf(", %zu sparse grams", counts.sparse_grams);
+	if (index.options.block_size) printf(", split into blocks of %zu bytes", index.options.block_size);
+	printf("\n");
+
+	const struct IndexSections sections = index_sections(index);
+	const struct { const char *name; uint64_t bytes; } rows[] = {
+		{ "header", sections.header },
+		{ "paths", sections.paths },
+		{ "documents", sections.docs },
+		{ "aliases", sections.aliases },
+		{ "file stats", sections.stats },
+		{ "ngrams", sections.ngrams },
+		{ "sparse grams", sections.sparse_grams },
+		{ "checksums", sections.checksums },
+	};
+	printf("\n%-26s%12s%10s\n", "Section", "bytes", "share");
+	for (size_t i = 0; i < sizeof(rows) / sizeof(rows[0]); ++i) {
+		printf("  %-24s%12zu%9.1f%%\n", rows[i].name, rows[i].bytes, percent(rows[i].bytes, file_size));
+	}
+
+	const struct IndexPathStats paths = index_path_stats(index);
+	printf("\nPaths: %zu (including aliases), ", paths.paths);
+	print_bytes(paths.raw_bytes);
+	printf(" uncompressed, ");
+	print_bytes(paths.stored_bytes);
+	printf(" stored (%.2fx)\n", paths.stored_bytes > 0 ? (double)paths.raw_bytes / paths.stored_bytes : 0);
+	printf("\n%-26s%12s%10s\n", "Prefix chain depth", "paths", "share");
+	const size_t ndepths = sizeof(paths.depths) / sizeof(paths.depths[0]);
+	for (size_t i = 0; i < ndepths; ++i) {
+		if (paths.depths[i] == 0) continue;
+		if (i + 1 == ndepths) printf("  %-24s", "longer");
+		else print_bucket(i);
+		printf("%12zu%9.1f%%\n", paths.depths[i], percent(paths.depths[i], paths.paths));
+	}
+	printf("  %-24s%12zu\n", "longest", paths.max_depth);
+
+	GramStats stats = { .all = index_all(index) };
+	index_each_gram(index, visit_gram, &stats);
+	print_histogram("Ngrams found in N files", stats.ngram_lists, stats.ngram_bytes);
+	print_histogram("Sparse grams in N files", stats.sparse_lists, stats.sparse_bytes);
+	printf(
+		"\n%zu grams are stored as the complement of their posting list, and %zu are found in every file (useless in queries)\n",
+		stats.complemented, stats.everywhere
+	);
+
+	const size_t ndense = stbds_arrlenu(stats.dense);
+	const size_t top = (size_t)cfg->top < ndense ? (size_t)cfg->top : ndense;
+	if (top > 0) {
+		qsort(stats.dense, ndense, sizeof(DenseGram), dense_gram_cmp);
+		printf("\n%-26s%12s%10s%14s\n", "Densest ngrams", "files", "share", "bytes");
+		for (size_t i = 0; i < top; ++i) {
+			const DenseGram dense = stats.dense[i];
+			print_gram((struct IndexQuery){ .text = dense.text, .strlen = dense.length });
+			printf("%12zu%9.1f%%%14zu\n", dense.files, percent(dense.files, counts.docs), dense.bytes);
+		}
+	}
+
+	const Encodings encodings = stats.encodings;
+	printf("\nPosting lists would take (estimated, without entry headers):\n");
+	print_encoding("as stored (u64 postings)", encodings.current, encodings.current);
+	print_encoding("as u32 file numbers", encodings.u32, encodings.current);
+	print_encoding("as varint gaps between file numbers", encodings.varint, encodings.current);
+	print_encoding("as bitmaps of every file", encodings.bitmap, encodings.current);
+	print_encoding("as the smallest of the two, per list", encodings.best, encodings.current);
+
+	stbds_arrfree(stats.dense);
+	index_cleanup(&index);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	Config cfg = { .top = 20 };
+	argp_program_version = VERSION_STRING;
+	argp_parse(&cli, argc, argv, 0, NULL, &cfg);
+
+	if (cfg.verbose) logger.level = LOG_LEVEL_DEBUG;
+
+	// manifests are reported shard by shard, since that's how they're queried
+	int retcode = 0;
+	bool first = true;
+	for (size_t i = 0; i < stbds_arrlenu(cfg.index_paths); ++i) {
+		const char *path = cfg.index_paths[i];
+		FILE *file = fopen(path, "r");
+		if (!file) LOG_FATALF("Failed to open index file at '%s' (errno = %d)", path, errno);
+		struct Manifest manifest = {0};
+		const bool is_manifest = manifest_sniff(file);
+		if (is_manifest) {
+			const int load_error = manifest_load(&manifest, file);
+			if (load_error) LOG_FATALF("Failed to parse manifest from '%s' (errno = %d)", path, load_error);
+			LOG_DEBUGF("Manifest with %zu shards loaded from %s", stbds_arrlenu(manifest.shards), path);
+		}
+		fclose(file);
+
+		const size_t nshards = is_manifest ? stbds_arrlenu(manifest.shards) : 1;
+		for (size_t j = 0; j < nshards; ++j) {
+			char *shard_path = is_manifest ? manifest_shard_path(path, manifest.shards[j]) : manifest_shard_path(NULL, path);
+			if (!shard_path) LOG_FATAL("Failed to allocate index path");
+			if (!first) printf("\n\n");
+			first = false;
+			if (!report(&cfg, shard_path)) retcode = 1;
+			free(shard_path);
+		}
+		manifest_cleanup(&manifest);
+	}
+
+	stbds_arrfree(cfg.index_paths);
+	return retcode;
+}
@@ -0,0 +1,92 @@
+#include "stats.h"
+
+#include <sys/resource.h> // getrusage
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h> // clock_gettime
+
+
+uint64_t stats_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void stats_add(struct StatsEntry *entry, uint64_t value)
+{
+	__atomic_fetch_add(&entry->value, value, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_since(struct StatsEntry *entry, uint64_t start)
+{
+	const uint64_t now = stats_clock();
+	stats_add(entry, now - start);
+	return now;
+}
+
+static void print_value(FILE *file, enum StatsFormat format, enum StatsKind kind, uint64_t value)
+{
+	switch (kind) {
+		case STATS_TIME:
+			fprintf(file, format == STATS_JSON ? "%.3f" : "%.3f ms", value / 1e6);
+			break;
+		case STATS_COUNT:
+			fprintf(file, "%zu", value);
+			break;
+		case STATS_BYTES:
+			if (format == STATS_JSON || value < 1024) {
+				fprintf(file, format == STATS_JSON ? "%zu" : "%zu B", value);
+			} else {
+				const char *units = "KMGTPE";
+				double scaled = value / 1024.0;
+				while (scaled >= 1024 && units[1]) {
+					scaled /= 1024;
+					++units;
+				}
+				fprintf(file, "%.1f %ciB", scaled, *units);
+			}
+			break;
+		case STATS_PERCENT:
+			fprintf(file, format == STATS_JSON ? "%.2f" : "%.2f %%", value / 100.0);
+			break;
+	}
+}
+
+void stats_print(FILE *file, enum StatsFormat format, const struct StatsEntry *entries, size_t n, uint64_t start)
+{
+	const uint64_t wall = stats_clock() - start;
+	struct rusage usage = {0};
+	getrusage(RUSAGE_SELF, &usage);
+	const uint64_t peak_rss = (uint64_t)usage.ru_maxrss * 1024;
+
+	// times get a unit in their keys, since JSON numbers don't have any
+	if (format == STATS_JSON) {
+		fprintf(file, "{");
+		for (size_t i = 0; i < n; ++i) {
+			const struct StatsEntry *entry = &entries[i];
+			const char *suffix = entry->kind == STATS_TIME ? "_ms" : entry->kind == STATS_PERCENT ? "_percent" : "";
+			fprintf(file, "\"%s%s\":", entry->key, suffix);
+			print_value(file, format, entry->kind, __atomic_load_n(&entry->value, __ATOMIC_RELAXED));
+			fprintf(file, ",");
+		}
+		fprintf(file, "\"wall_ms\":%.3f,\"peak_rss\":%zu}\n", wall / 1e6, peak_rss);
+		return;
+	}
+
+	// phases may overlap (or run in several threads at once), so they don't add up to the wall time
+	for (size_t i = 0; i < n; ++i) {
+		const struct StatsEntry *entry = &entries[i];
+		fprintf(file, "%-42s ", entry->label);
+		print_value(file, format, entry->kind, __atomic_load_n(&entry->value, __ATOMIC_RELAXED));
+		fprintf(file, "\n");
+	}
+	fprintf(file, "%-42s ", "Wall time");
+	print_value(file, format, STATS_TIME, wall);
+	fprintf(file, "\n%-42s ", "Peak RSS");
+	print_value(file, format, STATS_BYTES, peak_rss);
+	fprintf(file, "\n");
+}
@@ -0,0 +1,45 @@
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+#include <stdio.h> // FILE
+
+
+// What a stat measures, which is how it's printed.
+enum StatsKind {
+	STATS_TIME, // nanoseconds (summed over threads), see `stats_since()`
+	STATS_COUNT,
+	STATS_BYTES,
+	STATS_PERCENT, // in hundredths of a percent
+};
+
+// Phase timing or counter, usually in a static array indexed by an enum.
+struct StatsEntry {
+	const char *key; // snake_case name, used in JSON
+	const char *label; // what it measures, used in tables
+	enum StatsKind kind;
+	uint64_t value; // only updated with the functions below, from any thread
+};
+
+// How stats are reported.
+enum StatsFormat {
+	STATS_TABLE,
+	STATS_JSON,
+};
+
+
+// Returns the current time of a monotonic clock, in nanoseconds.
+uint64_t stats_clock(void);
+
+// Adds some value to a counter.
+void stats_add(struct StatsEntry *entry, uint64_t value);
+
+// Adds the time elapsed since `start` (see `stats_clock()`) to a timing, returning the current time.
+uint64_t stats_since(struct StatsEntry *entry, uint64_t start);
+
+// Prints every entry, followed by the wall time since `start` and the peak RSS of the process.
+void stats_print(FILE *file, enum StatsFormat format, const struct StatsEntry *entries, size_t n, uint64_t start);
+
+#endif // INCLUDE_STATS_H
@@ -0,0 +1,173 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stb/stb_ds.h> // arr* macros
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h> // calloc, free
+#include <string.h> // strlen, memcpy
+#include <time.h> // clock_gettime
+
+
+typedef struct {
+	const char *name;
+	uint64_t begin; // in nanoseconds since tracing started
+	uint64_t end;
+	size_t detail; // offset into the thread's details, plus one (zero when there's none)
+} TraceEvent;
+
+// Spans recorded by a single thread, which no other thread touches until they're saved.
+typedef struct {
+	unsigned tid;
+	TraceEvent *events;
+	char *details; // NUL-separated
+} TraceBuffer;
+
+static bool tracing; // read from any thread, hence only through atomics
+static uint64_t origin; // when tracing started
+static TraceBuffer **buffers; // guarded by the lock, like the registration of new ones
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local TraceBuffer *local;
+
+// Same clock as the stats, without depending on them.
+static uint64_t trace_clock(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Returns the buffer of the calling thread, which is registered the first time (or NULL).
+static TraceBuffer *local_buffer(void)
+{
+	if (local) return local;
+	TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+	if (!buffer) return NULL;
+	pthread_mutex_lock(&lock);
+	buffer->tid = stbds_arrlenu(buffers) + 1;
+	stbds_arrpush(buffers, buffer);
+	pthread_mutex_unlock(&lock);
+	local = buffer;
+	return buffer;
+}
+
+void trace_start(void)
+{
+	origin = trace_clock() - 1; // so that no span begins at zero
+	local_buffer(); // the thread tracing is started from is always the first one
+	__atomic_store_n(&tracing, true, __ATOMIC_RELEASE);
+}
+
+uint64_t trace_begin(void)
+{
+	if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE)) return 0;
+	return trace_clock() - origin;
+}
+
+void trace_endn(const char *name, const char *detail, size_t length, uint64_t start)
+{
+	if (start == 0) return;
+	const uint64_t end = trace_clock() - origin;
+	TraceBuffer *buffer = local_buffer();
+	if (!buffer) return;
+
+	TraceEvent event = { .name = name, .begin = start, .end = end };
+	if (detail) {
+		event.detail = stbds_arrlenu(buffer->details) + 1;
+		memcpy(stbds_arraddnptr(buffer->details, length), detail, length);
+		stbds_arrpush(buffer->details, '\0');
+	}
+	stbds_arrpush(buffer->events, event);
+}
+
+void trace_end(const char *name, const char *detail, uint64_t start)
+{
+	trace_endn(name, detail, detail ? strlen(detail) : 0, start);
+}
+
+// Writes a JSON string. Paths (and ngrams cut in the middle of a character) might not
+// be valid UTF-8, in which case the offending bytes are escaped as if they were Latin-1.
+static void write_json_string(FILE *file, const char *str)
+{
+	putc('"', file);
+	for (const unsigned char *s = (const unsigned char *)str; *s;) {
+		const unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			fprintf(file, "\\%c", c);
+			++s;
+			continue;
+		} else if (c < 0x20 || c == 0x7F) {
+			fprintf(file, "\\u%04x", c);
+			++s;
+			continue;
+		} else if (c < 0x80) {
+			putc(c, file);
+			++s;
+			continue;
+		}
+
+		// a valid multibyte sequence is copied as it is
+		const size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC2 ? 2 : 0;
+		bool valid = length > 0 && c < 0xF5;
+		for (size_t i = 1; valid && i < length; ++i) valid = (s[i] & 0xC0) == 0x80;
+		if (valid) {
+			fwrite(s, 1, length, file);
+			s += length;
+		} else {
+			fprintf(file, "\\u%04x", c);
+			++s;
+		}
+	}
+	putc('"', file);
+}
+
+int trace_save(const char *path)
+{
+	__atomic_store_n(&tracing, false, __ATOMIC_RELEASE);
+	FILE *file = fopen(path, "w");
+	int error = file ? 0 : -errno;
+
+	pthread_mutex_lock(&lock);
+	if (file) fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (size_t i = 0; i < stbds_arrlenu(buffers); ++i) {
+		TraceBuffer *buffer = buffers[i];
+		if (file) {
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",\n", buffer->tid);
+			first = false;
+			if (buffer->tid == 1) {
+				fprintf(file, "\"main\"}}");
+			} else {
+				fprintf(file, "\"thread %u\"}}", buffer->tid);
+			}
+		}
+		for (size_t j = 0; file && j < stbds_arrlenu(buffer->events); ++j) {
+			const TraceEvent event = buffer->events[j];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,", event.name, buffer->tid);
+			fprintf(file, "\"ts\":%.3f,\"dur\":%.3f", event.begin / 1e3, (event.end - event.begin) / 1e3);
+			if (event.detail) {
+				fprintf(file, ",\"args\":{\"detail\":");
+				write_json_string(file, &buffer->details[event.detail - 1]);
+				putc('}', file);
+			}
+			putc('}', file);
+		}
+		stbds_arrfree(buffer->events);
+		stbds_arrfree(buffer->details);
+		free(buffer);
+	}
+	stbds_arrfree(buffers);
+	pthread_mutex_unlock(&lock);
+	local = NULL;
+
+	if (file) {
+		fprintf(file, "\n]}\n");
+		if (ferror(file)) error = -EIO;
+		if (fclose(file) != 0 && !error) error = -errno;
+	}
+	return error;
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_TRACE_H
+#define INCLUDE_TRACE_H
+
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+
+// Starts recording spans, in every thread (spans are dropped until then).
+void trace_start(void);
+
+// Returns when a span begins, to be passed to `trace_end()` (or zero when not tracing).
+uint64_t trace_begin(void);
+
+// Records a span (in a buffer of the calling thread) from `start` until now. Its name
+// must be a static string, while `detail` (e.g. a path, unless NULL) is copied.
+void trace_end(const char *name, const char *detail, uint64_t start);
+
+// Same as `trace_end()`, with a detail which isn't NUL-terminated.
+void trace_endn(const char *name, const char *detail, size_t length, uint64_t start);
+
+// Writes every span recorded so far as Chrome trace-event JSON, then stops tracing.
+// Threads which recorded spans must no longer be recording. Returns zero or a negative errno.
+int trace_save(const char *path);
+
+#endif // INCLUDE_TRACE_H
@@ -0,0 +1,504 @@
+#include "walk.h"
+
+#include <stb/stb_ds.h> // arr* and hm* macros
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h> // openat
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdlib.h> // calloc, free, qsort
+#include <string.h> // strcmp, strlen, memcpy
+#include <sys/stat.h> // fstat, fstatat
+#include <unistd.h> // close
+
+
+typedef struct {
+	uint64_t device;
+	uint64_t inode;
+} DirId;
+
+typedef struct {
+	DirId key;
+	bool value; // unused
+} DirIdSet;
+
+enum WalkDirState {
+	WALK_DIR_PENDING, // waiting in some deque
+	WALK_DIR_CLAIMED, // being listed by someone
+	WALK_DIR_LISTED, // entries are ready
+	WALK_DIR_RELEASED, // entries are gone (or were never listed)
+};
+
+struct WalkDir {
+	struct WalkDir *parent;
+	struct WalkDir *next; // every directory is kept in a list, only freed at the end
+	char *path; // full path, used to open it
+	size_t pathlen;
+	struct WalkDir *root;
+	int depth;
+	DirId id; // only valid when opened
+	bool opened;
+	bool duplicate; // not listed, since some other path to it was being listed already
+	enum WalkDirState state; // guarded by the walk's lock
+	int error;
+	struct WalkEntry *entries;
+	char *names; // names of all entries, back to back
+	struct IgnoreRules rules; // from its ignore files, kept until the walk is finished
+};
+
+// Work-stealing deque: its owner pushes and pops at the back, while thieves
+// steal from the front, where the oldest (and usually biggest) subtrees are.
+typedef struct {
+	pthread_mutex_t lock;
+	struct WalkDir **items;
+	size_t head;
+} WalkDeque;
+
+typedef struct {
+	struct Walk *walk;
+	int deque; // index of its own deque
+} WalkThread;
+
+struct Walk {
+	struct WalkOptions options;
+	int nthreads;
+	pthread_t *threads;
+	WalkThread *thread_args;
+	WalkDeque *deques; // the first one is for the consumer, followed by one per thread
+	pthread_mutex_t lock; // guards the fields below, plus the state of every directory
+	pthread_cond_t listed; // signaled when a directory is listed
+	pthread_cond_t wakeup; // signaled when walkers have something to do, or must stop
+	size_t queued; // directories in all deques
+	size_t ahead; // entries listed but not yet released
+	bool stopping;
+	DirIdSet *claimed; // directories being listed, when skipping revisits
+	DirIdSet *visited; // directories handed out by `walk_list()`, when skipping revisits
+	struct WalkDir *dirs; // every directory ever seen
+};
+
+
+static void deque_push(WalkDeque *deque, struct WalkDir *dir)
+{
+	pthread_mutex_lock(&deque->lock);
+	stbds_arrpush(deque->items, dir);
+	pthread_mutex_unlock(&deque->lock);
+}
+
+static struct WalkDir *deque_pop(WalkDeque *deque)
+{
+	struct WalkDir *dir = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (stbds_arrlenu(deque->items) > deque->head) dir = stbds_arrpop(deque->items);
+	if (stbds_arrlenu(deque->items) == deque->head) {
+		stbds_arrsetlen(deque->items, 0);
+		deque->head = 0;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return dir;
+}
+
+static struct WalkDir *deque_steal(WalkDeque *deque)
+{
+	struct WalkDir *dir = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (stbds_arrlenu(deque->items) > deque->head) dir = deque->items[deque->head++];
+	if (stbds_arrlenu(deque->items) == deque->head) {
+		stbds_arrsetlen(deque->items, 0);
+		deque->head = 0;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return dir;
+}
+
+static int entry_cmp(const struct WalkEntry *a, const struct WalkEntry *b)
+{
+	return strcmp(a->name, b->name);
+}
+
+static char *path_join(const char *dirpath, size_t dirlen, const char *name, size_t namelen)
+{
+	char *path = malloc(dirlen + 1 + namelen + 1);
+	if (!path) return NULL;
+	memcpy(path, dirpath, dirlen);
+	path[dirlen] = '/';
+	memcpy(&path[dirlen + 1], name, namelen + 1);
+	return path;
+}
+
+// Checks whether an entry of `dir` is excluded by the globs in the options or by the
+// ignore files of `dir` and its parents, where the deepest ones take precedence.
+static bool walk_excluded(
+	const struct Walk *walk, const struct WalkDir *dir,
+	const char *name, size_t namelen, bool is_dir, char **pathbufp
+) {
+	const struct WalkOptions *options = &walk->options;
+	if (!options->excludes && !options->includes && stbds_arrlenu(options->ignore_files) == 0) return false;
+
+	// patterns are matched against paths relative to the directory they apply to
+	char *pathbuf = *pathbufp;
+	stbds_arrsetlen(pathbuf, dir->pathlen + 1 + namelen);
+	memcpy(pathbuf, dir->path, dir->pathlen);
+	pathbuf[dir->pathlen] = '/';
+	memcpy(&pathbuf[dir->pathlen + 1], name, namelen);
+	*pathbufp = pathbuf;
+	const size_t pathlen = stbds_arrlenu(pathbuf);
+	#define RELATIVE_TO(ancestor) &pathbuf[(ancestor)->pathlen + 1], pathlen - (ancestor)->pathlen - 1
+
+	enum IgnoreMatch match = IGNORE_NONE;
+	if (options->excludes) match = ignore_match(options->excludes, RELATIVE_TO(dir->root), is_dir);
+	for (const struct WalkDir *parent = dir; parent && match == IGNORE_NONE; parent = parent->parent) {
+		if (stbds_arrlenu(parent->rules.patterns) == 0) continue;
+		match = ignore_match(&parent->rules, RELATIVE_TO(parent), is_dir);
+	}
+	if (match == IGNORE_MATCHED) return true;
+
+	// directories are always listed, since they may have files to be included
+	const bool included = is_dir || !options->includes
+		|| ignore_match(options->includes, RELATIVE_TO(dir->root), false) == IGNORE_MATCHED;
+
+	#undef RELATIVE_TO
+	return !included;
+}
+
+// Lists a claimed directory, then pushes its subdirectories to the given deque.
+// When `forced`, it was previously skipped as a duplicate and must be listed now.
+static void walk_process(struct Walk *walk, struct WalkDir *dir, bool forced, int deque)
+{
+	struct WalkDir **subdirs = NULL;
+	DIR *stream = NULL;
+
+	if (dir->depth >= walk->options.max_depth) {
+		dir->error = WALK_TOO_DEEP;
+		goto publish;
+	}
+
+	const int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		dir->error = -errno;
+		goto publish;
+	}
+	struct stat dirstat = {0};
+	if (fstat(fd, &dirstat) != 0) {
+		dir->error = -errno;
+		close(fd);
+		goto publish;
+	}
+	dir->id = (DirId){ .device = dirstat.st_dev, .inode = dirstat.st_ino };
+	dir->opened = true;
+
+	if (!forced) {
+		// a symlink back into one of our parents would make us recurse forever
+		for (const struct WalkDir *parent = dir->parent; parent; parent = parent->parent) {
+			if (parent->id.device == dir->id.device && parent->id.inode == dir->id.inode) {
+				dir->error = WALK_LOOP;
+				close(fd);
+				goto publish;
+			}
+		}
+
+		// and we can save some work when other paths don't need to be listed again
+		if (walk->options.skip_revisits) {
+			pthread_mutex_lock(&walk->lock);
+			dir->duplicate = stbds_hmgeti(walk->claimed, dir->id) >= 0;
+			if (!dir->duplicate) stbds_hmput(walk->claimed, dir->id, true);
+			pthread_mutex_unlock(&walk->lock);
+			if (dir->duplicate) {
+				close(fd);
+				goto publish;
+			}
+		}
+	}
+
+	// patterns in its ignore files apply to every entry below it
+	ignore_cleanup(&dir->rules);
+	for (size_t i = 0; i < stbds_arrlenu(walk->options.ignore_files); ++i) {
+		ignore_load(&dir->rules, fd, walk->options.ignore_files[i]);
+	}
+
+	stream = fdopendir(fd);
+	if (!stream) {
+		dir->error = -errno;
+		close(fd);
+		goto publish;
+	}
+
+	size_t *name_offsets = NULL;
+	char *pathbuf = NULL;
+	errno = 0;
+	for (struct dirent *entry = NULL; (entry = readdir(stream)); errno = 0) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0) continue;
+		if (strcmp(name, "..") == 0) continue;
+
+		// d_type spares us a stat for subdirectories (which are fstat'ed when opened), but
+		// files are stat'ed for their ids: d_ino isn't always st_ino (e.g. in overlayfs,
+		// or for files bind-mounted over others), and ids have to match fstat's to be compared
+		struct WalkEntry walk_entry = {0};
+		unsigned char type = entry->d_type;
+		if (type != DT_DIR) {
+			struct stat entrystat = {0};
+			if (fstatat(dirfd(stream), name, &entrystat, 0) != 0) {
+				walk_entry.error = -errno;
+				type = DT_UNKNOWN;
+			} else {
+				type = S_ISDIR(entrystat.st_mode) ? DT_DIR : S_ISREG(entrystat.st_mode) ? DT_REG : DT_UNKNOWN;
+				walk_entry.device = entrystat.st_dev;
+				walk_entry.inode = entrystat.st_ino;
+			}
+		}
+		if (type != DT_DIR && type != DT_REG && walk_entry.error == 0) continue;
+		const size_t namelen = strlen(name);
+		if (walk_excluded(walk, dir, name, namelen, type == DT_DIR, &pathbuf)) continue;
+
+		if (type == DT_DIR) {
+			struct WalkDir *subdir = calloc(1, sizeof(struct WalkDir));
+			char *subpath = path_join(dir->path, dir->pathlen, name, namelen);
+			if (!subdir || !subpath) {
+				free(subdir);
+				free(subpath);
+				walk_entry.error = -ENOMEM;
+			} else {
+				subdir->parent = dir;
+				subdir->path = subpath;
+				subdir->pathlen = dir->pathlen + 1 + namelen;
+				subdir->root = dir->root;
+				subdir->depth = dir->depth + 1;
+				subdir->state = WALK_DIR_PENDING;
+				walk_entry.dir = subdir;
+				stbds_arrpush(subdirs, subdir);
+			}
+		}
+
+		// names are only pointed to after the (reallocated) buffer is complete
+		const size_t offset = stbds_arraddnindex(dir->names, namelen + 1);
+		memcpy(&dir->names[offset], name, namelen + 1);
+		stbds_arrpush(name_offsets, offset);
+		stbds_arrpush(dir->entries, walk_entry);
+	}
+	if (errno) dir->error = -errno;
+	closedir(stream);
+	stbds_arrfree(pathbuf);
+
+	for (size_t i = 0; i < stbds_arrlenu(dir->entries); ++i) {
+		dir->entries[i].name = &dir->names[name_offsets[i]];
+	}
+	stbds_arrfree(name_offsets);
+	if (stbds_arrlenu(dir->entries) > 0) qsort(
+		dir->entries, stbds_arrlenu(dir->entries), sizeof(struct WalkEntry),
+		(int (*)(const void *, const void *))entry_cmp
+	);
+
+publish:
+	pthread_mutex_lock(&walk->lock);
+	for (size_t i = 0; i < stbds_arrlenu(subdirs); ++i) {
+		subdirs[i]->next = walk->dirs;
+		walk->dirs = subdirs[i];
+	}
+	dir->state = WALK_DIR_LISTED;
+	walk->ahead += stbds_arrlenu(dir->entries);
+	pthread_cond_broadcast(&walk->listed);
+	pthread_mutex_unlock(&walk->lock);
+
+	// pushed in reverse, so that we pop them in order and stay ahead of the consumer
+	const size_t nsubdirs = stbds_arrlenu(subdirs);
+	if (nsubdirs > 0) {
+		for (size_t i = nsubdirs; i > 0; --i) deque_push(&walk->deques[deque], subdirs[i - 1]);
+		pthread_mutex_lock(&walk->lock);
+		walk->queued += nsubdirs;
+		pthread_cond_broadcast(&walk->wakeup);
+		pthread_mutex_unlock(&walk->lock);
+	}
+	stbds_arrfree(subdirs);
+}
+
+static void *walk_thread(void *arg)
+{
+	const WalkThread *self = arg;
+	struct Walk *walk = self->walk;
+	const int ndeques = walk->nthreads + 1;
+
+	for (;;) {
+		pthread_mutex_lock(&walk->lock);
+		while (!walk->stopping && (walk->queued == 0 || walk->ahead > walk->options.max_ahead)) {
+			pthread_cond_wait(&walk->wakeup, &walk->lock);
+		}
+		const bool stopping = walk->stopping;
+		pthread_mutex_unlock(&walk->lock);
+		if (stopping) break;
+
+		// prefer our own work, otherwise steal from the others
+		struct WalkDir *dir = deque_pop(&walk->deques[self->deque]);
+		for (int i = 1; !dir && i < ndeques; ++i) {
+			dir = deque_steal(&walk->deques[(self->deque + i) % ndeques]);
+		}
+		if (!dir) continue;
+
+		pthread_mutex_lock(&walk->lock);
+		walk->queued--;
+		const bool claimed = dir->state == WALK_DIR_PENDING;
+		if (claimed) dir->state = WALK_DIR_CLAIMED;
+		pthread_mutex_unlock(&walk->lock);
+
+		// it may have been listed by the consumer itself, or released by now
+		if (claimed) walk_process(walk, dir, false, self->deque);
+	}
+
+	return NULL;
+}
+
+struct Walk *walk_start(struct WalkOptions options)
+{
+	struct Walk *walk = calloc(1, sizeof(struct Walk));
+	if (!walk) return NULL;
+	walk->options = options;
+	if (walk->options.threads < 0) walk->options.threads = 0;
+
+	const int nthreads = walk->options.threads;
+	walk->deques = calloc(nthreads + 1, sizeof(WalkDeque));
+	walk->threads = calloc(nthreads + 1, sizeof(pthread_t));
+	walk->thread_args = calloc(nthreads + 1, sizeof(WalkThread));
+	if (!walk->deques || !walk->threads || !walk->thread_args) {
+		free(walk->deques);
+		free(walk->threads);
+		free(walk->thread_args);
+		free(walk);
+		return NULL;
+	}
+
+	pthread_mutex_init(&walk->lock, NULL);
+	pthread_cond_init(&walk->listed, NULL);
+	pthread_cond_init(&walk->wakeup, NULL);
+	for (int i = 0; i <= nthreads; ++i) pthread_mutex_init(&walk->deques[i].lock, NULL);
+
+	// having fewer threads than requested only makes the consumer list more by itself
+	for (int i = 0; i < nthreads; ++i) {
+		walk->thread_args[i] = (WalkThread){ .walk = walk, .deque = i + 1 };
+		if (pthread_create(&walk->threads[i], NULL, walk_thread, &walk->thread_args[i]) != 0) break;
+		walk->nthreads = i + 1;
+	}
+
+	return walk;
+}
+
+void walk_finish(struct Walk *walk)
+{
+	if (!walk) return;
+
+	pthread_mutex_lock(&walk->lock);
+	walk->stopping = true;
+	pthread_cond_broadcast(&walk->wakeup);
+	pthread_mutex_unlock(&walk->lock);
+	for (int i = 0; i < walk->nthreads; ++i) pthread_join(walk->threads[i], NULL);
+
+	for (struct WalkDir *dir = walk->dirs; dir;) {
+		struct WalkDir *next = dir->next;
+		stbds_arrfree(dir->entries);
+		stbds_arrfree(dir->names);
+		ignore_cleanup(&dir->rules);
+		free(dir->path);
+		free(dir);
+		dir = next;
+	}
+	for (int i = 0; i <= walk->options.threads; ++i) {
+		stbds_arrfree(walk->deques[i].items);
+		pthread_mutex_destroy(&walk->deques[i].lock);
+	}
+	stbds_hmfree(walk->claimed);
+	stbds_hmfree(walk->visited);
+	pthread_cond_destroy(&walk->wakeup);
+	pthread_cond_destroy(&walk->listed);
+	pthread_mutex_destroy(&walk->lock);
+	free(walk->deques);
+	free(walk->threads);
+	free(walk->thread_args);
+	free(walk);
+}
+
+struct WalkDir *walk_root(struct Walk *walk, const char *dirpath)
+{
+	struct WalkDir *dir = calloc(1, sizeof(struct WalkDir));
+	const size_t pathlen = strlen(dirpath);
+	char *path = malloc(pathlen + 1);
+	if (!dir || !path) {
+		free(dir);
+		free(path);
+		return NULL;
+	}
+	memcpy(path, dirpath, pathlen + 1);
+	dir->path = path;
+	dir->pathlen = pathlen;
+	dir->root = dir;
+	dir->state = WALK_DIR_PENDING;
+
+	pthread_mutex_lock(&walk->lock);
+	dir->next = walk->dirs;
+	walk->dirs = dir;
+	pthread_mutex_unlock(&walk->lock);
+
+	deque_push(&walk->deques[0], dir);
+	pthread_mutex_lock(&walk->lock);
+	walk->queued++;
+	pthread_cond_broadcast(&walk->wakeup);
+	pthread_mutex_unlock(&walk->lock);
+	return dir;
+}
+
+struct WalkListing walk_list(struct Walk *walk, struct WalkDir *dir)
+{
+	// if nobody got to it yet, it's faster to list it ourselves than to wait
+	pthread_mutex_lock(&walk->lock);
+	assert(dir->state != WALK_DIR_RELEASED);
+	while (dir->state == WALK_DIR_CLAIMED) pthread_cond_wait(&walk->listed, &walk->lock);
+	const bool ours = dir->state == WALK_DIR_PENDING;
+	if (ours) dir->state = WALK_DIR_CLAIMED;
+	pthread_mutex_unlock(&walk->lock);
+	if (ours) walk_process(walk, dir, false, 0);
+
+	// directories may be listed in any order, but only the first one we hand out is
+	// reported, even when it was its duplicate which got listed in the background
+	if (walk->options.skip_revisits && dir->opened && dir->error != WALK_LOOP) {
+		if (stbds_hmgeti(walk->visited, dir->id) >= 0) {
+			return (struct WalkListing){ .error = WALK_REVISITED };
+		}
+		stbds_hmput(walk->visited, dir->id, true);
+		if (dir->duplicate) walk_process(walk, dir, true, 0);
+	}
+
+	return (struct WalkListing){
+		.entries = dir->entries,
+		.length = stbds_arrlenu(dir->entries),
+		.error = dir->error,
+	};
+}
+
+static void walk_release_locked(struct Walk *walk, struct WalkDir *dir)
+{
+	while (dir->state == WALK_DIR_CLAIMED) pthread_cond_wait(&walk->listed, &walk->lock);
+	if (dir->state == WALK_DIR_PENDING) {
+		dir->state = WALK_DIR_RELEASED;
+		return;
+	} else if (dir->state == WALK_DIR_RELEASED) {
+		return;
+	}
+
+	assert(dir->state == WALK_DIR_LISTED);
+	for (size_t i = 0; i < stbds_arrlenu(dir->entries); ++i) {
+		if (dir->entries[i].dir) walk_release_locked(walk, dir->entries[i].dir);
+	}
+	walk->ahead -= stbds_arrlenu(dir->entries);
+	stbds_arrfree(dir->entries);
+	stbds_arrfree(dir->names);
+	dir->state = WALK_DIR_RELEASED;
+}
+
+void walk_release(struct Walk *walk, struct WalkDir *dir)
+{
+	pthread_mutex_lock(&walk->lock);
+	walk_release_locked(walk, dir);
+	pthread_cond_broadcast(&walk->wakeup);
+	pthread_mutex_unlock(&walk->lock);
+}
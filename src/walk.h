@@ -0,0 +1,65 @@
+#ifndef INCLUDE_WALK_H
+#define INCLUDE_WALK_H
+
+#include "ignore.h"
+
+#include <stdbool.h>
+#include <stddef.h> // size_t
+#include <stdint.h>
+
+
+struct Walk; // opaque
+struct WalkDir; // opaque
+
+// Directory walk options.
+struct WalkOptions {
+	int threads; // background threads listing directories, or zero to list them on demand
+	size_t max_ahead; // how many entries may be listed but not yet released
+	int max_depth; // directories nested deeper than this are not listed
+	bool skip_revisits; // list directories reached through several links only once
+	const struct IgnoreRules *excludes; // entries not to be listed (relative to their root), or NULL
+	const struct IgnoreRules *includes; // when not NULL, files not matching these aren't listed
+	const char **ignore_files; // stb array with names of ignore files applying to their directory
+};
+
+// Entry in a directory listing, which excluded entries are left out of (so they're never opened).
+struct WalkEntry {
+	const char *name; // relative to the listed directory
+	struct WalkDir *dir; // subdirectory to be listed, or NULL for regular files
+	int error; // negative errno when the entry couldn't be stat'ed (e.g. broken symlinks)
+	uint64_t device, inode; // of regular files, as reported by `st_dev` and `st_ino`
+};
+
+// Error codes for directories which are deliberately not listed.
+enum {
+	WALK_LOOP = 1, // directory is one of its own parents
+	WALK_TOO_DEEP, // directory is nested beyond `max_depth`
+	WALK_REVISITED, // directory was already listed through another link
+};
+
+// Result of `walk_list()`, with entries sorted by name.
+struct WalkListing {
+	const struct WalkEntry *entries;
+	size_t length;
+	int error; // zero, a negative errno or one of the WALK_* codes
+};
+
+
+// Starts walker threads, returning NULL when they can't be started.
+struct Walk *walk_start(struct WalkOptions options);
+
+// Stops walker threads and deallocates everything, including unreleased listings.
+void walk_finish(struct Walk *walk);
+
+// Adds a root directory to be listed in the background.
+struct WalkDir *walk_root(struct Walk *walk, const char *dirpath);
+
+// Waits until a directory is listed (or lists it right away), returning its entries.
+// This must be called in the order the entries are consumed, starting from a root,
+// so that it's always the same path which gets through when `skip_revisits` is set.
+struct WalkListing walk_list(struct Walk *walk, struct WalkDir *dir);
+
+// Releases a directory listing (and those of any subdirectories not yet released).
+void walk_release(struct Walk *walk, struct WalkDir *dir);
+
+#endif // INCLUDE_WALK_H
@@ -0,0 +1,180 @@
+#include "watch.h"
+
+#include <stb/stb_ds.h> // arr* and hm* macros
+
+#include <errno.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h> // size_t, NULL
+#include <stdint.h>
+#include <stdlib.h> // calloc, malloc, free, qsort
+#include <string.h> // strlen, strcmp, memcpy
+#include <sys/inotify.h>
+#include <time.h> // clock_gettime
+#include <unistd.h> // read, close
+
+
+// Changes which keep coming in are still reported after this many debounce periods.
+#ifndef WATCH_MAX_DELAY
+#define WATCH_MAX_DELAY 10
+#endif
+
+#define WATCH_MASK ( \
+	IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+	| IN_DELETE_SELF | IN_MOVE_SELF | IN_EXCL_UNLINK \
+)
+
+typedef struct {
+	int key; // watch descriptor
+	char *value; // path it was added with
+} WatchedPath;
+
+struct Watch {
+	int fd;
+	WatchedPath *paths; // stb hashmap
+};
+
+
+struct Watch *watch_start(void)
+{
+	struct Watch *watch = calloc(1, sizeof(struct Watch));
+	if (!watch) return NULL;
+	watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watch->fd < 0) {
+		free(watch);
+		return NULL;
+	}
+	return watch;
+}
+
+void watch_finish(struct Watch *watch)
+{
+	if (!watch) return;
+	close(watch->fd);
+	for (size_t i = 0; i < stbds_hmlenu(watch->paths); ++i) free(watch->paths[i].value);
+	stbds_hmfree(watch->paths);
+	free(watch);
+}
+
+int watch_add(struct Watch *watch, const char *path)
+{
+	const int wd = inotify_add_watch(watch->fd, path, WATCH_MASK);
+	if (wd < 0) return -errno;
+	if (stbds_hmgeti(watch->paths, wd) >= 0) return 0;
+
+	const size_t length = strlen(path);
+	char *copy = malloc(length + 1);
+	if (!copy) return -ENOMEM;
+	memcpy(copy, path, length + 1);
+	stbds_hmput(watch->paths, wd, copy);
+	return 0;
+}
+
+static int64_t elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Records the path of every event in the buffer, returning whether some were lost.
+static bool watch_record(struct Watch *watch, const char *buffer, size_t length, char ***changes)
+{
+	bool overflow = false;
+	for (size_t offset = 0; offset + sizeof(struct inotify_event) <= length;) {
+		const struct inotify_event *event = (const struct inotify_event *)&buffer[offset];
+		offset += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			overflow = true;
+			continue;
+		}
+		const ptrdiff_t i = stbds_hmgeti(watch->paths, event->wd);
+		if (i < 0) continue;
+		const char *path = watch->paths[i].value;
+
+		// events without a name are about the watched path itself
+		const size_t pathlen = strlen(path);
+		const size_t namelen = event->len > 0 ? strlen(event->name) : 0;
+		char *changed = malloc(pathlen + 1 + namelen + 1);
+		if (changed) {
+			memcpy(changed, path, pathlen);
+			if (namelen > 0) {
+				changed[pathlen] = '/';
+				memcpy(&changed[pathlen + 1], event->name, namelen + 1);
+			} else {
+				changed[pathlen] = '\0';
+			}
+			stbds_arrpush(*changes, changed);
+		} else {
+			overflow = true;
+		}
+
+		// the kernel drops watches of deleted paths by itself
+		if (event->mask & IN_IGNORED) {
+			free(watch->paths[i].value);
+			stbds_hmdel(watch->paths, event->wd);
+		}
+	}
+	return overflow;
+}
+
+static int strcmp_indirect(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int watch_wait(struct Watch *watch, int debounce_ms, char ***changes)
+{
+	alignas(struct inotify_event) char buffer[16 * 1024];
+	struct pollfd pollfd = { .fd = watch->fd, .events = POLLIN };
+	const size_t first = stbds_arrlenu(*changes);
+	bool overflow = false;
+
+	// block until something happens, then keep going until it calms down
+	struct timespec started = {0};
+	for (bool waiting = true;;) {
+		int timeout = -1;
+		if (!waiting) {
+			const int64_t remaining = (int64_t)debounce_ms * WATCH_MAX_DELAY - elapsed_ms(&started);
+			if (remaining <= 0) break;
+			timeout = remaining < debounce_ms ? remaining : debounce_ms;
+		}
+		const int ready = poll(&pollfd, 1, timeout);
+		if (ready < 0 && errno == EINTR) continue;
+		if (ready < 0) return -errno;
+		if (ready == 0) break;
+
+		const ssize_t length = read(watch->fd, buffer, sizeof(buffer));
+		if (length < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+		if (length < 0) return -errno;
+		if (watch_record(watch, buffer, length, changes)) overflow = true;
+		if (waiting) {
+			clock_gettime(CLOCK_MONOTONIC, &started);
+			waiting = false;
+		}
+	}
+
+	// the same paths usually change several times in a row
+	char **new_changes = &(*changes)[first];
+	const size_t count = stbds_arrlenu(*changes) - first;
+	if (count > 0) qsort(new_changes, count, sizeof(char *), strcmp_indirect);
+	size_t unique = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (unique > 0 && strcmp(new_changes[unique - 1], new_changes[i]) == 0) {
+			free(new_changes[i]);
+			continue;
+		}
+		new_changes[unique++] = new_changes[i];
+	}
+	stbds_arrsetlen(*changes, first + unique);
+
+	return overflow ? WATCH_OVERFLOW : 0;
+}
+
+void watch_changes_free(char **changes)
+{
+	for (size_t i = 0; i < stbds_arrlenu(changes); ++i) free(changes[i]);
+	stbds_arrfree(changes);
+}
@@ -0,0 +1,29 @@
+#ifndef INCLUDE_WATCH_H
+#define INCLUDE_WATCH_H
+
+
+struct Watch; // opaque
+
+// Result of `watch_wait()` when events were dropped by the kernel, so anything may have changed.
+#define WATCH_OVERFLOW 1
+
+
+// Starts watching for changes, returning NULL (with errno set) when not supported.
+struct Watch *watch_start(void);
+
+// Stops watching everything, then deallocates it all.
+void watch_finish(struct Watch *watch);
+
+// Watches a file, or the entries of a directory (but not those of its subdirectories),
+// returning zero or a negative errno. Watching the same path again is a no-op.
+int watch_add(struct Watch *watch, const char *path);
+
+// Waits for changes, then for them to settle (i.e. no more for `debounce_ms`), appending
+// to `changes` the paths of what changed (stb array of strings, sorted and unique).
+// Returns zero, WATCH_OVERFLOW (along with whatever changes are known) or a negative errno.
+int watch_wait(struct Watch *watch, int debounce_ms, char ***changes);
+
+// Deallocates the paths returned by `watch_wait()`.
+void watch_changes_free(char **changes);
+
+#endif // INCLUDE_WATCH_H